@@ -167,6 +167,7 @@ HEADERS += src/convert_functions.h \
     src/sync.h \
     src/util.h \
     src/hash.h \
+    src/sha256.h \
     src/uint256.h \
     src/serialize.h \
     src/main.h \
@@ -206,6 +207,7 @@ HEADERS += src/convert_functions.h \
     src/qt/walletstack.h \
     src/qt/walletframe.h \
     src/bitcoinrpc.h \
+    src/stratum.h \
     src/qt/overviewpage.h \
     src/qt/csvmodelwriter.h \
     src/crypter.h \
@@ -227,6 +229,7 @@ HEADERS += src/convert_functions.h \
     src/leveldb.h \
     src/threadsafety.h \
     src/limitedmap.h \
+    src/memusage.h \
     src/qt/splashscreen.h
 
 SOURCES += src/convert_functions.cpp \
@@ -249,6 +252,10 @@ SOURCES += src/convert_functions.cpp \
     src/sync.cpp \
     src/util.cpp \
     src/hash.cpp \
+    src/sha256.cpp \
+    src/sha256_shani.cpp \
+    src/sha256_sse2.cpp \
+    src/sha256_avx2.cpp \
     src/netbase.cpp \
     src/key.cpp \
     src/script.cpp \
@@ -278,6 +285,7 @@ SOURCES += src/convert_functions.cpp \
     src/qt/walletstack.cpp \
     src/qt/walletframe.cpp \
     src/bitcoinrpc.cpp \
+    src/stratum.cpp \
     src/rpcdump.cpp \
     src/rpcnet.cpp \
     src/rpcmining.cpp \
@@ -174,6 +174,7 @@ HEADERS += src/convert_functions.h \
     src/sync.h \
     src/util.h \
     src/hash.h \
+    src/sha256.h \
     src/uint256.h \
     src/serialize.h \
     src/main.h \
@@ -213,6 +214,7 @@ HEADERS += src/convert_functions.h \
     src/qt/walletstack.h \
     src/qt/walletframe.h \
     src/bitcoinrpc.h \
+    src/stratum.h \
     src/qt/overviewpage.h \
     src/qt/csvmodelwriter.h \
     src/crypter.h \
@@ -234,6 +236,7 @@ HEADERS += src/convert_functions.h \
     src/leveldb.h \
     src/threadsafety.h \
     src/limitedmap.h \
+    src/memusage.h \
     src/qt/splashscreen.h \
     src/hashblock.h \
     src/sph_blake.h \
@@ -267,6 +270,10 @@ SOURCES += src/convert_functions.cpp \
     src/sync.cpp \
     src/util.cpp \
     src/hash.cpp \
+    src/sha256.cpp \
+    src/sha256_shani.cpp \
+    src/sha256_sse2.cpp \
+    src/sha256_avx2.cpp \
     src/netbase.cpp \
     src/key.cpp \
     src/script.cpp \
@@ -296,6 +303,7 @@ SOURCES += src/convert_functions.cpp \
     src/qt/walletstack.cpp \
     src/qt/walletframe.cpp \
     src/bitcoinrpc.cpp \
+    src/stratum.cpp \
     src/rpcdump.cpp \
     src/rpcnet.cpp \
     src/rpcmining.cpp \
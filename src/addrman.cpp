@@ -85,7 +85,7 @@ CAddrInfo* CAddrMan::Find(const CNetAddr& addr, int *pnId)
         return NULL;
     if (pnId)
         *pnId = (*it).second;
-    std::map<int, CAddrInfo>::iterator it2 = mapInfo.find((*it).second);
+    boost::unordered_map<int, CAddrInfo>::iterator it2 = mapInfo.find((*it).second);
     if (it2 != mapInfo.end())
         return &(*it2).second;
     return NULL;
@@ -98,11 +98,87 @@ CAddrInfo* CAddrMan::Create(const CAddress &addr, const CNetAddr &addrSource, in
     mapAddr[addr] = nId;
     mapInfo[nId].nRandomPos = vRandom.size();
     vRandom.push_back(nId);
+    setChanged.insert(nId);
     if (pnId)
         *pnId = nId;
     return &mapInfo[nId];
 }
 
+// Keep vUsed, the list of buckets with entries, and vUsedPos, the position
+// of each bucket in that list, up to date when bucket nBucket changes.
+static void SetBucketUsed(std::vector<int> &vUsed, std::vector<int> &vUsedPos, int nBucket, bool fUsed)
+{
+    int nPos = vUsedPos[nBucket];
+    if (fUsed == (nPos != -1))
+        return;
+    if (fUsed)
+    {
+        vUsedPos[nBucket] = vUsed.size();
+        vUsed.push_back(nBucket);
+    } else {
+        int nLast = vUsed.back();
+        vUsed[nPos] = nLast;
+        vUsedPos[nLast] = nPos;
+        vUsed.pop_back();
+        vUsedPos[nBucket] = -1;
+    }
+}
+
+void CAddrMan::ClearBuckets()
+{
+    vvTried = std::vector<std::vector<int> >(ADDRMAN_TRIED_BUCKET_COUNT, std::vector<int>(0));
+    vvNew = std::vector<std::vector<int> >(ADDRMAN_NEW_BUCKET_COUNT, std::vector<int>(0));
+    vTriedUsed.clear();
+    vTriedUsedPos.assign(ADDRMAN_TRIED_BUCKET_COUNT, -1);
+    vNewUsed.clear();
+    vNewUsedPos.assign(ADDRMAN_NEW_BUCKET_COUNT, -1);
+}
+
+void CAddrMan::InsertNew(int nUBucket, int nId)
+{
+    vvNew[nUBucket].push_back(nId);
+    SetBucketUsed(vNewUsed, vNewUsedPos, nUBucket, true);
+}
+
+void CAddrMan::InsertTried(int nKBucket, int nId)
+{
+    vvTried[nKBucket].push_back(nId);
+    SetBucketUsed(vTriedUsed, vTriedUsedPos, nKBucket, true);
+}
+
+bool CAddrMan::EraseTried(int nKBucket, int nId)
+{
+    std::vector<int> &vTried = vvTried[nKBucket];
+    std::vector<int>::iterator it = std::find(vTried.begin(), vTried.end(), nId);
+    if (it == vTried.end())
+        return false;
+    *it = vTried.back();
+    vTried.pop_back();
+    if (vTried.empty())
+        SetBucketUsed(vTriedUsed, vTriedUsedPos, nKBucket, false);
+    return true;
+}
+
+bool CAddrMan::EraseNew(int nUBucket, int nId)
+{
+    std::vector<int> &vNew = vvNew[nUBucket];
+    std::vector<int>::iterator it = std::find(vNew.begin(), vNew.end(), nId);
+    if (it == vNew.end())
+        return false;
+    *it = vNew.back();
+    vNew.pop_back();
+    if (vNew.empty())
+        SetBucketUsed(vNewUsed, vNewUsedPos, nUBucket, false);
+    return true;
+}
+
+int CAddrMan::GetNewBucket(const CAddress &addr, const CNetAddr& source) const
+{
+    if (!addr.IsRoutable())
+        return -1;
+    return CAddrInfo(addr, source).GetNewBucket(nKey);
+}
+
 void CAddrMan::SwapRandom(unsigned int nRndPos1, unsigned int nRndPos2)
 {
     if (nRndPos1 == nRndPos2)
@@ -147,68 +223,83 @@ int CAddrMan::SelectTried(int nKBucket)
     return nOldestPos;
 }
 
+void CAddrMan::Delete(int nId)
+{
+    boost::unordered_map<int, CAddrInfo>::iterator it = mapInfo.find(nId);
+    assert(it != mapInfo.end());
+    CAddrInfo &info = (*it).second;
+    assert(!info.fInTried && info.nRefCount == 0);
+
+    SwapRandom(info.nRandomPos, vRandom.size()-1);
+    vRandom.pop_back();
+    mapAddr.erase(info);
+    setChanged.erase(nId);
+    vDeleted.push_back(info);
+    mapInfo.erase(it);
+    nNew--;
+}
+
+int CAddrMan::FindNewBucket(int nId) const
+{
+    if (vNewUsed.empty())
+        return -1;
+    int nRnd = GetRandInt(vNewUsed.size());
+    for (unsigned int n = 0; n < vNewUsed.size(); n++)
+    {
+        int nB = vNewUsed[(n+nRnd) % vNewUsed.size()];
+        const std::vector<int> &vNew = vvNew[nB];
+        if (std::find(vNew.begin(), vNew.end(), nId) != vNew.end())
+            return nB;
+    }
+    return -1;
+}
+
 int CAddrMan::ShrinkNew(int nUBucket)
 {
     assert(nUBucket >= 0 && (unsigned int)nUBucket < vvNew.size());
-    std::set<int> &vNew = vvNew[nUBucket];
+    std::vector<int> &vNew = vvNew[nUBucket];
+    int64 nNow = GetAdjustedTime();
 
     // first look for deletable items
-    for (std::set<int>::iterator it = vNew.begin(); it != vNew.end(); it++)
+    for (unsigned int i = 0; i < vNew.size(); i++)
     {
-        assert(mapInfo.count(*it));
-        CAddrInfo &info = mapInfo[*it];
-        if (info.IsTerrible())
+        int nId = vNew[i];
+        assert(mapInfo.count(nId));
+        CAddrInfo &info = mapInfo[nId];
+        if (info.IsTerrible(nNow))
         {
+            EraseNew(nUBucket, nId);
             if (--info.nRefCount == 0)
-            {
-                SwapRandom(info.nRandomPos, vRandom.size()-1);
-                vRandom.pop_back();
-                mapAddr.erase(info);
-                mapInfo.erase(*it);
-                nNew--;
-            }
-            vNew.erase(it);
+                Delete(nId);
             return 0;
         }
     }
 
     // otherwise, select four randomly, and pick the oldest of those to replace
-    int n[4] = {GetRandInt(vNew.size()), GetRandInt(vNew.size()), GetRandInt(vNew.size()), GetRandInt(vNew.size())};
-    int nI = 0;
     int nOldest = -1;
-    for (std::set<int>::iterator it = vNew.begin(); it != vNew.end(); it++)
+    for (int n = 0; n < 4; n++)
     {
-        if (nI == n[0] || nI == n[1] || nI == n[2] || nI == n[3])
-        {
-            assert(nOldest == -1 || mapInfo.count(*it) == 1);
-            if (nOldest == -1 || mapInfo[*it].nTime < mapInfo[nOldest].nTime)
-                nOldest = *it;
-        }
-        nI++;
+        int nId = vNew[GetRandInt(vNew.size())];
+        assert(mapInfo.count(nId) == 1);
+        if (nOldest == -1 || mapInfo[nId].nTime < mapInfo[nOldest].nTime)
+            nOldest = nId;
     }
-    assert(mapInfo.count(nOldest) == 1);
+    EraseNew(nUBucket, nOldest);
     CAddrInfo &info = mapInfo[nOldest];
     if (--info.nRefCount == 0)
-    {
-        SwapRandom(info.nRandomPos, vRandom.size()-1);
-        vRandom.pop_back();
-        mapAddr.erase(info);
-        mapInfo.erase(nOldest);
-        nNew--;
-    }
-    vNew.erase(nOldest);
+        Delete(nOldest);
 
     return 1;
 }
 
 void CAddrMan::MakeTried(CAddrInfo& info, int nId, int nOrigin)
 {
-    assert(vvNew[nOrigin].count(nId) == 1);
+    assert(std::count(vvNew[nOrigin].begin(), vvNew[nOrigin].end(), nId) == 1);
 
     // remove the entry from all new buckets
-    for (std::vector<std::set<int> >::iterator it = vvNew.begin(); it != vvNew.end(); it++)
+    for (unsigned int n = 0; n < vvNew.size() && info.nRefCount > 0; n++)
     {
-        if ((*it).erase(nId))
+        if (EraseNew(n, nId))
             info.nRefCount--;
     }
     nNew--;
@@ -222,7 +313,7 @@ void CAddrMan::MakeTried(CAddrInfo& info, int nId, int nOrigin)
     // first check whether there is place to just add it
     if (vTried.size() < ADDRMAN_TRIED_BUCKET_SIZE)
     {
-        vTried.push_back(nId);
+        InsertTried(nKBucket, nId);
         nTried++;
         info.fInTried = true;
         return;
@@ -234,22 +325,22 @@ void CAddrMan::MakeTried(CAddrInfo& info, int nId, int nOrigin)
     // find which new bucket it belongs to
     assert(mapInfo.count(vTried[nPos]) == 1);
     int nUBucket = mapInfo[vTried[nPos]].GetNewBucket(nKey);
-    std::set<int> &vNew = vvNew[nUBucket];
 
     // remove the to-be-replaced tried entry from the tried set
     CAddrInfo& infoOld = mapInfo[vTried[nPos]];
     infoOld.fInTried = false;
     infoOld.nRefCount = 1;
+    setChanged.insert(vTried[nPos]);
     // do not update nTried, as we are going to move something else there immediately
 
     // check whether there is place in that one,
-    if (vNew.size() < ADDRMAN_NEW_BUCKET_SIZE)
+    if (vvNew[nUBucket].size() < ADDRMAN_NEW_BUCKET_SIZE)
     {
         // if so, move it back there
-        vNew.insert(vTried[nPos]);
+        InsertNew(nUBucket, vTried[nPos]);
     } else {
         // otherwise, move it to the new bucket nId came from (there is certainly place there)
-        vvNew[nOrigin].insert(vTried[nPos]);
+        InsertNew(nOrigin, vTried[nPos]);
     }
     nNew++;
 
@@ -281,24 +372,14 @@ void CAddrMan::Good_(const CService &addr, int64 nTime)
     info.nLastTry = nTime;
     info.nTime = nTime;
     info.nAttempts = 0;
+    setChanged.insert(nId);
 
     // if it is already in the tried set, don't do anything else
     if (info.fInTried)
         return;
 
     // find a bucket it is in now
-    int nRnd = GetRandInt(vvNew.size());
-    int nUBucket = -1;
-    for (unsigned int n = 0; n < vvNew.size(); n++)
-    {
-        int nB = (n+nRnd) % vvNew.size();
-        std::set<int> &vNew = vvNew[nB];
-        if (vNew.count(nId))
-        {
-            nUBucket = nB;
-            break;
-        }
-    }
+    int nUBucket = FindNewBucket(nId);
 
     // if no bucket is found, something bad happened;
     // TODO: maybe re-add the node, but for now, just bail out
@@ -310,9 +391,9 @@ void CAddrMan::Good_(const CService &addr, int64 nTime)
     MakeTried(info, nId, nUBucket);
 }
 
-bool CAddrMan::Add_(const CAddress &addr, const CNetAddr& source, int64 nTimePenalty)
+bool CAddrMan::Add_(const CAddress &addr, const CNetAddr& source, int64 nTimePenalty, int nUBucket)
 {
-    if (!addr.IsRoutable())
+    if (nUBucket < 0)
         return false;
 
     bool fNew = false;
@@ -321,6 +402,9 @@ bool CAddrMan::Add_(const CAddress &addr, const CNetAddr& source, int64 nTimePen
 
     if (pinfo)
     {
+        int64 nTimeOld = pinfo->nTime;
+        uint64 nServicesOld = pinfo->nServices;
+
         // periodically update nTime
         bool fCurrentlyOnline = (GetAdjustedTime() - addr.nTime < 24 * 60 * 60);
         int64 nUpdateInterval = (fCurrentlyOnline ? 60 * 60 : 24 * 60 * 60);
@@ -330,6 +414,9 @@ bool CAddrMan::Add_(const CAddress &addr, const CNetAddr& source, int64 nTimePen
         // add services
         pinfo->nServices |= addr.nServices;
 
+        if (pinfo->nTime != nTimeOld || pinfo->nServices != nServicesOld)
+            setChanged.insert(nId);
+
         // do not update if no new information is present
         if (!addr.nTime || (pinfo->nTime && addr.nTime <= pinfo->nTime))
             return false;
@@ -356,21 +443,21 @@ bool CAddrMan::Add_(const CAddress &addr, const CNetAddr& source, int64 nTimePen
         fNew = true;
     }
 
-    int nUBucket = pinfo->GetNewBucket(nKey, source);
-    std::set<int> &vNew = vvNew[nUBucket];
-    if (!vNew.count(nId))
+    std::vector<int> &vNew = vvNew[nUBucket];
+    if (std::find(vNew.begin(), vNew.end(), nId) == vNew.end())
     {
         pinfo->nRefCount++;
         if (vNew.size() == ADDRMAN_NEW_BUCKET_SIZE)
             ShrinkNew(nUBucket);
-        vvNew[nUBucket].insert(nId);
+        InsertNew(nUBucket, nId);
     }
     return fNew;
 }
 
 void CAddrMan::Attempt_(const CService &addr, int64 nTime)
 {
-    CAddrInfo *pinfo = Find(addr);
+    int nId;
+    CAddrInfo *pinfo = Find(addr, &nId);
 
     // if not found, bail out
     if (!pinfo)
@@ -385,64 +472,55 @@ void CAddrMan::Attempt_(const CService &addr, int64 nTime)
     // update info
     info.nLastTry = nTime;
     info.nAttempts++;
+    setChanged.insert(nId);
 }
 
-CAddress CAddrMan::Select_(int nUnkBias)
+CAddress CAddrMan::Select_(int nUnkBias) const
 {
     if (size() == 0)
         return CAddress();
 
+    // pick a table; buckets are drawn from the non-empty ones only, so
+    // every probe lands on an entry however sparse the tables are
     double nCorTried = sqrt(nTried) * (100.0 - nUnkBias);
     double nCorNew = sqrt(nNew) * nUnkBias;
-    if ((nCorTried + nCorNew)*GetRandInt(1<<30)/(1<<30) < nCorTried)
+    bool fTried = ((nCorTried + nCorNew)*GetRandInt(1<<30)/(1<<30) < nCorTried);
+    if (vTriedUsed.empty())
+        fTried = false;
+    if (vNewUsed.empty())
+        fTried = true;
+    const std::vector<int> &vUsed = fTried ? vTriedUsed : vNewUsed;
+    const std::vector<std::vector<int> > &vvBuckets = fTried ? vvTried : vvNew;
+    if (vUsed.empty())
+        return CAddress();
+
+    int64 nNow = GetAdjustedTime();
+    double fChanceFactor = 1.0;
+    while(1)
     {
-        // use a tried node
-        double fChanceFactor = 1.0;
-        while(1)
-        {
-            int nKBucket = GetRandInt(vvTried.size());
-            std::vector<int> &vTried = vvTried[nKBucket];
-            if (vTried.size() == 0) continue;
-            int nPos = GetRandInt(vTried.size());
-            assert(mapInfo.count(vTried[nPos]) == 1);
-            CAddrInfo &info = mapInfo[vTried[nPos]];
-            if (GetRandInt(1<<30) < fChanceFactor*info.GetChance()*(1<<30))
-                return info;
-            fChanceFactor *= 1.2;
-        }
-    } else {
-        // use a new node
-        double fChanceFactor = 1.0;
-        while(1)
-        {
-            int nUBucket = GetRandInt(vvNew.size());
-            std::set<int> &vNew = vvNew[nUBucket];
-            if (vNew.size() == 0) continue;
-            int nPos = GetRandInt(vNew.size());
-            std::set<int>::iterator it = vNew.begin();
-            while (nPos--)
-                it++;
-            assert(mapInfo.count(*it) == 1);
-            CAddrInfo &info = mapInfo[*it];
-            if (GetRandInt(1<<30) < fChanceFactor*info.GetChance()*(1<<30))
-                return info;
-            fChanceFactor *= 1.2;
-        }
+        const std::vector<int> &vBucket = vvBuckets[vUsed[GetRandInt(vUsed.size())]];
+        int nId = vBucket[GetRandInt(vBucket.size())];
+        boost::unordered_map<int, CAddrInfo>::const_iterator it = mapInfo.find(nId);
+        assert(it != mapInfo.end());
+        const CAddrInfo &info = (*it).second;
+        if (GetRandInt(1<<30) < fChanceFactor*info.GetChance(nNow)*(1<<30))
+            return info;
+        fChanceFactor *= 1.2;
     }
 }
 
 #ifdef DEBUG_ADDRMAN
-int CAddrMan::Check_()
+int CAddrMan::Check_() const
 {
     std::set<int> setTried;
     std::map<int, int> mapNew;
 
     if (vRandom.size() != nTried + nNew) return -7;
 
-    for (std::map<int, CAddrInfo>::iterator it = mapInfo.begin(); it != mapInfo.end(); it++)
+    for (boost::unordered_map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end(); it++)
     {
         int n = (*it).first;
-        CAddrInfo &info = (*it).second;
+        const CAddrInfo &info = (*it).second;
         if (info.fInTried)
         {
 
@@ -454,7 +532,8 @@ int CAddrMan::Check_()
             if (!info.nRefCount) return -4;
             mapNew[n] = info.nRefCount;
         }
-        if (mapAddr[info] != n) return -5;
+        std::map<CNetAddr, int>::const_iterator itAddr = mapAddr.find(info);
+        if (itAddr == mapAddr.end() || (*itAddr).second != n) return -5;
         if (info.nRandomPos<0 || info.nRandomPos>=vRandom.size() || vRandom[info.nRandomPos] != n) return -14;
         if (info.nLastTry < 0) return -6;
         if (info.nLastSuccess < 0) return -8;
@@ -465,8 +544,10 @@ int CAddrMan::Check_()
 
     for (int n=0; n<vvTried.size(); n++)
     {
-        std::vector<int> &vTried = vvTried[n];
-        for (std::vector<int>::iterator it = vTried.begin(); it != vTried.end(); it++)
+        const std::vector<int> &vTried = vvTried[n];
+        if (vTried.empty() != (vTriedUsedPos[n] == -1)) return -16;
+        if (!vTried.empty() && vTriedUsed[vTriedUsedPos[n]] != n) return -16;
+        for (std::vector<int>::const_iterator it = vTried.begin(); it != vTried.end(); it++)
         {
             if (!setTried.count(*it)) return -11;
             setTried.erase(*it);
@@ -475,8 +556,10 @@ int CAddrMan::Check_()
 
     for (int n=0; n<vvNew.size(); n++)
     {
-        std::set<int> &vNew = vvNew[n];
-        for (std::set<int>::iterator it = vNew.begin(); it != vNew.end(); it++)
+        const std::vector<int> &vNew = vvNew[n];
+        if (vNew.empty() != (vNewUsedPos[n] == -1)) return -17;
+        if (!vNew.empty() && vNewUsed[vNewUsedPos[n]] != n) return -17;
+        for (std::vector<int>::const_iterator it = vNew.begin(); it != vNew.end(); it++)
         {
             if (!mapNew.count(*it)) return -12;
             if (--mapNew[*it] == 0)
@@ -491,25 +574,30 @@ int CAddrMan::Check_()
 }
 #endif
 
-void CAddrMan::GetAddr_(std::vector<CAddress> &vAddr)
+void CAddrMan::GetAddr_(std::vector<CAddress> &vAddr) const
 {
     int nNodes = ADDRMAN_GETADDR_MAX_PCT*vRandom.size()/100;
     if (nNodes > ADDRMAN_GETADDR_MAX)
         nNodes = ADDRMAN_GETADDR_MAX;
 
-    // perform a random shuffle over the first nNodes elements of vRandom (selecting from all)
+    // perform a random shuffle over the first nNodes elements of a copy of
+    // vRandom (selecting from all), so this only needs the lock shared
+    std::vector<int> vIds(vRandom);
+    vAddr.reserve(nNodes);
     for (int n = 0; n<nNodes; n++)
     {
-        int nRndPos = GetRandInt(vRandom.size() - n) + n;
-        SwapRandom(n, nRndPos);
-        assert(mapInfo.count(vRandom[n]) == 1);
-        vAddr.push_back(mapInfo[vRandom[n]]);
+        int nRndPos = GetRandInt(vIds.size() - n) + n;
+        std::swap(vIds[n], vIds[nRndPos]);
+        boost::unordered_map<int, CAddrInfo>::const_iterator it = mapInfo.find(vIds[n]);
+        assert(it != mapInfo.end());
+        vAddr.push_back((*it).second);
     }
 }
 
 void CAddrMan::Connected_(const CService &addr, int64 nTime)
 {
-    CAddrInfo *pinfo = Find(addr);
+    int nId;
+    CAddrInfo *pinfo = Find(addr, &nId);
 
     // if not found, bail out
     if (!pinfo)
@@ -524,5 +612,82 @@ void CAddrMan::Connected_(const CService &addr, int64 nTime)
     // update info
     int64 nUpdateInterval = 20 * 60;
     if (nTime - info.nTime > nUpdateInterval)
+    {
         info.nTime = nTime;
+        setChanged.insert(nId);
+    }
+}
+
+void CAddrMan::GetChanges(std::vector<CAddrLogRecord> &vRecords)
+{
+    boost::unique_lock<boost::shared_mutex> lock(cs);
+    vRecords.reserve(vRecords.size() + vDeleted.size() + setChanged.size());
+    for (std::vector<CAddrInfo>::const_iterator it = vDeleted.begin(); it != vDeleted.end(); it++)
+        vRecords.push_back(CAddrLogRecord(CAddrLogRecord::DELETED, *it));
+    for (std::set<int>::const_iterator it = setChanged.begin(); it != setChanged.end(); it++)
+    {
+        boost::unordered_map<int, CAddrInfo>::const_iterator mi = mapInfo.find(*it);
+        assert(mi != mapInfo.end());
+        const CAddrInfo &info = (*mi).second;
+        vRecords.push_back(CAddrLogRecord(info.fInTried ? CAddrLogRecord::TRIED : CAddrLogRecord::NEW, info));
+    }
+    vDeleted.clear();
+    setChanged.clear();
+}
+
+void CAddrMan::Replay_(const CAddrLogRecord &rec)
+{
+    const CAddrInfo &recinfo = rec.info;
+    int nId;
+    CAddrInfo *pinfo = Find(recinfo, &nId);
+
+    if (rec.nState == CAddrLogRecord::DELETED)
+    {
+        if (!pinfo)
+            return;
+        if (pinfo->fInTried)
+        {
+            // it was evicted back to the "new" table before being deleted
+            EraseTried(pinfo->GetTriedBucket(nKey), nId);
+            pinfo->fInTried = false;
+            nTried--;
+            nNew++;
+        }
+        for (unsigned int n = 0; n < vvNew.size() && pinfo->nRefCount > 0; n++)
+        {
+            if (EraseNew(n, nId))
+                pinfo->nRefCount--;
+        }
+        pinfo->nRefCount = 0;
+        Delete(nId);
+        return;
+    }
+
+    if (!pinfo)
+    {
+        int nUBucket = GetNewBucket(recinfo, recinfo.source);
+        if (nUBucket < 0)
+            return;
+        pinfo = Create(recinfo, recinfo.source, &nId);
+        nNew++;
+        pinfo->nRefCount++;
+        if (vvNew[nUBucket].size() == ADDRMAN_NEW_BUCKET_SIZE)
+            ShrinkNew(nUBucket);
+        InsertNew(nUBucket, nId);
+    }
+
+    pinfo->nTime = recinfo.nTime;
+    pinfo->nServices = recinfo.nServices;
+    pinfo->nLastSuccess = recinfo.nLastSuccess;
+    pinfo->nLastTry = recinfo.nLastTry;
+    pinfo->nAttempts = recinfo.nAttempts;
+
+    // an entry that was evicted back to "new" stays tried here: the
+    // promotions replayed before it have made their own room
+    if (rec.nState == CAddrLogRecord::TRIED && !pinfo->fInTried && pinfo->nLastSuccess)
+    {
+        int nUBucket = FindNewBucket(nId);
+        if (nUBucket != -1)
+            MakeTried(*pinfo, nId, nUBucket);
+    }
 }
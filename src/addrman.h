@@ -10,9 +10,13 @@
 #include "sync.h"
 
 
+#include <algorithm>
 #include <map>
+#include <set>
 #include <vector>
 
+#include <boost/unordered_map.hpp>
+
 #include <openssl/rand.h>
 
 
@@ -93,6 +97,30 @@ public:
 
 };
 
+/** The state of one entry after a change, as journaled to peers.log */
+class CAddrLogRecord
+{
+public:
+    enum
+    {
+        DELETED = 0,
+        NEW = 1,
+        TRIED = 2,
+    };
+
+    unsigned char nState;
+    CAddrInfo info;
+
+    IMPLEMENT_SERIALIZE(
+        READWRITE(nState);
+        READWRITE(info);
+        READWRITE(info.nLastTry);
+    )
+
+    CAddrLogRecord() : nState(DELETED) {}
+    CAddrLogRecord(unsigned char nStateIn, const CAddrInfo &infoIn) : nState(nStateIn), info(infoIn) {}
+};
+
 // Stochastic address manager
 //
 // Design goals:
@@ -165,8 +193,10 @@ public:
 class CAddrMan
 {
 private:
-    // critical section to protect the inner data structures
-    mutable CCriticalSection cs;
+    // lock protecting the inner data structures; selecting and returning
+    // addresses only needs it shared, anything that changes the tables
+    // takes it exclusively
+    mutable boost::shared_mutex cs;
 
     // secret key to randomize bucket select with
     std::vector<unsigned char> nKey;
@@ -175,7 +205,7 @@ private:
     int nIdCount;
 
     // table with information about all nIds
-    std::map<int, CAddrInfo> mapInfo;
+    boost::unordered_map<int, CAddrInfo> mapInfo;
 
     // find an nId based on its network address
     std::map<CNetAddr, int> mapAddr;
@@ -192,8 +222,19 @@ private:
     // number of (unique) "new" entries
     int nNew;
 
-    // list of "new" buckets
-    std::vector<std::set<int> > vvNew;
+    // list of "new" buckets (unordered, so entries can be picked by position)
+    std::vector<std::vector<int> > vvNew;
+
+    // entries changed and addresses deleted since the last GetChanges (memory only)
+    std::set<int> setChanged;
+    std::vector<CAddrInfo> vDeleted;
+
+    // non-empty "tried" and "new" buckets, and the position of each bucket in
+    // them (-1 if empty), so selection never has to probe empty buckets
+    std::vector<int> vTriedUsed;
+    std::vector<int> vTriedUsedPos;
+    std::vector<int> vNewUsed;
+    std::vector<int> vNewUsedPos;
 
 protected:
 
@@ -207,6 +248,27 @@ protected:
     // Swap two elements in vRandom.
     void SwapRandom(unsigned int nRandomPos1, unsigned int nRandomPos2);
 
+    // Delete an entry that is in no bucket anymore.
+    void Delete(int nId);
+
+    // Find a "new" bucket nId is in, or -1.
+    int FindNewBucket(int nId) const;
+
+    // Add nId to a "new" or "tried" bucket.
+    void InsertNew(int nUBucket, int nId);
+    void InsertTried(int nKBucket, int nId);
+
+    // Remove nId from a "new" or "tried" bucket. Returns false if it wasn't there.
+    bool EraseNew(int nUBucket, int nId);
+    bool EraseTried(int nKBucket, int nId);
+
+    // Reset all buckets to empty.
+    void ClearBuckets();
+
+    // Calculate the "new" bucket addr goes into when learned from source.
+    // Only depends on nKey, so it is called before taking the lock.
+    int GetNewBucket(const CAddress &addr, const CNetAddr& source) const;
+
     // Return position in given bucket to replace.
     int SelectTried(int nKBucket);
 
@@ -222,27 +284,30 @@ protected:
     // Mark an entry "good", possibly moving it from "new" to "tried".
     void Good_(const CService &addr, int64 nTime);
 
-    // Add an entry to the "new" table.
-    bool Add_(const CAddress &addr, const CNetAddr& source, int64 nTimePenalty);
+    // Add an entry to the "new" table, into bucket nUBucket (see GetNewBucket).
+    bool Add_(const CAddress &addr, const CNetAddr& source, int64 nTimePenalty, int nUBucket);
 
     // Mark an entry as attempted to connect.
     void Attempt_(const CService &addr, int64 nTime);
 
     // Select an address to connect to.
     // nUnkBias determines how much to favor new addresses over tried ones (min=0, max=100)
-    CAddress Select_(int nUnkBias);
+    CAddress Select_(int nUnkBias) const;
 
 #ifdef DEBUG_ADDRMAN
     // Perform consistency check. Returns an error code or zero.
-    int Check_();
+    int Check_() const;
 #endif
 
     // Select several addresses at once.
-    void GetAddr_(std::vector<CAddress> &vAddr);
+    void GetAddr_(std::vector<CAddress> &vAddr) const;
 
     // Mark an entry as currently-connected-to.
     void Connected_(const CService &addr, int64 nTime);
 
+    // Bring an entry to the state in a journal record.
+    void Replay_(const CAddrLogRecord &rec);
+
 public:
 
     IMPLEMENT_SERIALIZE
@@ -268,7 +333,12 @@ public:
         // This format is more complex, but significantly smaller (at most 1.5 MiB), and supports
         // changes to the ADDRMAN_ parameters without breaking the on-disk structure.
         {
-            LOCK(cs);
+            boost::shared_lock<boost::shared_mutex> lockShared(cs, boost::defer_lock);
+            boost::unique_lock<boost::shared_mutex> lockExclusive(cs, boost::defer_lock);
+            if (fWrite)
+                lockShared.lock();
+            else
+                lockExclusive.lock();
             unsigned char nVersion = 0;
             READWRITE(nVersion);
             READWRITE(nKey);
@@ -282,7 +352,7 @@ public:
                 READWRITE(nUBuckets);
                 std::map<int, int> mapUnkIds;
                 int nIds = 0;
-                for (std::map<int, CAddrInfo>::iterator it = am->mapInfo.begin(); it != am->mapInfo.end(); it++)
+                for (boost::unordered_map<int, CAddrInfo>::iterator it = am->mapInfo.begin(); it != am->mapInfo.end(); it++)
                 {
                     if (nIds == nNew) break; // this means nNew was wrong, oh ow
                     mapUnkIds[(*it).first] = nIds;
@@ -294,7 +364,7 @@ public:
                     }
                 }
                 nIds = 0;
-                for (std::map<int, CAddrInfo>::iterator it = am->mapInfo.begin(); it != am->mapInfo.end(); it++)
+                for (boost::unordered_map<int, CAddrInfo>::iterator it = am->mapInfo.begin(); it != am->mapInfo.end(); it++)
                 {
                     if (nIds == nTried) break; // this means nTried was wrong, oh ow
                     CAddrInfo &info = (*it).second;
@@ -304,12 +374,12 @@ public:
                         nIds++;
                     }
                 }
-                for (std::vector<std::set<int> >::iterator it = am->vvNew.begin(); it != am->vvNew.end(); it++)
+                for (std::vector<std::vector<int> >::iterator it = am->vvNew.begin(); it != am->vvNew.end(); it++)
                 {
-                    const std::set<int> &vNew = (*it);
+                    const std::vector<int> &vNew = (*it);
                     int nSize = vNew.size();
                     READWRITE(nSize);
-                    for (std::set<int>::iterator it2 = vNew.begin(); it2 != vNew.end(); it2++)
+                    for (std::vector<int>::const_iterator it2 = vNew.begin(); it2 != vNew.end(); it2++)
                     {
                         int nIndex = mapUnkIds[*it2];
                         READWRITE(nIndex);
@@ -322,8 +392,9 @@ public:
                 am->mapInfo.clear();
                 am->mapAddr.clear();
                 am->vRandom.clear();
-                am->vvTried = std::vector<std::vector<int> >(ADDRMAN_TRIED_BUCKET_COUNT, std::vector<int>(0));
-                am->vvNew = std::vector<std::set<int> >(ADDRMAN_NEW_BUCKET_COUNT, std::set<int>());
+                am->ClearBuckets();
+                am->setChanged.clear();
+                am->vDeleted.clear();
                 for (int n = 0; n < am->nNew; n++)
                 {
                     CAddrInfo &info = am->mapInfo[n];
@@ -333,7 +404,7 @@ public:
                     am->vRandom.push_back(n);
                     if (nUBuckets != ADDRMAN_NEW_BUCKET_COUNT)
                     {
-                        am->vvNew[info.GetNewBucket(am->nKey)].insert(n);
+                        am->InsertNew(info.GetNewBucket(am->nKey), n);
                         info.nRefCount++;
                     }
                 }
@@ -343,15 +414,15 @@ public:
                 {
                     CAddrInfo info;
                     READWRITE(info);
-                    std::vector<int> &vTried = am->vvTried[info.GetTriedBucket(am->nKey)];
-                    if (vTried.size() < ADDRMAN_TRIED_BUCKET_SIZE)
+                    int nKBucket = info.GetTriedBucket(am->nKey);
+                    if (am->vvTried[nKBucket].size() < ADDRMAN_TRIED_BUCKET_SIZE)
                     {
                         info.nRandomPos = vRandom.size();
                         info.fInTried = true;
                         am->vRandom.push_back(am->nIdCount);
                         am->mapInfo[am->nIdCount] = info;
                         am->mapAddr[info] = am->nIdCount;
-                        vTried.push_back(am->nIdCount);
+                        am->InsertTried(nKBucket, am->nIdCount);
                         am->nIdCount++;
                     } else {
                         nLost++;
@@ -360,7 +431,6 @@ public:
                 am->nTried -= nLost;
                 for (int b = 0; b < nUBuckets; b++)
                 {
-                    std::set<int> &vNew = am->vvNew[b];
                     int nSize = 0;
                     READWRITE(nSize);
                     for (int n = 0; n < nSize; n++)
@@ -368,10 +438,11 @@ public:
                         int nIndex = 0;
                         READWRITE(nIndex);
                         CAddrInfo &info = am->mapInfo[nIndex];
-                        if (nUBuckets == ADDRMAN_NEW_BUCKET_COUNT && info.nRefCount < ADDRMAN_NEW_BUCKETS_PER_ADDRESS)
+                        if (nUBuckets == ADDRMAN_NEW_BUCKET_COUNT && info.nRefCount < ADDRMAN_NEW_BUCKETS_PER_ADDRESS &&
+                            std::find(am->vvNew[b].begin(), am->vvNew[b].end(), nIndex) == am->vvNew[b].end())
                         {
                             info.nRefCount++;
-                            vNew.insert(nIndex);
+                            am->InsertNew(b, nIndex);
                         }
                     }
                 }
@@ -379,8 +450,9 @@ public:
         }
     });)
 
-    CAddrMan() : vRandom(0), vvTried(ADDRMAN_TRIED_BUCKET_COUNT, std::vector<int>(0)), vvNew(ADDRMAN_NEW_BUCKET_COUNT, std::set<int>())
+    CAddrMan() : vRandom(0)
     {
+         ClearBuckets();
          nKey.resize(32);
          RAND_bytes(&nKey[0], 32);
 
@@ -390,21 +462,18 @@ public:
     }
 
     // Return the number of (unique) addresses in all tables.
-    int size()
+    int size() const
     {
         return vRandom.size();
     }
 
-    // Consistency check
-    void Check()
+    // Consistency check; the caller holds cs
+    void Check() const
     {
 #ifdef DEBUG_ADDRMAN
-        {
-            LOCK(cs);
-            int err;
-            if ((err=Check_()))
-                printf("ADDRMAN CONSISTENCY CHECK FAILED!!! err=%i\n", err);
-        }
+        int err;
+        if ((err=Check_()))
+            printf("ADDRMAN CONSISTENCY CHECK FAILED!!! err=%i\n", err);
 #endif
     }
 
@@ -412,10 +481,11 @@ public:
     bool Add(const CAddress &addr, const CNetAddr& source, int64 nTimePenalty = 0)
     {
         bool fRet = false;
+        int nUBucket = GetNewBucket(addr, source);
         {
-            LOCK(cs);
+            boost::unique_lock<boost::shared_mutex> lock(cs);
             Check();
-            fRet |= Add_(addr, source, nTimePenalty);
+            fRet |= Add_(addr, source, nTimePenalty, nUBucket);
             Check();
         }
         if (fRet)
@@ -427,11 +497,15 @@ public:
     bool Add(const std::vector<CAddress> &vAddr, const CNetAddr& source, int64 nTimePenalty = 0)
     {
         int nAdd = 0;
+        std::vector<int> vUBucket;
+        vUBucket.reserve(vAddr.size());
+        for (std::vector<CAddress>::const_iterator it = vAddr.begin(); it != vAddr.end(); it++)
+            vUBucket.push_back(GetNewBucket(*it, source));
         {
-            LOCK(cs);
+            boost::unique_lock<boost::shared_mutex> lock(cs);
             Check();
-            for (std::vector<CAddress>::const_iterator it = vAddr.begin(); it != vAddr.end(); it++)
-                nAdd += Add_(*it, source, nTimePenalty) ? 1 : 0;
+            for (unsigned int i = 0; i < vAddr.size(); i++)
+                nAdd += Add_(vAddr[i], source, nTimePenalty, vUBucket[i]) ? 1 : 0;
             Check();
         }
         if (nAdd)
@@ -443,7 +517,7 @@ public:
     void Good(const CService &addr, int64 nTime = GetAdjustedTime())
     {
         {
-            LOCK(cs);
+            boost::unique_lock<boost::shared_mutex> lock(cs);
             Check();
             Good_(addr, nTime);
             Check();
@@ -454,7 +528,7 @@ public:
     void Attempt(const CService &addr, int64 nTime = GetAdjustedTime())
     {
         {
-            LOCK(cs);
+            boost::unique_lock<boost::shared_mutex> lock(cs);
             Check();
             Attempt_(addr, nTime);
             Check();
@@ -467,10 +541,9 @@ public:
     {
         CAddress addrRet;
         {
-            LOCK(cs);
+            boost::shared_lock<boost::shared_mutex> lock(cs);
             Check();
             addrRet = Select_(nUnkBias);
-            Check();
         }
         return addrRet;
     }
@@ -478,13 +551,12 @@ public:
     // Return a bunch of addresses, selected at random.
     std::vector<CAddress> GetAddr()
     {
-        Check();
         std::vector<CAddress> vAddr;
         {
-            LOCK(cs);
+            boost::shared_lock<boost::shared_mutex> lock(cs);
+            Check();
             GetAddr_(vAddr);
         }
-        Check();
         return vAddr;
     }
 
@@ -492,12 +564,33 @@ public:
     void Connected(const CService &addr, int64 nTime = GetAdjustedTime())
     {
         {
-            LOCK(cs);
+            boost::unique_lock<boost::shared_mutex> lock(cs);
             Check();
             Connected_(addr, nTime);
             Check();
         }
     }
+
+    // Return the entries that changed since the last call, deletions first,
+    // and start collecting anew. A snapshot serialized after this call
+    // contains all of them.
+    void GetChanges(std::vector<CAddrLogRecord> &vRecords);
+
+    // Apply journaled changes on top of a loaded snapshot. Bucket placement
+    // is randomized again, but every address and its statistics are kept.
+    void Replay(const std::vector<CAddrLogRecord> &vRecords)
+    {
+        {
+            boost::unique_lock<boost::shared_mutex> lock(cs);
+            Check();
+            for (std::vector<CAddrLogRecord>::const_iterator it = vRecords.begin(); it != vRecords.end(); it++)
+                Replay_(*it);
+            // these are on disk already
+            setChanged.clear();
+            vDeleted.clear();
+            Check();
+        }
+    }
 };
 
 #endif
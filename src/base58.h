@@ -25,44 +25,87 @@
 
 static const char* pszBase58 = "123456789ABCDEFGHJKLMNPQRSTUVWXYZabcdefghijkmnopqrstuvwxyz";
 
+// Value of each character in pszBase58, or -1
+static const signed char mapBase58[256] = {
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,0,1,2,3,4,5,6,7,8,-1,-1,-1,-1,-1,-1,
+    -1,9,10,11,12,13,14,15,16,-1,17,18,19,20,21,-1,
+    22,23,24,25,26,27,28,29,30,31,32,-1,-1,-1,-1,-1,
+    -1,33,34,35,36,37,38,39,40,41,42,43,-1,44,45,46,
+    47,48,49,50,51,52,53,54,55,56,57,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1
+};
+
+// The conversions below work on limbs of five base58 digits, the most that
+// fit in 32 bits, instead of a bignum
+static const uint64 BASE58_LIMB = 58ULL * 58 * 58 * 58 * 58;
+
 // Encode a byte sequence as a base58-encoded string
 inline std::string EncodeBase58(const unsigned char* pbegin, const unsigned char* pend)
 {
-    CAutoBN_CTX pctx;
-    CBigNum bn58 = 58;
-    CBigNum bn0 = 0;
-
-    // Convert big endian data to little endian
-    // Extra zero at the end make sure bignum will interpret as a positive number
-    std::vector<unsigned char> vchTmp(pend-pbegin+1, 0);
-    reverse_copy(pbegin, pend, vchTmp.begin());
-
-    // Convert little endian data to bignum
-    CBigNum bn;
-    bn.setvch(vchTmp);
+    // Leading zeroes encoded as base58 zeros
+    int nZeroes = 0;
+    while (pbegin != pend && *pbegin == 0)
+    {
+        pbegin++;
+        nZeroes++;
+    }
 
-    // Convert bignum to std::string
-    std::string str;
+    // Convert big endian data to little endian base58 limbs, up to four bytes at a time
     // Expected size increase from base58 conversion is approximately 137%
     // use 138% to be safe
-    str.reserve((pend - pbegin) * 138 / 100 + 1);
-    CBigNum dv;
-    CBigNum rem;
-    while (bn > bn0)
+    std::vector<uint32_t> vLimbs;
+    vLimbs.reserve((pend - pbegin) * 138 / 500 + 1);
+    while (pbegin != pend)
     {
-        if (!BN_div(&dv, &rem, &bn, &bn58, pctx))
-            throw bignum_error("EncodeBase58 : BN_div failed");
-        bn = dv;
-        unsigned int c = rem.getulong();
-        str += pszBase58[c];
+        uint64 nMul = 1;
+        uint64 nCarry = 0;
+        for (int i = 0; i < 4 && pbegin != pend; i++)
+        {
+            nCarry = (nCarry << 8) | *pbegin++;
+            nMul <<= 8;
+        }
+        for (std::vector<uint32_t>::iterator it = vLimbs.begin(); it != vLimbs.end(); ++it)
+        {
+            uint64 n = *it * nMul + nCarry;
+            *it = n % BASE58_LIMB;
+            nCarry = n / BASE58_LIMB;
+        }
+        while (nCarry > 0)
+        {
+            vLimbs.push_back(nCarry % BASE58_LIMB);
+            nCarry /= BASE58_LIMB;
+        }
     }
 
-    // Leading zeroes encoded as base58 zeros
-    for (const unsigned char* p = pbegin; p < pend && *p == 0; p++)
-        str += pszBase58[0];
-
-    // Convert little endian std::string to big endian
-    reverse(str.begin(), str.end());
+    // Convert limbs to big endian std::string
+    std::string str(nZeroes, pszBase58[0]);
+    str.reserve(nZeroes + vLimbs.size() * 5);
+    for (std::vector<uint32_t>::reverse_iterator it = vLimbs.rbegin(); it != vLimbs.rend(); ++it)
+    {
+        char buf[5];
+        uint32_t n = *it;
+        for (int i = 4; i >= 0; i--)
+        {
+            buf[i] = pszBase58[n % 58];
+            n /= 58;
+        }
+        // The most significant limb is nonzero, drop its leading zero digits
+        int nSkip = 0;
+        if (it == vLimbs.rbegin())
+            while (buf[nSkip] == pszBase58[0])
+                nSkip++;
+        str.append(buf + nSkip, 5 - nSkip);
+    }
     return str;
 }
 
@@ -76,47 +119,57 @@ inline std::string EncodeBase58(const std::vector<unsigned char>& vch)
 // returns true if decoding is successful
 inline bool DecodeBase58(const char* psz, std::vector<unsigned char>& vchRet)
 {
-    CAutoBN_CTX pctx;
     vchRet.clear();
-    CBigNum bn58 = 58;
-    CBigNum bn = 0;
-    CBigNum bnChar;
     while (isspace(*psz))
         psz++;
 
-    // Convert big endian string to bignum
-    for (const char* p = psz; *p; p++)
+    // Restore leading zeros
+    int nZeroes = 0;
+    while (*psz == pszBase58[0])
     {
-        const char* p1 = strchr(pszBase58, *p);
-        if (p1 == NULL)
+        psz++;
+        nZeroes++;
+    }
+
+    // Convert big endian string to little endian 32-bit limbs, up to five digits at a time
+    std::vector<uint32_t> vLimbs;
+    vLimbs.reserve(strlen(psz) * 733 / 4000 + 1); // log(58) / log(256) bytes per digit
+    const unsigned char* p = (const unsigned char*)psz;
+    for (;;)
+    {
+        uint64 nMul = 1;
+        uint64 nCarry = 0;
+        while (nMul < BASE58_LIMB && mapBase58[*p] >= 0)
         {
-            while (isspace(*p))
-                p++;
-            if (*p != '\0')
-                return false;
+            nCarry = nCarry * 58 + mapBase58[*p++];
+            nMul *= 58;
+        }
+        if (nMul == 1)
             break;
+        for (std::vector<uint32_t>::iterator it = vLimbs.begin(); it != vLimbs.end(); ++it)
+        {
+            uint64 n = *it * nMul + nCarry;
+            *it = (uint32_t)n;
+            nCarry = n >> 32;
+        }
+        while (nCarry > 0)
+        {
+            vLimbs.push_back((uint32_t)nCarry);
+            nCarry >>= 32;
         }
-        bnChar.setulong(p1 - pszBase58);
-        if (!BN_mul(&bn, &bn, &bn58, pctx))
-            throw bignum_error("DecodeBase58 : BN_mul failed");
-        bn += bnChar;
     }
+    while (isspace(*p))
+        p++;
+    if (*p != '\0')
+        return false;
 
-    // Get bignum as little endian data
-    std::vector<unsigned char> vchTmp = bn.getvch();
-
-    // Trim off sign byte if present
-    if (vchTmp.size() >= 2 && vchTmp.end()[-1] == 0 && vchTmp.end()[-2] >= 0x80)
-        vchTmp.erase(vchTmp.end()-1);
-
-    // Restore leading zeros
-    int nLeadingZeros = 0;
-    for (const char* p = psz; *p == pszBase58[0]; p++)
-        nLeadingZeros++;
-    vchRet.assign(nLeadingZeros + vchTmp.size(), 0);
-
-    // Convert little endian data to big endian
-    reverse_copy(vchTmp.begin(), vchTmp.end(), vchRet.end() - vchTmp.size());
+    // Convert limbs to big endian data, without the leading zero bytes of the top limb
+    vchRet.reserve(nZeroes + vLimbs.size() * 4);
+    vchRet.assign(nZeroes, 0);
+    for (std::vector<uint32_t>::reverse_iterator it = vLimbs.rbegin(); it != vLimbs.rend(); ++it)
+        for (int nShift = 24; nShift >= 0; nShift -= 8)
+            if (it != vLimbs.rbegin() || (*it >> nShift) != 0)
+                vchRet.push_back((unsigned char)(*it >> nShift));
     return true;
 }
 
@@ -134,7 +187,9 @@ inline bool DecodeBase58(const std::string& str, std::vector<unsigned char>& vch
 inline std::string EncodeBase58Check(const std::vector<unsigned char>& vchIn)
 {
     // add 4-byte hash check to the end
-    std::vector<unsigned char> vch(vchIn);
+    std::vector<unsigned char> vch;
+    vch.reserve(vchIn.size() + 4);
+    vch.assign(vchIn.begin(), vchIn.end());
     uint256 hash = Hash(vch.begin(), vch.end());
     vch.insert(vch.end(), (unsigned char*)&hash, (unsigned char*)&hash + 4);
     return EncodeBase58(vch);
@@ -3,8 +3,10 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "bloom.h"
+#include "hash.h"
 #include "main.h"
 #include "script.h"
 
@@ -29,27 +31,68 @@ nHashFuncs(min((unsigned int)(vData.size() * 8 / nElements * LN2), MAX_HASH_FUNC
 nTweak(nTweakIn),
 nFlags(nFlagsIn)
 {
+    UpdateSeeds();
 }
 
-inline unsigned int CBloomFilter::Hash(unsigned int nHashNum, const std::vector<unsigned char>& vDataToHash) const
+void CBloomFilter::UpdateSeeds()
 {
+    // Filters with more hash functions are refused by IsWithinSizeConstraints,
+    // don't let one that was just deserialized allocate them all
+    vSeeds.resize(min(nHashFuncs, MAX_HASH_FUNCS));
     // 0xFBA4C795 chosen as it guarantees a reasonable bit difference between nHashNum values.
-    return MurmurHash3(nHashNum * 0xFBA4C795 + nTweak, vDataToHash) % (vData.size() * 8);
+    for (unsigned int i = 0; i < vSeeds.size(); i++)
+        vSeeds[i] = i * 0xFBA4C795 + nTweak;
 }
 
-void CBloomFilter::insert(const vector<unsigned char>& vKey)
+void CBloomFilter::insert(const uint32_t* pnWords, unsigned int nLen)
 {
-    if (isFull)
-        return;
-    for (unsigned int i = 0; i < nHashFuncs; i++)
+    unsigned int nBits = vData.size() * 8;
+    for (unsigned int i = 0; i < vSeeds.size(); i += 4)
     {
-        unsigned int nIndex = Hash(i, vKey);
-        // Sets bit nIndex of vData
-        vData[nIndex >> 3] |= bit_mask[7 & nIndex];
+        uint32_t vHash[4];
+        unsigned int n = min((unsigned int)vSeeds.size() - i, 4U);
+        MurmurHash3Seeds(pnWords, nLen, &vSeeds[i], n, vHash);
+        for (unsigned int j = 0; j < n; j++)
+        {
+            unsigned int nIndex = vHash[j] % nBits;
+            // Sets bit nIndex of vData
+            vData[nIndex >> 3] |= bit_mask[7 & nIndex];
+        }
     }
     isEmpty = false;
 }
 
+bool CBloomFilter::contains(const uint32_t* pnWords, unsigned int nLen) const
+{
+    unsigned int nBits = vData.size() * 8;
+    // Most elements miss at the first hash function, the others are
+    // likely to need several and get them four at a time
+    for (unsigned int i = 0; i < vSeeds.size(); )
+    {
+        uint32_t vHash[4];
+        unsigned int n = (i == 0 ? 1 : min((unsigned int)vSeeds.size() - i, 4U));
+        MurmurHash3Seeds(pnWords, nLen, &vSeeds[i], n, vHash);
+        for (unsigned int j = 0; j < n; j++)
+        {
+            unsigned int nIndex = vHash[j] % nBits;
+            // Checks bit nIndex of vData
+            if (!(vData[nIndex >> 3] & bit_mask[7 & nIndex]))
+                return false;
+        }
+        i += n;
+    }
+    return true;
+}
+
+void CBloomFilter::insert(const vector<unsigned char>& vKey)
+{
+    if (isFull)
+        return;
+    vector<uint32_t> vWords((vKey.size() + 3) / 4);
+    MurmurHash3Mix(vKey.empty() ? NULL : &vKey[0], vKey.size(), vWords.empty() ? NULL : &vWords[0]);
+    insert(vWords.empty() ? NULL : &vWords[0], vKey.size());
+}
+
 void CBloomFilter::insert(const COutPoint& outpoint)
 {
     CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
@@ -70,14 +113,9 @@ bool CBloomFilter::contains(const vector<unsigned char>& vKey) const
         return true;
     if (isEmpty)
         return false;
-    for (unsigned int i = 0; i < nHashFuncs; i++)
-    {
-        unsigned int nIndex = Hash(i, vKey);
-        // Checks bit nIndex of vData
-        if (!(vData[nIndex >> 3] & bit_mask[7 & nIndex]))
-            return false;
-    }
-    return true;
+    vector<uint32_t> vWords((vKey.size() + 3) / 4);
+    MurmurHash3Mix(vKey.empty() ? NULL : &vKey[0], vKey.size(), vWords.empty() ? NULL : &vWords[0]);
+    return contains(vWords.empty() ? NULL : &vWords[0], vKey.size());
 }
 
 bool CBloomFilter::contains(const COutPoint& outpoint) const
@@ -99,70 +137,126 @@ bool CBloomFilter::IsWithinSizeConstraints() const
     return vData.size() <= MAX_BLOOM_FILTER_SIZE && nHashFuncs <= MAX_HASH_FUNCS;
 }
 
+CBloomTxElements::CBloomTxElements(const CTransaction& tx, const uint256& hashIn) : ptx(&tx), hash(hashIn)
+{
+    // Room for all the script data, which is most of the elements
+    unsigned int nSize = sizeof(hash) + 36 * tx.vin.size();
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        nSize += txin.scriptSig.size();
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        nSize += txout.scriptPubKey.size();
+    vWords.reserve(nSize / 4 + 2 * tx.vin.size() + tx.vout.size() + 1);
+    vElements.reserve(1 + 3 * tx.vin.size() + 2 * tx.vout.size());
+
+    Add(hash.begin(), sizeof(hash), -1);
+
+    vector<unsigned char> data;
+    for (unsigned int i = 0; i < tx.vout.size(); i++)
+    {
+        const CScript& script = tx.vout[i].scriptPubKey;
+        CScript::const_iterator pc = script.begin();
+        while (pc < script.end())
+        {
+            opcodetype opcode;
+            if (!script.GetOp(pc, opcode, data))
+                break;
+            if (data.size() != 0)
+                Add(&data[0], data.size(), i);
+        }
+    }
+    nInputElements = vElements.size();
+
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        // The outpoint as serialized
+        unsigned char pchOutPoint[36];
+        memcpy(pchOutPoint, txin.prevout.hash.begin(), 32);
+        memcpy(pchOutPoint + 32, &txin.prevout.n, 4);
+        Add(pchOutPoint, sizeof(pchOutPoint), -1);
+
+        const CScript& script = txin.scriptSig;
+        CScript::const_iterator pc = script.begin();
+        while (pc < script.end())
+        {
+            opcodetype opcode;
+            if (!script.GetOp(pc, opcode, data))
+                break;
+            if (data.size() != 0)
+                Add(&data[0], data.size(), -1);
+        }
+    }
+}
+
+void CBloomTxElements::Add(const unsigned char* pdata, unsigned int nLen, int nOut)
+{
+    CElement element;
+    element.nWord = vWords.size();
+    element.nLen = nLen;
+    element.nOut = nOut;
+    vWords.resize(vWords.size() + (nLen + 3) / 4);
+    MurmurHash3Mix(pdata, nLen, &vWords[element.nWord]);
+    vElements.push_back(element);
+}
+
 bool CBloomFilter::IsRelevantAndUpdate(const CTransaction& tx, const uint256& hash)
+{
+    if (isFull)
+        return true;
+    if (isEmpty)
+        return false;
+    return IsRelevantAndUpdate(CBloomTxElements(tx, hash));
+}
+
+bool CBloomFilter::IsRelevantAndUpdate(const CBloomTxElements& elements)
 {
     bool fFound = false;
-    // Match if the filter contains the hash of tx
-    //  for finding tx when they appear in a block
     if (isFull)
         return true;
     if (isEmpty)
         return false;
-    if (contains(hash))
-        fFound = true;
 
-    for (unsigned int i = 0; i < tx.vout.size(); i++)
+    // Match if the filter contains the hash of tx
+    //  for finding tx when they appear in a block
+    // Match if the filter contains any arbitrary script data element in any scriptPubKey in tx
+    // If this matches, also add the specific output that was matched.
+    // This means clients don't have to update the filter themselves when a new relevant tx 
+    // is discovered in order to find spending transactions, which avoids round-tripping and race conditions.
+    const vector<CBloomTxElements::CElement>& vElements = elements.vElements;
+    for (unsigned int i = 0; i < elements.nInputElements; i++)
     {
-        const CTxOut& txout = tx.vout[i];
-        // Match if the filter contains any arbitrary script data element in any scriptPubKey in tx
-        // If this matches, also add the specific output that was matched.
-        // This means clients don't have to update the filter themselves when a new relevant tx 
-        // is discovered in order to find spending transactions, which avoids round-tripping and race conditions.
-        CScript::const_iterator pc = txout.scriptPubKey.begin();
-        vector<unsigned char> data;
-        while (pc < txout.scriptPubKey.end())
+        const CBloomTxElements::CElement& element = vElements[i];
+        if (!contains(&elements.vWords[element.nWord], element.nLen))
+            continue;
+        fFound = true;
+        if (element.nOut < 0)
+            continue;
+
+        const CTxOut& txout = elements.ptx->vout[element.nOut];
+        if ((nFlags & BLOOM_UPDATE_MASK) == BLOOM_UPDATE_ALL)
+            insert(COutPoint(elements.hash, element.nOut));
+        else if ((nFlags & BLOOM_UPDATE_MASK) == BLOOM_UPDATE_P2PUBKEY_ONLY)
         {
-            opcodetype opcode;
-            if (!txout.scriptPubKey.GetOp(pc, opcode, data))
-                break;
-            if (data.size() != 0 && contains(data))
-            {
-                fFound = true;
-                if ((nFlags & BLOOM_UPDATE_MASK) == BLOOM_UPDATE_ALL)
-                    insert(COutPoint(hash, i));
-                else if ((nFlags & BLOOM_UPDATE_MASK) == BLOOM_UPDATE_P2PUBKEY_ONLY)
-                {
-                    txnouttype type;
-                    vector<vector<unsigned char> > vSolutions;
-                    if (Solver(txout.scriptPubKey, type, vSolutions) &&
-                            (type == TX_PUBKEY || type == TX_MULTISIG))
-                        insert(COutPoint(hash, i));
-                }
-                break;
-            }
+            txnouttype type;
+            vector<vector<unsigned char> > vSolutions;
+            if (Solver(txout.scriptPubKey, type, vSolutions) &&
+                    (type == TX_PUBKEY || type == TX_MULTISIG))
+                insert(COutPoint(elements.hash, element.nOut));
         }
+        // The rest of this output's data doesn't need to be checked
+        while (i + 1 < elements.nInputElements && vElements[i + 1].nOut == element.nOut)
+            i++;
     }
 
     if (fFound)
         return true;
 
-    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    // Match if the filter contains an outpoint tx spends, or any arbitrary
+    // script data element in any scriptSig in tx
+    for (unsigned int i = elements.nInputElements; i < vElements.size(); i++)
     {
-        // Match if the filter contains an outpoint tx spends
-        if (contains(txin.prevout))
+        const CBloomTxElements::CElement& element = vElements[i];
+        if (contains(&elements.vWords[element.nWord], element.nLen))
             return true;
-
-        // Match if the filter contains any arbitrary script data element in any scriptSig in tx
-        CScript::const_iterator pc = txin.scriptSig.begin();
-        vector<unsigned char> data;
-        while (pc < txin.scriptSig.end())
-        {
-            opcodetype opcode;
-            if (!txin.scriptSig.GetOp(pc, opcode, data))
-                break;
-            if (data.size() != 0 && contains(data))
-                return true;
-        }
     }
 
     return false;
@@ -180,3 +274,78 @@ void CBloomFilter::UpdateEmptyFull()
     isFull = full;
     isEmpty = empty;
 }
+
+CRollingBloomFilter::CRollingBloomFilter(unsigned int nElements, double nFPRate)
+{
+    // Up to one and a half times nElements are in the filter, the sizing
+    // follows the formulas of CBloomFilter for that many
+    nEntriesPerGeneration = max(nElements / 2, 1U);
+    double nMaxElements = nEntriesPerGeneration * 3;
+    nHashFuncs = max(1, min((int)(log(nFPRate) / log(0.5) + 0.5), 50));
+    nPositions = (unsigned int)ceil(-1.0 * nHashFuncs * nMaxElements / log(1.0 - exp(log(nFPRate) / nHashFuncs)));
+    vData.resize(((nPositions + 63) / 64) * 2);
+    reset();
+}
+
+void CRollingBloomFilter::reset()
+{
+    nTweak0 = GetRand(~(uint64)0);
+    nTweak1 = GetRand(~(uint64)0);
+    nEntriesThisGeneration = 0;
+    nGeneration = 1;
+    std::fill(vData.begin(), vData.end(), 0);
+}
+
+// Position n of the entry with hash h, by double hashing
+static inline unsigned int RollingBloomPosition(uint64 h, unsigned int n, unsigned int nPositions)
+{
+    uint32_t nHash = (uint32_t)h + n * ((uint32_t)(h >> 32) | 1);
+    return ((uint64)nHash * nPositions) >> 32;
+}
+
+void CRollingBloomFilter::insert(const uint256& hash)
+{
+    if (nEntriesThisGeneration == nEntriesPerGeneration)
+    {
+        nEntriesThisGeneration = 0;
+        if (++nGeneration == 4)
+            nGeneration = 1;
+        // Wipe the positions last set by the generation being reused
+        uint64 nMask1 = -(uint64)(nGeneration & 1);
+        uint64 nMask2 = -(uint64)(nGeneration >> 1);
+        for (unsigned int p = 0; p < vData.size(); p += 2)
+        {
+            uint64 nKeep = (vData[p] ^ nMask1) | (vData[p + 1] ^ nMask2);
+            vData[p] &= nKeep;
+            vData[p + 1] &= nKeep;
+        }
+    }
+    nEntriesThisGeneration++;
+
+    uint64 h = SipHashUint256(nTweak0, nTweak1, hash);
+    uint64 nBit1 = nGeneration & 1;
+    uint64 nBit2 = nGeneration >> 1;
+    for (unsigned int n = 0; n < nHashFuncs; n++)
+    {
+        unsigned int nPos = RollingBloomPosition(h, n, nPositions);
+        unsigned int nWord = (nPos >> 6) * 2;
+        unsigned int nBit = nPos & 63;
+        vData[nWord] = (vData[nWord] & ~((uint64)1 << nBit)) | (nBit1 << nBit);
+        vData[nWord + 1] = (vData[nWord + 1] & ~((uint64)1 << nBit)) | (nBit2 << nBit);
+    }
+}
+
+bool CRollingBloomFilter::contains(const uint256& hash) const
+{
+    uint64 h = SipHashUint256(nTweak0, nTweak1, hash);
+    for (unsigned int n = 0; n < nHashFuncs; n++)
+    {
+        unsigned int nPos = RollingBloomPosition(h, n, nPositions);
+        unsigned int nWord = (nPos >> 6) * 2;
+        unsigned int nBit = nPos & 63;
+        // a position is empty when both bits of its generation are zero
+        if (!(((vData[nWord] | vData[nWord + 1]) >> nBit) & 1))
+            return false;
+    }
+    return true;
+}
@@ -27,6 +27,38 @@ enum bloomflags
     BLOOM_UPDATE_MASK = 3,
 };
 
+/**
+ * The data elements of a transaction that bloom filters are matched against:
+ * its hash, the data pushed by its scripts and the outpoints it spends.
+ * They are extracted and premixed for MurmurHash3 once, and then shared by
+ * the filters of all peers the transaction is relayed to.
+ */
+class CBloomTxElements
+{
+public:
+    // nLen bytes, premixed into vWords from nWord on. nOut is the output
+    // whose scriptPubKey pushed the data, or -1.
+    struct CElement
+    {
+        unsigned int nWord;
+        unsigned int nLen;
+        int nOut;
+    };
+
+    const CTransaction* ptx;
+    uint256 hash;
+    std::vector<uint32_t> vWords;
+    // The hash, the data of the outputs, then from nInputElements on the
+    // outpoints and data of the inputs
+    std::vector<CElement> vElements;
+    unsigned int nInputElements;
+
+    CBloomTxElements(const CTransaction& tx, const uint256& hashIn);
+
+private:
+    void Add(const unsigned char* pdata, unsigned int nLen, int nOut);
+};
+
 /**
  * BloomFilter is a probabilistic filter which SPV clients provide
  * so that we can filter the transactions we sends them.
@@ -47,8 +79,13 @@ private:
     unsigned int nHashFuncs;
     unsigned int nTweak;
     unsigned char nFlags;
+    // MurmurHash3 seeds of the hash functions, derived from nTweak
+    std::vector<uint32_t> vSeeds;
 
-    unsigned int Hash(unsigned int nHashNum, const std::vector<unsigned char>& vDataToHash) const;
+    void UpdateSeeds();
+    // Element premixed by MurmurHash3Mix
+    void insert(const uint32_t* pnWords, unsigned int nLen);
+    bool contains(const uint32_t* pnWords, unsigned int nLen) const;
 
 public:
     // Creates a new bloom filter which will provide the given fp rate when filled with the given number of elements
@@ -67,6 +104,8 @@ public:
         READWRITE(nHashFuncs);
         READWRITE(nTweak);
         READWRITE(nFlags);
+        if (fRead)
+            const_cast<CBloomFilter*>(this)->UpdateSeeds();
     )
 
     void insert(const std::vector<unsigned char>& vKey);
@@ -83,9 +122,43 @@ public:
 
     // Also adds any outputs which match the filter to the filter (to match their spending txes)
     bool IsRelevantAndUpdate(const CTransaction& tx, const uint256& hash);
+    bool IsRelevantAndUpdate(const CBloomTxElements& elements);
 
     // Checks for empty and full filters to avoid wasting cpu
     void UpdateEmptyFull();
 };
 
+/**
+ * A bloom filter that keeps track of the most recently inserted hashes,
+ * such as the inventory a peer already knows about. At least the last
+ * nElements inserted are remembered, older ones are forgotten over time.
+ *
+ * Entries are inserted in generations of nElements / 2, of which the last
+ * three are kept: each position stores the 2-bit number of the generation
+ * that set it, and starting a generation wipes the positions of the one
+ * three generations back. All positions of an entry are derived from a
+ * single salted hash.
+ */
+class CRollingBloomFilter
+{
+private:
+    unsigned int nEntriesPerGeneration;
+    unsigned int nEntriesThisGeneration;
+    unsigned int nGeneration;
+    unsigned int nHashFuncs;
+    unsigned int nPositions;
+    // two words per 64 positions, with the low and high bits of their generation
+    std::vector<uint64> vData;
+    uint64 nTweak0, nTweak1;
+
+public:
+    CRollingBloomFilter(unsigned int nElements, double nFPRate);
+
+    void insert(const uint256& hash);
+    bool contains(const uint256& hash) const;
+
+    // Forget everything, and pick new hash salts
+    void reset();
+};
+
 #endif /* BITCOIN_BLOOM_H */
@@ -24,6 +24,10 @@
 #include <net/if.h>
 #include <netinet/in.h>
 #include <ifaddrs.h>
+#ifdef __linux__
+#define USE_EPOLL 1
+#include <sys/epoll.h>
+#endif
 #endif
 
 typedef u_int SOCKET;
@@ -11,6 +11,9 @@
 
 #ifndef WIN32
 #include "sys/stat.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #endif
 
 using namespace std;
@@ -486,83 +489,237 @@ void CDBEnv::Flush(bool fShutdown)
 //
 
 
-CAddrDB::CAddrDB()
+/** Read-only view of a whole file, memory-mapped where possible */
+class CMappedFile
 {
-    pathAddr = GetDataDir() / "peers.dat";
-}
+private:
+    const char* pdata;
+    size_t nSize;
+#ifdef WIN32
+    std::vector<char> vchData;
+#endif
+
+public:
+    CMappedFile(const boost::filesystem::path& path) : pdata(NULL), nSize(0)
+    {
+#ifdef WIN32
+        FILE *file = fopen(path.string().c_str(), "rb");
+        if (!file)
+            return;
+        vchData.resize(GetFilesize(file));
+        if (!vchData.empty() && fread(&vchData[0], 1, vchData.size(), file) == vchData.size())
+        {
+            pdata = &vchData[0];
+            nSize = vchData.size();
+        }
+        fclose(file);
+#else
+        int fd = open(path.string().c_str(), O_RDONLY);
+        if (fd == -1)
+            return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0)
+        {
+            void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED)
+            {
+                // we read it front to back once
+                madvise(p, st.st_size, MADV_SEQUENTIAL);
+                pdata = (const char*)p;
+                nSize = st.st_size;
+            }
+        }
+        close(fd);
+#endif
+    }
+
+    ~CMappedFile()
+    {
+#ifndef WIN32
+        if (pdata)
+            munmap((void*)pdata, nSize);
+#endif
+    }
+
+    bool IsOpen() const         { return pdata != NULL; }
+    const char* begin() const   { return pdata; }
+    const char* end() const     { return pdata + nSize; }
+    size_t size() const         { return nSize; }
+};
 
-bool CAddrDB::Write(const CAddrMan& addr)
+// Write data to a random temporary file and rename it over path
+static bool WriteFileAtomic(const boost::filesystem::path& path, CDataStream& ssData)
 {
-    // Generate random temporary filename
     unsigned short randv = 0;
     RAND_bytes((unsigned char *)&randv, sizeof(randv));
-    std::string tmpfn = strprintf("peers.dat.%04x", randv);
-
-    // serialize addresses, checksum data up to that point, then append csum
-    CDataStream ssPeers(SER_DISK, CLIENT_VERSION);
-    ssPeers << FLATDATA(pchMessageStart);
-    ssPeers << addr;
-    uint256 hash = Hash(ssPeers.begin(), ssPeers.end());
-    ssPeers << hash;
+    boost::filesystem::path pathTmp = path.string() + strprintf(".%04x", randv);
 
     // open temp output file, and associate with CAutoFile
-    boost::filesystem::path pathTmp = GetDataDir() / tmpfn;
     FILE *file = fopen(pathTmp.string().c_str(), "wb");
     CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
     if (!fileout)
-        return error("CAddrman::Write() : open failed");
+        return error("WriteFileAtomic() : open failed");
 
     // Write and commit header, data
     try {
-        fileout << ssPeers;
+        fileout << ssData;
     }
     catch (std::exception &e) {
-        return error("CAddrman::Write() : I/O error");
+        return error("WriteFileAtomic() : I/O error");
     }
     FileCommit(fileout);
     fileout.fclose();
 
-    // replace existing peers.dat, if any, with new peers.dat.XXXX
-    if (!RenameOver(pathTmp, pathAddr))
-        return error("CAddrman::Write() : Rename-into-place failed");
+    // replace existing file, if any, with the temporary one
+    if (!RenameOver(pathTmp, path))
+        return error("WriteFileAtomic() : Rename-into-place failed");
 
     return true;
 }
 
-bool CAddrDB::Read(CAddrMan& addr)
+// Read the size of a file and the checksum (or log header hash) at its
+// end (or start)
+static bool ReadFileHash(const boost::filesystem::path& path, bool fAtEnd, uint256& hash, int& nSize)
 {
-    // open input file, and associate with CAutoFile
-    FILE *file = fopen(pathAddr.string().c_str(), "rb");
+    FILE *file = fopen(path.string().c_str(), "rb");
     CAutoFile filein = CAutoFile(file, SER_DISK, CLIENT_VERSION);
     if (!filein)
-        return error("CAddrman::Read() : open failed");
-
-    // use file size to size memory buffer
-    int fileSize = GetFilesize(filein);
-    int dataSize = fileSize - sizeof(uint256);
-    //Don't try to resize to a negative number if file is small
-    if ( dataSize < 0 ) dataSize = 0;
-    vector<unsigned char> vchData;
-    vchData.resize(dataSize);
-    uint256 hashIn;
-
-    // read data and checksum from file
+        return false;
+    nSize = GetFilesize(filein);
+    if (nSize < (int)(sizeof(pchMessageStart) + sizeof(uint256)))
+        return false;
+    if (fseek(filein, fAtEnd ? nSize - sizeof(uint256) : sizeof(pchMessageStart), SEEK_SET))
+        return false;
     try {
-        filein.read((char *)&vchData[0], dataSize);
-        filein >> hashIn;
+        filein >> hash;
     }
     catch (std::exception &e) {
-        return error("CAddrman::Read() 2 : I/O error or stream data corrupted");
+        return false;
+    }
+    return true;
+}
+
+// Set when peers.dat failed to load, so that the log isn't appended to a
+// snapshot that won't load again; cleared by the next Write
+static bool fAddrSnapshotBad = false;
+
+CAddrDB::CAddrDB()
+{
+    pathAddr = GetDataDir() / "peers.dat";
+    pathLog = GetDataDir() / "peers.log";
+}
+
+bool CAddrDB::Write(CAddrMan& addr)
+{
+    // everything changed up to here is in the snapshot
+    std::vector<CAddrLogRecord> vSnapshotted;
+    addr.GetChanges(vSnapshotted);
+
+    // serialize addresses, checksum data up to that point, then append csum
+    CDataStream ssPeers(SER_DISK, CLIENT_VERSION);
+    ssPeers << FLATDATA(pchMessageStart);
+    ssPeers << addr;
+    uint256 hash = Hash(ssPeers.begin(), ssPeers.end());
+    ssPeers << hash;
+
+    // start a new log for this snapshot; if that fails, remove the old one
+    // so the next Append writes a complete snapshot again
+    CDataStream ssLog(SER_DISK, CLIENT_VERSION);
+    ssLog << FLATDATA(pchMessageStart) << hash;
+    if (!WriteFileAtomic(pathAddr, ssPeers) || !WriteFileAtomic(pathLog, ssLog))
+    {
+        boost::system::error_code ec;
+        boost::filesystem::remove(pathLog, ec);
+        return error("CAddrman::Write() : writing peers.dat failed");
+    }
+    fAddrSnapshotBad = false;
+
+    return true;
+}
+
+bool CAddrDB::Append(CAddrMan& addr, bool* pfSnapshot)
+{
+    if (pfSnapshot)
+        *pfSnapshot = false;
+
+    // the log must belong to the current snapshot; once it has grown to half
+    // the snapshot's size, fold it into a new one
+    uint256 hashSnapshot, hashLog;
+    int nSnapshotSize = 0, nLogSize = 0;
+    if (fAddrSnapshotBad)
+    {
+        printf("peers.dat failed to load; writing it anew\n");
+        if (pfSnapshot)
+            *pfSnapshot = true;
+        return Write(addr);
+    }
+    if (!ReadFileHash(pathAddr, true, hashSnapshot, nSnapshotSize) ||
+        !ReadFileHash(pathLog, false, hashLog, nLogSize) ||
+        hashLog != hashSnapshot || nLogSize > nSnapshotSize / 2)
+    {
+        printf("Compacting peers.log into peers.dat\n");
+        if (pfSnapshot)
+            *pfSnapshot = true;
+        return Write(addr);
     }
-    filein.fclose();
 
-    CDataStream ssPeers(vchData, SER_DISK, CLIENT_VERSION);
+    std::vector<CAddrLogRecord> vRecords;
+    addr.GetChanges(vRecords);
+    if (vRecords.empty())
+        return true;
+
+    // each batch is followed by its own checksum, so a torn write at the
+    // end is detected and dropped when reading
+    CDataStream ssBatch(SER_DISK, CLIENT_VERSION);
+    ssBatch << vRecords;
+    uint256 hash = Hash(ssBatch.begin(), ssBatch.end());
+    ssBatch << hash;
+
+    FILE *file = fopen(pathLog.string().c_str(), "ab");
+    CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    bool fOk = !!fileout;
+    if (fOk)
+    {
+        try {
+            fileout << ssBatch;
+            FileCommit(fileout);
+        }
+        catch (std::exception &e) {
+            fOk = false;
+        }
+    }
+    if (!fOk)
+    {
+        // these changes are only in memory now; have the next call write them all
+        fileout.fclose();
+        boost::system::error_code ec;
+        boost::filesystem::remove(pathLog, ec);
+        return error("CAddrman::Append() : writing peers.log failed");
+    }
+
+    return true;
+}
+
+bool CAddrDB::Read(CAddrMan& addr)
+{
+    // until it has loaded in full
+    fAddrSnapshotBad = true;
+
+    // map the file and read it in place
+    CMappedFile filein(pathAddr);
+    if (!filein.IsOpen())
+        return error("CAddrman::Read() : open failed");
+    if (filein.size() < sizeof(uint256))
+        return error("CAddrman::Read() : file too short");
 
     // verify stored checksum matches input data
-    uint256 hashTmp = Hash(ssPeers.begin(), ssPeers.end());
-    if (hashIn != hashTmp)
+    const char* pchDataEnd = filein.end() - sizeof(uint256);
+    uint256 hashIn;
+    memcpy(&hashIn, pchDataEnd, sizeof(hashIn));
+    if (hashIn != Hash(filein.begin(), pchDataEnd))
         return error("CAddrman::Read() : checksum mismatch; data corrupted");
 
+    CBufferReader ssPeers(filein.begin(), pchDataEnd, SER_DISK, CLIENT_VERSION);
     unsigned char pchMsgTmp[4];
     try {
         // de-serialize file header (pchMessageStart magic number) and
@@ -579,6 +736,66 @@ bool CAddrDB::Read(CAddrMan& addr)
         return error("CAddrman::Read() : I/O error or stream data corrupted");
     }
 
+    fAddrSnapshotBad = false;
+    ReadLog(addr, hashIn);
+
     return true;
 }
 
+void CAddrDB::ReadLog(CAddrMan& addr, const uint256& hashSnapshot)
+{
+    size_t nGood = 0, nSize = 0;
+    int nRecords = 0;
+    {
+        CMappedFile filein(pathLog);
+        if (!filein.IsOpen())
+            return;
+        nSize = filein.size();
+
+        CBufferReader ssLog(filein.begin(), filein.end(), SER_DISK, CLIENT_VERSION);
+        unsigned char pchMsgTmp[4];
+        uint256 hashLog;
+        try {
+            ssLog >> FLATDATA(pchMsgTmp) >> hashLog;
+        }
+        catch (std::exception &e) {
+            return;
+        }
+        if (memcmp(pchMsgTmp, pchMessageStart, sizeof(pchMsgTmp)) || hashLog != hashSnapshot)
+        {
+            printf("peers.log was not written for this peers.dat; ignoring it\n");
+            return;
+        }
+        nGood = ssLog.GetPos();
+
+        // replay batches up to the first incomplete one
+        while (!ssLog.empty())
+        {
+            std::vector<CAddrLogRecord> vRecords;
+            uint256 hash;
+            try {
+                ssLog >> vRecords;
+                const char* pchBatchEnd = filein.begin() + ssLog.GetPos();
+                ssLog >> hash;
+                if (hash != Hash(filein.begin() + nGood, pchBatchEnd))
+                    break;
+            }
+            catch (std::exception &e) {
+                break;
+            }
+            addr.Replay(vRecords);
+            nRecords += vRecords.size();
+            nGood = ssLog.GetPos();
+        }
+    }
+
+    printf("Replayed %d changes from peers.log\n", nRecords);
+    if (nGood < nSize)
+    {
+        // cut off the torn batch, so later ones can be appended after it
+        printf("peers.log : dropping %"PRIszu" bytes of an incomplete write\n", nSize - nGood);
+        boost::system::error_code ec;
+        boost::filesystem::resize_file(pathLog, nGood, ec);
+    }
+}
+
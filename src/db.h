@@ -313,14 +313,25 @@ public:
 
 
 
-/** Access to the (IP) address database (peers.dat) */
+/** Access to the (IP) address database: a snapshot of the whole table
+ *  (peers.dat) and a log of the entries changed since it was written
+ *  (peers.log), which is folded into a new snapshot when it grows large.
+ */
 class CAddrDB
 {
 private:
     boost::filesystem::path pathAddr;
+    boost::filesystem::path pathLog;
+
+    void ReadLog(CAddrMan& addr, const uint256& hashSnapshot);
 public:
     CAddrDB();
-    bool Write(const CAddrMan& addr);
+    // Write a new snapshot and start an empty log
+    bool Write(CAddrMan& addr);
+    // Append the changes since the last Write or Append to the log, or write
+    // a new snapshot when the log is due to be folded in or peers.dat failed
+    // to load (*pfSnapshot tells which)
+    bool Append(CAddrMan& addr, bool* pfSnapshot = NULL);
     bool Read(CAddrMan& addr);
 };
 
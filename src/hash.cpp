@@ -1,5 +1,11 @@
 #include "hash.h"
 
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 inline uint32_t ROTL32 ( uint32_t x, int8_t r )
 {
     return (x << r) | (x >> (32 - r));
@@ -56,3 +62,139 @@ unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char
 
     return h1;
 }
+
+void MurmurHash3Mix(const unsigned char* pdata, size_t nLen, uint32_t* pnWords)
+{
+    const uint32_t c1 = 0xcc9e2d51;
+    const uint32_t c2 = 0x1b873593;
+
+    // Full blocks, then the tail bytes padded with zeros
+    size_t nBlocks = nLen / 4;
+    for (size_t i = 0; i < nBlocks; i++)
+    {
+        uint32_t k1;
+        memcpy(&k1, pdata + i * 4, 4);
+        k1 *= c1; k1 = ROTL32(k1,15); k1 *= c2;
+        pnWords[i] = k1;
+    }
+    if (nLen & 3)
+    {
+        const uint8_t * tail = pdata + nBlocks * 4;
+        uint32_t k1 = 0;
+        switch (nLen & 3)
+        {
+        case 3: k1 ^= tail[2] << 16;
+        case 2: k1 ^= tail[1] << 8;
+        case 1: k1 ^= tail[0];
+        };
+        k1 *= c1; k1 = ROTL32(k1,15); k1 *= c2;
+        pnWords[nBlocks] = k1;
+    }
+}
+
+static inline uint32_t MurmurHash3Finish(uint32_t h1, const uint32_t* pnWords, size_t nLen)
+{
+    size_t nBlocks = nLen / 4;
+    for (size_t i = 0; i < nBlocks; i++)
+    {
+        h1 ^= pnWords[i];
+        h1 = ROTL32(h1,13);
+        h1 = h1*5+0xe6546b64;
+    }
+    if (nLen & 3)
+        h1 ^= pnWords[nBlocks];
+
+    h1 ^= nLen;
+    h1 ^= h1 >> 16;
+    h1 *= 0x85ebca6b;
+    h1 ^= h1 >> 13;
+    h1 *= 0xc2b2ae35;
+    h1 ^= h1 >> 16;
+    return h1;
+}
+
+#if defined(__SSE2__)
+// Lane-wise 32-bit multiply; SSE2 only multiplies the even lanes into 64 bits
+static inline __m128i Mul32(__m128i a, __m128i b)
+{
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                              _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+static inline void MurmurHash3Finish_4way(const uint32_t* pnSeeds, const uint32_t* pnWords, size_t nLen, uint32_t* pnHashes)
+{
+    __m128i h1 = _mm_loadu_si128((const __m128i*)pnSeeds);
+    const __m128i n = _mm_set1_epi32(0xe6546b64);
+    size_t nBlocks = nLen / 4;
+    for (size_t i = 0; i < nBlocks; i++)
+    {
+        h1 = _mm_xor_si128(h1, _mm_set1_epi32(pnWords[i]));
+        h1 = _mm_or_si128(_mm_slli_epi32(h1, 13), _mm_srli_epi32(h1, 19));
+        h1 = _mm_add_epi32(_mm_add_epi32(_mm_slli_epi32(h1, 2), h1), n);
+    }
+    if (nLen & 3)
+        h1 = _mm_xor_si128(h1, _mm_set1_epi32(pnWords[nBlocks]));
+
+    h1 = _mm_xor_si128(h1, _mm_set1_epi32((uint32_t)nLen));
+    h1 = _mm_xor_si128(h1, _mm_srli_epi32(h1, 16));
+    h1 = Mul32(h1, _mm_set1_epi32(0x85ebca6b));
+    h1 = _mm_xor_si128(h1, _mm_srli_epi32(h1, 13));
+    h1 = Mul32(h1, _mm_set1_epi32(0xc2b2ae35));
+    h1 = _mm_xor_si128(h1, _mm_srli_epi32(h1, 16));
+    _mm_storeu_si128((__m128i*)pnHashes, h1);
+}
+#endif
+
+void MurmurHash3Seeds(const uint32_t* pnWords, size_t nLen, const uint32_t* pnSeeds, unsigned int nSeeds, uint32_t* pnHashes)
+{
+    unsigned int i = 0;
+#if defined(__SSE2__)
+    for (; i + 4 <= nSeeds; i += 4)
+        MurmurHash3Finish_4way(pnSeeds + i, pnWords, nLen, pnHashes + i);
+#endif
+    for (; i < nSeeds; i++)
+        pnHashes[i] = MurmurHash3Finish(pnSeeds[i], pnWords, nLen);
+}
+
+#define ROTL64(x, b) (uint64)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND do { \
+    v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0; v0 = ROTL64(v0, 32); \
+    v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2; \
+    v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0; \
+    v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2; v2 = ROTL64(v2, 32); \
+} while (0)
+
+uint64 SipHashUint256(uint64 k0, uint64 k1, const uint256& val)
+{
+    // SipHash-2-4 of the 32 bytes of val, see https://131002.net/siphash/
+    uint64 v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64 v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64 v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64 v3 = 0x7465646279746573ULL ^ k1;
+
+    for (int i = 0; i < 4; i++)
+    {
+        uint64 m = val.Get64(i);
+        v3 ^= m;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m;
+    }
+
+    // Final block: only the length, 32 bytes
+    uint64 m = ((uint64)32) << 56;
+    v3 ^= m;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= m;
+
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
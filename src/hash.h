@@ -7,8 +7,8 @@
 
 #include "uint256.h"
 #include "serialize.h"
+#include "sha256.h"
 
-#include <openssl/sha.h>
 #include <openssl/ripemd.h>
 #include <vector>
 
@@ -17,23 +17,23 @@ inline uint256 Hash(const T1 pbegin, const T1 pend)
 {
     static unsigned char pblank[1];
     uint256 hash1;
-    SHA256((pbegin == pend ? pblank : (unsigned char*)&pbegin[0]), (pend - pbegin) * sizeof(pbegin[0]), (unsigned char*)&hash1);
+    CSHA256().Write((pbegin == pend ? pblank : (unsigned char*)&pbegin[0]), (pend - pbegin) * sizeof(pbegin[0])).Finalize((unsigned char*)&hash1);
     uint256 hash2;
-    SHA256((unsigned char*)&hash1, sizeof(hash1), (unsigned char*)&hash2);
+    CSHA256().Write((unsigned char*)&hash1, sizeof(hash1)).Finalize((unsigned char*)&hash2);
     return hash2;
 }
 
 class CHashWriter
 {
 private:
-    SHA256_CTX ctx;
+    CSHA256 ctx;
 
 public:
     int nType;
     int nVersion;
 
     void Init() {
-        SHA256_Init(&ctx);
+        ctx.Reset();
     }
 
     CHashWriter(int nTypeIn, int nVersionIn) : nType(nTypeIn), nVersion(nVersionIn) {
@@ -41,16 +41,16 @@ public:
     }
 
     CHashWriter& write(const char *pch, size_t size) {
-        SHA256_Update(&ctx, pch, size);
+        ctx.Write((const unsigned char*)pch, size);
         return (*this);
     }
 
     // invalidates the object
     uint256 GetHash() {
         uint256 hash1;
-        SHA256_Final((unsigned char*)&hash1, &ctx);
+        ctx.Finalize((unsigned char*)&hash1);
         uint256 hash2;
-        SHA256((unsigned char*)&hash1, sizeof(hash1), (unsigned char*)&hash2);
+        CSHA256().Write((unsigned char*)&hash1, sizeof(hash1)).Finalize((unsigned char*)&hash2);
         return hash2;
     }
 
@@ -69,13 +69,12 @@ inline uint256 Hash(const T1 p1begin, const T1 p1end,
 {
     static unsigned char pblank[1];
     uint256 hash1;
-    SHA256_CTX ctx;
-    SHA256_Init(&ctx);
-    SHA256_Update(&ctx, (p1begin == p1end ? pblank : (unsigned char*)&p1begin[0]), (p1end - p1begin) * sizeof(p1begin[0]));
-    SHA256_Update(&ctx, (p2begin == p2end ? pblank : (unsigned char*)&p2begin[0]), (p2end - p2begin) * sizeof(p2begin[0]));
-    SHA256_Final((unsigned char*)&hash1, &ctx);
+    CSHA256 ctx;
+    ctx.Write((p1begin == p1end ? pblank : (unsigned char*)&p1begin[0]), (p1end - p1begin) * sizeof(p1begin[0]));
+    ctx.Write((p2begin == p2end ? pblank : (unsigned char*)&p2begin[0]), (p2end - p2begin) * sizeof(p2begin[0]));
+    ctx.Finalize((unsigned char*)&hash1);
     uint256 hash2;
-    SHA256((unsigned char*)&hash1, sizeof(hash1), (unsigned char*)&hash2);
+    CSHA256().Write((unsigned char*)&hash1, sizeof(hash1)).Finalize((unsigned char*)&hash2);
     return hash2;
 }
 
@@ -86,14 +85,13 @@ inline uint256 Hash(const T1 p1begin, const T1 p1end,
 {
     static unsigned char pblank[1];
     uint256 hash1;
-    SHA256_CTX ctx;
-    SHA256_Init(&ctx);
-    SHA256_Update(&ctx, (p1begin == p1end ? pblank : (unsigned char*)&p1begin[0]), (p1end - p1begin) * sizeof(p1begin[0]));
-    SHA256_Update(&ctx, (p2begin == p2end ? pblank : (unsigned char*)&p2begin[0]), (p2end - p2begin) * sizeof(p2begin[0]));
-    SHA256_Update(&ctx, (p3begin == p3end ? pblank : (unsigned char*)&p3begin[0]), (p3end - p3begin) * sizeof(p3begin[0]));
-    SHA256_Final((unsigned char*)&hash1, &ctx);
+    CSHA256 ctx;
+    ctx.Write((p1begin == p1end ? pblank : (unsigned char*)&p1begin[0]), (p1end - p1begin) * sizeof(p1begin[0]));
+    ctx.Write((p2begin == p2end ? pblank : (unsigned char*)&p2begin[0]), (p2end - p2begin) * sizeof(p2begin[0]));
+    ctx.Write((p3begin == p3end ? pblank : (unsigned char*)&p3begin[0]), (p3end - p3begin) * sizeof(p3begin[0]));
+    ctx.Finalize((unsigned char*)&hash1);
     uint256 hash2;
-    SHA256((unsigned char*)&hash1, sizeof(hash1), (unsigned char*)&hash2);
+    CSHA256().Write((unsigned char*)&hash1, sizeof(hash1)).Finalize((unsigned char*)&hash2);
     return hash2;
 }
 
@@ -107,8 +105,9 @@ uint256 SerializeHash(const T& obj, int nType=SER_GETHASH, int nVersion=PROTOCOL
 
 inline uint160 Hash160(const std::vector<unsigned char>& vch)
 {
+    static unsigned char pblank[1];
     uint256 hash1;
-    SHA256(&vch[0], vch.size(), (unsigned char*)&hash1);
+    CSHA256().Write((vch.empty() ? pblank : &vch[0]), vch.size()).Finalize((unsigned char*)&hash1);
     uint160 hash2;
     RIPEMD160((unsigned char*)&hash1, sizeof(hash1), (unsigned char*)&hash2);
     return hash2;
@@ -116,4 +115,18 @@ inline uint160 Hash160(const std::vector<unsigned char>& vch)
 
 unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char>& vDataToHash);
 
+/** The seed independent part of MurmurHash3: mix the nLen bytes of pdata
+ *  into (nLen + 3) / 4 words at pnWords, for MurmurHash3Seeds.
+ */
+void MurmurHash3Mix(const unsigned char* pdata, size_t nLen, uint32_t* pnWords);
+
+/** Finish MurmurHash3 of nLen bytes premixed by MurmurHash3Mix for nSeeds
+ *  seeds, writing the hashes to pnHashes. Four seeds are done side by side
+ *  where SSE2 is available.
+ */
+void MurmurHash3Seeds(const uint32_t* pnWords, size_t nLen, const uint32_t* pnSeeds, unsigned int nSeeds, uint32_t* pnHashes);
+
+/** SipHash-2-4 of a 256-bit value with the 128-bit key (k0, k1) */
+uint64 SipHashUint256(uint64 k0, uint64 k1, const uint256& val);
+
 #endif
@@ -6,6 +6,7 @@
 #include "txdb.h"
 #include "walletdb.h"
 #include "bitcoinrpc.h"
+#include "stratum.h"
 #include "net.h"
 #include "init.h"
 #include "util.h"
@@ -87,6 +88,10 @@ bool ShutdownRequested()
 
 static CCoinsViewDB *pcoinsdbview;
 
+// Set once fee_estimates.dat was read, or found missing, so that a shutdown
+// during startup doesn't overwrite it with empty statistics
+static bool fFeeEstimatesInitialized = false;
+
 void Shutdown()
 {
     printf("Shutdown : In progress...\n");
@@ -99,6 +104,18 @@ void Shutdown()
     StopRPCThreads();
     bitdb.Flush(false);
     StopNode();
+    StopStratumServer();
+    if (GetBoolArg("-persistmempool", true))
+        DumpMempool();
+    if (fFeeEstimatesInitialized)
+    {
+        boost::filesystem::path pathFeeEstimates = GetDataDir() / "fee_estimates.dat";
+        CAutoFile fileFeeEstimates(fopen(pathFeeEstimates.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        if (fileFeeEstimates)
+            mempool.WriteFeeEstimates(fileFeeEstimates);
+        else
+            printf("Shutdown : failed to write fee estimates to %s\n", pathFeeEstimates.string().c_str());
+    }
     {
         LOCK(cs_main);
         if (pwalletMain)
@@ -317,7 +334,14 @@ std::string HelpMessage()
         "  -banscore=<n>          " + _("Threshold for disconnecting misbehaving peers (default: 100)") + "\n" +
         "  -bantime=<n>           " + _("Number of seconds to keep misbehaving peers from reconnecting (default: 86400)") + "\n" +
         "  -maxreceivebuffer=<n>  " + _("Maximum per-connection receive buffer, <n>*1000 bytes (default: 5000)") + "\n" +
-        "  -maxsendbuffer=<n>     " + _("Maximum per-connection send buffer, <n>*1000 bytes (default: 1000)") + "\n" +
+        "  -maxsendbuffer=<n>     " + _("Per-connection send buffer, <n>*1000 bytes (default: 1000)") + "\n" +
+        "  -maxreceivebuffertotal=<n> " + _("Maximum receive buffer over all connections, <n>*1000 bytes (default: 100000)") + "\n" +
+        "  -maxsendbuffertotal=<n> " + _("Send buffer shared by connections beyond their own, <n>*1000 bytes (default: 100000)") + "\n" +
+        "  -msghandthreads=<n>    " + _("Number of extra threads handling peer messages, each peer's in order (default: 0)") + "\n" +
+        "  -compactblocks         " + _("Exchange new blocks with supporting peers as header and short transaction ids (default: 1)") + "\n" +
+#ifdef USE_EPOLL
+        "  -epoll                 " + _("Wait for socket activity with epoll instead of select, allowing more than 1024 connections (default: 1)") + "\n" +
+#endif
 #ifdef USE_UPNP
 #if USE_UPNP
         "  -upnp                  " + _("Use UPnP to map the listening port (default: 1 when listening)") + "\n" +
@@ -326,6 +350,7 @@ std::string HelpMessage()
 #endif
 #endif
         "  -paytxfee=<amt>        " + _("Fee per KB to add to transactions you send") + "\n" +
+        "  -txconfirmtarget=<n>   " + _("Without -paytxfee, pay the fee estimated to begin confirmation within n blocks (default: 0, off)") + "\n" +
 #ifdef QT_GUI
         "  -server                " + _("Accept command line and JSON-RPC commands") + "\n" +
 #endif
@@ -349,6 +374,13 @@ std::string HelpMessage()
         "  -rpcconnect=<ip>       " + _("Send commands to node running on <ip> (default: 127.0.0.1)") + "\n" +
 #endif
         "  -rpcthreads=<n>        " + _("Set the number of threads to service RPC calls (default: 4)") + "\n" +
+        "  -stratum               " + _("Accept stratum mining connections") + "\n" +
+        "  -stratumbind=<addr>    " + _("Listen for stratum connections on <addr> (default: 127.0.0.1)") + "\n" +
+        "  -stratumport=<port>    " + _("Listen for stratum connections on <port> (default: 3333)") + "\n" +
+        "  -stratumaddress=<addr> " + _("Pay blocks found by stratum miners to <addr> (default: a new wallet key)") + "\n" +
+        "  -stratumpassword=<pw>  " + _("Password stratum miners authorize with (default: any)") + "\n" +
+        "  -stratumdifficulty=<n> " + _("Share difficulty for stratum miners (default: 1)") + "\n" +
+        "  -stratumjobinterval=<n> " + _("Seconds between stratum jobs for new transactions (default: 10)") + "\n" +
         "  -blocknotify=<cmd>     " + _("Execute command when the best block changes (%s in cmd is replaced by block hash)") + "\n" +
         "  -walletnotify=<cmd>    " + _("Execute command when a wallet transaction changes (%s in cmd is replaced by TxID)") + "\n" +
         "  -alertnotify=<cmd>     " + _("Execute command when a relevant alert is received (%s in cmd is replaced by message)") + "\n" +
@@ -362,6 +394,9 @@ std::string HelpMessage()
         "  -loadblock=<file>      " + _("Imports blocks from external blk000??.dat file") + "\n" +
         "  -reindex               " + _("Rebuild block chain index from current blk000??.dat files") + "\n" +
         "  -par=<n>               " + _("Set the number of script verification threads (up to 16, 0 = auto, <0 = leave that many cores free, default: 0)") + "\n" +
+        "  -maxpubkeycachesize=<n> " + _("Keep at most <n> parsed public keys in memory for signature checks (default: 5000)") + "\n" +
+        "  -maxmempool=<n>        " + _("Keep the transaction memory pool below <n> megabytes (default: 300)") + "\n" +
+        "  -persistmempool        " + _("Save the transaction memory pool on shutdown and load it on startup (default: 1)") + "\n" +
 
         "\n" + _("Block creation options:") + "\n" +
         "  -blockminsize=<n>      "   + _("Set minimum block size in bytes (default: 0)") + "\n" +
@@ -436,6 +471,10 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
             LoadExternalBlockFile(file);
         }
     }
+
+    // $DATADIR/mempool.dat, as written on the last shutdown
+    if (GetBoolArg("-persistmempool", true))
+        LoadMempool();
 }
 
 /** Initialize bitcoin.
@@ -533,6 +572,12 @@ bool AppInit2(boost::thread_group& threadGroup)
     // Make sure enough file descriptors are available
     int nBind = std::max((int)mapArgs.count("-bind"), 1);
     nMaxConnections = GetArg("-maxconnections", 125);
+#ifdef USE_EPOLL
+    // epoll has no limit on descriptor numbers, only the process limit below applies
+    if (GetBoolArg("-epoll", true))
+        nMaxConnections = std::max(nMaxConnections, 0);
+    else
+#endif
     nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS)), 0);
     int nFD = RaiseFileDescriptorLimit(nMaxConnections + MIN_CORE_FILEDESCRIPTORS);
     if (nFD < MIN_CORE_FILEDESCRIPTORS)
@@ -616,6 +661,7 @@ bool AppInit2(boost::thread_group& threadGroup)
         if (nTransactionFee > 0.25 * COIN)
             InitWarning(_("Warning: -paytxfee is set very high! This is the transaction fee you will pay if you send a transaction."));
     }
+    nTxConfirmTarget = GetArg("-txconfirmtarget", 0);
 
     // ********************************************************* Step 4: application initialization: dir lock, daemonize, pidfile, debug log
 
@@ -634,6 +680,7 @@ bool AppInit2(boost::thread_group& threadGroup)
     printf("\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n");
     printf("Bitcoin version %s (%s)\n", FormatFullVersion().c_str(), CLIENT_DATE.c_str());
     printf("Using OpenSSL version %s\n", SSLeay_version(SSLEAY_VERSION));
+    printf("Using SHA256 implementation %s\n", SHA256AutoDetect().c_str());
     if (!fLogTimestamps)
         printf("Startup time: %s\n", DateTimeStrFormat("%Y-%m-%d %H:%M:%S", GetTime()).c_str());
     printf("Default data directory %s\n", GetDefaultDataDir().string().c_str());
@@ -647,7 +694,10 @@ bool AppInit2(boost::thread_group& threadGroup)
     if (nScriptCheckThreads) {
         printf("Using %u threads for script verification\n", nScriptCheckThreads);
         for (int i=0; i<nScriptCheckThreads-1; i++)
+        {
             threadGroup.create_thread(&ThreadScriptCheck);
+            threadGroup.create_thread(&ThreadMempoolScriptCheck);
+        }
     }
 
     int64 nStart;
@@ -916,6 +966,13 @@ bool AppInit2(boost::thread_group& threadGroup)
     }
     printf(" block index %15"PRI64d"ms\n", GetTimeMillis() - nStart);
 
+    // Missing on first startup, or after a crash
+    boost::filesystem::path pathFeeEstimates = GetDataDir() / "fee_estimates.dat";
+    CAutoFile fileFeeEstimates(fopen(pathFeeEstimates.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    if (fileFeeEstimates)
+        mempool.ReadFeeEstimates(fileFeeEstimates);
+    fFeeEstimatesInitialized = true;
+
     if (GetBoolArg("-printblockindex") || GetBoolArg("-printblocktree"))
     {
         PrintBlockTree();
@@ -1086,6 +1143,13 @@ bool AppInit2(boost::thread_group& threadGroup)
     if (fServer)
         StartRPCThreads();
 
+    if (GetBoolArg("-stratum"))
+    {
+        std::string strError;
+        if (!StartStratumServer(threadGroup, strError))
+            return InitError(strError);
+    }
+
     // Generate coins in the background
     GenerateBitcoins(GetBoolArg("-gen", false), pwalletMain);
 
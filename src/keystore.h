@@ -121,6 +121,9 @@ protected:
 
     bool Unlock(const CKeyingMaterial& vMasterKeyIn);
 
+    // Forget a key whose database record was never committed
+    void RemoveKey(const CKeyID &address);
+
 public:
     CCryptoKeyStore() : fUseCrypto(false)
     {
@@ -11,6 +11,9 @@
 #include "init.h"
 #include "ui_interface.h"
 #include "checkqueue.h"
+#include "memusage.h"
+#include <openssl/sha.h>
+#include <boost/shared_ptr.hpp>
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
@@ -28,6 +31,7 @@ set<CWallet*> setpwalletRegistered;
 CCriticalSection cs_main;
 
 CTxMemPool mempool;
+CBlockAssembler blockassembler(mempool);
 unsigned int nTransactionsUpdated = 0;
 
 map<uint256, CBlockIndex*> mapBlockIndex;
@@ -39,6 +43,9 @@ uint256 nBestChainWork = 0;
 uint256 nBestInvalidWork = 0;
 uint256 hashBestChain = 0;
 CBlockIndex* pindexBest = NULL;
+// Held while changing hashBestChain, and notified after, for WaitForBlockChange
+static boost::mutex mutexBlockChange;
+static boost::condition_variable condBlockChange;
 set<CBlockIndex*, CBlockIndexWorkComparator> setBlockIndexValid; // may contain all CBlockIndex*'s that have validness >=BLOCK_VALID_TRANSACTIONS, and must contain those who aren't failed
 int64 nTimeBestReceived = 0;
 int nScriptCheckThreads = 0;
@@ -58,8 +65,21 @@ CMedianFilter<int> cPeerBlockCounts(8, 0); // Amount of blocks that other nodes
 map<uint256, CBlock*> mapOrphanBlocks;
 multimap<uint256, CBlock*> mapOrphanBlocksByPrev;
 
-map<uint256, CTransaction> mapOrphanTransactions;
+CCriticalSection cs_orphans;
+map<uint256, COrphanTx> mapOrphanTransactions;
 map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
+// Every orphan once, to pick one at random
+vector<map<uint256, COrphanTx>::iterator> vOrphanList;
+map<NodeId, uint64> mapOrphanBytesByPeer;
+uint64 nOrphanBytes = 0;
+
+// Compact blocks waiting for their missing transactions (protected by cs_main)
+static map<uint256, CPartialBlock> mapPartialBlocks;
+static const unsigned int MAX_PARTIAL_BLOCKS = 16;
+// Seconds for a peer to send the missing transactions before the block is
+// asked of it in full, and for a gone peer's entry to be forgotten
+static const int64 PARTIAL_BLOCK_TIMEOUT = 10;
+static const int64 PARTIAL_BLOCK_EXPIRY = 60;
 
 // Constant stuff for coinbase transactions we create:
 CScript COINBASE_FLAGS;
@@ -71,6 +91,7 @@ int64 nHPSTimerStart = 0;
 
 // Settings
 int64 nTransactionFee = 0;
+unsigned int nTxConfirmTarget = 0;
 
 
 
@@ -283,9 +304,10 @@ CBlockTreeDB *pblocktree = NULL;
 // mapOrphanTransactions
 //
 
-bool AddOrphanTx(const CTransaction& tx)
+bool AddOrphanTx(const boost::shared_ptr<CTransaction>& ptx, NodeId peer)
 {
-    uint256 hash = tx.GetHash();
+    LOCK(cs_orphans);
+    uint256 hash = ptx->GetHash();
     if (mapOrphanTransactions.count(hash))
         return false;
 
@@ -294,49 +316,155 @@ bool AddOrphanTx(const CTransaction& tx)
     // large transaction with a missing parent then we assume
     // it will rebroadcast it later, after the parent transaction(s)
     // have been mined or received.
-    // 10,000 orphans, each of which is at most 5,000 bytes big is
-    // at most 500 megabytes of orphans:
-    unsigned int sz = tx.GetSerializeSize(SER_NETWORK, CTransaction::CURRENT_VERSION);
+    unsigned int sz = ptx->GetSerializeSize(SER_NETWORK, CTransaction::CURRENT_VERSION);
     if (sz > 5000)
     {
         printf("ignoring large orphan tx (size: %u, hash: %s)\n", sz, hash.ToString().c_str());
         return false;
     }
+    // Likewise once the peer's orphans take their share
+    uint64& nPeerBytes = mapOrphanBytesByPeer[peer];
+    if (nPeerBytes + sz > MAX_ORPHAN_BYTES_PER_PEER)
+    {
+        if (nPeerBytes == 0)
+            mapOrphanBytesByPeer.erase(peer);
+        printf("ignoring orphan tx %s, peer=%d has too many\n", hash.ToString().c_str(), peer);
+        return false;
+    }
 
-    mapOrphanTransactions[hash] = tx;
-    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    COrphanTx& orphan = mapOrphanTransactions[hash];
+    orphan.ptx = ptx;
+    orphan.fromPeer = peer;
+    orphan.nTxSize = sz;
+    orphan.nListPos = vOrphanList.size();
+    vOrphanList.push_back(mapOrphanTransactions.find(hash));
+    BOOST_FOREACH(const CTxIn& txin, ptx->vin)
         mapOrphanTransactionsByPrev[txin.prevout.hash].insert(hash);
+    nPeerBytes += sz;
+    nOrphanBytes += sz;
 
-    printf("stored orphan tx %s (mapsz %"PRIszu")\n", hash.ToString().c_str(),
-        mapOrphanTransactions.size());
+    printf("stored orphan tx %s (mapsz %"PRIszu", %"PRI64u" bytes)\n", hash.ToString().c_str(),
+        mapOrphanTransactions.size(), nOrphanBytes);
     return true;
 }
 
 void static EraseOrphanTx(uint256 hash)
 {
-    if (!mapOrphanTransactions.count(hash))
+    map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.find(hash);
+    if (it == mapOrphanTransactions.end())
         return;
-    const CTransaction& tx = mapOrphanTransactions[hash];
-    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    const COrphanTx& orphan = it->second;
+    BOOST_FOREACH(const CTxIn& txin, orphan.ptx->vin)
+    {
+        map<uint256, set<uint256> >::iterator mi = mapOrphanTransactionsByPrev.find(txin.prevout.hash);
+        if (mi == mapOrphanTransactionsByPrev.end())
+            continue;
+        mi->second.erase(hash);
+        if (mi->second.empty())
+            mapOrphanTransactionsByPrev.erase(mi);
+    }
+
+    map<NodeId, uint64>::iterator mi = mapOrphanBytesByPeer.find(orphan.fromPeer);
+    mi->second -= orphan.nTxSize;
+    if (mi->second == 0)
+        mapOrphanBytesByPeer.erase(mi);
+    nOrphanBytes -= orphan.nTxSize;
+
+    // Move the last one of the list into its place
+    vOrphanList[orphan.nListPos] = vOrphanList.back();
+    vOrphanList[orphan.nListPos]->second.nListPos = orphan.nListPos;
+    vOrphanList.pop_back();
+    mapOrphanTransactions.erase(it);
+}
+
+void EraseOrphansFor(NodeId peer)
+{
+    LOCK(cs_orphans);
+    if (!mapOrphanBytesByPeer.count(peer))
+        return;
+    int nErased = 0;
+    map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.begin();
+    while (it != mapOrphanTransactions.end())
     {
-        mapOrphanTransactionsByPrev[txin.prevout.hash].erase(hash);
-        if (mapOrphanTransactionsByPrev[txin.prevout.hash].empty())
-            mapOrphanTransactionsByPrev.erase(txin.prevout.hash);
+        map<uint256, COrphanTx>::iterator itErase = it++;
+        if (itErase->second.fromPeer == peer)
+        {
+            EraseOrphanTx(itErase->first);
+            nErased++;
+        }
     }
-    mapOrphanTransactions.erase(hash);
+    printf("Erased %d orphan tx from peer=%d\n", nErased, peer);
 }
 
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
+// Try the orphans spending a transaction that was just accepted, then those
+// spending the ones accepted from them, a generation at a time. The orphans
+// are only looked up under cs_orphans, not accepted or relayed under it.
+void static ProcessOrphansOf(const uint256& hashAccepted)
 {
+    vector<uint256> vParents(1, hashAccepted);
+    set<uint256> setErase;
+    setErase.insert(hashAccepted);
+    while (!vParents.empty())
+    {
+        // Each orphan once, however many of the parents it spends
+        map<uint256, boost::shared_ptr<CTransaction> > mapGeneration;
+        {
+            LOCK(cs_orphans);
+            BOOST_FOREACH(const uint256& hashParent, vParents)
+            {
+                map<uint256, set<uint256> >::iterator mi = mapOrphanTransactionsByPrev.find(hashParent);
+                if (mi == mapOrphanTransactionsByPrev.end())
+                    continue;
+                BOOST_FOREACH(const uint256& hashOrphan, mi->second)
+                    if (!setErase.count(hashOrphan))
+                        mapGeneration[hashOrphan] = mapOrphanTransactions[hashOrphan].ptx;
+            }
+        }
+        vParents.clear();
+
+        for (map<uint256, boost::shared_ptr<CTransaction> >::iterator mi = mapGeneration.begin(); mi != mapGeneration.end(); ++mi)
+        {
+            const uint256& orphanHash = mi->first;
+            CTransaction& orphanTx = *mi->second;
+            bool fMissingInputs = false;
+            // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
+            // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
+            // anyone relaying LegitTxX banned)
+            CValidationState stateDummy;
+
+            if (orphanTx.AcceptToMemoryPool(stateDummy, true, true, &fMissingInputs))
+            {
+                printf("   accepted orphan tx %s\n", orphanHash.ToString().c_str());
+                RelayTransaction(orphanTx, orphanHash);
+                {
+                    LOCK(cs_main);
+                    mapAlreadyAskedFor.erase(CInv(MSG_TX, orphanHash));
+                }
+                vParents.push_back(orphanHash);
+                setErase.insert(orphanHash);
+            }
+            else if (!fMissingInputs)
+            {
+                // invalid or too-little-fee orphan
+                setErase.insert(orphanHash);
+                printf("   removed orphan tx %s\n", orphanHash.ToString().c_str());
+            }
+        }
+    }
+
+    LOCK(cs_orphans);
+    BOOST_FOREACH(const uint256& hash, setErase)
+        EraseOrphanTx(hash);
+}
+
+unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, uint64 nMaxBytes)
+{
+    LOCK(cs_orphans);
     unsigned int nEvicted = 0;
-    while (mapOrphanTransactions.size() > nMaxOrphans)
+    while (mapOrphanTransactions.size() > nMaxOrphans || nOrphanBytes > nMaxBytes)
     {
         // Evict a random orphan:
-        uint256 randomhash = GetRandHash();
-        map<uint256, CTransaction>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
-        if (it == mapOrphanTransactions.end())
-            it = mapOrphanTransactions.begin();
-        EraseOrphanTx(it->first);
+        EraseOrphanTx(vOrphanList[GetRand(vOrphanList.size())]->first);
         ++nEvicted;
     }
     return nEvicted;
@@ -654,9 +782,43 @@ void CTxMemPool::pruneSpent(const uint256 &hashTx, CCoins &coins)
     }
 }
 
+// The script checks of transactions offered to the memory pool run on their
+// own queue, so they don't wait for (or hold up) the block being connected
+static CCheckQueue<CScriptCheck> mempoolcheckqueue(128);
+// Taken by the one transaction at a time that uses the queue
+static CCriticalSection cs_mempoolcheckqueue;
+
+void ThreadMempoolScriptCheck() {
+    RenameThread("bitcoin-txscrch");
+    mempoolcheckqueue.Thread();
+}
+
+// Run script checks on the memory pool's queue, or on this thread when
+// another transaction has the queue or there is just one check
+static bool RunMempoolScriptChecks(vector<CScriptCheck>& vChecks)
+{
+    if (nScriptCheckThreads && vChecks.size() > 1)
+    {
+        TRY_LOCK(cs_mempoolcheckqueue, lockQueue);
+        if (lockQueue)
+        {
+            CCheckQueueControl<CScriptCheck> control(&mempoolcheckqueue);
+            control.Add(vChecks);
+            return control.Wait();
+        }
+    }
+    BOOST_FOREACH(CScriptCheck& check, vChecks)
+        if (!check())
+            return false;
+    return true;
+}
+
 bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckInputs, bool fLimitFree,
-                        bool* pfMissingInputs)
+                        bool* pfMissingInputs, int64 nAcceptTime)
 {
+    // Cheapest first: the transaction alone, then its inputs under a short
+    // hold of cs_main and the pool's lock, then its scripts without either,
+    // and last the commit, under both again.
     if (pfMissingInputs)
         *pfMissingInputs = false;
 
@@ -677,77 +839,105 @@ bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckIn
         return error("CTxMemPool::accept() : nonstandard transaction (%s)",
                      strNonStd.c_str());
 
-    // is it already in the memory pool?
     uint256 hash = tx.GetHash();
+    unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    const unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC | SCRIPT_VERIFY_DERSIG;
+
+    // What the entry remembers of the inputs, known when they are checked
+    int64 nFees = 0;
+    double dPriority = 0;
+    unsigned int nHeight = 0;
+    int64 nValueInChain = 0;
+    unsigned int nSigOps = tx.GetLegacySigOpCount();
+
+    // The chain tip and the pool transactions the inputs were found at
+    uint256 hashTip;
+    vector<uint256> vPoolParents;
+
+    CCoinsView dummy;
+    CCoinsViewCache view(dummy);
+    const CTransaction* ptxOld = NULL;
     {
-        LOCK(cs);
+        LOCK2(cs_main, cs);
+
+        // is it already in the memory pool?
         if (mapTx.count(hash))
             return false;
-    }
 
-    // Check for conflicts with in-memory transactions
-    CTransaction* ptxOld = NULL;
-    for (unsigned int i = 0; i < tx.vin.size(); i++)
-    {
-        COutPoint outpoint = tx.vin[i].prevout;
-        if (mapNextTx.count(outpoint))
+        // Check for conflicts with in-memory transactions
+        for (unsigned int i = 0; i < tx.vin.size(); i++)
         {
-            // Disable replacement feature for now
-            return false;
-
-            // Allow replacing with a newer version of the same transaction
-            if (i != 0)
-                return false;
-            ptxOld = mapNextTx[outpoint].ptx;
-            if (ptxOld->IsFinal())
-                return false;
-            if (!tx.IsNewerThan(*ptxOld))
-                return false;
-            for (unsigned int i = 0; i < tx.vin.size(); i++)
+            COutPoint outpoint = tx.vin[i].prevout;
+            if (mapNextTx.count(outpoint))
             {
-                COutPoint outpoint = tx.vin[i].prevout;
-                if (!mapNextTx.count(outpoint) || mapNextTx[outpoint].ptx != ptxOld)
+                // Disable replacement feature for now
+                return false;
+
+                // Allow replacing with a newer version of the same transaction
+                if (i != 0)
+                    return false;
+                ptxOld = mapNextTx[outpoint].ptx;
+                if (ptxOld->IsFinal())
+                    return false;
+                if (!tx.IsNewerThan(*ptxOld))
                     return false;
+                for (unsigned int i = 0; i < tx.vin.size(); i++)
+                {
+                    COutPoint outpoint = tx.vin[i].prevout;
+                    if (!mapNextTx.count(outpoint) || mapNextTx[outpoint].ptx != ptxOld)
+                        return false;
+                }
+                break;
             }
-            break;
         }
-    }
 
-    if (fCheckInputs)
-    {
-        CCoinsView dummy;
-        CCoinsViewCache view(dummy);
+        nHeight = nBestHeight + 1;
+        hashTip = hashBestChain;
 
+        if (fCheckInputs)
         {
-        LOCK(cs);
-        CCoinsViewMemPool viewMemPool(*pcoinsTip, *this);
-        view.SetBackend(viewMemPool);
-
-        // do we already have it?
-        if (view.HaveCoins(hash))
-            return false;
+            CCoinsViewMemPool viewMemPool(*pcoinsTip, *this);
+            view.SetBackend(viewMemPool);
 
-        // do all inputs exist?
-        // Note that this does not check for the presence of actual outputs (see the next check for that),
-        // only helps filling in pfMissingInputs (to determine missing vs spent).
-        BOOST_FOREACH(const CTxIn txin, tx.vin) {
-            if (!view.HaveCoins(txin.prevout.hash)) {
-                if (pfMissingInputs)
-                    *pfMissingInputs = true;
+            // do we already have it?
+            if (view.HaveCoins(hash))
                 return false;
+
+            // do all inputs exist?
+            // Note that this does not check for the presence of actual outputs (see the next check for that),
+            // only helps filling in pfMissingInputs (to determine missing vs spent).
+            BOOST_FOREACH(const CTxIn txin, tx.vin) {
+                if (!view.HaveCoins(txin.prevout.hash)) {
+                    if (pfMissingInputs)
+                        *pfMissingInputs = true;
+                    return false;
+                }
+                if (mapTx.count(txin.prevout.hash))
+                    vPoolParents.push_back(txin.prevout.hash);
             }
-        }
 
-        // are the actual inputs available?
-        if (!tx.HaveInputs(view))
-            return state.Invalid(error("CTxMemPool::accept() : inputs already spent"));
+            // are the actual inputs available?
+            if (!tx.HaveInputs(view))
+                return state.Invalid(error("CTxMemPool::accept() : inputs already spent"));
 
-        // Bring the best block into scope
-        view.GetBestBlock();
+            // Bring the best block into scope
+            view.GetBestBlock();
 
-        // we have all inputs cached now, so switch back to dummy, so we don't need to keep lock on mempool
-        view.SetBackend(dummy);
+            // we have all inputs cached now, so switch back to dummy, so we don't need to keep lock on mempool
+            view.SetBackend(dummy);
         }
+    }
+
+    if (fCheckInputs)
+    {
+        nFees = tx.GetValueIn(view)-tx.GetValueOut();
+
+        // Don't look at the scripts of what would be evicted again straight away
+        int64 nMempoolMinFee = GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000) * nSize / 1000;
+        if (fLimitFree && nMempoolMinFee > 0 && nFees < nMempoolMinFee)
+            return error("CTxMemPool::accept() : mempool min fee not met %s, %"PRI64d" < %"PRI64d,
+                         hash.ToString().c_str(),
+                         nFees, nMempoolMinFee);
 
         // Check for non-standard pay-to-script-hash in inputs
         if (!tx.AreInputsStandard(view) && !fTestNet)
@@ -757,8 +947,8 @@ bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckIn
         // you should add code here to check that the transaction does a
         // reasonable number of ECDSA signature verifications.
 
-        int64 nFees = tx.GetValueIn(view)-tx.GetValueOut();
-        unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+        dPriority = tx.GetPriority(view, nHeight, &nValueInChain);
+        nSigOps += tx.GetP2SHSigOpCount(view);
 
         // Don't accept it if it can't get into a block
         int64 txMinFee = tx.GetMinFee(1000, true, GMF_RELAY);
@@ -792,54 +982,371 @@ bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckIn
 
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        if (!tx.CheckInputs(state, view, true, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC | SCRIPT_VERIFY_DERSIG))
-        {
+        vector<CScriptCheck> vChecks;
+        if (!tx.CheckInputs(state, view, true, flags, &vChecks))
+            return error("CTxMemPool::accept() : ConnectInputs failed %s", hash.ToString().c_str());
+        // On failure check again in order, so the state tells what is wrong
+        if (!RunMempoolScriptChecks(vChecks) && !tx.CheckInputs(state, view, true, flags))
             return error("CTxMemPool::accept() : ConnectInputs failed %s", hash.ToString().c_str());
-        }
     }
 
     // Store transaction in memory
     {
-        LOCK(cs);
-        if (ptxOld)
+        LOCK(cs_main);
         {
-            printf("CTxMemPool::accept() : replacing tx %s with new version\n", ptxOld->GetHash().ToString().c_str());
-            remove(*ptxOld);
+            LOCK(cs);
+
+            // What changed while the scripts were checked
+            if (mapTx.count(hash))
+                return false;
+            if (!ptxOld)
+            {
+                BOOST_FOREACH(const CTxIn& txin, tx.vin)
+                    if (mapNextTx.count(txin.prevout))
+                        return false;
+            }
+            if (fCheckInputs)
+            {
+                if (hashBestChain != hashTip)
+                {
+                    // A block came in: the inputs may be spent or immature now
+                    CCoinsViewMemPool viewMemPool(*pcoinsTip, *this);
+                    CCoinsViewCache viewTip(viewMemPool);
+                    if (!tx.CheckInputs(state, viewTip, false, flags))
+                        return error("CTxMemPool::accept() : inputs changed %s", hash.ToString().c_str());
+                }
+                else
+                {
+                    // Without a block, only the parents in the pool may have gone
+                    BOOST_FOREACH(const uint256& hashParent, vPoolParents)
+                        if (!mapTx.count(hashParent))
+                            return error("CTxMemPool::accept() : parent of %s left the pool", hash.ToString().c_str());
+                }
+            }
+
+            if (ptxOld)
+            {
+                printf("CTxMemPool::accept() : replacing tx %s with new version\n", ptxOld->GetHash().ToString().c_str());
+                remove(*ptxOld);
+            }
+            addUnchecked(hash, CTxMemPoolEntry(tx, nFees, nAcceptTime ? nAcceptTime : GetTime(), dPriority, nHeight, nValueInChain, nSigOps),
+                         !IsInitialBlockDownload());
+
+            if (fLimitFree)
+            {
+                TrimToSize(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000);
+                if (!mapTx.count(hash))
+                    return error("CTxMemPool::accept() : mempool full, %s not kept", hash.ToString().c_str());
+            }
         }
-        addUnchecked(hash, tx);
-    }
 
-    ///// are we sure this is ok when loading transactions or restoring block txes
-    // If updated, erase old tx from wallet
-    if (ptxOld)
-        EraseFromWallets(ptxOld->GetHash());
-    SyncWithWallets(hash, tx, NULL, true);
+        ///// are we sure this is ok when loading transactions or restoring block txes
+        // If updated, erase old tx from wallet
+        if (ptxOld)
+            EraseFromWallets(ptxOld->GetHash());
+        SyncWithWallets(hash, tx, NULL, true);
+    }
 
     return true;
 }
 
-bool CTransaction::AcceptToMemoryPool(CValidationState &state, bool fCheckInputs, bool fLimitFree, bool* pfMissingInputs)
+bool CTransaction::AcceptToMemoryPool(CValidationState &state, bool fCheckInputs, bool fLimitFree, bool* pfMissingInputs,
+                                      int64 nAcceptTime)
 {
     try {
-        return mempool.accept(state, *this, fCheckInputs, fLimitFree, pfMissingInputs);
+        return mempool.accept(state, *this, fCheckInputs, fLimitFree, pfMissingInputs, nAcceptTime);
     } catch(std::runtime_error &e) {
         return state.Abort(_("System error: ") + e.what());
     }
 }
 
-bool CTxMemPool::addUnchecked(const uint256& hash, const CTransaction &tx)
+CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& txIn, int64 nFeeIn, int64 nTimeIn, double dPriorityIn,
+                                 unsigned int nHeightIn, int64 nValueInChainIn, unsigned int nSigOpsIn) :
+    tx(txIn), nFee(nFeeIn), nTime(nTimeIn), dPriority(dPriorityIn), nHeight(nHeightIn), nValueInChain(nValueInChainIn),
+    nSigOps(nSigOpsIn)
+{
+    hash = tx.GetHash();
+    nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    nUsageSize = memusage::DynamicUsage(tx.vin) + memusage::DynamicUsage(tx.vout);
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        nUsageSize += memusage::DynamicUsage(txin.scriptSig);
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        nUsageSize += memusage::DynamicUsage(txout.scriptPubKey);
+    nCountWithAncestors = nCountWithDescendants = 1;
+    nSizeWithAncestors = nSizeWithDescendants = nTxSize;
+    nFeesWithAncestors = nFeesWithDescendants = nFee;
+}
+
+double CTxMemPoolEntry::GetPriority(unsigned int nCurrentHeight) const
+{
+    if (nCurrentHeight <= nHeight)
+        return dPriority;
+    return dPriority + (double)nValueInChain * (nCurrentHeight - nHeight) / nTxSize;
+}
+
+void CTxMemPoolEntry::UpdateAncestorState(int64 nCountDelta, int64 nSizeDelta, int64 nFeeDelta)
+{
+    nCountWithAncestors += nCountDelta;
+    nSizeWithAncestors += nSizeDelta;
+    nFeesWithAncestors += nFeeDelta;
+}
+
+void CTxMemPoolEntry::UpdateDescendantState(int64 nCountDelta, int64 nSizeDelta, int64 nFeeDelta)
+{
+    nCountWithDescendants += nCountDelta;
+    nSizeWithDescendants += nSizeDelta;
+    nFeesWithDescendants += nFeeDelta;
+}
+
+// Whether fee rate nFeeA / nSizeA is lower than nFeeB / nSizeB
+static inline bool FeeRateLess(int64 nFeeA, uint64 nSizeA, int64 nFeeB, uint64 nSizeB)
+{
+    return (double)nFeeA * nSizeB < (double)nFeeB * nSizeA;
+}
+
+bool CompareTxMemPoolEntryByDescendantScore::operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+{
+    // The higher of the two fee rates of each
+    int64 nFeeA = a.GetFee(), nFeeB = b.GetFee();
+    uint64 nSizeA = a.GetTxSize(), nSizeB = b.GetTxSize();
+    if (FeeRateLess(nFeeA, nSizeA, a.GetFeesWithDescendants(), a.GetSizeWithDescendants()))
+        nFeeA = a.GetFeesWithDescendants(), nSizeA = a.GetSizeWithDescendants();
+    if (FeeRateLess(nFeeB, nSizeB, b.GetFeesWithDescendants(), b.GetSizeWithDescendants()))
+        nFeeB = b.GetFeesWithDescendants(), nSizeB = b.GetSizeWithDescendants();
+
+    if (FeeRateLess(nFeeA, nSizeA, nFeeB, nSizeB))
+        return true;
+    if (FeeRateLess(nFeeB, nSizeB, nFeeA, nSizeA))
+        return false;
+    return a.GetTime() > b.GetTime();
+}
+
+bool CompareTxMemPoolEntryByAncestorScore::operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+{
+    // The lower of the two fee rates of each
+    int64 nFeeA = a.GetFee(), nFeeB = b.GetFee();
+    uint64 nSizeA = a.GetTxSize(), nSizeB = b.GetTxSize();
+    if (FeeRateLess(a.GetFeesWithAncestors(), a.GetSizeWithAncestors(), nFeeA, nSizeA))
+        nFeeA = a.GetFeesWithAncestors(), nSizeA = a.GetSizeWithAncestors();
+    if (FeeRateLess(b.GetFeesWithAncestors(), b.GetSizeWithAncestors(), nFeeB, nSizeB))
+        nFeeB = b.GetFeesWithAncestors(), nSizeB = b.GetSizeWithAncestors();
+
+    if (FeeRateLess(nFeeB, nSizeB, nFeeA, nSizeA))
+        return true;
+    if (FeeRateLess(nFeeA, nSizeA, nFeeB, nSizeB))
+        return false;
+    return a.GetHash() < b.GetHash();
+}
+
+// Parents before children: a child has more ancestors than any of them
+class CompareTxIterByAncestorCount
+{
+public:
+    bool operator()(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b) const
+    {
+        if (a->GetCountWithAncestors() == b->GetCountWithAncestors())
+            return a->GetHash() < b->GetHash();
+        return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+    }
+};
+
+CSaltedTxidHasher::CSaltedTxidHasher() : k0(GetRand(~(uint64)0)), k1(GetRand(~(uint64)0))
+{
+}
+
+// Functors for indexed_transaction_set::modify, which reorders the entry
+class CUpdateAncestorState
+{
+private:
+    int64 nCountDelta, nSizeDelta, nFeeDelta;
+public:
+    CUpdateAncestorState(int64 nCount, int64 nSize, int64 nFee) : nCountDelta(nCount), nSizeDelta(nSize), nFeeDelta(nFee) {}
+    void operator()(CTxMemPoolEntry& entry) { entry.UpdateAncestorState(nCountDelta, nSizeDelta, nFeeDelta); }
+};
+
+class CUpdateDescendantState
+{
+private:
+    int64 nCountDelta, nSizeDelta, nFeeDelta;
+public:
+    CUpdateDescendantState(int64 nCount, int64 nSize, int64 nFee) : nCountDelta(nCount), nSizeDelta(nSize), nFeeDelta(nFee) {}
+    void operator()(CTxMemPoolEntry& entry) { entry.UpdateDescendantState(nCountDelta, nSizeDelta, nFeeDelta); }
+};
+
+const CTxMemPool::setEntries& CTxMemPool::GetMemPoolParents(txiter it) const
+{
+    return mapLinks.find(it)->second.parents;
+}
+
+const CTxMemPool::setEntries& CTxMemPool::GetMemPoolChildren(txiter it) const
+{
+    return mapLinks.find(it)->second.children;
+}
+
+void CTxMemPool::CalculateAncestors(txiter it, setEntries& setAncestors) const
+{
+    vector<txiter> vStack(1, it);
+    while (!vStack.empty())
+    {
+        txiter itNext = vStack.back();
+        vStack.pop_back();
+        BOOST_FOREACH(txiter itParent, GetMemPoolParents(itNext))
+            if (setAncestors.insert(itParent).second)
+                vStack.push_back(itParent);
+    }
+}
+
+void CTxMemPool::CalculateDescendants(txiter it, setEntries& setDescendants) const
+{
+    vector<txiter> vStack(1, it);
+    while (!vStack.empty())
+    {
+        txiter itNext = vStack.back();
+        vStack.pop_back();
+        BOOST_FOREACH(txiter itChild, GetMemPoolChildren(itNext))
+            if (setDescendants.insert(itChild).second)
+                vStack.push_back(itChild);
+    }
+}
+
+void CTxMemPool::UpdateEntryTotals(txiter it)
+{
+    setEntries setAncestors, setDescendants;
+    CalculateAncestors(it, setAncestors);
+    CalculateDescendants(it, setDescendants);
+    int64 nCount = 0, nSize = 0, nFee = 0;
+    BOOST_FOREACH(txiter itAncestor, setAncestors)
+        nCount++, nSize += itAncestor->GetTxSize(), nFee += itAncestor->GetFee();
+    mapTx.modify(it, CUpdateAncestorState(1 + nCount - it->GetCountWithAncestors(),
+                                          it->GetTxSize() + nSize - it->GetSizeWithAncestors(),
+                                          it->GetFee() + nFee - it->GetFeesWithAncestors()));
+    nCount = nSize = nFee = 0;
+    BOOST_FOREACH(txiter itDescendant, setDescendants)
+        nCount++, nSize += itDescendant->GetTxSize(), nFee += itDescendant->GetFee();
+    mapTx.modify(it, CUpdateDescendantState(1 + nCount - it->GetCountWithDescendants(),
+                                            it->GetTxSize() + nSize - it->GetSizeWithDescendants(),
+                                            it->GetFee() + nFee - it->GetFeesWithDescendants()));
+}
+
+bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry, bool fCurrentEstimate)
 {
     // Add to memory pool without checking anything.  Don't call this directly,
     // call CTxMemPool::accept to properly check the transaction first.
+    LOCK(cs);
+    std::pair<txiter, bool> ret = mapTx.insert(entry);
+    if (!ret.second)
+        return false;
+    txiter it = ret.first;
+    TxLinks& links = mapLinks[it];
+    const CTransaction& tx = it->GetTx();
+    totalTxSize += it->GetTxSize();
+    cachedInnerUsage += it->DynamicMemoryUsage();
+    // Each link is a node in the sets of both ends
+    size_t nLinkUsage = 2 * memusage::IncrementalDynamicUsage(links.parents);
+    for (unsigned int i = 0; i < tx.vin.size(); i++)
     {
-        mapTx[hash] = tx;
-        for (unsigned int i = 0; i < tx.vin.size(); i++)
-            mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
-        nTransactionsUpdated++;
+        mapNextTx[tx.vin[i].prevout] = CInPoint(&tx, i);
+        txiter itParent = mapTx.find(tx.vin[i].prevout.hash);
+        if (itParent != mapTx.end() && links.parents.insert(itParent).second)
+        {
+            mapLinks[itParent].children.insert(it);
+            cachedInnerUsage += nLinkUsage;
+        }
+    }
+    // Transactions in the pool may already spend it, when it comes back
+    // from a disconnected block
+    for (std::map<COutPoint, CInPoint>::iterator mi = mapNextTx.lower_bound(COutPoint(hash, 0));
+         mi != mapNextTx.end() && mi->first.hash == hash; ++mi)
+    {
+        txiter itChild = mapTx.find(mi->second.ptx->GetHash());
+        if (links.children.insert(itChild).second)
+        {
+            mapLinks[itChild].parents.insert(it);
+            cachedInnerUsage += nLinkUsage;
+        }
+    }
+
+    setEntries setAncestors;
+    CalculateAncestors(it, setAncestors);
+    if (links.children.empty())
+    {
+        BOOST_FOREACH(txiter itAncestor, setAncestors)
+        {
+            mapTx.modify(itAncestor, CUpdateDescendantState(1, it->GetTxSize(), it->GetFee()));
+            mapTx.modify(it, CUpdateAncestorState(1, itAncestor->GetTxSize(), itAncestor->GetFee()));
+        }
     }
+    else
+    {
+        // Rare enough to simply recount everything it is linked to
+        setEntries setDescendants;
+        CalculateDescendants(it, setDescendants);
+        UpdateEntryTotals(it);
+        BOOST_FOREACH(txiter itAncestor, setAncestors)
+            UpdateEntryTotals(itAncestor);
+        BOOST_FOREACH(txiter itDescendant, setDescendants)
+            UpdateEntryTotals(itDescendant);
+    }
+    if (passembler)
+        passembler->TransactionAdded(it);
+    // Waiting for a parent in the pool, it can't say what its fee gets
+    minerPolicyEstimator.processTransaction(*it, fCurrentEstimate && links.parents.empty());
+    nTransactionsUpdated++;
     return true;
 }
 
+bool CTxMemPool::addUnchecked(const uint256& hash, const CTransaction &tx)
+{
+    return addUnchecked(hash, CTxMemPoolEntry(tx, 0, GetTime(), 0, nBestHeight + 1, 0, tx.GetLegacySigOpCount()));
+}
+
+void CTxMemPool::RemoveStaged(const setEntries& setRemove)
+{
+    if (passembler)
+    {
+        BOOST_FOREACH(txiter it, setRemove)
+            passembler->TransactionRemoved(it);
+    }
+    BOOST_FOREACH(txiter it, setRemove)
+        minerPolicyEstimator.removeTx(it->GetHash());
+
+    // Take each transaction out of the totals of what stays
+    BOOST_FOREACH(txiter it, setRemove)
+    {
+        setEntries setAncestors, setDescendants;
+        CalculateAncestors(it, setAncestors);
+        CalculateDescendants(it, setDescendants);
+        BOOST_FOREACH(txiter itAncestor, setAncestors)
+            if (!setRemove.count(itAncestor))
+                mapTx.modify(itAncestor, CUpdateDescendantState(-1, -(int64)it->GetTxSize(), -it->GetFee()));
+        BOOST_FOREACH(txiter itDescendant, setDescendants)
+            if (!setRemove.count(itDescendant))
+                mapTx.modify(itDescendant, CUpdateAncestorState(-1, -(int64)it->GetTxSize(), -it->GetFee()));
+    }
+    BOOST_FOREACH(txiter it, setRemove)
+    {
+        const TxLinks& links = mapLinks[it];
+        size_t nNodeUsage = memusage::IncrementalDynamicUsage(links.parents);
+        BOOST_FOREACH(txiter itParent, links.parents)
+            if (!setRemove.count(itParent))
+                mapLinks[itParent].children.erase(it), cachedInnerUsage -= nNodeUsage;
+        BOOST_FOREACH(txiter itChild, links.children)
+            if (!setRemove.count(itChild))
+                mapLinks[itChild].parents.erase(it), cachedInnerUsage -= nNodeUsage;
+        BOOST_FOREACH(const CTxIn& txin, it->GetTx().vin)
+            mapNextTx.erase(txin.prevout);
+    }
+    BOOST_FOREACH(txiter it, setRemove)
+    {
+        const TxLinks& links = mapLinks[it];
+        cachedInnerUsage -= it->DynamicMemoryUsage() + memusage::DynamicUsage(links.parents) +
+                            memusage::DynamicUsage(links.children);
+        totalTxSize -= it->GetTxSize();
+        mapLinks.erase(it);
+        mapTx.erase(it);
+        nTransactionsUpdated++;
+    }
+}
 
 bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
 {
@@ -847,20 +1354,28 @@ bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
     {
         LOCK(cs);
         uint256 hash = tx.GetHash();
+        setEntries setRemove;
+        txiter it = mapTx.find(hash);
+        if (it != mapTx.end())
+            setRemove.insert(it);
         if (fRecursive) {
-            for (unsigned int i = 0; i < tx.vout.size(); i++) {
-                std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
-                if (it != mapNextTx.end())
-                    remove(*it->second.ptx, true);
+            // The transaction itself may not be in the pool, but what spends it is
+            setEntries setSpenders;
+            if (it != mapTx.end())
+                setSpenders = GetMemPoolChildren(it);
+            else {
+                for (unsigned int i = 0; i < tx.vout.size(); i++) {
+                    std::map<COutPoint, CInPoint>::iterator mi = mapNextTx.find(COutPoint(hash, i));
+                    if (mi != mapNextTx.end())
+                        setSpenders.insert(mapTx.find(mi->second.ptx->GetHash()));
+                }
+            }
+            BOOST_FOREACH(txiter itSpender, setSpenders) {
+                setRemove.insert(itSpender);
+                CalculateDescendants(itSpender, setRemove);
             }
         }
-        if (mapTx.count(hash))
-        {
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-                mapNextTx.erase(txin.prevout);
-            mapTx.erase(hash);
-            nTransactionsUpdated++;
-        }
+        RemoveStaged(setRemove);
     }
     return true;
 }
@@ -880,22 +1395,495 @@ bool CTxMemPool::removeConflicts(const CTransaction &tx)
     return true;
 }
 
+void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx, unsigned int nBlockHeight, bool fCurrentEstimate)
+{
+    LOCK(cs);
+    std::vector<const CTxMemPoolEntry*> entries;
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+    {
+        txiter it = mapTx.find(tx.GetHash());
+        if (it != mapTx.end())
+            entries.push_back(&*it);
+    }
+    minerPolicyEstimator.processBlock(nBlockHeight, entries, fCurrentEstimate);
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+    {
+        remove(tx);
+        removeConflicts(tx);
+    }
+}
+
 void CTxMemPool::clear()
 {
     LOCK(cs);
+    if (passembler)
+        passembler->Invalidate();
+    mapLinks.clear();
     mapTx.clear();
     mapNextTx.clear();
+    totalTxSize = 0;
+    cachedInnerUsage = 0;
     ++nTransactionsUpdated;
 }
 
+size_t CTxMemPool::DynamicMemoryUsage() const
+{
+    LOCK(cs);
+    // Each entry also carries a pointer per hashed index and three pointers
+    // and a color per ordered index
+    return memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 12 * sizeof(void*)) * mapTx.size() +
+           memusage::MallocUsage(mapTx.bucket_count() * sizeof(void*)) +
+           memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapLinks) + cachedInnerUsage;
+}
+
+void CTxMemPool::TrimToSize(size_t nSizeLimit)
+{
+    LOCK(cs);
+    unsigned int nRemoved = 0;
+    while (!mapTx.empty() && DynamicMemoryUsage() > nSizeLimit)
+    {
+        // The package to drop is the cheapest entry with what spends it
+        txiter it = mapTx.project<0>(mapTx.get<descendant_score>().begin());
+        setEntries setRemove;
+        setRemove.insert(it);
+        CalculateDescendants(it, setRemove);
+
+        // What replaces it pays more, and for relaying it on top
+        double dFeeRate = (double)it->GetFeesWithDescendants() * 1000 / it->GetSizeWithDescendants() +
+                          CTransaction::nMinRelayTxFee;
+        if (dFeeRate > rollingMinimumFeeRate)
+        {
+            rollingMinimumFeeRate = dFeeRate;
+            blockSinceLastRollingFeeBump = false;
+        }
+
+        nRemoved += setRemove.size();
+        RemoveStaged(setRemove);
+    }
+    if (nRemoved > 0 && fDebug)
+        printf("CTxMemPool::TrimToSize() : removed %u transactions, minimum fee now %.0f\n",
+               nRemoved, rollingMinimumFeeRate);
+}
+
+int64 CTxMemPool::GetMinFee(size_t nSizeLimit)
+{
+    LOCK(cs);
+    if (!blockSinceLastRollingFeeBump || rollingMinimumFeeRate == 0)
+        return (int64)rollingMinimumFeeRate;
+
+    int64 nNow = GetTime();
+    if (nNow > lastRollingFeeUpdate + 10)
+    {
+        double dHalfLife = ROLLING_FEE_HALFLIFE;
+        size_t nUsage = DynamicMemoryUsage();
+        if (nUsage < nSizeLimit / 4)
+            dHalfLife /= 4;
+        else if (nUsage < nSizeLimit / 2)
+            dHalfLife /= 2;
+        rollingMinimumFeeRate /= pow(2.0, (nNow - lastRollingFeeUpdate) / dHalfLife);
+        lastRollingFeeUpdate = nNow;
+
+        if (rollingMinimumFeeRate < CTransaction::nMinRelayTxFee / 2)
+        {
+            rollingMinimumFeeRate = 0;
+            return 0;
+        }
+    }
+    return std::max((int64)rollingMinimumFeeRate, CTransaction::nMinRelayTxFee);
+}
+
+void CTxMemPool::BlockConnected()
+{
+    LOCK(cs);
+    lastRollingFeeUpdate = GetTime();
+    blockSinceLastRollingFeeBump = true;
+}
+
+// Fee estimation tracks confirmation within up to 25 blocks, and lets each
+// block's counts fade by 0.2% per block after, a half-life of ~350 blocks
+static const unsigned int MAX_BLOCK_CONFIRMS = 25;
+static const double DEFAULT_DECAY = .998;
+// Share of a bucket's transactions confirmed in time for it to be enough
+static const double MIN_SUCCESS_PCT = .85;
+// Transactions per block a range of buckets needs before it is judged
+static const double SUFFICIENT_FEETXS = 1;
+static const double SUFFICIENT_PRITXS = .2;
+// Bucket bounds, from the tracked minimum up to these, then one for the rest
+static const double MIN_FEERATE = 10;
+static const double MAX_FEERATE = 1e7;
+static const double FEE_SPACING = 1.1;
+static const double MIN_PRIORITY = 10;
+static const double MAX_PRIORITY = 1e16;
+static const double PRI_SPACING = 2;
+static const double INF_BUCKET = 1e99;
+
+void CTxConfirmStats::Initialize(const std::vector<double>& vBuckets, unsigned int nMaxConfirms, double dDecay)
+{
+    decay = dDecay;
+    buckets = vBuckets;
+    bucketMap.clear();
+    for (unsigned int i = 0; i < buckets.size(); i++)
+        bucketMap[buckets[i]] = i;
+    txCtAvg.assign(buckets.size(), 0);
+    avg.assign(buckets.size(), 0);
+    confAvg.assign(nMaxConfirms, std::vector<double>(buckets.size(), 0));
+    curBlockTxCt.assign(buckets.size(), 0);
+    curBlockVal.assign(buckets.size(), 0);
+    curBlockConf.assign(nMaxConfirms, std::vector<int>(buckets.size(), 0));
+    unconfTxs.assign(nMaxConfirms, std::vector<int>(buckets.size(), 0));
+    oldUnconfTxs.assign(buckets.size(), 0);
+}
+
+void CTxConfirmStats::ClearCurrent(unsigned int nBlockHeight)
+{
+    // Those that came in a full window ago are now old
+    std::vector<int>& vUnconf = unconfTxs[nBlockHeight % unconfTxs.size()];
+    for (unsigned int j = 0; j < buckets.size(); j++)
+    {
+        oldUnconfTxs[j] += vUnconf[j];
+        vUnconf[j] = 0;
+        for (unsigned int i = 0; i < curBlockConf.size(); i++)
+            curBlockConf[i][j] = 0;
+        curBlockTxCt[j] = 0;
+        curBlockVal[j] = 0;
+    }
+}
+
+void CTxConfirmStats::Record(int nBlocksToConfirm, double dVal)
+{
+    if (nBlocksToConfirm < 1)
+        return;
+    unsigned int nBucket = bucketMap.lower_bound(dVal)->second;
+    // Confirmed within nBlocksToConfirm is confirmed within any more too
+    for (unsigned int i = nBlocksToConfirm; i <= curBlockConf.size(); i++)
+        curBlockConf[i - 1][nBucket]++;
+    curBlockTxCt[nBucket]++;
+    curBlockVal[nBucket] += dVal;
+}
+
+void CTxConfirmStats::UpdateMovingAverages()
+{
+    for (unsigned int j = 0; j < buckets.size(); j++)
+    {
+        for (unsigned int i = 0; i < confAvg.size(); i++)
+            confAvg[i][j] = confAvg[i][j] * decay + curBlockConf[i][j];
+        avg[j] = avg[j] * decay + curBlockVal[j];
+        txCtAvg[j] = txCtAvg[j] * decay + curBlockTxCt[j];
+    }
+}
+
+unsigned int CTxConfirmStats::NewTx(unsigned int nBlockHeight, double dVal)
+{
+    unsigned int nBucket = bucketMap.lower_bound(dVal)->second;
+    unconfTxs[nBlockHeight % unconfTxs.size()][nBucket]++;
+    return nBucket;
+}
+
+void CTxConfirmStats::RemoveTx(unsigned int nEntryHeight, unsigned int nBestSeenHeight, unsigned int nBucket)
+{
+    // Before any block was seen, everything is in the current window
+    int nBlocksAgo = nBestSeenHeight == 0 ? 0 : (int)nBestSeenHeight - (int)nEntryHeight;
+    if (nBlocksAgo < 0)
+        return;
+    if (nBlocksAgo >= (int)unconfTxs.size())
+    {
+        if (oldUnconfTxs[nBucket] > 0)
+            oldUnconfTxs[nBucket]--;
+    }
+    else
+    {
+        std::vector<int>& vUnconf = unconfTxs[nEntryHeight % unconfTxs.size()];
+        if (vUnconf[nBucket] > 0)
+            vUnconf[nBucket]--;
+    }
+}
+
+double CTxConfirmStats::EstimateMedianVal(int nConfTarget, double dSufficientTxVal, double dSuccessBreakPoint,
+                                          bool fRequireGreater, unsigned int nBlockHeight) const
+{
+    // Counts of the range of buckets being combined: confirmed in time,
+    // confirmed at all, and waiting at least nConfTarget blocks
+    double nConf = 0;
+    double nTotal = 0;
+    int nExtra = 0;
+
+    int nMaxBucket = buckets.size() - 1;
+    unsigned int nStartBucket = fRequireGreater ? nMaxBucket : 0;
+    int nStep = fRequireGreater ? -1 : 1;
+
+    // The range being counted, and the last one that succeeded
+    unsigned int nCurNear = nStartBucket, nCurFar = nStartBucket;
+    unsigned int nBestNear = nStartBucket, nBestFar = nStartBucket;
+    bool fFound = false;
+    unsigned int nBins = unconfTxs.size();
+
+    for (int nBucket = nStartBucket; nBucket >= 0 && nBucket <= nMaxBucket; nBucket += nStep)
+    {
+        nCurFar = nBucket;
+        nConf += confAvg[nConfTarget - 1][nBucket];
+        nTotal += txCtAvg[nBucket];
+        for (unsigned int nConfCt = nConfTarget; nConfCt < GetMaxConfirms(); nConfCt++)
+            nExtra += unconfTxs[(nBlockHeight - nConfCt) % nBins][nBucket];
+        nExtra += oldUnconfTxs[nBucket];
+
+        // Judge the range once it has seen enough, as many transactions
+        // per block as asked for over the decay's window
+        if (nTotal < dSufficientTxVal / (1 - decay))
+            continue;
+        double dPct = nConf / (nTotal + nExtra);
+        if (fRequireGreater ? dPct < dSuccessBreakPoint : dPct > dSuccessBreakPoint)
+            break;
+        fFound = true;
+        nConf = 0;
+        nTotal = 0;
+        nExtra = 0;
+        nBestNear = nCurNear;
+        nBestFar = nCurFar;
+        nCurNear = nBucket + nStep;
+    }
+
+    // The average value of the bucket holding the median transaction of the
+    // range; the transactions themselves aren't kept
+    if (!fFound)
+        return -1;
+    unsigned int nMin = std::min(nBestNear, nBestFar);
+    unsigned int nMax = std::max(nBestNear, nBestFar);
+    double dTxSum = 0;
+    for (unsigned int j = nMin; j <= nMax; j++)
+        dTxSum += txCtAvg[j];
+    if (dTxSum == 0)
+        return -1;
+    dTxSum /= 2;
+    for (unsigned int j = nMin; j <= nMax; j++)
+    {
+        if (txCtAvg[j] < dTxSum)
+            dTxSum -= txCtAvg[j];
+        else
+            return avg[j] / txCtAvg[j];
+    }
+    return -1;
+}
+
+void CTxConfirmStats::Write(CAutoFile& fileout) const
+{
+    fileout << decay << buckets << avg << txCtAvg << confAvg;
+}
+
+void CTxConfirmStats::Read(CAutoFile& filein)
+{
+    double dFileDecay;
+    std::vector<double> vFileBuckets, vFileAvg, vFileTxCtAvg;
+    std::vector<std::vector<double> > vFileConfAvg;
+    filein >> dFileDecay >> vFileBuckets >> vFileAvg >> vFileTxCtAvg >> vFileConfAvg;
+
+    if (dFileDecay <= 0 || dFileDecay >= 1)
+        throw std::runtime_error("CTxConfirmStats::Read() : decay must be between 0 and 1 (non-inclusive)");
+    unsigned int nBuckets = vFileBuckets.size();
+    if (nBuckets <= 1 || nBuckets > 1000)
+        throw std::runtime_error("CTxConfirmStats::Read() : must have between 2 and 1000 buckets");
+    if (vFileAvg.size() != nBuckets || vFileTxCtAvg.size() != nBuckets)
+        throw std::runtime_error("CTxConfirmStats::Read() : mismatch in bucket count");
+    unsigned int nMaxConfirms = vFileConfAvg.size();
+    if (nMaxConfirms <= 0 || nMaxConfirms > 6 * 24 * 7)
+        throw std::runtime_error("CTxConfirmStats::Read() : must track between 1 and a week's blocks");
+    for (unsigned int i = 0; i < nMaxConfirms; i++)
+        if (vFileConfAvg[i].size() != nBuckets)
+            throw std::runtime_error("CTxConfirmStats::Read() : mismatch in bucket count");
+
+    // The buckets are the file's, as its counts are by them
+    Initialize(vFileBuckets, nMaxConfirms, dFileDecay);
+    avg = vFileAvg;
+    txCtAvg = vFileTxCtAvg;
+    confAvg = vFileConfAvg;
+}
+
+CBlockPolicyEstimator::CBlockPolicyEstimator(int64 nMinRelayFee) : nBestSeenHeight(0)
+{
+    minTrackedFee = std::max((double)nMinRelayFee, MIN_FEERATE);
+    std::vector<double> vFeeList;
+    for (double dBound = minTrackedFee; dBound <= MAX_FEERATE; dBound *= FEE_SPACING)
+        vFeeList.push_back(dBound);
+    vFeeList.push_back(INF_BUCKET);
+    feeStats.Initialize(vFeeList, MAX_BLOCK_CONFIRMS, DEFAULT_DECAY);
+
+    // Free transactions need the priority AllowFree() asks for
+    minTrackedPriority = std::max((double)COIN * 144 / 250, MIN_PRIORITY);
+    std::vector<double> vPriList;
+    for (double dBound = minTrackedPriority; dBound <= MAX_PRIORITY; dBound *= PRI_SPACING)
+        vPriList.push_back(dBound);
+    vPriList.push_back(INF_BUCKET);
+    priStats.Initialize(vPriList, MAX_BLOCK_CONFIRMS, DEFAULT_DECAY);
+}
+
+CTxConfirmStats* CBlockPolicyEstimator::GetStatsFor(double dFeeRate, double dPriority)
+{
+    bool fFee = dFeeRate >= minTrackedFee;
+    bool fPriority = dPriority >= minTrackedPriority;
+    if (fFee && !fPriority)
+        return &feeStats;
+    if (fPriority && !fFee)
+        return &priStats;
+    return NULL;
+}
+
+void CBlockPolicyEstimator::processTransaction(const CTxMemPoolEntry& entry, bool fCurrentEstimate)
+{
+    // The tip it came in at; a transaction coming back from a disconnected
+    // block, or in before the estimates are current, says nothing of how
+    // long blocks take to take it
+    unsigned int nTxHeight = entry.GetHeight() - 1;
+    if (nTxHeight < nBestSeenHeight || !fCurrentEstimate)
+        return;
+    if (mapMemPoolTxs.count(entry.GetHash()))
+        return;
+
+    double dFeeRate = (double)entry.GetFee() * 1000 / entry.GetTxSize();
+    double dPriority = entry.GetPriority(entry.GetHeight());
+    CTxConfirmStats* pstats = GetStatsFor(dFeeRate, dPriority);
+    if (!pstats)
+        return;
+    TxStatsInfo& info = mapMemPoolTxs[entry.GetHash()];
+    info.stats = pstats;
+    info.blockHeight = nTxHeight;
+    info.bucketIndex = pstats->NewTx(nTxHeight, pstats == &feeStats ? dFeeRate : dPriority);
+}
+
+bool CBlockPolicyEstimator::removeTx(const uint256& hash)
+{
+    std::map<uint256, TxStatsInfo>::iterator mi = mapMemPoolTxs.find(hash);
+    if (mi == mapMemPoolTxs.end())
+        return false;
+    mi->second.stats->RemoveTx(mi->second.blockHeight, nBestSeenHeight, mi->second.bucketIndex);
+    mapMemPoolTxs.erase(mi);
+    return true;
+}
+
+void CBlockPolicyEstimator::processBlock(unsigned int nBlockHeight, const std::vector<const CTxMemPoolEntry*>& entries,
+                                         bool fCurrentEstimate)
+{
+    // Side chains and reorganizations are left out; as random as they are,
+    // they don't move the estimates
+    if (nBlockHeight <= nBestSeenHeight)
+        return;
+    nBestSeenHeight = nBlockHeight;
+
+    // While catching up, what took a block to confirm isn't known
+    if (!fCurrentEstimate)
+        return;
+
+    feeStats.ClearCurrent(nBlockHeight);
+    priStats.ClearCurrent(nBlockHeight);
+
+    BOOST_FOREACH(const CTxMemPoolEntry* pentry, entries)
+    {
+        std::map<uint256, TxStatsInfo>::iterator mi = mapMemPoolTxs.find(pentry->GetHash());
+        if (mi == mapMemPoolTxs.end())
+            continue;
+        CTxConfirmStats* pstats = mi->second.stats;
+        int nBlocksToConfirm = nBlockHeight - mi->second.blockHeight;
+        removeTx(pentry->GetHash());
+        if (pstats == &feeStats)
+            feeStats.Record(nBlocksToConfirm, (double)pentry->GetFee() * 1000 / pentry->GetTxSize());
+        else
+            priStats.Record(nBlocksToConfirm, pentry->GetPriority(nBlockHeight));
+    }
+
+    feeStats.UpdateMovingAverages();
+    priStats.UpdateMovingAverages();
+
+    if (fDebug)
+        printf("Fee estimates at height %u: %"PRI64d" in 1 block, %"PRI64d" in 6, %"PRIszu" transactions tracked\n",
+               nBlockHeight, estimateFee(1), estimateFee(6), mapMemPoolTxs.size());
+}
+
+int64 CBlockPolicyEstimator::estimateFee(int nConfTarget) const
+{
+    if (nConfTarget <= 0 || (unsigned int)nConfTarget > feeStats.GetMaxConfirms())
+        return -1;
+    double dMedian = feeStats.EstimateMedianVal(nConfTarget, SUFFICIENT_FEETXS, MIN_SUCCESS_PCT, true, nBestSeenHeight);
+    if (dMedian < 0)
+        return -1;
+    return (int64)dMedian;
+}
+
+double CBlockPolicyEstimator::estimatePriority(int nConfTarget) const
+{
+    if (nConfTarget <= 0 || (unsigned int)nConfTarget > priStats.GetMaxConfirms())
+        return -1;
+    return priStats.EstimateMedianVal(nConfTarget, SUFFICIENT_PRITXS, MIN_SUCCESS_PCT, true, nBestSeenHeight);
+}
+
+void CBlockPolicyEstimator::Write(CAutoFile& fileout) const
+{
+    fileout << nBestSeenHeight;
+    feeStats.Write(fileout);
+    priStats.Write(fileout);
+}
+
+void CBlockPolicyEstimator::Read(CAutoFile& filein)
+{
+    unsigned int nFileBestSeenHeight;
+    filein >> nFileBestSeenHeight;
+    // Both, or neither, so a bad file leaves the estimates as they were
+    CTxConfirmStats feeStatsRead, priStatsRead;
+    feeStatsRead.Read(filein);
+    priStatsRead.Read(filein);
+    nBestSeenHeight = nFileBestSeenHeight;
+    feeStats = feeStatsRead;
+    priStats = priStatsRead;
+}
+
+int64 CTxMemPool::estimateFee(int nBlocks) const
+{
+    LOCK(cs);
+    return minerPolicyEstimator.estimateFee(nBlocks);
+}
+
+double CTxMemPool::estimatePriority(int nBlocks) const
+{
+    LOCK(cs);
+    return minerPolicyEstimator.estimatePriority(nBlocks);
+}
+
+// Version of fee_estimates.dat; older files are started over from
+static const int FEE_ESTIMATES_VERSION = 1;
+
+bool CTxMemPool::WriteFeeEstimates(CAutoFile& fileout) const
+{
+    try {
+        LOCK(cs);
+        fileout << FEE_ESTIMATES_VERSION << CLIENT_VERSION;
+        minerPolicyEstimator.Write(fileout);
+    } catch (std::exception &e) {
+        return error("CTxMemPool::WriteFeeEstimates() : unable to write policy estimator data (%s)", e.what());
+    }
+    return true;
+}
+
+bool CTxMemPool::ReadFeeEstimates(CAutoFile& filein)
+{
+    try {
+        int nVersion, nVersionThatWrote;
+        filein >> nVersion >> nVersionThatWrote;
+        if (nVersion != FEE_ESTIMATES_VERSION)
+            return error("CTxMemPool::ReadFeeEstimates() : version %d of the file, written by %d, isn't known",
+                         nVersion, nVersionThatWrote);
+        LOCK(cs);
+        minerPolicyEstimator.Read(filein);
+    } catch (std::exception &e) {
+        return error("CTxMemPool::ReadFeeEstimates() : unable to read policy estimator data (%s)", e.what());
+    }
+    return true;
+}
+
 void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
 {
     vtxid.clear();
 
     LOCK(cs);
     vtxid.reserve(mapTx.size());
-    for (map<uint256, CTransaction>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
-        vtxid.push_back((*mi).first);
+    for (indexed_transaction_set::const_iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
+        vtxid.push_back(mi->GetHash());
 }
 
 
@@ -946,7 +1934,7 @@ bool CMerkleTx::AcceptToMemoryPool(bool fCheckInputs, bool fLimitFree)
 bool CWalletTx::AcceptWalletTransaction(bool fCheckInputs)
 {
     {
-        LOCK(mempool.cs);
+        LOCK2(cs_main, mempool.cs);
         // Add previous supporting transactions first
         BOOST_FOREACH(CMerkleTx& tx, vtxPrev)
         {
@@ -1330,6 +2318,27 @@ int64 CTransaction::GetValueIn(CCoinsViewCache& inputs) const
     return nResult;
 }
 
+double CTransaction::GetPriority(CCoinsViewCache& inputs, int nHeight, int64* pnValueInChain) const
+{
+    double dResult = 0;
+    int64 nValueInChain = 0;
+    if (!IsCoinBase())
+    {
+        BOOST_FOREACH(const CTxIn& txin, vin)
+        {
+            const CCoins &coins = inputs.GetCoins(txin.prevout.hash);
+            if (coins.nHeight == MEMPOOL_HEIGHT)
+                continue;
+            int64 nValueIn = coins.vout[txin.prevout.n].nValue;
+            nValueInChain += nValueIn;
+            dResult += (double)nValueIn * (nHeight - coins.nHeight);
+        }
+    }
+    if (pnValueInChain)
+        *pnValueInChain = nValueInChain;
+    return dResult / ::GetSerializeSize(*this, SER_NETWORK, PROTOCOL_VERSION);
+}
+
 unsigned int CTransaction::GetP2SHSigOpCount(CCoinsViewCache& inputs) const
 {
     if (IsCoinBase())
@@ -1812,7 +2821,7 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
     }
 
     // Connect longer branch
-    vector<CTransaction> vDelete;
+    vector<pair<unsigned int, vector<CTransaction> > > vDelete;
     BOOST_FOREACH(CBlockIndex *pindex, vConnect) {
         CBlock block;
         if (!block.ReadFromDisk(pindex))
@@ -1829,8 +2838,7 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
             printf("- Connect: %.2fms\n", (GetTimeMicros() - nStart) * 0.001);
 
         // Queue memory transactions to delete
-        BOOST_FOREACH(const CTransaction& tx, block.vtx)
-            vDelete.push_back(tx);
+        vDelete.push_back(make_pair((unsigned int)pindex->nHeight, block.vtx));
     }
 
     // Flush changes to global coin state
@@ -1879,10 +2887,13 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
     }
 
     // Delete redundant memory transactions that are in the connected branch
-    BOOST_FOREACH(CTransaction& tx, vDelete) {
-        mempool.remove(tx);
-        mempool.removeConflicts(tx);
-    }
+    for (unsigned int i = 0; i < vDelete.size(); i++)
+        mempool.removeForBlock(vDelete[i].second, vDelete[i].first, !fIsInitialDownload);
+    if (!vConnect.empty())
+        mempool.BlockConnected();
+    // What came back from disconnected blocks may not all fit
+    if (!vResurrect.empty())
+        mempool.TrimToSize(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000);
 
     // Update best block in wallet (so we can detect restored wallets)
     if ((pindexNew->nHeight % 20160) == 0 || (!fIsInitialDownload && (pindexNew->nHeight % 144) == 0))
@@ -1892,13 +2903,17 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
     }
 
     // New best block
-    hashBestChain = pindexNew->GetBlockHash();
+    {
+        boost::lock_guard<boost::mutex> lock(mutexBlockChange);
+        hashBestChain = pindexNew->GetBlockHash();
+    }
     pindexBest = pindexNew;
     pblockindexFBBHLast = NULL;
     nBestHeight = pindexBest->nHeight;
     nBestChainWork = pindexNew->nChainWork;
     nTimeBestReceived = GetTime();
     nTransactionsUpdated++;
+    condBlockChange.notify_all();
     printf("SetBestChain: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f\n",
       hashBestChain.ToString().c_str(), nBestHeight, log(nBestChainWork.getdouble())/log(2.0), (unsigned long)pindexNew->nChainTx,
       DateTimeStrFormat("%Y-%m-%d %H:%M:%S", pindexBest->GetBlockTime()).c_str(),
@@ -2248,6 +3263,7 @@ bool CBlock::AcceptBlock(CValidationState &state, CDiskBlockPos *dbp)
         BOOST_FOREACH(CNode* pnode, vNodes)
             if (nBestHeight > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
                 pnode->PushInventory(CInv(MSG_BLOCK, hash));
+        WakeMessageHandler();
     }
 
     return true;
@@ -2352,6 +3368,20 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
 
 
 CMerkleBlock::CMerkleBlock(const CBlock& block, CBloomFilter& filter)
+{
+    vector<CBloomTxElements> vElements;
+    vElements.reserve(block.vtx.size());
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        vElements.push_back(CBloomTxElements(tx, tx.GetHash()));
+    Init(block, vElements, filter);
+}
+
+CMerkleBlock::CMerkleBlock(const CBlock& block, const vector<CBloomTxElements>& vElements, CBloomFilter& filter)
+{
+    Init(block, vElements, filter);
+}
+
+void CMerkleBlock::Init(const CBlock& block, const vector<CBloomTxElements>& vElements, CBloomFilter& filter)
 {
     header = block.GetBlockHeader();
 
@@ -2363,8 +3393,8 @@ CMerkleBlock::CMerkleBlock(const CBlock& block, CBloomFilter& filter)
 
     for (unsigned int i = 0; i < block.vtx.size(); i++)
     {
-        uint256 hash = block.vtx[i].GetHash();
-        if (filter.IsRelevantAndUpdate(block.vtx[i], hash))
+        const uint256& hash = vElements[i].hash;
+        if (filter.IsRelevantAndUpdate(vElements[i]))
         {
             vMatch.push_back(true);
             vMatchedTxn.push_back(make_pair(i, hash));
@@ -2379,6 +3409,121 @@ CMerkleBlock::CMerkleBlock(const CBlock& block, CBloomFilter& filter)
 
 
 
+CCompactBlock::CCompactBlock(const CBlock& block, uint64 nNonceIn) : nNonce(nNonceIn)
+{
+    header = block.GetBlockHeader();
+    if (block.vtx.empty())
+        return;
+
+    // The receiver can't have the coinbase
+    vPrefilledTxn.push_back(CPrefilledTransaction(0, block.vtx[0]));
+
+    uint64 k0, k1;
+    GetShortIDKeys(k0, k1);
+    vShortTxID.reserve(block.vtx.size() - 1);
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+        vShortTxID.push_back(GetShortID(k0, k1, block.vtx[i].GetHash()));
+}
+
+void CCompactBlock::GetShortIDKeys(uint64& k0, uint64& k1) const
+{
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << header << nNonce;
+    uint256 hash = ss.GetHash();
+    k0 = hash.Get64(0);
+    k1 = hash.Get64(1);
+}
+
+bool CPartialBlock::Init(const CCompactBlock& cmpctblock, CTxMemPool& pool)
+{
+    // No transaction is smaller than 60 bytes
+    unsigned int nTx = cmpctblock.GetTransactionCount();
+    if (nTx == 0 || nTx > MAX_BLOCK_SIZE / 60)
+        return false;
+
+    block = CBlock(cmpctblock.header);
+    block.vtx.resize(nTx);
+    vHave.assign(nTx, false);
+
+    // Prefilled transactions come in block order, short ids fill the gaps
+    unsigned int nNext = 0;
+    BOOST_FOREACH(const CPrefilledTransaction& prefilled, cmpctblock.vPrefilledTxn)
+    {
+        if (prefilled.nIndex < nNext || prefilled.nIndex >= nTx)
+            return false;
+        block.vtx[prefilled.nIndex] = prefilled.tx;
+        vHave[prefilled.nIndex] = true;
+        nNext = prefilled.nIndex + 1;
+    }
+
+    map<uint64, unsigned int> mapShortID;
+    for (unsigned int i = 0, j = 0; i < nTx; i++)
+        if (!vHave[i] && !mapShortID.insert(make_pair(cmpctblock.vShortTxID[j++], i)).second)
+            return false;
+
+    // Stop looking once everything is found, a collision with a later pool
+    // transaction then shows up as a merkle root mismatch
+    unsigned int nMissing = mapShortID.size();
+    uint64 k0, k1;
+    cmpctblock.GetShortIDKeys(k0, k1);
+    {
+        LOCK(pool.cs);
+        for (indexed_transaction_set::const_iterator mi = pool.mapTx.begin(); mi != pool.mapTx.end() && nMissing > 0; ++mi)
+        {
+            map<uint64, unsigned int>::iterator it = mapShortID.find(CCompactBlock::GetShortID(k0, k1, mi->GetHash()));
+            if (it == mapShortID.end())
+                continue;
+            unsigned int i = it->second;
+            if (vHave[i])
+            {
+                // Two pool transactions share this short id, ask for the right one
+                vHave[i] = false;
+                block.vtx[i].SetNull();
+                mapShortID.erase(it);
+                nMissing++;
+                continue;
+            }
+            block.vtx[i] = mi->GetTx();
+            vHave[i] = true;
+            nMissing--;
+        }
+    }
+    return true;
+}
+
+std::vector<unsigned int> CPartialBlock::GetMissing() const
+{
+    std::vector<unsigned int> vMissing;
+    for (unsigned int i = 0; i < vHave.size(); i++)
+        if (!vHave[i])
+            vMissing.push_back(i);
+    return vMissing;
+}
+
+bool CPartialBlock::FillMissing(const std::vector<CTransaction>& vtx)
+{
+    unsigned int j = 0;
+    for (unsigned int i = 0; i < vHave.size(); i++)
+    {
+        if (vHave[i])
+            continue;
+        if (j == vtx.size())
+            return false;
+        block.vtx[i] = vtx[j++];
+        vHave[i] = true;
+    }
+    return j == vtx.size();
+}
+
+bool CPartialBlock::IsValid() const
+{
+    if (vHave.empty() || std::find(vHave.begin(), vHave.end(), false) != vHave.end())
+        return false;
+    return block.BuildMerkleTree() == block.hashMerkleRoot;
+}
+
+
+
 
 
 
@@ -2729,6 +3874,8 @@ void UnloadBlockIndex()
     nBestInvalidWork = 0;
     hashBestChain = 0;
     pindexBest = NULL;
+    LOCK(mempool.cs);
+    blockassembler.Invalidate();
 }
 
 bool LoadBlockIndex()
@@ -2966,6 +4113,153 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
     return nLoaded > 0;
 }
 
+// Bumped when the layout of mempool.dat changes
+static const uint64 MEMPOOL_DUMP_VERSION = 2;
+// Transactions verified on the script check threads at a time
+static const unsigned int MEMPOOL_LOAD_BATCH = 1000;
+
+// Set once the pool was reloaded, so that a shutdown before that doesn't
+// overwrite mempool.dat with part of it
+static bool fMempoolLoaded = false;
+
+bool DumpMempool()
+{
+    if (!fMempoolLoaded)
+        return false;
+
+    int64 nStart = GetTimeMillis();
+    boost::filesystem::path pathMempool = GetDataDir() / "mempool.dat";
+    boost::filesystem::path pathTmp = GetDataDir() / "mempool.dat.new";
+    CAutoFile file(fopen(pathTmp.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+    if (!file)
+        return error("DumpMempool() : open failed");
+
+    unsigned int nCount = 0;
+    try {
+        LOCK(mempool.cs);
+        // Parents first, so that each transaction finds its inputs on reload
+        vector<CTxMemPool::txiter> vEntries;
+        vEntries.reserve(mempool.mapTx.size());
+        for (CTxMemPool::txiter it = mempool.mapTx.begin(); it != mempool.mapTx.end(); ++it)
+            vEntries.push_back(it);
+        std::sort(vEntries.begin(), vEntries.end(), CompareTxIterByAncestorCount());
+
+        file << MEMPOOL_DUMP_VERSION << (uint64)vEntries.size();
+        BOOST_FOREACH(CTxMemPool::txiter it, vEntries)
+            file << it->GetTx() << it->GetTime();
+        nCount = vEntries.size();
+        FileCommit(file);
+        file.fclose();
+    } catch (std::exception &e) {
+        return error("DumpMempool() : I/O error %s", e.what());
+    }
+    if (!RenameOver(pathTmp, pathMempool))
+        return error("DumpMempool() : rename failed");
+
+    printf("Dumped %u mempool transactions in %"PRI64d"ms\n", nCount, GetTimeMillis() - nStart);
+    return true;
+}
+
+// Verify the scripts of a batch of transactions on the script check
+// threads, so that accepting them one by one afterwards finds their
+// signatures in the cache
+static void PreverifyScripts(const vector<CTransaction>& vtx)
+{
+    if (!nScriptCheckThreads)
+        return;
+
+    vector<CScriptCheck> vChecks;
+    {
+        LOCK2(cs_main, mempool.cs);
+        CCoinsViewMemPool viewMemPool(*pcoinsTip, mempool);
+        CCoinsViewCache view(viewMemPool);
+        BOOST_FOREACH(const CTransaction& tx, vtx)
+        {
+            CValidationState state;
+            if (!tx.CheckInputs(state, view, true, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC | SCRIPT_VERIFY_DERSIG, &vChecks))
+                continue;
+            // Later ones of the batch may spend it
+            CTxUndo undo;
+            tx.UpdateCoins(state, view, undo, nBestHeight + 1, tx.GetHash());
+        }
+    }
+
+    // Whether they pass is left to the checks on acceptance
+    RunMempoolScriptChecks(vChecks);
+}
+
+bool LoadMempool()
+{
+    int64 nStart = GetTimeMillis();
+    CAutoFile file(fopen((GetDataDir() / "mempool.dat").string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    if (!file)
+    {
+        fMempoolLoaded = true;
+        return false;
+    }
+
+    int nAccepted = 0, nRejected = 0, nAlready = 0;
+    uint64 nCount = 0;
+    try {
+        uint64 nVersion;
+        file >> nVersion;
+        if (nVersion != MEMPOOL_DUMP_VERSION)
+        {
+            fMempoolLoaded = true;
+            return error("LoadMempool() : unknown version %"PRI64u, nVersion);
+        }
+        file >> nCount;
+    } catch (std::exception &e) {
+        printf("LoadMempool() : Deserialize or I/O error %s\n", e.what());
+    }
+
+    while (nCount > 0)
+    {
+        // What was read of a truncated file is still worth having
+        vector<CTransaction> vBatch;
+        vector<int64> vTime;
+        vBatch.reserve(std::min(nCount, (uint64)MEMPOOL_LOAD_BATCH));
+        vTime.reserve(vBatch.capacity());
+        try {
+            while (vBatch.size() < std::min(nCount, (uint64)MEMPOOL_LOAD_BATCH))
+            {
+                vBatch.push_back(CTransaction());
+                vTime.push_back(0);
+                file >> vBatch.back() >> vTime.back();
+            }
+            nCount -= vBatch.size();
+        } catch (std::exception &e) {
+            printf("LoadMempool() : Deserialize or I/O error %s\n", e.what());
+            vBatch.pop_back();
+            vTime.pop_back();
+            nCount = 0;
+        }
+
+        boost::this_thread::interruption_point();
+
+        // Accepting takes cs_main only around looking up the inputs and
+        // adding to the pool, the scripts are checked without it. The fee
+        // limits are those of a transaction relayed to us now, the time
+        // that of when it first came in.
+        PreverifyScripts(vBatch);
+        for (unsigned int i = 0; i < vBatch.size(); i++)
+        {
+            CValidationState state;
+            if (mempool.exists(vBatch[i].GetHash()))
+                nAlready++;
+            else if (vBatch[i].AcceptToMemoryPool(state, true, true, NULL, vTime[i]))
+                nAccepted++;
+            else
+                nRejected++;
+        }
+    }
+    fMempoolLoaded = true;
+
+    printf("Loaded mempool transactions from disk: %d accepted, %d rejected, %d already there (%"PRI64d"ms)\n",
+           nAccepted, nRejected, nAlready, GetTimeMillis() - nStart);
+    return true;
+}
+
 
 
 
@@ -3055,10 +4349,16 @@ bool static AlreadyHave(const CInv& inv)
                 LOCK(mempool.cs);
                 txInMap = mempool.exists(inv.hash);
             }
-            return txInMap || mapOrphanTransactions.count(inv.hash) ||
+            bool txInOrphans = false;
+            {
+                LOCK(cs_orphans);
+                txInOrphans = mapOrphanTransactions.count(inv.hash);
+            }
+            return txInMap || txInOrphans ||
                 pcoinsTip->HaveCoins(inv.hash);
         }
     case MSG_BLOCK:
+    case MSG_CMPCT_BLOCK:
         return mapBlockIndex.count(inv.hash) ||
                mapOrphanBlocks.count(inv.hash);
     }
@@ -3075,6 +4375,128 @@ bool static AlreadyHave(const CInv& inv)
 unsigned char pchMessageStart[4] = { 0xf9, 0xbe, 0xb4, 0xd9 };
 
 
+// Read a block from its blk?????.dat file as a complete "block" message,
+// without deserializing it. The block data on disk is preceded by the
+// network magic and its size, see CBlock::WriteToDisk.
+bool ReadBlockMessage(const CBlockIndex* pindex, CSerializeData& vMsg)
+{
+    CDiskBlockPos pos = pindex->GetBlockPos();
+    if (pos.nPos < sizeof(unsigned int))
+        return error("ReadBlockMessage() : bad block position");
+    CAutoFile filein = CAutoFile(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return error("ReadBlockMessage() : OpenBlockFile failed");
+    if (fseek(filein, pos.nPos - sizeof(unsigned int), SEEK_SET))
+        return error("ReadBlockMessage() : fseek failed");
+
+    unsigned int nSize = 0;
+    try {
+        filein >> nSize;
+    }
+    catch (std::exception &e) {
+        return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+    }
+    if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
+        return error("ReadBlockMessage() : bad block size %u", nSize);
+
+    vMsg.resize(CMessageHeader::HEADER_SIZE + nSize);
+    char* pchBlock = &vMsg[CMessageHeader::HEADER_SIZE];
+    if (fread(pchBlock, 1, nSize, filein) != nSize)
+        return error("ReadBlockMessage() : I/O error");
+
+    // Make sure this is the block we were asked for
+    if (Hash(pchBlock, pchBlock + 80) != pindex->GetBlockHash())
+        return error("ReadBlockMessage() : block hash mismatch");
+
+    CMessageHeader hdr("block", nSize);
+    uint256 hash = Hash(pchBlock, pchBlock + nSize);
+    memcpy(&hdr.nChecksum, &hash, sizeof(hdr.nChecksum));
+    CDataStream ssHeader(SER_NETWORK, PROTOCOL_VERSION);
+    ssHeader << hdr;
+    assert(ssHeader.size() == CMessageHeader::HEADER_SIZE);
+    memcpy(&vMsg[0], &ssHeader[0], CMessageHeader::HEADER_SIZE);
+    return true;
+}
+
+// Blocks near the tip are typically requested by many peers right after they
+// were found, keep the last few served in their message form
+class CBlockMessageCache
+{
+private:
+    typedef std::list<std::pair<uint256, boost::shared_ptr<const CSerializeData> > > list_type;
+    list_type listMsg; // most recently used first
+    std::map<uint256, list_type::iterator> mapMsg;
+    size_t nBytes;
+    size_t nMaxBytes;
+    CCriticalSection cs;
+
+public:
+    CBlockMessageCache(size_t nMaxBytesIn) : nBytes(0), nMaxBytes(nMaxBytesIn) {}
+
+    boost::shared_ptr<const CSerializeData> Get(const uint256& hash)
+    {
+        LOCK(cs);
+        std::map<uint256, list_type::iterator>::iterator mi = mapMsg.find(hash);
+        if (mi == mapMsg.end())
+            return boost::shared_ptr<const CSerializeData>();
+        listMsg.splice(listMsg.begin(), listMsg, mi->second);
+        return mi->second->second;
+    }
+
+    void Insert(const uint256& hash, const boost::shared_ptr<const CSerializeData>& pmsg)
+    {
+        LOCK(cs);
+        if (mapMsg.count(hash))
+            return;
+        listMsg.push_front(std::make_pair(hash, pmsg));
+        mapMsg[hash] = listMsg.begin();
+        nBytes += pmsg->size();
+        while (nBytes > nMaxBytes && listMsg.size() > 1)
+        {
+            nBytes -= listMsg.back().second->size();
+            mapMsg.erase(listMsg.back().first);
+            listMsg.pop_back();
+        }
+    }
+};
+
+static CBlockMessageCache blockMessageCache(8 * MAX_BLOCK_SIZE);
+
+// A block with the filter data of its transactions, for serving it to the
+// SPV peers that all fetch a new tip filtered
+struct CFilteredBlockData
+{
+    CBlock block;
+    std::vector<CBloomTxElements> vElements;
+};
+
+static boost::shared_ptr<const CFilteredBlockData> pfilteredBlockLast;
+static CCriticalSection cs_filteredBlockLast;
+
+static boost::shared_ptr<const CFilteredBlockData> GetFilteredBlockData(CBlockIndex* pindex, bool fCache)
+{
+    uint256 hash = pindex->GetBlockHash();
+    {
+        LOCK(cs_filteredBlockLast);
+        if (pfilteredBlockLast && pfilteredBlockLast->block.GetHash() == hash)
+            return pfilteredBlockLast;
+    }
+
+    CFilteredBlockData* pdata = new CFilteredBlockData();
+    boost::shared_ptr<const CFilteredBlockData> ret(pdata);
+    pdata->block.ReadFromDisk(pindex);
+    pdata->vElements.reserve(pdata->block.vtx.size());
+    BOOST_FOREACH(const CTransaction& tx, pdata->block.vtx)
+        pdata->vElements.push_back(CBloomTxElements(tx, tx.GetHash()));
+    if (fCache)
+    {
+        LOCK(cs_filteredBlockLast);
+        pfilteredBlockLast = ret;
+    }
+    return ret;
+}
+
+// Called without cs_main
 void static ProcessGetData(CNode* pfrom)
 {
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
@@ -3083,7 +4505,7 @@ void static ProcessGetData(CNode* pfrom)
 
     while (it != pfrom->vRecvGetData.end()) {
         // Don't bother if send buffer is too full to respond anyway
-        if (pfrom->nSendSize >= SendBufferSize())
+        if (pfrom->IsSendBufferFull())
             break;
 
         const CInv &inv = *it;
@@ -3091,22 +4513,55 @@ void static ProcessGetData(CNode* pfrom)
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
             {
-                // Send block from disk
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
-                if (mi != mapBlockIndex.end())
+                // Send block from disk. Only the index lookup needs cs_main,
+                // block index entries are never freed and the read happens
+                // without it so other peers aren't held up.
+                CBlockIndex* pindex = NULL;
+                uint256 hashBest;
+                int nBest = 0;
                 {
-                    CBlock block;
-                    block.ReadFromDisk((*mi).second);
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
+                    LOCK(cs_main);
+                    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
+                    if (mi != mapBlockIndex.end())
+                        pindex = (*mi).second;
+                    hashBest = hashBestChain;
+                    nBest = nBestHeight;
+                }
+                if (pindex)
+                {
+                    // Only blocks near the tip are likely to be in the peer's memory pool
+                    if (inv.type == MSG_CMPCT_BLOCK && pindex->nHeight > nBest - 10)
+                    {
+                        CBlock block;
+                        if (block.ReadFromDisk(pindex))
+                            pfrom->PushMessage("cmpctblock", CCompactBlock(block, GetRand(~(uint64)0)));
+                    }
+                    else if (inv.type == MSG_BLOCK || inv.type == MSG_CMPCT_BLOCK)
+                    {
+                        // Blocks are sent as stored, cached if near the tip
+                        boost::shared_ptr<const CSerializeData> pmsg = blockMessageCache.Get(inv.hash);
+                        if (!pmsg)
+                        {
+                            CSerializeData* pmsgNew = new CSerializeData();
+                            pmsg.reset(pmsgNew);
+                            if (!ReadBlockMessage(pindex, *pmsgNew))
+                                pmsg.reset();
+                            else if (pindex->nHeight > nBest - 6)
+                                blockMessageCache.Insert(inv.hash, pmsg);
+                        }
+                        if (pmsg)
+                            pfrom->PushFramedMessage(pmsg);
+                    }
                     else // MSG_FILTERED_BLOCK)
                     {
+                        boost::shared_ptr<const CFilteredBlockData> pdata = GetFilteredBlockData(pindex, pindex->nHeight > nBest - 6);
+                        const CBlock& block = pdata->block;
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter)
                         {
-                            CMerkleBlock merkleBlock(block, *pfrom->pfilter);
+                            CMerkleBlock merkleBlock(block, pdata->vElements, *pfrom->pfilter);
                             pfrom->PushMessage("merkleblock", merkleBlock);
                             // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
                             // This avoids hurting performance by pointlessly requiring a round-trip
@@ -3116,7 +4571,7 @@ void static ProcessGetData(CNode* pfrom)
                             // however we MUST always provide at least what the remote peer needs
                             typedef std::pair<unsigned int, uint256> PairType;
                             BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
+                                if (!pfrom->IsInventoryKnown(CInv(MSG_TX, pair.second)))
                                     pfrom->PushMessage("tx", block.vtx[pair.first]);
                         }
                         // else
@@ -3130,7 +4585,7 @@ void static ProcessGetData(CNode* pfrom)
                         // and we want it right after the last block so they don't
                         // wait for other stuff first.
                         vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, hashBestChain));
+                        vInv.push_back(CInv(MSG_BLOCK, hashBest));
                         pfrom->PushMessage("inv", vInv);
                         pfrom->hashContinue = 0;
                     }
@@ -3140,11 +4595,10 @@ void static ProcessGetData(CNode* pfrom)
             {
                 // Send stream from relay memory
                 bool pushed = false;
-                {
-                    LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
-                    if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+                if (inv.type == MSG_TX) {
+                    boost::shared_ptr<const CSerializeData> pmsg = GetRelayedTransaction(inv.hash);
+                    if (pmsg) {
+                        pfrom->PushFramedMessage(pmsg);
                         pushed = true;
                     }
                 }
@@ -3167,7 +4621,7 @@ void static ProcessGetData(CNode* pfrom)
             // Track requests for our stuff.
             Inventory(inv.hash);
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
                 break;
         }
     }
@@ -3186,6 +4640,69 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
+void static ProcessReceivedBlock(CNode* pfrom, CBlock& block)
+{
+    CInv inv(MSG_BLOCK, block.GetHash());
+    pfrom->AddInventoryKnown(inv);
+
+    CValidationState state;
+    if (ProcessBlock(state, pfrom, &block) || state.CorruptionPossible())
+    {
+        mapAlreadyAskedFor.erase(inv);
+    }
+    int nDoS = 0;
+    if (state.IsInvalid(nDoS))
+        if (nDoS > 0)
+            pfrom->Misbehaving(nDoS);
+}
+
+void static RequestFullBlock(CNode* pfrom, const uint256& hash)
+{
+    vector<CInv> vGetData(1, CInv(MSG_BLOCK, hash));
+    pfrom->PushMessage("getdata", vGetData);
+}
+
+// A compact block whose transactions don't hash to its merkle root had a
+// short id collision, or a peer sent the wrong transactions. Either way
+// the block is downloaded in full.
+void static ProcessPartialBlock(CNode* pfrom, CPartialBlock& partial)
+{
+    uint256 hash = partial.block.GetHash();
+    if (!partial.IsValid())
+    {
+        printf("compact block %s doesn't match its header, requesting it in full\n", hash.ToString().c_str());
+        RequestFullBlock(pfrom, hash);
+        return;
+    }
+    printf("reconstructed block %s\n", hash.ToString().c_str());
+    ProcessReceivedBlock(pfrom, partial.block);
+}
+
+// Salts for the deterministic relay choices below. Messages are handled on
+// several threads, so they are picked once, before first use, by call_once.
+static boost::once_flag relaySaltInitFlag = BOOST_ONCE_INIT;
+static uint256 hashAddrRelaySalt;
+static uint256 hashTrickleSalt;
+
+static void RelaySaltInit()
+{
+    hashAddrRelaySalt = GetRandHash();
+    hashTrickleSalt = GetRandHash();
+}
+
+// Messages that only touch the sending peer, the address manager, or data
+// with locks of its own. These are handled without cs_main, so they aren't
+// held up by block validation or by other peers' chain requests. "tx" takes
+// cs_main itself, but not while its scripts are checked.
+static bool IsMessageWithoutChainState(const string& strCommand)
+{
+    return strCommand == "verack" || strCommand == "ping" || strCommand == "addr" ||
+           strCommand == "getaddr" || strCommand == "getdata" || strCommand == "filterload" ||
+           strCommand == "filteradd" || strCommand == "filterclear" || strCommand == "sendcmpct" ||
+           strCommand == "getblocktxn" || strCommand == "tx";
+}
+
+// Requires LOCK(cs_main) unless IsMessageWithoutChainState(strCommand)
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 {
     RandAddSeedPerfmon();
@@ -3316,6 +4833,17 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     else if (strCommand == "verack")
     {
         pfrom->SetRecvVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
+
+        // Let the peer know it can send us new blocks as compact blocks
+        if (GetBoolArg("-compactblocks", true) && pfrom->nVersion >= COMPACT_BLOCKS_VERSION)
+            pfrom->PushMessage("sendcmpct");
+    }
+
+
+    else if (strCommand == "sendcmpct")
+    {
+        if (pfrom->nVersion >= COMPACT_BLOCKS_VERSION)
+            pfrom->fCompactBlocks = true;
     }
 
 
@@ -3352,11 +4880,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                     LOCK(cs_vNodes);
                     // Use deterministic randomness to send to the same nodes for 24 hours
                     // at a time so the setAddrKnowns of the chosen nodes prevent repeats
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        hashSalt = GetRandHash();
+                    boost::call_once(&RelaySaltInit, relaySaltInitFlag);
                     uint64 hashAddr = addr.GetHash();
-                    uint256 hashRand = hashSalt ^ (hashAddr<<32) ^ ((GetTime()+hashAddr)/(24*60*60));
+                    uint256 hashRand = hashAddrRelaySalt ^ (hashAddr<<32) ^ ((GetTime()+hashAddr)/(24*60*60));
                     hashRand = Hash(BEGIN(hashRand), END(hashRand));
                     multimap<uint256, CNode*> mapMix;
                     BOOST_FOREACH(CNode* pnode, vNodes)
@@ -3398,12 +4924,18 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
         // find last block in inv vector
         unsigned int nLastBlock = (unsigned int)(-1);
+        unsigned int nBlocks = 0;
         for (unsigned int nInv = 0; nInv < vInv.size(); nInv++) {
             if (vInv[vInv.size() - 1 - nInv].type == MSG_BLOCK) {
-                nLastBlock = vInv.size() - 1 - nInv;
-                break;
+                if (nBlocks++ == 0)
+                    nLastBlock = vInv.size() - 1 - nInv;
             }
         }
+
+        // A single block is the announcement of a new one rather than an
+        // answer to getblocks, we most likely have its transactions already
+        bool fCompact = nBlocks == 1 && pfrom->fCompactBlocks && GetBoolArg("-compactblocks", true) &&
+                        !IsInitialBlockDownload();
         for (unsigned int nInv = 0; nInv < vInv.size(); nInv++)
         {
             const CInv &inv = vInv[nInv];
@@ -3416,8 +4948,13 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 printf("  got inventory: %s  %s\n", inv.ToString().c_str(), fAlreadyHave ? "have" : "new");
 
             if (!fAlreadyHave) {
-                if (!fImporting && !fReindex)
+                if (!fImporting && !fReindex) {
+                    // Asked for by block hash either way, so that other
+                    // peers' announcements of the block wait for this one
                     pfrom->AskFor(inv);
+                    if (fCompact && inv.type == MSG_BLOCK)
+                        pfrom->setAskForCompact.insert(inv.hash);
+                }
             } else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash)) {
                 pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(mapOrphanBlocks[inv.hash]));
             } else if (nInv == nLastBlock) {
@@ -3529,10 +5066,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
     else if (strCommand == "tx")
     {
-        vector<uint256> vWorkQueue;
-        vector<uint256> vEraseQueue;
-        CDataStream vMsg(vRecv);
-        CTransaction tx;
+        // Kept as is if it turns out to be an orphan
+        boost::shared_ptr<CTransaction> ptx(new CTransaction());
+        CTransaction& tx = *ptx;
         vRecv >> tx;
 
         CInv inv(MSG_TX, tx.GetHash());
@@ -3543,57 +5079,24 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         if (tx.AcceptToMemoryPool(state, true, true, &fMissingInputs))
         {
             RelayTransaction(tx, inv.hash);
-            mapAlreadyAskedFor.erase(inv);
-            vWorkQueue.push_back(inv.hash);
-            vEraseQueue.push_back(inv.hash);
+            {
+                LOCK(cs_main);
+                mapAlreadyAskedFor.erase(inv);
+            }
 
             printf("AcceptToMemoryPool: %s %s : accepted %s (poolsz %"PRIszu")\n",
                 pfrom->addr.ToString().c_str(), pfrom->cleanSubVer.c_str(),
                 tx.GetHash().ToString().c_str(),
-                mempool.mapTx.size());
-
-            // Recursively process any orphan transactions that depended on this one
-            for (unsigned int i = 0; i < vWorkQueue.size(); i++)
-            {
-                uint256 hashPrev = vWorkQueue[i];
-                for (set<uint256>::iterator mi = mapOrphanTransactionsByPrev[hashPrev].begin();
-                     mi != mapOrphanTransactionsByPrev[hashPrev].end();
-                     ++mi)
-                {
-                    const uint256& orphanHash = *mi;
-                    const CTransaction& orphanTx = mapOrphanTransactions[orphanHash];
-                    bool fMissingInputs2 = false;
-                    // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
-                    // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
-                    // anyone relaying LegitTxX banned)
-                    CValidationState stateDummy;
-
-                    if (tx.AcceptToMemoryPool(stateDummy, true, true, &fMissingInputs2))
-                    {
-                        printf("   accepted orphan tx %s\n", orphanHash.ToString().c_str());
-                        RelayTransaction(orphanTx, orphanHash);
-                        mapAlreadyAskedFor.erase(CInv(MSG_TX, orphanHash));
-                        vWorkQueue.push_back(orphanHash);
-                        vEraseQueue.push_back(orphanHash);
-                    }
-                    else if (!fMissingInputs2)
-                    {
-                        // invalid or too-little-fee orphan
-                        vEraseQueue.push_back(orphanHash);
-                        printf("   removed orphan tx %s\n", orphanHash.ToString().c_str());
-                    }
-                }
-            }
+                mempool.size());
 
-            BOOST_FOREACH(uint256 hash, vEraseQueue)
-                EraseOrphanTx(hash);
+            ProcessOrphansOf(inv.hash);
         }
         else if (fMissingInputs)
         {
-            AddOrphanTx(tx);
+            AddOrphanTx(ptx, pfrom->id);
 
             // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
-            unsigned int nEvicted = LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS);
+            unsigned int nEvicted = LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS, MAX_ORPHAN_BYTES);
             if (nEvicted > 0)
                 printf("mapOrphan overflow, removed %u tx\n", nEvicted);
         }
@@ -3616,22 +5119,119 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         printf("received block %s\n", block.GetHash().ToString().c_str());
         // block.print();
 
-        CInv inv(MSG_BLOCK, block.GetHash());
+        ProcessReceivedBlock(pfrom, block);
+    }
+
+
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex)
+    {
+        CCompactBlock cmpctblock;
+        vRecv >> cmpctblock;
+
+        uint256 hash = cmpctblock.header.GetHash();
+        printf("received compact block %s (%"PRIszu" short ids)\n", hash.ToString().c_str(), cmpctblock.vShortTxID.size());
+
+        CInv inv(MSG_BLOCK, hash);
         pfrom->AddInventoryKnown(inv);
+        if (AlreadyHave(inv) || mapPartialBlocks.count(hash))
+            return true;
 
-        CValidationState state;
-        if (ProcessBlock(state, pfrom, &block) || state.CorruptionPossible())
-            mapAlreadyAskedFor.erase(inv);
-        int nDoS = 0;
-        if (state.IsInvalid(nDoS))
-            if (nDoS > 0)
-                pfrom->Misbehaving(nDoS);
+        // Don't go through the memory pool for junk
+        if (!CheckProofOfWork(hash, cmpctblock.header.nBits))
+        {
+            pfrom->Misbehaving(50);
+            return error("message cmpctblock : proof of work failed");
+        }
+
+        CPartialBlock partial;
+        if (mapPartialBlocks.size() >= MAX_PARTIAL_BLOCKS || !partial.Init(cmpctblock, mempool))
+        {
+            RequestFullBlock(pfrom, hash);
+            return true;
+        }
+
+        vector<unsigned int> vMissing = partial.GetMissing();
+        if (vMissing.empty())
+        {
+            ProcessPartialBlock(pfrom, partial);
+            return true;
+        }
+
+        if (fDebug)
+            printf("compact block %s : requesting %"PRIszu" of %"PRIszu" transactions\n", hash.ToString().c_str(),
+                   vMissing.size(), partial.block.vtx.size());
+        CBlockTransactionsRequest req;
+        req.blockhash = hash;
+        req.vIndexes.swap(vMissing);
+        pfrom->PushMessage("getblocktxn", req);
+
+        partial.nodeFrom = pfrom->id;
+        partial.nTime = GetTime();
+        mapPartialBlocks[hash] = partial;
+    }
+
+
+    else if (strCommand == "getblocktxn")
+    {
+        CBlockTransactionsRequest req;
+        vRecv >> req;
+
+        // Only answered for blocks recent enough to be sent compact
+        CBlockIndex* pindex = NULL;
+        {
+            LOCK(cs_main);
+            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(req.blockhash);
+            if (mi != mapBlockIndex.end() && mi->second->nHeight > nBestHeight - 10)
+                pindex = mi->second;
+        }
+        CBlock block;
+        if (!pindex || !block.ReadFromDisk(pindex))
+            return true;
+
+        CBlockTransactions resp;
+        resp.blockhash = req.blockhash;
+        resp.vtx.reserve(req.vIndexes.size());
+        BOOST_FOREACH(unsigned int nIndex, req.vIndexes)
+        {
+            if (nIndex >= block.vtx.size())
+            {
+                pfrom->Misbehaving(100);
+                return error("message getblocktxn : index %u out of range", nIndex);
+            }
+            resp.vtx.push_back(block.vtx[nIndex]);
+        }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex)
+    {
+        CBlockTransactions resp;
+        vRecv >> resp;
+
+        // Ignore transactions we didn't ask this peer for
+        map<uint256, CPartialBlock>::iterator mi = mapPartialBlocks.find(resp.blockhash);
+        if (mi == mapPartialBlocks.end() || mi->second.nodeFrom != pfrom->id)
+            return true;
+        CPartialBlock partial = mi->second;
+        mapPartialBlocks.erase(mi);
+
+        if (!partial.FillMissing(resp.vtx))
+        {
+            pfrom->Misbehaving(10);
+            RequestFullBlock(pfrom, resp.blockhash);
+            return error("message blocktxn : wrong number of transactions");
+        }
+        ProcessPartialBlock(pfrom, partial);
     }
 
 
     else if (strCommand == "getaddr")
     {
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_addrKnown);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             pfrom->PushAddress(addr);
@@ -3798,7 +5398,7 @@ bool ProcessMessages(CNode* pfrom)
     std::deque<CNetMessage>::iterator it = pfrom->vRecvMsg.begin();
     while (!pfrom->fDisconnect && it != pfrom->vRecvMsg.end()) {
         // Don't bother if send buffer is too full to respond anyway
-        if (pfrom->nSendSize >= SendBufferSize())
+        if (pfrom->IsSendBufferFull())
             break;
 
         // get next message
@@ -3851,6 +5451,9 @@ bool ProcessMessages(CNode* pfrom)
         bool fRet = false;
         try
         {
+            if (IsMessageWithoutChainState(strCommand))
+                fRet = ProcessMessage(pfrom, strCommand, vRecv);
+            else
             {
                 LOCK(cs_main);
                 fRet = ProcessMessage(pfrom, strCommand, vRecv);
@@ -3891,12 +5494,27 @@ bool ProcessMessages(CNode* pfrom)
 
     // In case the connection got shut down, its receive buffer was wiped
     if (!pfrom->fDisconnect)
-        pfrom->vRecvMsg.erase(pfrom->vRecvMsg.begin(), it);
+        pfrom->EraseRecvMsg(it);
 
     return fOk;
 }
 
 
+// Transaction invs are trickled out to one peer at a time to protect the
+// privacy of where they came from, except for 1/4 that go to everyone
+// immediately. Our own transactions are always trickled.
+bool IsTrickledTransaction(const uint256& hash)
+{
+    boost::call_once(&RelaySaltInit, relaySaltInitFlag);
+    uint256 hashRand = hash ^ hashTrickleSalt;
+    hashRand = Hash(BEGIN(hashRand), END(hashRand));
+    if ((hashRand & 3) != 0)
+        return true;
+
+    CWalletTx wtx;
+    return GetTransaction(hash, wtx) && wtx.fFromMe;
+}
+
 bool SendMessages(CNode* pto, bool fSendTrickle)
 {
     TRY_LOCK(cs_main, lockMain);
@@ -3915,6 +5533,25 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 pto->PushMessage("ping");
         }
 
+        // Compact blocks whose missing transactions didn't come: get them
+        // in full from this peer, and forget those of peers that are gone
+        {
+            int64 nNow = GetTime();
+            for (map<uint256, CPartialBlock>::iterator mi = mapPartialBlocks.begin(); mi != mapPartialBlocks.end(); )
+            {
+                if (mi->second.nodeFrom == pto->id && mi->second.nTime < nNow - PARTIAL_BLOCK_TIMEOUT)
+                {
+                    printf("compact block %s : no transactions from peer, requesting it in full\n", mi->first.ToString().c_str());
+                    RequestFullBlock(pto, mi->first);
+                    mapPartialBlocks.erase(mi++);
+                }
+                else if (mi->second.nTime < nNow - PARTIAL_BLOCK_EXPIRY)
+                    mapPartialBlocks.erase(mi++);
+                else
+                    ++mi;
+            }
+        }
+
         // Start block sync
         if (pto->fStartSync && !fImporting && !fReindex) {
             pto->fStartSync = false;
@@ -3939,7 +5576,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 {
                     // Periodically clear setAddrKnown to allow refresh broadcasts
                     if (nLastRebroadcast)
+                    {
+                        LOCK(pnode->cs_addrKnown);
                         pnode->setAddrKnown.clear();
+                    }
 
                     // Rebroadcast our address
                     if (!fNoListen)
@@ -3958,25 +5598,24 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         if (fSendTrickle)
         {
-            vector<CAddress> vAddr;
-            vAddr.reserve(pto->vAddrToSend.size());
-            BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
+            vector<CAddress> vAddrNew;
             {
-                // returns true if wasn't already contained in the set
-                if (pto->setAddrKnown.insert(addr).second)
+                LOCK(pto->cs_addrKnown);
+                vAddrNew.reserve(pto->vAddrToSend.size());
+                BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
                 {
-                    vAddr.push_back(addr);
-                    // receiver rejects addr messages larger than 1000
-                    if (vAddr.size() >= 1000)
-                    {
-                        pto->PushMessage("addr", vAddr);
-                        vAddr.clear();
-                    }
+                    // returns true if wasn't already contained in the set
+                    if (pto->setAddrKnown.insert(addr).second)
+                        vAddrNew.push_back(addr);
                 }
+                pto->vAddrToSend.clear();
             }
-            pto->vAddrToSend.clear();
-            if (!vAddr.empty())
+            // receiver rejects addr messages larger than 1000
+            for (unsigned int i = 0; i < vAddrNew.size(); i += 1000)
+            {
+                vector<CAddress> vAddr(vAddrNew.begin() + i, vAddrNew.begin() + min(i + 1000, (unsigned int)vAddrNew.size()));
                 pto->PushMessage("addr", vAddr);
+            }
         }
 
 
@@ -3984,55 +5623,29 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Message: inventory
         //
         vector<CInv> vInv;
-        vector<CInv> vInvWait;
         {
             LOCK(pto->cs_inventory);
-            vInv.reserve(pto->vInventoryToSend.size());
-            vInvWait.reserve(pto->vInventoryToSend.size());
+            // Which transactions wait for a trickle turn was decided when
+            // they were relayed (see IsTrickledTransaction)
+            if (fSendTrickle)
+            {
+                pto->vInventoryToSend.insert(pto->vInventoryToSend.end(), pto->vInventoryToTrickle.begin(), pto->vInventoryToTrickle.end());
+                pto->vInventoryToTrickle.clear();
+            }
+            vInv.reserve(min(pto->vInventoryToSend.size(), (size_t)1000));
             BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
             {
-                if (pto->setInventoryKnown.count(inv))
+                if (pto->filterInventoryKnown.contains(inv.hash))
                     continue;
-
-                // trickle out tx inv to protect privacy
-                if (inv.type == MSG_TX && !fSendTrickle)
-                {
-                    // 1/4 of tx invs blast to all immediately
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        hashSalt = GetRandHash();
-                    uint256 hashRand = inv.hash ^ hashSalt;
-                    hashRand = Hash(BEGIN(hashRand), END(hashRand));
-                    bool fTrickleWait = ((hashRand & 3) != 0);
-
-                    // always trickle our own transactions
-                    if (!fTrickleWait)
-                    {
-                        CWalletTx wtx;
-                        if (GetTransaction(inv.hash, wtx))
-                            if (wtx.fFromMe)
-                                fTrickleWait = true;
-                    }
-
-                    if (fTrickleWait)
-                    {
-                        vInvWait.push_back(inv);
-                        continue;
-                    }
-                }
-
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second)
+                pto->filterInventoryKnown.insert(inv.hash);
+                vInv.push_back(inv);
+                if (vInv.size() >= 1000)
                 {
-                    vInv.push_back(inv);
-                    if (vInv.size() >= 1000)
-                    {
-                        pto->PushMessage("inv", vInv);
-                        vInv.clear();
-                    }
+                    pto->PushMessage("inv", vInv);
+                    vInv.clear();
                 }
             }
-            pto->vInventoryToSend = vInvWait;
+            pto->vInventoryToSend.clear();
         }
         if (!vInv.empty())
             pto->PushMessage("inv", vInv);
@@ -4045,7 +5658,9 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         int64 nNow = GetTime() * 1000000;
         while (!pto->mapAskFor.empty() && (*pto->mapAskFor.begin()).first <= nNow)
         {
-            const CInv& inv = (*pto->mapAskFor.begin()).second;
+            CInv inv = (*pto->mapAskFor.begin()).second;
+            if (inv.type == MSG_BLOCK && pto->setAskForCompact.erase(inv.hash))
+                inv.type = MSG_CMPCT_BLOCK;
             if (!AlreadyHave(inv))
             {
                 if (fDebugNet)
@@ -4126,22 +5741,18 @@ void SHA256Transform(void* pstate, void* pinput, const void* pinit)
 // All input buffers are 16-byte aligned.  nNonce is usually preserved
 // between calls, but periodically or if nNonce is 0xffff0000 or above,
 // the block is rebuilt and nNonce starts over at zero.
+// The hashing is done by SHA256ScanNonces, which tries several nonces
+// per pass against the shared midstate when the CPU supports it.
 //
-unsigned int static ScanHash_CryptoPP(char* pmidstate, char* pdata, char* phash1, char* phash, unsigned int& nHashesDone)
+unsigned int static ScanHash(char* pmidstate, char* pdata, char* phash, unsigned int& nHashesDone)
 {
     unsigned int& nNonce = *(unsigned int*)(pdata + 12);
     for (;;)
     {
-        // Crypto++ SHA256
-        // Hash pdata using pmidstate as the starting state into
-        // pre-formatted buffer phash1, then hash phash1 into phash
-        nNonce++;
-        SHA256Transform(phash1, pdata, pmidstate);
-        SHA256Transform(phash, phash1, pSHA256InitState);
-
         // Return the nonce if the hash has at least some zero bits,
         // caller will check if it has enough to reach the target
-        if (((unsigned short*)phash)[14] == 0)
+        unsigned int nCount = 0x1000 - (nNonce & 0xfff);
+        if (SHA256ScanNonces((const uint32_t*)pmidstate, (const uint32_t*)pdata, nNonce, nCount, (uint32_t*)phash))
             return nNonce;
 
         // If nothing found after trying for a while, return -1
@@ -4150,88 +5761,17 @@ unsigned int static ScanHash_CryptoPP(char* pmidstate, char* pdata, char* phash1
             nHashesDone = 0xffff+1;
             return (unsigned int) -1;
         }
-        if ((nNonce & 0xfff) == 0)
-            boost::this_thread::interruption_point();
+        boost::this_thread::interruption_point();
     }
 }
 
-// Some explaining would be appreciated
-class COrphan
-{
-public:
-    CTransaction* ptx;
-    set<uint256> setDependsOn;
-    double dPriority;
-    double dFeePerKb;
-
-    COrphan(CTransaction* ptxIn)
-    {
-        ptx = ptxIn;
-        dPriority = dFeePerKb = 0;
-    }
-
-    void print() const
-    {
-        printf("COrphan(hash=%s, dPriority=%.1f, dFeePerKb=%.1f)\n",
-               ptx->GetHash().ToString().c_str(), dPriority, dFeePerKb);
-        BOOST_FOREACH(uint256 hash, setDependsOn)
-            printf("   setDependsOn %s\n", hash.ToString().c_str());
-    }
-};
-
-
 uint64 nLastBlockTx = 0;
 uint64 nLastBlockSize = 0;
 
-// We want to sort transactions by priority and fee, so:
-typedef boost::tuple<double, double, CTransaction*> TxPriority;
-class TxPriorityCompare
-{
-    bool byFee;
-public:
-    TxPriorityCompare(bool _byFee) : byFee(_byFee) { }
-    bool operator()(const TxPriority& a, const TxPriority& b)
-    {
-        if (byFee)
-        {
-            if (a.get<1>() == b.get<1>())
-                return a.get<0>() < b.get<0>();
-            return a.get<1>() < b.get<1>();
-        }
-        else
-        {
-            if (a.get<0>() == b.get<0>())
-                return a.get<1>() < b.get<1>();
-            return a.get<0>() < b.get<0>();
-        }
-    }
-};
-
-CBlockTemplate* CreateNewBlock(CReserveKey& reservekey)
+static void GetBlockSizeLimits(unsigned int& nBlockMaxSize, unsigned int& nBlockPrioritySize, unsigned int& nBlockMinSize)
 {
-    // Create new block
-    auto_ptr<CBlockTemplate> pblocktemplate(new CBlockTemplate());
-    if(!pblocktemplate.get())
-        return NULL;
-    CBlock *pblock = &pblocktemplate->block; // pointer for convenience
-
-    // Create coinbase tx
-    CTransaction txNew;
-    txNew.vin.resize(1);
-    txNew.vin[0].prevout.SetNull();
-    txNew.vout.resize(1);
-    CPubKey pubkey;
-    if (!reservekey.GetReservedKey(pubkey))
-        return NULL;
-    txNew.vout[0].scriptPubKey << pubkey << OP_CHECKSIG;
-
-    // Add our coinbase tx as first transaction
-    pblock->vtx.push_back(txNew);
-    pblocktemplate->vTxFees.push_back(-1); // updated at end
-    pblocktemplate->vTxSigOps.push_back(-1); // updated at end
-
     // Largest block you're willing to create:
-    unsigned int nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
+    nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
     // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
     nBlockMaxSize = std::max((unsigned int)1000, std::min((unsigned int)(MAX_BLOCK_SIZE-1000), nBlockMaxSize));
 
@@ -4241,221 +5781,409 @@ CBlockTemplate* CreateNewBlock(CReserveKey& reservekey)
 
     // How much of the block should be dedicated to high-priority transactions,
     // included regardless of the fees they pay
-    unsigned int nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
+    nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
     nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
 
     // Minimum block size you want to create; block will be filled with free transactions
     // until there are no more or the block reaches this size:
-    unsigned int nBlockMinSize = GetArg("-blockminsize", 0);
+    nBlockMinSize = GetArg("-blockminsize", 0);
     nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
+}
 
-    // Collect memory pool transactions into the block
-    int64 nFees = 0;
+// Whether a fee for a size is below the minimum fee for mining
+static inline bool IsFreeForMining(int64 nFee, uint64 nSize)
+{
+    return FeeRateLess(nFee, nSize, CTransaction::nMinTxFee, 1000);
+}
+
+// Priority below which transactions have to pay fees to get in
+static const double dPriorityThreshold = COIN * 144 / 250;
+
+// We want to sort transactions by priority, then by fee rate:
+typedef std::pair<double, CTxMemPool::txiter> TxPriority;
+class TxPriorityCompare
+{
+public:
+    bool operator()(const TxPriority& a, const TxPriority& b) const
     {
-        LOCK2(cs_main, mempool.cs);
-        CBlockIndex* pindexPrev = pindexBest;
-        CCoinsViewCache view(*pcoinsTip, true);
+        if (a.first == b.first)
+            return FeeRateLess(a.second->GetFee(), a.second->GetTxSize(), b.second->GetFee(), b.second->GetTxSize());
+        return a.first < b.first;
+    }
+};
 
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-        bool fPrintPriority = GetBoolArg("-printpriority");
+CBlockAssembler::CBlockAssembler(CTxMemPool& poolIn) : pool(poolIn), pviewBlock(NULL), nChanges(0)
+{
+    Invalidate();
+    pool.SetAssembler(this);
+}
 
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
-        {
-            CTransaction& tx = (*mi).second;
-            if (tx.IsCoinBase() || !tx.IsFinal())
-                continue;
+CBlockAssembler::~CBlockAssembler()
+{
+    pool.SetAssembler(NULL);
+    delete pviewBlock;
+}
 
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            int64 nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-            {
-                // Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        printf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
+void CBlockAssembler::Invalidate()
+{
+    nChanges++;
+    fValid = false;
+    fImprovable = false;
+    delete pviewBlock;
+    pviewBlock = NULL;
+    vBlock.clear();
+    vTxFees.clear();
+    vTxSigOps.clear();
+    setInBlock.clear();
+    nBlockSize = 1000;
+    nBlockSigOps = 100;
+    nFees = 0;
+    nLowestFee = 0;
+    nLowestSize = 0;
+}
 
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].vout[txin.prevout.n].nValue;
-                    continue;
-                }
-                const CCoins &coins = view.GetCoins(txin.prevout.hash);
+bool CBlockAssembler::TestPackage(uint64 nPackageSize, unsigned int nPackageSigOps) const
+{
+    if (nBlockSize + nPackageSize >= nBlockMaxSize)
+        return false;
+    if (nBlockSigOps + nPackageSigOps >= MAX_BLOCK_SIGOPS)
+        return false;
+    return true;
+}
 
-                int64 nValueIn = coins.vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
+bool CBlockAssembler::IsBetterThanLowest(int64 nFee, uint64 nSize) const
+{
+    return nLowestSize > 0 && FeeRateLess(nLowestFee, nLowestSize, nFee, nSize);
+}
+
+bool CBlockAssembler::AddToBlock(CTxMemPool::txiter it)
+{
+    const CTransaction& tx = it->GetTx();
+    CCoinsViewCache& view = *pviewBlock;
+    if (tx.IsCoinBase() || !tx.IsFinal() || !tx.HaveInputs(view))
+        return false;
+
+    unsigned int nTxSigOps = tx.GetLegacySigOpCount() + tx.GetP2SHSigOpCount(view);
+    if (!TestPackage(it->GetTxSize(), nTxSigOps))
+        return false;
 
-                int nConf = pindexPrev->nHeight - coins.nHeight + 1;
+    int64 nTxFees = tx.GetValueIn(view)-tx.GetValueOut();
 
-                dPriority += (double)nValueIn * nConf;
-            }
-            if (fMissingInputs) continue;
+    CValidationState state;
+    if (!tx.CheckInputs(state, view, true, SCRIPT_VERIFY_P2SH))
+        return false;
 
-            // Priority is sum(valuein * age) / txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority /= nTxSize;
+    CTxUndo txundo;
+    tx.UpdateCoins(state, view, txundo, nHeight, it->GetHash());
 
-            // This is a more accurate fee-per-kilobyte than is used by the client code, because the
-            // client code rounds up the size to the nearest 1K. That's good, because it gives an
-            // incentive to create smaller transactions.
-            double dFeePerKb =  double(nTotalIn-tx.GetValueOut()) / (double(nTxSize)/1000.0);
+    nChanges++;
+    vBlock.push_back(it);
+    vTxFees.push_back(nTxFees);
+    vTxSigOps.push_back(nTxSigOps);
+    setInBlock.insert(it);
+    nBlockSize += it->GetTxSize();
+    nBlockSigOps += nTxSigOps;
+    nFees += nTxFees;
 
-            if (porphan)
-            {
-                porphan->dPriority = dPriority;
-                porphan->dFeePerKb = dFeePerKb;
-            }
-            else
-                vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &(*mi).second));
-        }
+    if (GetBoolArg("-printpriority"))
+    {
+        printf("priority %.1f fee %s txid %s\n",
+               it->GetPriority(nHeight), FormatMoney(nTxFees).c_str(), it->GetHash().ToString().c_str());
+    }
+    return true;
+}
 
-        // Collect transactions into block
-        uint64 nBlockSize = 1000;
-        uint64 nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
+void CBlockAssembler::Rebuild(const CBlockIndex* pindexPrev)
+{
+    Invalidate();
+    fValid = true;
+    nTimeBuilt = GetTime();
+    pviewBlock = new CCoinsViewCache(*pcoinsTip, true);
+    hashPrevBlock = pindexPrev->GetBlockHash();
+    nHeight = pindexPrev->nHeight + 1;
+    GetBlockSizeLimits(nBlockMaxSize, nBlockPrioritySize, nBlockMinSize);
+
+    // High-priority transactions first, regardless of the fees they pay.
+    // A transaction becomes a candidate once what it spends from the pool is in.
+    if (nBlockPrioritySize > 0)
+    {
+        vector<TxPriority> vecPriority;
+        vecPriority.reserve(pool.mapTx.size());
+        for (CTxMemPool::txiter it = pool.mapTx.begin(); it != pool.mapTx.end(); ++it)
+            if (pool.GetMemPoolParents(it).empty())
+                vecPriority.push_back(TxPriority(it->GetPriority(nHeight), it));
 
-        TxPriorityCompare comparer(fSortedByFee);
+        TxPriorityCompare comparer;
         std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
         while (!vecPriority.empty())
         {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            double dFeePerKb = vecPriority.front().get<1>();
-            CTransaction& tx = *(vecPriority.front().get<2>());
-
+            double dPriority = vecPriority.front().first;
+            CTxMemPool::txiter it = vecPriority.front().second;
             std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
             vecPriority.pop_back();
 
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
-
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = tx.GetLegacySigOpCount();
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            // Skip free transactions if we're past the minimum block size:
-            if (fSortedByFee && (dFeePerKb < CTransaction::nMinTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
+            if (dPriority < dPriorityThreshold || nBlockSize + it->GetTxSize() >= nBlockPrioritySize)
+                break;
+            if (!AddToBlock(it))
                 continue;
 
-            // Prioritize by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || (dPriority < COIN * 144 / 250)))
+            BOOST_FOREACH(CTxMemPool::txiter itChild, pool.GetMemPoolChildren(it))
             {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                bool fReady = true;
+                BOOST_FOREACH(CTxMemPool::txiter itParent, pool.GetMemPoolParents(itChild))
+                {
+                    if (!setInBlock.count(itParent))
+                    {
+                        fReady = false;
+                        break;
+                    }
+                }
+                if (fReady)
+                {
+                    vecPriority.push_back(TxPriority(itChild->GetPriority(nHeight), itChild));
+                    std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                }
             }
+        }
+    }
 
-            if (!tx.HaveInputs(view))
-                continue;
-
-            int64 nTxFees = tx.GetValueIn(view)-tx.GetValueOut();
+    // Then by fee rate, each transaction together with what it spends from
+    // the pool that is not in yet
+    typedef indexed_transaction_set::index<ancestor_score>::type::const_iterator ancestor_iter;
+    const indexed_transaction_set::index<ancestor_score>::type& index = pool.mapTx.get<ancestor_score>();
+    CTxMemPool::setEntries setFailed;
+    int nFailures = 0;
+    for (ancestor_iter mi = index.begin(); mi != index.end(); ++mi)
+    {
+        CTxMemPool::txiter it = pool.mapTx.project<0>(mi);
+        if (setInBlock.count(it) || setFailed.count(it))
+            continue;
 
-            nTxSigOps += tx.GetP2SHSigOpCount(view);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+        CTxMemPool::setEntries setPackage;
+        pool.CalculateAncestors(it, setPackage);
+        setPackage.insert(it);
+        vector<CTxMemPool::txiter> vPackage;
+        uint64 nPackageSize = 0;
+        unsigned int nPackageSigOps = 0;
+        int64 nPackageFee = 0;
+        bool fFailed = false;
+        BOOST_FOREACH(CTxMemPool::txiter itPackage, setPackage)
+        {
+            if (setInBlock.count(itPackage))
                 continue;
+            fFailed = fFailed || setFailed.count(itPackage);
+            vPackage.push_back(itPackage);
+            nPackageSize += itPackage->GetTxSize();
+            nPackageSigOps += itPackage->GetSigOps();
+            nPackageFee += itPackage->GetFee();
+        }
+        if (fFailed)
+        {
+            setFailed.insert(it);
+            continue;
+        }
 
-            CValidationState state;
-            if (!tx.CheckInputs(state, view, true, SCRIPT_VERIFY_P2SH))
-                continue;
+        // Skip free transactions if we're past the minimum block size:
+        if (IsFreeForMining(nPackageFee, nPackageSize) && nBlockSize + nPackageSize >= nBlockMinSize)
+            continue;
+
+        if (!TestPackage(nPackageSize, nPackageSigOps))
+        {
+            // Give up on a nearly full block after enough misses in a row
+            if (++nFailures > 1000 && nBlockSize + 4000 > nBlockMaxSize)
+                break;
+            continue;
+        }
+        nFailures = 0;
 
-            CTxUndo txundo;
-            uint256 hash = tx.GetHash();
-            tx.UpdateCoins(state, view, txundo, pindexPrev->nHeight+1, hash);
+        // What does not check out also leaves out what spends it
+        std::sort(vPackage.begin(), vPackage.end(), CompareTxIterByAncestorCount());
+        BOOST_FOREACH(CTxMemPool::txiter itPackage, vPackage)
+            if (!AddToBlock(itPackage))
+                setFailed.insert(itPackage);
+        if (nLowestSize == 0 || FeeRateLess(nPackageFee, nPackageSize, nLowestFee, nLowestSize))
+            nLowestFee = nPackageFee, nLowestSize = nPackageSize;
+    }
+}
 
-            // Added
-            pblock->vtx.push_back(tx);
-            pblocktemplate->vTxFees.push_back(nTxFees);
-            pblocktemplate->vTxSigOps.push_back(nTxSigOps);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
+void CBlockAssembler::TransactionAdded(CTxMemPool::txiter it)
+{
+    if (!fValid)
+        return;
 
-            if (fPrintPriority)
-            {
-                printf("priority %.1f feeperkb %.1f txid %s\n",
-                       dPriority, dFeePerKb, tx.GetHash().ToString().c_str());
-            }
+    // Picked for a block that is no longer the best, or back from a
+    // disconnected block with what spends it already in the pool
+    if (hashBestChain != hashPrevBlock || !pool.GetMemPoolChildren(it).empty())
+    {
+        Invalidate();
+        return;
+    }
 
-            // Add transactions that depend on this one to the priority queue
-            if (mapDependers.count(hash))
-            {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
-                {
-                    if (!porphan->setDependsOn.empty())
-                    {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                        {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
-                }
-            }
+    // Spending from the pool what was left out: picking again would only
+    // take it if it pays for them
+    BOOST_FOREACH(CTxMemPool::txiter itParent, pool.GetMemPoolParents(it))
+    {
+        if (!setInBlock.count(itParent))
+        {
+            if (IsBetterThanLowest(it->GetFeesWithAncestors(), it->GetSizeWithAncestors()))
+                fImprovable = true;
+            return;
         }
+    }
+
+    bool fPriority = nBlockPrioritySize > 0 && nBlockSize + it->GetTxSize() < nBlockPrioritySize &&
+                     it->GetPriority(nHeight) >= dPriorityThreshold;
+    if (!fPriority && IsFreeForMining(it->GetFee(), it->GetTxSize()) && nBlockSize + it->GetTxSize() >= nBlockMinSize)
+        return;
+
+    if (TestPackage(it->GetTxSize(), it->GetSigOps()))
+    {
+        if (AddToBlock(it) && !fPriority &&
+            (nLowestSize == 0 || FeeRateLess(it->GetFee(), it->GetTxSize(), nLowestFee, nLowestSize)))
+            nLowestFee = it->GetFee(), nLowestSize = it->GetTxSize();
+    }
+    else if (IsBetterThanLowest(it->GetFee(), it->GetTxSize()))
+        fImprovable = true;
+}
+
+void CBlockAssembler::TransactionRemoved(CTxMemPool::txiter it)
+{
+    // The room it leaves may go to something else
+    if (fValid && setInBlock.count(it))
+        Invalidate();
+}
+
+bool CBlockAssembler::Update(const CBlockIndex* pindexPrev)
+{
+    // Better transactions that did not fit are worth picking again for, but
+    // not more than every few seconds
+    if (fValid && hashPrevBlock == pindexPrev->GetBlockHash() &&
+        (!fImprovable || GetTime() - nTimeBuilt <= 5))
+        return false;
+    Rebuild(pindexPrev);
+    return true;
+}
+
+int64 CBlockAssembler::Fill(CBlockTemplate& blocktemplate) const
+{
+    CBlock& block = blocktemplate.block;
+    block.vtx.reserve(block.vtx.size() + vBlock.size());
+    for (unsigned int i = 0; i < vBlock.size(); i++)
+    {
+        block.vtx.push_back(vBlock[i]->GetTx());
+        blocktemplate.vTxFees.push_back(vTxFees[i]);
+        blocktemplate.vTxSigOps.push_back(vTxSigOps[i]);
+    }
+    return nFees;
+}
+
+// The last block made from the block assembler's pick, with a coinbase that
+// pays out to nobody yet. CreateNewBlock hands out copies of it, each with its
+// own coinbase, until the pick changes. Guarded like the block assembler.
+static boost::shared_ptr<const CBlockTemplate> pblocktemplateShared;
+static unsigned int nBlockTemplateChanges = 0;
 
-        nLastBlockTx = nBlockTx;
-        nLastBlockSize = nBlockSize;
-        printf("CreateNewBlock(): total size %"PRI64u"\n", nBlockSize);
+static boost::shared_ptr<const CBlockTemplate> GetSharedBlockTemplate(CBlockIndex*& pindexPrev)
+{
+    LOCK2(cs_main, mempool.cs);
+    pindexPrev = pindexBest;
+    bool fRebuilt = blockassembler.Update(pindexPrev);
+    if (pblocktemplateShared && nBlockTemplateChanges == blockassembler.GetChanges() &&
+        pblocktemplateShared->block.hashPrevBlock == pindexPrev->GetBlockHash())
+        return pblocktemplateShared;
+
+    // Create new block
+    boost::shared_ptr<CBlockTemplate> pblocktemplate(new CBlockTemplate());
+    CBlock *pblock = &pblocktemplate->block; // pointer for convenience
 
-        pblock->vtx[0].vout[0].nValue = GetBlockValue(pindexPrev->nHeight+1, nFees);
-        pblocktemplate->vTxFees[0] = -nFees;
+    // Create coinbase tx
+    CTransaction txNew;
+    txNew.vin.resize(1);
+    txNew.vin[0].prevout.SetNull();
+    txNew.vout.resize(1);
 
-        // Fill in header
-        pblock->hashPrevBlock  = pindexPrev->GetBlockHash();
-        pblock->UpdateTime(pindexPrev);
-        pblock->nBits          = GetNextWorkRequired(pindexPrev, pblock);
-        pblock->nNonce         = 0;
-        pblock->vtx[0].vin[0].scriptSig = CScript() << OP_0 << OP_0;
-        pblocktemplate->vTxSigOps[0] = pblock->vtx[0].GetLegacySigOpCount();
+    // Add our coinbase tx as first transaction
+    pblock->vtx.push_back(txNew);
+    pblocktemplate->vTxFees.push_back(-1); // updated at end
+    pblocktemplate->vTxSigOps.push_back(-1); // updated at end
 
+    // Collect memory pool transactions into the block
+    int64 nFees = blockassembler.Fill(*pblocktemplate);
+
+    nLastBlockTx = blockassembler.GetBlockTx();
+    nLastBlockSize = blockassembler.GetBlockSize();
+    if (fRebuilt)
+        printf("CreateNewBlock(): total size %"PRI64u"\n", nLastBlockSize);
+
+    pblock->vtx[0].vout[0].nValue = GetBlockValue(pindexPrev->nHeight+1, nFees);
+    pblocktemplate->vTxFees[0] = -nFees;
+
+    // Fill in header
+    pblock->hashPrevBlock  = pindexPrev->GetBlockHash();
+    pblock->UpdateTime(pindexPrev);
+    pblock->nBits          = GetNextWorkRequired(pindexPrev, pblock);
+    pblock->nNonce         = 0;
+    pblock->vtx[0].vin[0].scriptSig = CScript() << OP_0 << OP_0;
+    pblocktemplate->vTxSigOps[0] = pblock->vtx[0].GetLegacySigOpCount();
+
+    // A fresh pick is checked in full. Transactions added to it later
+    // were checked against the same chain on their way into the pool.
+    if (fRebuilt)
+    {
         CBlockIndex indexDummy(*pblock);
         indexDummy.pprev = pindexPrev;
         indexDummy.nHeight = pindexPrev->nHeight + 1;
         CCoinsViewCache viewNew(*pcoinsTip, true);
         CValidationState state;
         if (!pblock->ConnectBlock(state, &indexDummy, viewNew, true))
+        {
+            blockassembler.Invalidate();
             throw std::runtime_error("CreateNewBlock() : ConnectBlock failed");
+        }
     }
 
+    // Hash the transactions once for every coinbase to come. The tree
+    // itself is dropped, it would not match any of them.
+    pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+    pblocktemplate->vCoinbaseBranch = pblock->GetMerkleBranch(0);
+    pblock->vMerkleTree.clear();
+
+    pblocktemplateShared = pblocktemplate;
+    nBlockTemplateChanges = blockassembler.GetChanges();
+    return pblocktemplateShared;
+}
+
+CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
+{
+    CBlockIndex* pindexPrev;
+    boost::shared_ptr<const CBlockTemplate> pshared = GetSharedBlockTemplate(pindexPrev);
+
+    // Outside of the locks, only the coinbase is new: the transactions are
+    // copied, and the merkle root takes a hash per level of the tree
+    auto_ptr<CBlockTemplate> pblocktemplate(new CBlockTemplate(*pshared));
+    CBlock *pblock = &pblocktemplate->block; // pointer for convenience
+    pblock->vtx[0].vout[0].scriptPubKey = scriptPubKeyIn;
+    pblocktemplate->vTxSigOps[0] = pblock->vtx[0].GetLegacySigOpCount();
+    pblock->hashMerkleRoot = CBlock::CheckMerkleBranch(pblock->vtx[0].GetHash(), pblocktemplate->vCoinbaseBranch, 0);
+    pblock->UpdateTime(pindexPrev);
+
     return pblocktemplate.release();
 }
 
+CBlockTemplate* CreateNewBlock(CReserveKey& reservekey)
+{
+    CPubKey pubkey;
+    if (!reservekey.GetReservedKey(pubkey))
+        return NULL;
+    CScript scriptPubKey = CScript() << pubkey << OP_CHECKSIG;
+    return CreateNewBlock(scriptPubKey);
+}
+
 
-void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
+void IncrementExtraNonce(CBlockTemplate* pblocktemplate, CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
 {
+    CBlock *pblock = &pblocktemplate->block; // pointer for convenience
+
     // Update nExtraNonce
     static uint256 hashPrevBlock;
     if (hashPrevBlock != pblock->hashPrevBlock)
@@ -4468,7 +6196,18 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
     pblock->vtx[0].vin[0].scriptSig = (CScript() << nHeight << CBigNum(nExtraNonce)) + COINBASE_FLAGS;
     assert(pblock->vtx[0].vin[0].scriptSig.size() <= 100);
 
-    pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+    pblock->hashMerkleRoot = CBlock::CheckMerkleBranch(pblock->vtx[0].GetHash(), pblocktemplate->vCoinbaseBranch, 0);
+}
+
+
+uint256 WaitForBlockChange(const uint256& hashKnown, int64 nMilliseconds)
+{
+    boost::system_time timeout = boost::get_system_time() + boost::posix_time::milliseconds(nMilliseconds);
+    boost::unique_lock<boost::mutex> lock(mutexBlockChange);
+    while (hashBestChain == hashKnown)
+        if (!condBlockChange.timed_wait(lock, timeout))
+            break;
+    return hashBestChain;
 }
 
 
@@ -4580,7 +6319,7 @@ void static BitcoinMiner(CWallet *pwallet)
         if (!pblocktemplate.get())
             return;
         CBlock *pblock = &pblocktemplate->block;
-        IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
+        IncrementExtraNonce(pblocktemplate.get(), pindexPrev, nExtraNonce);
 
         printf("Running BitcoinMiner with %"PRIszu" transactions in block (%u bytes)\n", pblock->vtx.size(),
                ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION));
@@ -4611,9 +6350,7 @@ void static BitcoinMiner(CWallet *pwallet)
             unsigned int nHashesDone = 0;
             unsigned int nNonceFound;
 
-            // Crypto++ SHA256
-            nNonceFound = ScanHash_CryptoPP(pmidstate, pdata + 64, phash1,
-                                            (char*)&hash, nHashesDone);
+            nNonceFound = ScanHash(pmidstate, pdata + 64, (char*)&hash, nHashesDone);
 
             // Check if something found
             if (nNonceFound != (unsigned int) -1)
@@ -4789,5 +6526,8 @@ public:
 
         // orphan transactions
         mapOrphanTransactions.clear();
+        mapOrphanTransactionsByPrev.clear();
+        vOrphanList.clear();
+        mapOrphanBytesByPeer.clear();
     }
 } instance_of_cmaincleanup;
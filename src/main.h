@@ -12,6 +12,12 @@
 
 #include <list>
 
+#include <boost/multi_index_container.hpp>
+#include <boost/multi_index/hashed_index.hpp>
+#include <boost/multi_index/identity.hpp>
+#include <boost/multi_index/mem_fun.hpp>
+#include <boost/multi_index/ordered_index.hpp>
+
 class CWallet;
 class CBlock;
 class CBlockIndex;
@@ -36,8 +42,14 @@ static const unsigned int DEFAULT_BLOCK_PRIORITY_SIZE = 30000;
 static const unsigned int MAX_STANDARD_TX_SIZE = 100000;
 /** The maximum allowed number of signature check operations in a block (network rule) */
 static const unsigned int MAX_BLOCK_SIGOPS = MAX_BLOCK_SIZE/50;
+/** Default for -maxmempool, memory the pool may take in megabytes */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
 /** The maximum number of orphan transactions kept in memory */
 static const unsigned int MAX_ORPHAN_TRANSACTIONS = MAX_BLOCK_SIZE/100;
+/** The maximum serialized size of all orphan transactions kept in memory */
+static const unsigned int MAX_ORPHAN_BYTES = 5 * MAX_BLOCK_SIZE;
+/** The part of MAX_ORPHAN_BYTES one peer's orphans may take */
+static const unsigned int MAX_ORPHAN_BYTES_PER_PEER = MAX_ORPHAN_BYTES / 10;
 /** The maximum number of entries in an 'inv' protocol message */
 static const unsigned int MAX_INV_SZ = 50000;
 /** The maximum size of a blk?????.dat file (since 0.8) */
@@ -100,6 +112,7 @@ extern unsigned int nCoinCacheSize;
 
 // Settings
 extern int64 nTransactionFee;
+extern unsigned int nTxConfirmTarget;
 
 // Minimum disk space required - used in CheckDiskSpace()
 static const uint64 nMinDiskSpace = 52428800;
@@ -117,6 +130,7 @@ class CScriptCheck;
 class CValidationState;
 
 struct CBlockTemplate;
+class CBlockAssembler;
 
 /** Register a wallet to receive updates from core */
 void RegisterWallet(CWallet* pwalletIn);
@@ -130,10 +144,16 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
 bool CheckDiskSpace(uint64 nAdditionalBytes = 0);
 /** Open a block file (blk?????.dat) */
 FILE* OpenBlockFile(const CDiskBlockPos &pos, bool fReadOnly = false);
+/** Read a block from disk as a complete "block" network message, without deserializing it */
+bool ReadBlockMessage(const CBlockIndex* pindex, CSerializeData& vMsg);
 /** Open an undo file (rev?????.dat) */
 FILE* OpenUndoFile(const CDiskBlockPos &pos, bool fReadOnly = false);
 /** Import blocks from an external file */
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp = NULL);
+/** Write the memory pool to mempool.dat */
+bool DumpMempool();
+/** Accept the transactions of mempool.dat into the memory pool again */
+bool LoadMempool();
 /** Initialize a new block tree database + block data on disk */
 bool InitBlockIndex();
 /** Load the block tree and coins database from disk */
@@ -148,16 +168,26 @@ void PrintBlockTree();
 CBlockIndex* FindBlockByHeight(int nHeight);
 /** Process protocol messages received from a given node */
 bool ProcessMessages(CNode* pfrom);
+/** Forget the orphan transactions a peer sent */
+void EraseOrphansFor(NodeId peer);
 /** Send queued protocol messages to be sent to a give node */
 bool SendMessages(CNode* pto, bool fSendTrickle);
+/** Whether a relayed transaction is only announced on trickle turns, rather than to all peers at once */
+bool IsTrickledTransaction(const uint256& hash);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the thread checking scripts of transactions offered to the memory pool */
+void ThreadMempoolScriptCheck();
 /** Run the miner threads */
 void GenerateBitcoins(bool fGenerate, CWallet* pwallet);
-/** Generate a new block, without valid proof-of-work */
+/** Generate a new block paying out to scriptPubKeyIn, without valid proof-of-work */
+CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn);
+/** Generate a new block paying out to a key from the wallet, without valid proof-of-work */
 CBlockTemplate* CreateNewBlock(CReserveKey& reservekey);
 /** Modify the extranonce in a block */
-void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
+void IncrementExtraNonce(CBlockTemplate* pblocktemplate, CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
+/** Wait until the best block is no longer hashKnown, for at most nMilliseconds; returns the best block hash */
+uint256 WaitForBlockChange(const uint256& hashKnown, int64 nMilliseconds);
 /** Do mining precalculation */
 void FormatHashBuffers(CBlock* pblock, char* pmidstate, char* pdata, char* phash1);
 /** Check mined block */
@@ -255,11 +285,11 @@ struct CDiskTxPos : public CDiskBlockPos
 class CInPoint
 {
 public:
-    CTransaction* ptx;
+    const CTransaction* ptx;
     unsigned int n;
 
     CInPoint() { SetNull(); }
-    CInPoint(CTransaction* ptxIn, unsigned int nIn) { ptx = ptxIn; n = nIn; }
+    CInPoint(const CTransaction* ptxIn, unsigned int nIn) { ptx = ptxIn; n = nIn; }
     void SetNull() { ptx = NULL; n = (unsigned int) -1; }
     bool IsNull() const { return (ptx == NULL && n == (unsigned int) -1); }
 };
@@ -612,6 +642,17 @@ public:
      */
     int64 GetValueIn(CCoinsViewCache& mapInputs) const;
 
+    /** Priority of this transaction in a block at height nHeight: the value of
+        each input times its number of confirmations by then, per byte.
+        Inputs from the memory pool have no confirmations yet.
+
+        @param[in] mapInputs	Map of previous transactions that have outputs we're spending
+        @param[out] pnValueInChain	If given, the value of the confirmed inputs, which
+                                    add to the priority with each further block
+        @return	The priority
+     */
+    double GetPriority(CCoinsViewCache& mapInputs, int nHeight, int64* pnValueInChain = NULL) const;
+
     static bool AllowFree(double dPriority)
     {
         // Large (in bytes) low-priority (new, small-coin) transactions
@@ -674,7 +715,8 @@ public:
     bool CheckTransaction(CValidationState &state) const;
 
     // Try to accept this transaction into the memory pool
-    bool AcceptToMemoryPool(CValidationState &state, bool fCheckInputs=true, bool fLimitFree = true, bool* pfMissingInputs=NULL);
+    bool AcceptToMemoryPool(CValidationState &state, bool fCheckInputs=true, bool fLimitFree = true, bool* pfMissingInputs=NULL,
+                            int64 nAcceptTime=0);
 
 protected:
     static const CTxOut &GetOutputFor(const CTxIn& input, CCoinsViewCache& mapInputs);
@@ -1373,11 +1415,16 @@ public:
         int j = 0;
         for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
         {
-            for (int i = 0; i < nSize; i += 2)
+            // Sibling hashes are adjacent, so each pair is one 64-byte
+            // message and the whole level can be hashed in one batch.
+            int nPairs = nSize / 2;
+            vMerkleTree.resize(j + nSize + (nSize + 1) / 2);
+            if (nPairs > 0)
+                SHA256D64(vMerkleTree[j + nSize].begin(), vMerkleTree[j].begin(), nPairs);
+            if (nSize & 1)
             {
-                int i2 = std::min(i+1, nSize-1);
-                vMerkleTree.push_back(Hash(BEGIN(vMerkleTree[j+i]),  END(vMerkleTree[j+i]),
-                                           BEGIN(vMerkleTree[j+i2]), END(vMerkleTree[j+i2])));
+                const uint256& last = vMerkleTree[j + nSize - 1];
+                vMerkleTree[j + nSize + nPairs] = Hash(BEGIN(last), END(last), BEGIN(last), END(last));
             }
             j += nSize;
         }
@@ -2073,21 +2120,336 @@ public:
 
 
 
+/** A transaction whose inputs are not known yet, kept until they are */
+struct COrphanTx
+{
+    boost::shared_ptr<CTransaction> ptx;
+    NodeId fromPeer;
+    unsigned int nTxSize;
+    size_t nListPos;    // in the list random evictions pick from
+};
+
+/** A transaction in the memory pool, with what it pays, its size and when it
+ *  came in. It also holds the totals of the transaction together with its
+ *  ancestors, and with its descendants, in the pool; CTxMemPool keeps them
+ *  up to date as transactions come and go.
+ */
+class CTxMemPoolEntry
+{
+private:
+    CTransaction tx;
+    uint256 hash;
+    int64 nFee;
+    unsigned int nTxSize;
+    int64 nTime;
+    double dPriority;       // priority in a block at nHeight
+    unsigned int nHeight;   // height of the next block when it came in
+    int64 nValueInChain;    // value of its inputs confirmed by then
+    unsigned int nSigOps;   // legacy and P2SH
+    size_t nUsageSize;      // heap memory taken by tx
+
+    uint64 nCountWithAncestors;
+    uint64 nSizeWithAncestors;
+    int64 nFeesWithAncestors;
+    uint64 nCountWithDescendants;
+    uint64 nSizeWithDescendants;
+    int64 nFeesWithDescendants;
+
+public:
+    CTxMemPoolEntry(const CTransaction& txIn, int64 nFeeIn, int64 nTimeIn, double dPriorityIn,
+                    unsigned int nHeightIn, int64 nValueInChainIn, unsigned int nSigOpsIn);
+
+    const CTransaction& GetTx() const { return tx; }
+    const uint256& GetHash() const { return hash; }
+    int64 GetFee() const { return nFee; }
+    unsigned int GetTxSize() const { return nTxSize; }
+    int64 GetTime() const { return nTime; }
+    unsigned int GetHeight() const { return nHeight; }
+    unsigned int GetSigOps() const { return nSigOps; }
+    size_t DynamicMemoryUsage() const { return nUsageSize; }
+    // Priority in a block at nCurrentHeight, as confirmed inputs age
+    double GetPriority(unsigned int nCurrentHeight) const;
+
+    uint64 GetCountWithAncestors() const { return nCountWithAncestors; }
+    uint64 GetSizeWithAncestors() const { return nSizeWithAncestors; }
+    int64 GetFeesWithAncestors() const { return nFeesWithAncestors; }
+    uint64 GetCountWithDescendants() const { return nCountWithDescendants; }
+    uint64 GetSizeWithDescendants() const { return nSizeWithDescendants; }
+    int64 GetFeesWithDescendants() const { return nFeesWithDescendants; }
+
+    void UpdateAncestorState(int64 nCountDelta, int64 nSizeDelta, int64 nFeeDelta);
+    void UpdateDescendantState(int64 nCountDelta, int64 nSizeDelta, int64 nFeeDelta);
+};
+
+/** Lowest fee rate first, of a transaction together with its descendants or
+ *  alone, whichever is higher: the order in which to drop transactions.
+ *  Newer transactions go first among equals.
+ */
+class CompareTxMemPoolEntryByDescendantScore
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const;
+};
+
+/** Highest fee rate first, of a transaction together with its ancestors or
+ *  alone, whichever is lower: the order in which to mine transactions.
+ */
+class CompareTxMemPoolEntryByAncestorScore
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const;
+};
+
+class CompareTxMemPoolEntryByEntryTime
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        return a.GetTime() < b.GetTime();
+    }
+};
+
+/** Hash of a txid, salted per table so that peers can't pick transactions
+ *  that collide. */
+class CSaltedTxidHasher
+{
+private:
+    uint64 k0, k1;
+public:
+    CSaltedTxidHasher();
+    size_t operator()(const uint256& hash) const { return SipHashUint256(k0, k1, hash); }
+};
+
+// Tags of the memory pool's orderings
+struct descendant_score {};
+struct entry_time {};
+struct ancestor_score {};
+
+typedef boost::multi_index_container<
+    CTxMemPoolEntry,
+    boost::multi_index::indexed_by<
+        // by txid
+        boost::multi_index::hashed_unique<
+            boost::multi_index::const_mem_fun<CTxMemPoolEntry, const uint256&, &CTxMemPoolEntry::GetHash>,
+            CSaltedTxidHasher>,
+        boost::multi_index::ordered_non_unique<
+            boost::multi_index::tag<descendant_score>,
+            boost::multi_index::identity<CTxMemPoolEntry>,
+            CompareTxMemPoolEntryByDescendantScore>,
+        boost::multi_index::ordered_non_unique<
+            boost::multi_index::tag<entry_time>,
+            boost::multi_index::identity<CTxMemPoolEntry>,
+            CompareTxMemPoolEntryByEntryTime>,
+        boost::multi_index::ordered_non_unique<
+            boost::multi_index::tag<ancestor_score>,
+            boost::multi_index::identity<CTxMemPoolEntry>,
+            CompareTxMemPoolEntryByAncestorScore>
+    >
+> indexed_transaction_set;
+
+/** For each bucket of fee rate (or priority), how many of the transactions
+ *  that got into blocks did so within 1, 2, ... blocks of entering the
+ *  memory pool, as moving averages that decay with each block. Those still
+ *  waiting count against their bucket too.
+ */
+class CTxConfirmStats
+{
+private:
+    // Upper bound of each bucket, and the bucket of each bound
+    std::vector<double> buckets;
+    std::map<double, unsigned int> bucketMap;
+
+    // Per bucket: transactions confirmed, the sum of their values, and
+    // [Y][bucket] those confirmed within Y+1 blocks
+    std::vector<double> txCtAvg;
+    std::vector<double> avg;
+    std::vector<std::vector<double> > confAvg;
+    // The same for the block being counted
+    std::vector<int> curBlockTxCt;
+    std::vector<double> curBlockVal;
+    std::vector<std::vector<int> > curBlockConf;
+
+    double decay;
+
+    // Transactions still in the pool, by the height they entered at modulo
+    // the tracked confirmations, and those in longer
+    std::vector<std::vector<int> > unconfTxs;
+    std::vector<int> oldUnconfTxs;
+
+public:
+    void Initialize(const std::vector<double>& vBuckets, unsigned int nMaxConfirms, double dDecay);
+
+    // A block at nBlockHeight is being counted
+    void ClearCurrent(unsigned int nBlockHeight);
+    // A transaction with value dVal got in nBlocksToConfirm blocks after it came
+    void Record(int nBlocksToConfirm, double dVal);
+    // Fold the block counted into the averages
+    void UpdateMovingAverages();
+
+    // A transaction with value dVal came in at nBlockHeight; returns its bucket
+    unsigned int NewTx(unsigned int nBlockHeight, double dVal);
+    // It left the pool, or got into a block
+    void RemoveTx(unsigned int nEntryHeight, unsigned int nBestSeenHeight, unsigned int nBucket);
+
+    /** The average value of the median bucket of the cheapest range of buckets
+     *  (from the top when fRequireGreater, else from the bottom) whose share
+     *  confirmed within nConfTarget blocks stays on the side of
+     *  dSuccessBreakPoint, combining buckets until each range has seen
+     *  dSufficientTxVal transactions per block. -1 if there is none.
+     */
+    double EstimateMedianVal(int nConfTarget, double dSufficientTxVal, double dSuccessBreakPoint,
+                             bool fRequireGreater, unsigned int nBlockHeight) const;
+
+    unsigned int GetMaxConfirms() const { return confAvg.size(); }
+
+    void Write(CAutoFile& fileout) const;
+    void Read(CAutoFile& filein);
+};
+
+/** Estimates the fee rate, or priority, a transaction needs to get into a
+ *  block within a number of blocks, from how long memory pool transactions
+ *  took to. Only transactions clear to go into the next block when they
+ *  came in, and seen while the chain was current, are counted. Guarded by
+ *  the memory pool's lock.
+ */
+class CBlockPolicyEstimator
+{
+private:
+    // Transactions paying less, or with less priority, are not counted
+    double minTrackedFee;
+    double minTrackedPriority;
+    unsigned int nBestSeenHeight;
+
+    struct TxStatsInfo
+    {
+        CTxConfirmStats* stats;
+        unsigned int blockHeight;
+        unsigned int bucketIndex;
+        TxStatsInfo() : stats(NULL), blockHeight(0), bucketIndex(0) {}
+    };
+    std::map<uint256, TxStatsInfo> mapMemPoolTxs;
+
+    CTxConfirmStats feeStats;
+    CTxConfirmStats priStats;
+
+    // The stats a transaction is counted in: the fee rate's if it paid at
+    // least the tracked fee without the tracked priority, and the other way
+    // round; neither if it had both or none.
+    CTxConfirmStats* GetStatsFor(double dFeeRate, double dPriority);
+
+public:
+    CBlockPolicyEstimator(int64 nMinRelayFee);
+
+    void processTransaction(const CTxMemPoolEntry& entry, bool fCurrentEstimate);
+    // The pool's transactions in a block connected at nBlockHeight
+    void processBlock(unsigned int nBlockHeight, const std::vector<const CTxMemPoolEntry*>& entries,
+                      bool fCurrentEstimate);
+    bool removeTx(const uint256& hash);
+
+    // Fee per 1000 bytes, or priority, for confirmation within nConfTarget
+    // blocks; -1 if not known (yet)
+    int64 estimateFee(int nConfTarget) const;
+    double estimatePriority(int nConfTarget) const;
+
+    void Write(CAutoFile& fileout) const;
+    void Read(CAutoFile& filein);
+};
+
 class CTxMemPool
 {
+public:
+    typedef indexed_transaction_set::const_iterator txiter;
+
+    struct CompareIteratorByHash
+    {
+        bool operator()(const txiter& a, const txiter& b) const { return a->GetHash() < b->GetHash(); }
+    };
+    typedef std::set<txiter, CompareIteratorByHash> setEntries;
+
+private:
+    // In-pool parents and children of each entry
+    struct TxLinks
+    {
+        setEntries parents;
+        setEntries children;
+    };
+    std::map<txiter, TxLinks, CompareIteratorByHash> mapLinks;
+
+    // Told of every entry added and removed, if set
+    CBlockAssembler* passembler;
+    CBlockPolicyEstimator minerPolicyEstimator;
+
+    uint64 totalTxSize;         // serialized size of all entries
+    uint64 cachedInnerUsage;    // heap memory of the entries and their links
+    // Fee rate per 1000 bytes of the last package evicted, decaying once
+    // blocks come in
+    double rollingMinimumFeeRate;
+    int64 lastRollingFeeUpdate;
+    bool blockSinceLastRollingFeeBump;
+    static const int ROLLING_FEE_HALFLIFE = 60 * 60 * 12;
+
+    // Recompute the ancestor and descendant totals of an entry from its links
+    void UpdateEntryTotals(txiter it);
+    void RemoveStaged(const setEntries& setRemove);
+
 public:
     mutable CCriticalSection cs;
-    std::map<uint256, CTransaction> mapTx;
+    indexed_transaction_set mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
 
-    bool accept(CValidationState &state, CTransaction &tx, bool fCheckInputs, bool fLimitFree, bool* pfMissingInputs);
+    CTxMemPool() : passembler(NULL), minerPolicyEstimator(CTransaction::nMinRelayTxFee), totalTxSize(0),
+                   cachedInnerUsage(0), rollingMinimumFeeRate(0), lastRollingFeeUpdate(0),
+                   blockSinceLastRollingFeeBump(false) {}
+
+    // nAcceptTime: when the transaction first entered a pool, 0 for now
+    bool accept(CValidationState &state, CTransaction &tx, bool fCheckInputs, bool fLimitFree, bool* pfMissingInputs,
+                int64 nAcceptTime = 0);
+    // fCurrentEstimate: the chain is current, so the fee estimates may count it
+    bool addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry, bool fCurrentEstimate = true);
+    // Add with nothing known of the transaction's inputs, for tests
     bool addUnchecked(const uint256& hash, const CTransaction &tx);
     bool remove(const CTransaction &tx, bool fRecursive = false);
     bool removeConflicts(const CTransaction &tx);
+    // Remove the transactions of a block connected at nBlockHeight, and what
+    // conflicts with them, counting how long they took to confirm
+    void removeForBlock(const std::vector<CTransaction>& vtx, unsigned int nBlockHeight, bool fCurrentEstimate);
     void clear();
     void queryHashes(std::vector<uint256>& vtxid);
     void pruneSpent(const uint256& hash, CCoins &coins);
 
+    // Entries directly spent by or spending it
+    const setEntries& GetMemPoolParents(txiter it) const;
+    const setEntries& GetMemPoolChildren(txiter it) const;
+    // Add all entries it spends, or that spend it, directly or not
+    void CalculateAncestors(txiter it, setEntries& setAncestors) const;
+    void CalculateDescendants(txiter it, setEntries& setDescendants) const;
+    void SetAssembler(CBlockAssembler* passemblerIn) { passembler = passemblerIn; }
+
+    // Heap memory taken by the pool, as -maxmempool counts it
+    size_t DynamicMemoryUsage() const;
+    uint64 GetTotalTxSize() const
+    {
+        LOCK(cs);
+        return totalTxSize;
+    }
+    // Evict the packages with the lowest fee rate until the pool takes no
+    // more than nSizeLimit bytes, raising the minimum fee to what they paid
+    void TrimToSize(size_t nSizeLimit);
+    // Fee per 1000 bytes a transaction needs to enter a pool limited to
+    // nSizeLimit bytes; it halves every 12 hours once blocks come in, faster
+    // when the pool is emptier
+    int64 GetMinFee(size_t nSizeLimit);
+    // A block was connected: the minimum fee may start to decay
+    void BlockConnected();
+
+    // Fee per 1000 bytes, or priority, to get into a block within nBlocks;
+    // -1 if not known
+    int64 estimateFee(int nBlocks) const;
+    double estimatePriority(int nBlocks) const;
+    // Keep the statistics behind the estimates across restarts
+    bool WriteFeeEstimates(CAutoFile& fileout) const;
+    bool ReadFeeEstimates(CAutoFile& filein);
+
     unsigned long size()
     {
         LOCK(cs);
@@ -2099,9 +2461,11 @@ public:
         return (mapTx.count(hash) != 0);
     }
 
-    CTransaction& lookup(uint256 hash)
+    const CTransaction& lookup(uint256 hash)
     {
-        return mapTx[hash];
+        indexed_transaction_set::const_iterator it = mapTx.find(hash);
+        assert(it != mapTx.end());
+        return it->GetTx();
     }
 };
 
@@ -2226,8 +2590,76 @@ struct CBlockTemplate
     CBlock block;
     std::vector<int64_t> vTxFees;
     std::vector<int64_t> vTxSigOps;
+    // Merkle branch of the coinbase: whatever goes into the coinbase, the
+    // merkle root is CheckMerkleBranch(coinbase hash, vCoinbaseBranch, 0)
+    std::vector<uint256> vCoinbaseBranch;
+};
+
+/** The memory pool transactions picked for the next block. The pick is kept
+ *  up to date as transactions enter the pool, so that a block template can be
+ *  handed out without going over the whole pool each time. A new best block,
+ *  or a picked transaction leaving the pool, has it pick again from scratch.
+ *  Guarded by the pool's lock, and by cs_main for the coins it reads.
+ */
+class CBlockAssembler
+{
+private:
+    CTxMemPool& pool;
+    // The chain with the picked transactions applied
+    CCoinsViewCache* pviewBlock;
+
+    bool fValid;
+    // Something came in that picking again would take instead
+    bool fImprovable;
+    int64 nTimeBuilt;
+    uint256 hashPrevBlock;
+    unsigned int nHeight;
+    unsigned int nBlockMaxSize;
+    unsigned int nBlockPrioritySize;
+    unsigned int nBlockMinSize;
+
+    // Picked transactions, parents first, with their fees and sigops
+    std::vector<CTxMemPool::txiter> vBlock;
+    std::vector<int64> vTxFees;
+    std::vector<unsigned int> vTxSigOps;
+    CTxMemPool::setEntries setInBlock;
+    uint64 nBlockSize;
+    unsigned int nBlockSigOps;
+    int64 nFees;
+    // Lowest fee rate of what was picked for its fees, if anything
+    int64 nLowestFee;
+    uint64 nLowestSize;
+    // Counts changes to the pick, to tell whether one made from it is current
+    unsigned int nChanges;
+
+    bool TestPackage(uint64 nPackageSize, unsigned int nPackageSigOps) const;
+    bool IsBetterThanLowest(int64 nFee, uint64 nSize) const;
+    // Check a transaction against the block so far and add it
+    bool AddToBlock(CTxMemPool::txiter it);
+    void Rebuild(const CBlockIndex* pindexPrev);
+
+public:
+    CBlockAssembler(CTxMemPool& poolIn);
+    ~CBlockAssembler();
+
+    void TransactionAdded(CTxMemPool::txiter it);
+    void TransactionRemoved(CTxMemPool::txiter it);
+    // Pick again from scratch next time
+    void Invalidate();
+
+    // Bring the pick up to date for a block on top of pindexPrev; returns
+    // true if it was made again from scratch
+    bool Update(const CBlockIndex* pindexPrev);
+    // Append the picked transactions, their fees and sigops, and return the total fees
+    int64 Fill(CBlockTemplate& blocktemplate) const;
+
+    unsigned int GetChanges() const { return nChanges; }
+    unsigned int GetBlockTx() const { return vBlock.size(); }
+    uint64 GetBlockSize() const { return nBlockSize; }
 };
 
+extern CBlockAssembler blockassembler;
+
 
 
 
@@ -2243,6 +2675,9 @@ public:
     CBlockHeader header;
     CPartialMerkleTree txn;
 
+private:
+    void Init(const CBlock& block, const std::vector<CBloomTxElements>& vElements, CBloomFilter& filter);
+
 public:
     // Public only for unit testing and relay testing
     // (not relayed)
@@ -2253,6 +2688,10 @@ public:
     // thus the filter will likely be modified.
     CMerkleBlock(const CBlock& block, CBloomFilter& filter);
 
+    // Same, with the filter data of each of the block's transactions already
+    // extracted, to be shared by the filters of several peers
+    CMerkleBlock(const CBlock& block, const std::vector<CBloomTxElements>& vElements, CBloomFilter& filter);
+
     IMPLEMENT_SERIALIZE
     (
         READWRITE(header);
@@ -2260,4 +2699,140 @@ public:
     )
 };
 
+
+
+/** A transaction sent in full as part of a compact block */
+class CPrefilledTransaction
+{
+public:
+    unsigned int nIndex; // position in the block
+    CTransaction tx;
+
+    CPrefilledTransaction() : nIndex(0) {}
+    CPrefilledTransaction(unsigned int nIndexIn, const CTransaction& txIn) : nIndex(nIndexIn), tx(txIn) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nIndex);
+        READWRITE(tx);
+    )
+};
+
+/** Used to relay new blocks as header + short transaction ids to peers
+ * that already have most of the transactions in their memory pool.
+ * Transactions they can't have, like the coinbase, are sent in full.
+ */
+class CCompactBlock
+{
+public:
+    static const unsigned int SHORTID_SIZE = 6;
+
+    CBlockHeader header;
+    uint64 nNonce;
+    // short ids of the transactions that aren't prefilled, in block order
+    std::vector<uint64> vShortTxID;
+    // sorted by index
+    std::vector<CPrefilledTransaction> vPrefilledTxn;
+
+    CCompactBlock() : nNonce(0) {}
+
+    // Create from a CBlock, prefilling the coinbase
+    CCompactBlock(const CBlock& block, uint64 nNonceIn);
+
+    unsigned int GetTransactionCount() const { return vShortTxID.size() + vPrefilledTxn.size(); }
+
+    // Short ids are keyed by the header and nonce, so collisions can't be
+    // precomputed and differ between peers
+    void GetShortIDKeys(uint64& k0, uint64& k1) const;
+    static uint64 GetShortID(uint64 k0, uint64 k1, const uint256& hash)
+    {
+        return SipHashUint256(k0, k1, hash) & 0xffffffffffffULL;
+    }
+
+    IMPLEMENT_SERIALIZE(
+        READWRITE(header);
+        READWRITE(nNonce);
+        std::vector<unsigned char> vBytes;
+        if (fRead) {
+            READWRITE(vBytes);
+            if (vBytes.size() % SHORTID_SIZE != 0)
+                throw std::ios_base::failure("CCompactBlock::Unserialize() : bad short id length");
+            CCompactBlock &us = *(const_cast<CCompactBlock*>(this));
+            us.vShortTxID.resize(vBytes.size() / SHORTID_SIZE);
+            for (unsigned int i = 0; i < us.vShortTxID.size(); i++)
+            {
+                uint64 nID = 0;
+                for (unsigned int j = 0; j < SHORTID_SIZE; j++)
+                    nID |= (uint64)vBytes[i * SHORTID_SIZE + j] << (8 * j);
+                us.vShortTxID[i] = nID;
+            }
+        } else {
+            vBytes.resize(vShortTxID.size() * SHORTID_SIZE);
+            for (unsigned int i = 0; i < vShortTxID.size(); i++)
+                for (unsigned int j = 0; j < SHORTID_SIZE; j++)
+                    vBytes[i * SHORTID_SIZE + j] = (unsigned char)(vShortTxID[i] >> (8 * j));
+            READWRITE(vBytes);
+        }
+        READWRITE(vPrefilledTxn);
+    )
+};
+
+/** Request for the transactions of a compact block the receiver couldn't
+ * find in its memory pool ("getblocktxn").
+ */
+class CBlockTransactionsRequest
+{
+public:
+    uint256 blockhash;
+    std::vector<unsigned int> vIndexes;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(blockhash);
+        READWRITE(vIndexes);
+    )
+};
+
+/** Answer to a CBlockTransactionsRequest ("blocktxn") */
+class CBlockTransactions
+{
+public:
+    uint256 blockhash;
+    std::vector<CTransaction> vtx;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(blockhash);
+        READWRITE(vtx);
+    )
+};
+
+/** A block being rebuilt from a compact block */
+class CPartialBlock
+{
+public:
+    CBlock block;
+    std::vector<bool> vHave;
+    // memory only
+    NodeId nodeFrom; // the peer the missing transactions were requested from
+    int64 nTime;
+
+    CPartialBlock() : nodeFrom(-1), nTime(0) {}
+
+    // Take the header and prefilled transactions and look up the others in
+    // pool. Returns false if the compact block is malformed or has colliding
+    // short ids; the block then has to be downloaded in full.
+    bool Init(const CCompactBlock& cmpctblock, CTxMemPool& pool);
+
+    // Positions of the transactions that weren't found
+    std::vector<unsigned int> GetMissing() const;
+
+    // Fill in the transactions that weren't found, in block order.
+    // Returns false if their number doesn't match.
+    bool FillMissing(const std::vector<CTransaction>& vtx);
+
+    // Whether the transactions found make up the block the header commits to
+    bool IsValid() const;
+};
+
 #endif
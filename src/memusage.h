@@ -0,0 +1,74 @@
+// Copyright (c) 2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_MEMUSAGE_H
+#define BITCOIN_MEMUSAGE_H
+
+#include <stddef.h>
+
+#include <map>
+#include <set>
+#include <vector>
+
+/** Estimates of the heap memory used by containers, including what the
+ *  allocator rounds each block up to. */
+namespace memusage
+{
+
+/** Bytes taken by a malloc of alloc bytes: a header word, rounded up to the
+ *  allocator's alignment. */
+static inline size_t MallocUsage(size_t alloc)
+{
+    if (alloc == 0)
+        return 0;
+    if (sizeof(void*) == 8)
+        return ((alloc + 31) >> 4) << 4;
+    return ((alloc + 15) >> 3) << 3;
+}
+
+// A node of a red-black tree as the standard library lays it out
+template<typename X>
+struct stl_tree_node
+{
+private:
+    int color;
+    void* parent;
+    void* left;
+    void* right;
+    X x;
+};
+
+template<typename X>
+static inline size_t DynamicUsage(const std::vector<X>& v)
+{
+    return MallocUsage(v.capacity() * sizeof(X));
+}
+
+template<typename X, typename Y>
+static inline size_t DynamicUsage(const std::set<X, Y>& s)
+{
+    return MallocUsage(sizeof(stl_tree_node<X>)) * s.size();
+}
+
+// What one more element adds
+template<typename X, typename Y>
+static inline size_t IncrementalDynamicUsage(const std::set<X, Y>& s)
+{
+    return MallocUsage(sizeof(stl_tree_node<X>));
+}
+
+template<typename X, typename Y, typename Z>
+static inline size_t DynamicUsage(const std::map<X, Y, Z>& m)
+{
+    return MallocUsage(sizeof(stl_tree_node<std::pair<const X, Y> >)) * m.size();
+}
+
+template<typename X, typename Y, typename Z>
+static inline size_t IncrementalDynamicUsage(const std::map<X, Y, Z>& m)
+{
+    return MallocUsage(sizeof(stl_tree_node<std::pair<const X, Y> >));
+}
+
+}
+
+#endif // BITCOIN_MEMUSAGE_H
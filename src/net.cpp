@@ -10,6 +10,9 @@
 #include "ui_interface.h"
 #include "script.h"
 
+#include <boost/optional.hpp>
+#include <boost/unordered_map.hpp>
+
 #ifdef WIN32
 #include <string.h>
 #endif
@@ -55,9 +58,20 @@ int nMaxConnections = 125;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
-deque<pair<int64, CInv> > vRelayExpiration;
-CCriticalSection cs_mapRelay;
+
+// Messages of recently relayed transactions, to answer getdata for them
+// without serializing them again for each peer
+class CRelayHasher
+{
+private:
+    uint64 k0, k1;
+public:
+    CRelayHasher() : k0(GetRand(~(uint64)0)), k1(GetRand(~(uint64)0)) {}
+    size_t operator()(const uint256& hash) const { return SipHashUint256(k0, k1, hash); }
+};
+static boost::unordered_map<uint256, boost::shared_ptr<const CSerializeData>, CRelayHasher> mapRelay;
+static deque<pair<int64, uint256> > vRelayExpiration;
+static CCriticalSection cs_mapRelay;
 limitedmap<CInv, int64> mapAlreadyAskedFor(MAX_INV_SZ);
 
 static deque<string> vOneShots;
@@ -71,6 +85,10 @@ CCriticalSection cs_vAddedNodes;
 
 static CSemaphore *semOutbound = NULL;
 
+static CCriticalSection cs_totalQueued;
+static uint64 nTotalSendQueued = 0;
+static uint64 nTotalRecvQueued = 0;
+
 void AddOneShot(string strDest)
 {
     LOCK(cs_vOneShots);
@@ -454,6 +472,195 @@ CNode* FindNode(const CService& addr)
     return NULL;
 }
 
+//
+// Socket readiness
+//
+// On Linux the socket thread waits on an edge-triggered epoll set. Each node
+// socket is registered once when the node is added, and a wakeup only reports
+// the sockets whose state changed, which is recorded in the node's
+// fSocketReadable/fSocketWritable until a recv or send would block. Elsewhere,
+// or when epoll is unavailable or disabled with -epoll=0, the flags are filled
+// from select() over all sockets on every pass.
+//
+#ifdef USE_EPOLL
+static int hEpoll = -1;
+#endif
+
+// select() can only watch descriptors below FD_SETSIZE (on Windows an fd_set
+// is a list of handles instead)
+static bool IsSelectableSocket(SOCKET hSocket)
+{
+#ifdef WIN32
+    return true;
+#else
+    return hSocket < FD_SETSIZE;
+#endif
+}
+
+static void SocketEventsInit()
+{
+#ifdef USE_EPOLL
+    if (hEpoll != -1 || !GetBoolArg("-epoll", true))
+        return;
+    hEpoll = epoll_create(1);
+    if (hEpoll == -1)
+    {
+        printf("epoll_create failed with error %d, using select()\n", errno);
+        return;
+    }
+    BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+    {
+        // Listening sockets stay level-triggered, they are drained one accept per pass
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hListenSocket, &event) == -1)
+            printf("epoll_ctl add listening socket failed with error %d\n", errno);
+    }
+#endif
+}
+
+// Start watching a new node's socket, call before it is serviced
+static void SocketEventsAdd(CNode* pnode)
+{
+#ifdef USE_EPOLL
+    if (hEpoll == -1)
+        return;
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    event.data.ptr = pnode;
+    if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, pnode->hSocket, &event) == -1)
+    {
+        printf("epoll_ctl add failed with error %d\n", errno);
+        pnode->fDisconnect = true;
+    }
+    // Closing the socket removes it from the epoll set again
+#endif
+}
+
+// Wait up to nTimeout milliseconds for socket activity and record it in the
+// nodes. fListenReady is set when a connection may be waiting to be accepted.
+static void SocketEventsWait(int nTimeout, bool& fListenReady)
+{
+    fListenReady = false;
+
+#ifdef USE_EPOLL
+    if (hEpoll != -1)
+    {
+        // Nodes are only deleted by the socket thread after their socket was
+        // closed, which drops any pending events, so the pointers are valid here
+        struct epoll_event events[256];
+        int nEvents = epoll_wait(hEpoll, events, ARRAYLEN(events), nTimeout);
+        boost::this_thread::interruption_point();
+        if (nEvents == -1)
+        {
+            if (errno != EINTR)
+            {
+                printf("epoll_wait error %d\n", errno);
+                MilliSleep(nTimeout);
+            }
+            return;
+        }
+        for (int i = 0; i < nEvents; i++)
+        {
+            CNode* pnode = (CNode*)events[i].data.ptr;
+            if (pnode == NULL)
+            {
+                fListenReady = true;
+                continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                pnode->fSocketReadable = true;
+            if (events[i].events & EPOLLOUT)
+                pnode->fSocketWritable = true;
+        }
+        return;
+    }
+#endif
+
+    struct timeval timeout;
+    timeout.tv_sec  = nTimeout / 1000;
+    timeout.tv_usec = (nTimeout % 1000) * 1000;
+
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+    bool have_fds = false;
+
+    BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
+        FD_SET(hListenSocket, &fdsetRecv);
+        hSocketMax = max(hSocketMax, hListenSocket);
+        have_fds = true;
+    }
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+        {
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+            if (!IsSelectableSocket(pnode->hSocket))
+            {
+                pnode->fDisconnect = true;
+                continue;
+            }
+            FD_SET(pnode->hSocket, &fdsetError);
+            hSocketMax = max(hSocketMax, pnode->hSocket);
+            have_fds = true;
+
+            // The socket thread decides whether to send or receive (see
+            // ThreadSocketHandler), only select() for what it would do
+            {
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                if (lockSend && !pnode->vSendMsg.empty()) {
+                    FD_SET(pnode->hSocket, &fdsetSend);
+                    continue;
+                }
+            }
+            {
+                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                if (lockRecv && pnode->IsReceiveBufferAvailable())
+                    FD_SET(pnode->hSocket, &fdsetRecv);
+            }
+        }
+    }
+
+    int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+                         &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    boost::this_thread::interruption_point();
+
+    if (nSelect == SOCKET_ERROR)
+    {
+        if (have_fds)
+        {
+            int nErr = WSAGetLastError();
+            printf("socket select error %d\n", nErr);
+            for (unsigned int i = 0; i <= hSocketMax; i++)
+                FD_SET(i, &fdsetRecv);
+        }
+        FD_ZERO(&fdsetSend);
+        FD_ZERO(&fdsetError);
+        MilliSleep(nTimeout);
+    }
+
+    BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+        if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+            fListenReady = true;
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+        {
+            SOCKET hSocket = pnode->hSocket;
+            bool fSelectable = hSocket != INVALID_SOCKET && IsSelectableSocket(hSocket);
+            pnode->fSocketReadable = fSelectable && (FD_ISSET(hSocket, &fdsetRecv) || FD_ISSET(hSocket, &fdsetError));
+            pnode->fSocketWritable = fSelectable && FD_ISSET(hSocket, &fdsetSend);
+        }
+    }
+}
+
 CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
 {
     if (pszDest == NULL) {
@@ -497,6 +704,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
         // Add node
         CNode* pnode = new CNode(hSocket, addrConnect, pszDest ? pszDest : "", false);
         pnode->AddRef();
+        SocketEventsAdd(pnode);
 
         {
             LOCK(cs_vNodes);
@@ -525,7 +733,7 @@ void CNode::CloseSocketDisconnect()
     // in case this fails, we'll empty the recv buffer when the CNode is deleted
     TRY_LOCK(cs_vRecvMsg, lockRecv);
     if (lockRecv)
-        vRecvMsg.clear();
+        EraseRecvMsg(vRecvMsg.end());
 
     // if this was the sync node, we'll need a new one
     if (this == pnodeSync)
@@ -534,6 +742,7 @@ void CNode::CloseSocketDisconnect()
 
 void CNode::Cleanup()
 {
+    EraseOrphansFor(id);
 }
 
 
@@ -553,6 +762,15 @@ void CNode::PushVersion()
 
 
 
+static NodeId nLastNodeId = 0;
+static CCriticalSection cs_nLastNodeId;
+
+NodeId GetNewNodeId()
+{
+    LOCK(cs_nLastNodeId);
+    return nLastNodeId++;
+}
+
 std::map<CNetAddr, int64> CNode::setBanned;
 CCriticalSection CNode::cs_setBanned;
 
@@ -618,6 +836,8 @@ void CNode::copyStats(CNodeStats &stats)
     X(nMisbehavior);
     X(nSendBytes);
     X(nRecvBytes);
+    X(nSendSize);
+    X(nRecvSize);
     stats.fSyncNode = (this == pnodeSync);
 }
 #undef X
@@ -633,6 +853,7 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
             vRecvMsg.push_back(CNetMessage(SER_NETWORK, nRecvVersion));
 
         CNetMessage& msg = vRecvMsg.back();
+        unsigned int nPosBefore = msg.nHdrPos + msg.nDataPos;
 
         // absorb network data
         int handled;
@@ -641,6 +862,10 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
         else
             handled = msg.readData(pch, nBytes);
 
+        unsigned int nAdded = msg.nHdrPos + msg.nDataPos - nPosBefore;
+        nRecvSize += nAdded;
+        AddTotalRecvQueued(nAdded);
+
         if (handled < 0)
                 return false;
 
@@ -651,6 +876,17 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
     return true;
 }
 
+// requires LOCK(cs_vRecvMsg)
+void CNode::EraseRecvMsg(std::deque<CNetMessage>::iterator itEnd)
+{
+    size_t nBytes = 0;
+    for (std::deque<CNetMessage>::iterator it = vRecvMsg.begin(); it != itEnd; it++)
+        nBytes += (*it).nHdrPos + (*it).nDataPos;
+    vRecvMsg.erase(vRecvMsg.begin(), itEnd);
+    nRecvSize -= nBytes;
+    AddTotalRecvQueued(-(int64)nBytes);
+}
+
 int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 {
     // copy data to temporary parsing buffer
@@ -678,7 +914,6 @@ int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 
     // switch state to reading message data
     in_data = true;
-    vRecv.resize(hdr.nMessageSize);
 
     return nCopy;
 }
@@ -688,6 +923,10 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
     unsigned int nRemaining = hdr.nMessageSize - nDataPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
+    // Allocate as the data comes in, not for the size the header claims
+    if (vRecv.size() < nDataPos + nCopy)
+        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
+
     memcpy(&vRecv[nDataPos], pch, nCopy);
     nDataPos += nCopy;
 
@@ -702,13 +941,45 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 
 
 
+uint64 GetTotalSendQueued()
+{
+    LOCK(cs_totalQueued);
+    return nTotalSendQueued;
+}
+
+uint64 GetTotalRecvQueued()
+{
+    LOCK(cs_totalQueued);
+    return nTotalRecvQueued;
+}
+
+void AddTotalSendQueued(int64 nBytes)
+{
+    bool fDrained;
+    {
+        LOCK(cs_totalQueued);
+        uint64 nLimit = SendBufferTotalSize();
+        fDrained = nTotalSendQueued >= nLimit && nTotalSendQueued + nBytes < nLimit;
+        nTotalSendQueued += nBytes;
+    }
+    // Peers may have held off answering requests for the others to drain
+    if (fDrained)
+        WakeMessageHandler();
+}
+
+void AddTotalRecvQueued(int64 nBytes)
+{
+    LOCK(cs_totalQueued);
+    nTotalRecvQueued += nBytes;
+}
+
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    std::deque<boost::shared_ptr<const CSerializeData> >::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
+        const CSerializeData &data = **it;
         assert(data.size() > pnode->nSendOffset);
         int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
         if (nBytes > 0) {
@@ -717,7 +988,7 @@ void SocketSendData(CNode *pnode)
             pnode->nSendOffset += nBytes;
             if (pnode->nSendOffset == data.size()) {
                 pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
+                pnode->AddSendSize(-(int64)data.size());
                 it++;
             } else {
                 // could not send full message; stop sending more
@@ -746,10 +1017,12 @@ void SocketSendData(CNode *pnode)
 }
 
 static list<CNode*> vNodesDisconnected;
+static bool IsMessageHandlerSignalled(CNode* pnode);
 
 void ThreadSocketHandler()
 {
     unsigned int nPrevNodeCount = 0;
+    bool fMoreWork = false;
     loop
     {
         //
@@ -786,7 +1059,7 @@ void ThreadSocketHandler()
             BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
             {
                 // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0)
+                if (pnode->GetRefCount() <= 0 && !IsMessageHandlerSignalled(pnode))
                 {
                     bool fDelete = false;
                     {
@@ -820,90 +1093,20 @@ void ThreadSocketHandler()
         //
         // Find which sockets have data to receive
         //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket);
-            have_fds = true;
-        }
-        {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
-            {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
-                have_fds = true;
-
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signalling.
-                // * Otherwise, if there is no (complete) message in the receive buffer,
-                //   or there is space left in the buffer, select() for receiving data.
-                // * (if neither of the above applies, there is certainly one message
-                //   in the receiver buffer ready to be processed).
-                // Together, that means that at least one of the following is always possible,
-                // so we don't deadlock:
-                // * We send some data.
-                // * We wait for data to be received (and disconnect after timeout).
-                // * We process a message in the buffer (message handler thread).
-                {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSendMsg.empty()) {
-                        FD_SET(pnode->hSocket, &fdsetSend);
-                        continue;
-                    }
-                }
-                {
-                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (
-                        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
-                        FD_SET(pnode->hSocket, &fdsetRecv);
-                }
-            }
-        }
-
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
-        boost::this_thread::interruption_point();
-
-        if (nSelect == SOCKET_ERROR)
-        {
-            if (have_fds)
-            {
-                int nErr = WSAGetLastError();
-                printf("socket select error %d\n", nErr);
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
-            }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec/1000);
-        }
+        // Don't block if a node was left with data to receive or send that
+        // couldn't be handled last pass, readiness isn't reported again for it.
+        // A node whose buffers were locked by the message handler, which can
+        // take a while over a block, is tried again at the next poll instead.
+        bool fListenReady;
+        SocketEventsWait(fMoreWork ? 0 : 50, fListenReady); // frequency to poll pnode->vSend
+        fMoreWork = false;
 
 
         //
         // Accept new connections
         //
         BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
-        if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+        if (fListenReady && hListenSocket != INVALID_SOCKET)
         {
 #ifdef USE_IPV6
             struct sockaddr_storage sockaddr;
@@ -932,6 +1135,15 @@ void ThreadSocketHandler()
                 if (nErr != WSAEWOULDBLOCK)
                     printf("socket error accept failed: %d\n", nErr);
             }
+#ifdef USE_EPOLL
+            else if (hEpoll == -1 && !IsSelectableSocket(hSocket))
+#else
+            else if (!IsSelectableSocket(hSocket))
+#endif
+            {
+                printf("connection from %s dropped (too many open sockets for select)\n", addr.ToString().c_str());
+                closesocket(hSocket);
+            }
             else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS)
             {
                 {
@@ -950,6 +1162,7 @@ void ThreadSocketHandler()
                 printf("accepted connection %s\n", addr.ToString().c_str());
                 CNode* pnode = new CNode(hSocket, addr, "", true);
                 pnode->AddRef();
+                SocketEventsAdd(pnode);
                 {
                     LOCK(cs_vNodes);
                     vNodes.push_back(pnode);
@@ -975,12 +1188,20 @@ void ThreadSocketHandler()
             //
             // Receive
             //
+            // If there is data to send, we first drain the write buffer before
+            // receiving more. This avoids needlessly queueing received data, if
+            // the remote peer is not themselves receiving data. This means properly
+            // utilizing TCP flow control signalling. Otherwise, receive if there is
+            // no (complete) message in the receive buffer, or there is space left
+            // in the buffer. If neither applies, there is certainly one message in
+            // the receive buffer ready to be processed by the message handler
+            // thread, so at least one of them can always make progress.
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+            if (pnode->fSocketReadable && pnode->nSendSize == 0)
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
+                if (lockRecv && pnode->IsReceiveBufferAvailable())
                 {
                     {
                         // typical socket buffer is 8K-64K
@@ -990,8 +1211,13 @@ void ThreadSocketHandler()
                         {
                             if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
                                 pnode->CloseSocketDisconnect();
+                            else if (pnode->vRecvMsg.front().complete())
+                                WakeMessageHandler(pnode);
                             pnode->nLastRecv = GetTime();
                             pnode->nRecvBytes += nBytes;
+                            // a short read drained the socket
+                            if (nBytes < (int)sizeof(pchBuf))
+                                pnode->fSocketReadable = false;
                         }
                         else if (nBytes == 0)
                         {
@@ -1004,7 +1230,9 @@ void ThreadSocketHandler()
                         {
                             // error
                             int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+                            if (nErr == WSAEWOULDBLOCK)
+                                pnode->fSocketReadable = false;
+                            else if (nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
                             {
                                 if (!pnode->fDisconnect)
                                     printf("socket recv error %d\n", nErr);
@@ -1012,6 +1240,8 @@ void ThreadSocketHandler()
                             }
                         }
                     }
+                    if (pnode->fSocketReadable && pnode->hSocket != INVALID_SOCKET)
+                        fMoreWork = true;
                 }
             }
 
@@ -1020,11 +1250,27 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
+            if (pnode->fSocketWritable)
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                    SocketSendData(pnode);
+                if (lockSend && !pnode->vSendMsg.empty())
+                {
+                    // a full send buffer holds up the node's message processing
+                    if (pnode->nSendSize >= SendBufferSize())
+                    {
+                        SocketSendData(pnode);
+                        if (pnode->nSendSize < SendBufferSize())
+                            WakeMessageHandler(pnode);
+                    }
+                    else
+                        SocketSendData(pnode);
+                    // anything left over means the socket buffer is full,
+                    // otherwise receiving can resume
+                    if (!pnode->vSendMsg.empty())
+                        pnode->fSocketWritable = false;
+                    else if (pnode->fSocketReadable)
+                        fMoreWork = true;
+                }
             }
 
             //
@@ -1331,10 +1577,11 @@ void DumpAddresses()
     int64 nStart = GetTimeMillis();
 
     CAddrDB adb;
-    adb.Write(addrman);
+    bool fSnapshot;
+    adb.Append(addrman, &fSnapshot);
 
-    printf("Flushed %d addresses to peers.dat  %"PRI64d"ms\n",
-           addrman.size(), GetTimeMillis() - nStart);
+    printf("Flushed %d addresses to %s  %"PRI64d"ms\n",
+           addrman.size(), fSnapshot ? "peers.dat" : "peers.log", GetTimeMillis() - nStart);
 }
 
 void static ProcessOneShot()
@@ -1604,75 +1851,229 @@ void static StartSync(const vector<CNode*> &vNodes) {
     }
 }
 
+// The message handler thread sleeps until a node has a complete message or
+// room in its send buffer again, or inventory was queued for relay, instead of
+// polling all nodes. Signalled nodes are put on a list, so that it only looks
+// at those. It queues the nodes that have work, and handles them itself or,
+// with -msghandthreads, leaves them to a pool of worker threads. A node is
+// queued at most once at a time, so each node's messages are still handled
+// one after the other.
+static boost::mutex mutexMessageHandler;
+static boost::condition_variable condMessageHandler;
+static boost::condition_variable condMessageHandlerWork;
+static bool fMessageHandlerWake = false;
+static bool fMessageHandlerWakeAll = false;
+static std::vector<CNode*> vMessageHandlerWake; // signalled nodes, not deleted while on it
+static std::deque<std::pair<CNode*, bool> > vMessageHandlerQueue; // node, send trickle
+static int nMessageHandlerThreads = 0;
+
+// Put pnode on the list of signalled nodes, unless it is on it already.
+// Needs mutexMessageHandler.
+static void SignalMessageHandler(CNode* pnode)
+{
+    if (pnode->fMessageHandlerWake)
+        return;
+    pnode->fMessageHandlerWake = true;
+    vMessageHandlerWake.push_back(pnode);
+}
+
+static bool IsMessageHandlerSignalled(CNode* pnode)
+{
+    boost::unique_lock<boost::mutex> lock(mutexMessageHandler);
+    return pnode->fMessageHandlerWake;
+}
+
+void WakeMessageHandler(CNode* pnode)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutexMessageHandler);
+        if (pnode)
+            SignalMessageHandler(pnode);
+        else
+            fMessageHandlerWakeAll = true;
+        fMessageHandlerWake = true;
+    }
+    condMessageHandler.notify_one();
+}
+
+// Handle one message of a queued node and send what it has pending
+static void ProcessNodeMessages(CNode* pnode, bool fSendTrickle)
+{
+    bool fMoreWork = false;
+    if (!pnode->fDisconnect)
+    {
+        // Receive messages
+        {
+            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+            if (lockRecv)
+            {
+                if (!ProcessMessages(pnode))
+                    pnode->CloseSocketDisconnect();
+
+                if (!pnode->IsSendBufferFull())
+                {
+                    if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
+                    {
+                        fMoreWork = true;
+                    }
+                }
+            }
+            else
+                fMoreWork = true;
+        }
+        boost::this_thread::interruption_point();
+
+        // Send messages
+        {
+            TRY_LOCK(pnode->cs_vSend, lockSend);
+            if (lockSend)
+                SendMessages(pnode, fSendTrickle);
+        }
+        boost::this_thread::interruption_point();
+    }
+
+    // Requeue it on the next pass if it still has work, or was signalled
+    // while it was being handled
+    bool fWake;
+    {
+        boost::unique_lock<boost::mutex> lock(mutexMessageHandler);
+        pnode->fMessageHandlerQueued = false;
+        if (fMoreWork)
+            SignalMessageHandler(pnode);
+        fWake = pnode->fMessageHandlerWake;
+        if (fWake)
+            fMessageHandlerWake = true;
+    }
+    if (fWake)
+        condMessageHandler.notify_one();
+
+    {
+        LOCK(cs_vNodes);
+        pnode->Release();
+    }
+}
+
+static bool PopMessageHandlerQueue(std::pair<CNode*, bool>& work, bool fWait)
+{
+    boost::unique_lock<boost::mutex> lock(mutexMessageHandler);
+    while (vMessageHandlerQueue.empty())
+    {
+        if (!fWait)
+            return false;
+        condMessageHandlerWork.wait(lock);
+    }
+    work = vMessageHandlerQueue.front();
+    vMessageHandlerQueue.pop_front();
+    return true;
+}
+
+void ThreadMessageHandlerWorker()
+{
+    SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
+    while (true)
+    {
+        std::pair<CNode*, bool> work;
+        PopMessageHandlerQueue(work, true);
+        ProcessNodeMessages(work.first, work.second);
+    }
+}
+
 void ThreadMessageHandler()
 {
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
+    int64 nNextTrickle = 0;
     while (true)
     {
-        bool fHaveSyncNode = false;
+        // Every 100ms all nodes get a turn, for the periodic work in
+        // SendMessages (pings, address relay and trickled inventory). In
+        // between only nodes that were signalled are visited, each handling
+        // at most one message per turn so a busy peer can't starve the others.
+        bool fTrickle = GetTimeMillis() >= nNextTrickle;
+        if (fTrickle)
+            nNextTrickle = GetTimeMillis() + 100;
+        bool fAll;
+        {
+            boost::unique_lock<boost::mutex> lock(mutexMessageHandler);
+            fAll = fTrickle || fMessageHandlerWakeAll;
+            fMessageHandlerWakeAll = false;
+        }
 
         vector<CNode*> vNodesCopy;
+        if (fAll)
         {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy) {
-                pnode->AddRef();
-                if (pnode == pnodeSync)
-                    fHaveSyncNode = true;
+            bool fHaveSyncNode = false;
+            {
+                LOCK(cs_vNodes);
+                vNodesCopy = vNodes;
+                BOOST_FOREACH(CNode* pnode, vNodesCopy) {
+                    pnode->AddRef();
+                    if (pnode == pnodeSync)
+                        fHaveSyncNode = true;
+                }
             }
-        }
 
-        if (!fHaveSyncNode)
-            StartSync(vNodesCopy);
+            if (!fHaveSyncNode)
+                StartSync(vNodesCopy);
+        }
 
-        // Poll the connected nodes for messages
         CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
+        if (fTrickle && !vNodesCopy.empty())
             pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
 
-        bool fSleep = true;
-
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        // Queue the nodes that have work and aren't queued already, the
+        // queue holds a reference to them
         {
-            if (pnode->fDisconnect)
-                continue;
-
-            // Receive messages
+            LOCK(cs_vNodes);
+            boost::unique_lock<boost::mutex> lock(mutexMessageHandler);
+            vector<CNode*> vWake;
+            vWake.swap(vMessageHandlerWake);
+            BOOST_FOREACH(CNode* pnode, vWake)
             {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
+                if (pnode->fMessageHandlerQueued)
                 {
-                    if (!ProcessMessages(pnode))
-                        pnode->CloseSocketDisconnect();
-
-                    if (pnode->nSendSize < SendBufferSize())
-                    {
-                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
-                        {
-                            fSleep = false;
-                        }
-                    }
+                    // Its turn comes once it is done with the message at hand
+                    vMessageHandlerWake.push_back(pnode);
+                    continue;
                 }
+                pnode->fMessageHandlerQueued = true;
+                pnode->fMessageHandlerWake = false;
+                pnode->AddRef();
+                vMessageHandlerQueue.push_back(std::make_pair(pnode, pnode == pnodeTrickle));
             }
-            boost::this_thread::interruption_point();
-
-            // Send messages
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
             {
-                TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                    SendMessages(pnode, pnode == pnodeTrickle);
+                if (pnode->fMessageHandlerQueued)
+                    continue;
+                pnode->fMessageHandlerQueued = true;
+                pnode->AddRef();
+                vMessageHandlerQueue.push_back(std::make_pair(pnode, pnode == pnodeTrickle));
             }
-            boost::this_thread::interruption_point();
         }
 
+        if (nMessageHandlerThreads > 0)
+            condMessageHandlerWork.notify_all();
+        else
+        {
+            std::pair<CNode*, bool> work;
+            while (PopMessageHandlerQueue(work, false))
+                ProcessNodeMessages(work.first, work.second);
+        }
+
+        if (!vNodesCopy.empty())
         {
             LOCK(cs_vNodes);
             BOOST_FOREACH(CNode* pnode, vNodesCopy)
                 pnode->Release();
         }
 
-        if (fSleep)
-            MilliSleep(100);
+        {
+            boost::unique_lock<boost::mutex> lock(mutexMessageHandler);
+            boost::system_time timeout = boost::get_system_time() + boost::posix_time::milliseconds(max(nNextTrickle - GetTimeMillis(), (int64)0));
+            while (!fMessageHandlerWake)
+                if (!condMessageHandler.timed_wait(lock, timeout))
+                    break;
+            fMessageHandlerWake = false;
+        }
     }
 }
 
@@ -1847,6 +2248,8 @@ void StartNode(boost::thread_group& threadGroup)
     if (pnodeLocalHost == NULL)
         pnodeLocalHost = new CNode(INVALID_SOCKET, CAddress(CService("127.0.0.1", 0), nLocalServices));
 
+    SocketEventsInit();
+
     Discover();
 
     //
@@ -1873,7 +2276,10 @@ void StartNode(boost::thread_group& threadGroup)
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
 
     // Process messages
+    nMessageHandlerThreads = max((int)GetArg("-msghandthreads", 0), 0);
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    for (int i = 0; i < nMessageHandlerThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msgwork", &ThreadMessageHandlerWorker));
 
     // Dump network addresses
     threadGroup.create_thread(boost::bind(&LoopForever<void (*)()>, "dumpaddr", &DumpAddresses, DUMP_ADDRESSES_INTERVAL * 1000));
@@ -1910,6 +2316,10 @@ public:
             if (hListenSocket != INVALID_SOCKET)
                 if (closesocket(hListenSocket) == SOCKET_ERROR)
                     printf("closesocket(hListenSocket) failed with error %d\n", WSAGetLastError());
+#ifdef USE_EPOLL
+        if (hEpoll != -1)
+            close(hEpoll);
+#endif
 
         // clean up some globals (to help leak detection)
         BOOST_FOREACH(CNode *pnode, vNodes)
@@ -1958,9 +2368,17 @@ void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataSt
         }
 
         // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
-        vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
+        if (mapRelay.insert(std::make_pair(hash, MakeFramedMessage("tx", ss))).second)
+            vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, hash));
     }
+
+    // Decided once here rather than for each peer
+    bool fTrickle = IsTrickledTransaction(hash);
+
+    // The data the peers' filters match against, extracted for the first
+    // filtered peer and reused for the others
+    boost::optional<CBloomTxElements> elements;
+
     LOCK(cs_vNodes);
     BOOST_FOREACH(CNode* pnode, vNodes)
     {
@@ -1969,9 +2387,37 @@ void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataSt
         LOCK(pnode->cs_filter);
         if (pnode->pfilter)
         {
-            if (pnode->pfilter->IsRelevantAndUpdate(tx, hash))
-                pnode->PushInventory(inv);
+            if (!elements)
+                elements = CBloomTxElements(tx, hash);
+            if (pnode->pfilter->IsRelevantAndUpdate(*elements))
+                pnode->PushInventory(inv, fTrickle);
         } else
-            pnode->PushInventory(inv);
+            pnode->PushInventory(inv, fTrickle);
     }
+    if (!fTrickle)
+        WakeMessageHandler();
+}
+
+boost::shared_ptr<const CSerializeData> GetRelayedTransaction(const uint256& hash)
+{
+    LOCK(cs_mapRelay);
+    boost::unordered_map<uint256, boost::shared_ptr<const CSerializeData>, CRelayHasher>::const_iterator mi = mapRelay.find(hash);
+    if (mi == mapRelay.end())
+        return boost::shared_ptr<const CSerializeData>();
+    return mi->second;
+}
+
+boost::shared_ptr<const CSerializeData> MakeFramedMessage(const char* pszCommand, const CDataStream& ssPayload)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss.reserve(CMessageHeader::HEADER_SIZE + ssPayload.size());
+    CMessageHeader hdr(pszCommand, ssPayload.size());
+    uint256 hash = Hash(ssPayload.begin(), ssPayload.end());
+    memcpy(&hdr.nChecksum, &hash, sizeof(hdr.nChecksum));
+    ss << hdr;
+    ss.write(&ssPayload[0], ssPayload.size());
+
+    CSerializeData* pmsg = new CSerializeData();
+    ss.GetAndClear(*pmsg);
+    return boost::shared_ptr<const CSerializeData>(pmsg);
 }
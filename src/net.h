@@ -8,6 +8,7 @@
 #include <deque>
 #include <boost/array.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <openssl/rand.h>
 
 #ifndef WIN32
@@ -26,10 +27,29 @@ class CNode;
 class CBlockIndex;
 extern int nBestHeight;
 
+/** Identifies a peer for as long as the process runs; not reused like CNode pointers */
+typedef int NodeId;
+NodeId GetNewNodeId();
+
 
 
 inline unsigned int ReceiveFloodSize() { return 1000*GetArg("-maxreceivebuffer", 5*1000); }
 inline unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 1*1000); }
+inline uint64 ReceiveFloodTotalSize() { return 1000*GetArg("-maxreceivebuffertotal", 100*1000); }
+inline uint64 SendBufferTotalSize() { return 1000*GetArg("-maxsendbuffertotal", 100*1000); }
+
+/** Inventory hashes remembered per peer. Outbound peers carry most of our
+ *  relay, so their filter remembers more of it (about 540 kB at 1e-6); the
+ *  inbound one (about 108 kB) still covers some 25 minutes of inventory. */
+static const unsigned int INVENTORY_KNOWN_OUTBOUND = 50000;
+static const unsigned int INVENTORY_KNOWN_INBOUND = 10000;
+
+/** Bytes waiting in the receive queues of all peers together, and in the send
+ *  queues beyond what each peer may hold on its own */
+uint64 GetTotalSendQueued();
+uint64 GetTotalRecvQueued();
+void AddTotalSendQueued(int64 nBytes);
+void AddTotalRecvQueued(int64 nBytes);
 
 void AddOneShot(std::string strDest);
 bool RecvLine(SOCKET hSocket, std::string& strLine);
@@ -44,6 +64,8 @@ bool BindListenPort(const CService &bindAddr, std::string& strError=REF(std::str
 void StartNode(boost::thread_group& threadGroup);
 bool StopNode();
 void SocketSendData(CNode *pnode);
+/** Signal the message handler thread that pnode has work, or all nodes if NULL */
+void WakeMessageHandler(CNode* pnode = NULL);
 
 enum
 {
@@ -78,9 +100,6 @@ extern int nMaxConnections;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
-extern std::deque<std::pair<int64, CInv> > vRelayExpiration;
-extern CCriticalSection cs_mapRelay;
 extern limitedmap<CInv, int64> mapAlreadyAskedFor;
 
 extern std::vector<std::string> vAddedNodes;
@@ -104,6 +123,8 @@ public:
     int nMisbehavior;
     uint64 nSendBytes;
     uint64 nRecvBytes;
+    size_t nSendSize;
+    size_t nRecvSize;
     bool fSyncNode;
 };
 
@@ -153,6 +174,7 @@ public:
 class CNode
 {
 public:
+    NodeId id;
     // socket
     uint64 nServices;
     SOCKET hSocket;
@@ -160,12 +182,24 @@ public:
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64 nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    // messages can be shared between peers, like cached blocks
+    std::deque<boost::shared_ptr<const CSerializeData> > vSendMsg;
     CCriticalSection cs_vSend;
+    // Socket readiness, set by the socket thread from epoll or select() and
+    // kept until a recv or send on the socket would block
+    bool fSocketReadable;
+    bool fSocketWritable;
+
+    // Set when the message handler has work for this node, and while the node
+    // is queued for handling. Guarded by the message handler's mutex (see
+    // WakeMessageHandler)
+    bool fMessageHandlerWake;
+    bool fMessageHandlerQueued;
 
     std::deque<CInv> vRecvGetData;
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
+    size_t nRecvSize; // bytes received into vRecvMsg
     uint64 nRecvBytes;
     int nRecvVersion;
 
@@ -193,6 +227,8 @@ public:
     // b) the peer may tell us in their version message that we should not relay tx invs
     //    until they have initialized their bloom filter.
     bool fRelayTxes;
+    // The peer sent sendcmpct: it understands compact blocks
+    bool fCompactBlocks;
     CSemaphoreGrant grantOutbound;
     CCriticalSection cs_filter;
     CBloomFilter* pfilter;
@@ -215,17 +251,21 @@ public:
     // flood relay
     std::vector<CAddress> vAddrToSend;
     std::set<CAddress> setAddrKnown;
+    CCriticalSection cs_addrKnown;
     bool fGetAddr;
     std::set<uint256> setKnown;
 
     // inventory based relay
-    mruset<CInv> setInventoryKnown;
+    CRollingBloomFilter filterInventoryKnown;
     std::vector<CInv> vInventoryToSend;
+    std::vector<CInv> vInventoryToTrickle; // sent on the node's trickle turns only
     CCriticalSection cs_inventory;
     std::multimap<int64, CInv> mapAskFor;
+    std::set<uint256> setAskForCompact; // asked for blocks to get as compact blocks
 
-    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : ssSend(SER_NETWORK, MIN_PROTO_VERSION)
+    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : ssSend(SER_NETWORK, MIN_PROTO_VERSION), filterInventoryKnown(fInboundIn ? INVENTORY_KNOWN_INBOUND : INVENTORY_KNOWN_OUTBOUND, 0.000001)
     {
+        id = GetNewNodeId();
         nServices = 0;
         hSocket = hSocketIn;
         nRecvVersion = MIN_PROTO_VERSION;
@@ -248,6 +288,11 @@ public:
         nRefCount = 0;
         nSendSize = 0;
         nSendOffset = 0;
+        nRecvSize = 0;
+        fSocketReadable = false;
+        fSocketWritable = false;
+        fMessageHandlerWake = false;
+        fMessageHandlerQueued = false;
         hashContinue = 0;
         pindexLastGetBlocksBegin = 0;
         hashLastGetBlocksEnd = 0;
@@ -256,7 +301,7 @@ public:
         fGetAddr = false;
         nMisbehavior = 0;
         fRelayTxes = false;
-        setInventoryKnown.max_size(SendBufferSize() / 1000);
+        fCompactBlocks = false;
         pfilter = new CBloomFilter();
 
         // Be shy and don't send version until we hear
@@ -273,6 +318,8 @@ public:
         }
         if (pfilter)
             delete pfilter;
+        AddSendSize(-(int64)nSendSize);
+        AddTotalRecvQueued(-(int64)nRecvSize);
     }
 
 private:
@@ -290,15 +337,49 @@ public:
     // requires LOCK(cs_vRecvMsg)
     unsigned int GetTotalRecvSize()
     {
-        unsigned int total = 0;
-        BOOST_FOREACH(const CNetMessage &msg, vRecvMsg) 
-            total += msg.vRecv.size() + 24;
-        return total;
+        return nRecvSize;
+    }
+
+    // Whether to read more from the socket: always while the next message
+    // is incomplete, so there is progress, otherwise within the per-peer
+    // and overall receive budgets.
+    // requires LOCK(cs_vRecvMsg)
+    bool IsReceiveBufferAvailable()
+    {
+        if (vRecvMsg.empty() || !vRecvMsg.front().complete())
+            return true;
+        return nRecvSize <= ReceiveFloodSize() && GetTotalRecvQueued() <= ReceiveFloodTotalSize();
+    }
+
+    // Whether to hold off answering requests until the send queues drain.
+    // A peer always has its own -maxsendbuffer, and only goes beyond it
+    // while the budget shared by all peers has room, so peers that stall
+    // can't hold up the others.
+    bool IsSendBufferFull()
+    {
+        return nSendSize >= SendBufferSize() && GetTotalSendQueued() >= SendBufferTotalSize();
+    }
+
+    // Charge queued bytes to the peer, and what is over its own buffer to
+    // the shared budget
+    // requires LOCK(cs_vSend)
+    void AddSendSize(int64 nBytes)
+    {
+        size_t nOwn = SendBufferSize();
+        int64 nOverBefore = nSendSize > nOwn ? nSendSize - nOwn : 0;
+        nSendSize += nBytes;
+        int64 nOverAfter = nSendSize > nOwn ? nSendSize - nOwn : 0;
+        if (nOverAfter != nOverBefore)
+            AddTotalSendQueued(nOverAfter - nOverBefore);
     }
 
     // requires LOCK(cs_vRecvMsg)
     bool ReceiveMsgBytes(const char *pch, unsigned int nBytes);
 
+    // Drop handled messages up to itEnd
+    // requires LOCK(cs_vRecvMsg)
+    void EraseRecvMsg(std::deque<CNetMessage>::iterator itEnd);
+
     // requires LOCK(cs_vRecvMsg)
     void SetRecvVersion(int nVersionIn)
     {
@@ -322,6 +403,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
+        LOCK(cs_addrKnown);
         setAddrKnown.insert(addr);
     }
 
@@ -330,6 +412,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
+        LOCK(cs_addrKnown);
         if (addr.IsValid() && !setAddrKnown.count(addr))
             vAddrToSend.push_back(addr);
     }
@@ -339,16 +422,22 @@ public:
     {
         {
             LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(inv.hash);
         }
     }
 
-    void PushInventory(const CInv& inv)
+    bool IsInventoryKnown(const CInv& inv)
+    {
+        LOCK(cs_inventory);
+        return filterInventoryKnown.contains(inv.hash);
+    }
+
+    void PushInventory(const CInv& inv, bool fTrickle = false)
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
-                vInventoryToSend.push_back(inv);
+            if (!filterInventoryKnown.contains(inv.hash))
+                (fTrickle ? vInventoryToTrickle : vInventoryToSend).push_back(inv);
         }
     }
 
@@ -432,9 +521,11 @@ public:
             printf("(%d bytes)\n", nSize);
         }
 
-        std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-        ssSend.GetAndClear(*it);
-        nSendSize += (*it).size();
+        CSerializeData* pmsg = new CSerializeData();
+        ssSend.GetAndClear(*pmsg);
+        std::deque<boost::shared_ptr<const CSerializeData> >::iterator it =
+            vSendMsg.insert(vSendMsg.end(), boost::shared_ptr<const CSerializeData>(pmsg));
+        AddSendSize(pmsg->size());
 
         // If write queue empty, attempt "optimistic write"
         if (it == vSendMsg.begin())
@@ -443,6 +534,22 @@ public:
         LEAVE_CRITICAL_SECTION(cs_vSend);
     }
 
+    // Queue a message that was framed beforehand, header included, such as
+    // a cached "block" message. The message is shared, not copied.
+    void PushFramedMessage(const boost::shared_ptr<const CSerializeData>& pmsg)
+    {
+        LOCK(cs_vSend);
+        if (fDebug)
+            printf("sending: framed message (%"PRIszu" bytes)\n", pmsg->size());
+
+        std::deque<boost::shared_ptr<const CSerializeData> >::iterator it = vSendMsg.insert(vSendMsg.end(), pmsg);
+        AddSendSize(pmsg->size());
+
+        // If write queue empty, attempt "optimistic write"
+        if (it == vSendMsg.begin())
+            SocketSendData(this);
+    }
+
     void PushVersion();
 
 
@@ -637,5 +744,9 @@ public:
 class CTransaction;
 void RelayTransaction(const CTransaction& tx, const uint256& hash);
 void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataStream& ss);
+/** The "tx" message of a transaction relayed in the last 15 minutes, or NULL */
+boost::shared_ptr<const CSerializeData> GetRelayedTransaction(const uint256& hash);
+/** Serialize a message with its header once, to be sent to several peers */
+boost::shared_ptr<const CSerializeData> MakeFramedMessage(const char* pszCommand, const CDataStream& ssPayload);
 
 #endif
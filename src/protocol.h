@@ -142,6 +142,9 @@ enum
     // Nodes may always request a MSG_FILTERED_BLOCK in a getdata, however,
     // MSG_FILTERED_BLOCK should not appear in any invs except as a part of getdata.
     MSG_FILTERED_BLOCK,
+    // Like MSG_FILTERED_BLOCK, only requested in getdata, answered with a
+    // cmpctblock to peers that sent us sendcmpct.
+    MSG_CMPCT_BLOCK,
 };
 
 #endif // __INCLUDED_PROTOCOL_H__
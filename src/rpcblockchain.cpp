@@ -4,6 +4,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "main.h"
+#include "init.h"
 #include "bitcoinrpc.h"
 
 using namespace json_spirit;
@@ -82,6 +83,54 @@ Value getblockcount(const Array& params, bool fHelp)
 }
 
 
+Value waitfornewblock(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 2)
+        throw runtime_error(
+            "waitfornewblock [timeout] [blockhash]\n"
+            "Waits until the best block is another than <blockhash> (default: the current\n"
+            "best block), or for at most [timeout] milliseconds if given and not 0.\n"
+            "Returns the hash and height of the best block then.");
+
+    int64 nTimeout = 0;
+    if (params.size() > 0)
+        nTimeout = params[0].get_int64();
+    if (nTimeout < 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative timeout");
+
+    uint256 hashKnown;
+    if (params.size() > 1)
+        hashKnown.SetHex(params[1].get_str());
+    else
+    {
+        LOCK(cs_main);
+        hashKnown = hashBestChain;
+    }
+
+    // Wake up every second to notice a shutdown
+    int64 nStop = GetTimeMillis() + nTimeout;
+    uint256 hashBest;
+    loop
+    {
+        int64 nWait = 1000;
+        if (nTimeout > 0)
+            nWait = std::min(nWait, std::max(nStop - GetTimeMillis(), (int64)0));
+        hashBest = WaitForBlockChange(hashKnown, nWait);
+        if (hashBest != hashKnown || (nTimeout > 0 && GetTimeMillis() >= nStop))
+            break;
+        if (ShutdownRequested())
+            throw JSONRPCError(RPC_CLIENT_NOT_CONNECTED, "Shutting down");
+    }
+
+    Object result;
+    LOCK(cs_main);
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBest);
+    result.push_back(Pair("hash", hashBest.GetHex()));
+    result.push_back(Pair("height", mi == mapBlockIndex.end() ? -1 : mi->second->nHeight));
+    return result;
+}
+
+
 Value getdifficulty(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -111,10 +160,47 @@ Value settxfee(const Array& params, bool fHelp)
 
 Value getrawmempool(const Array& params, bool fHelp)
 {
-    if (fHelp || params.size() != 0)
+    if (fHelp || params.size() > 1)
         throw runtime_error(
-            "getrawmempool\n"
-            "Returns all transaction ids in memory pool.");
+            "getrawmempool [verbose=false]\n"
+            "Returns all transaction ids in memory pool.\n"
+            "With verbose, returns an object per transaction id with its size, fee,\n"
+            "time and height it entered the pool, starting and current priority,\n"
+            "the totals with its ancestors and descendants in the pool, and the\n"
+            "pool transactions it spends.");
+
+    bool fVerbose = false;
+    if (params.size() > 0)
+        fVerbose = params[0].get_bool();
+
+    if (fVerbose)
+    {
+        LOCK(mempool.cs);
+        Object o;
+        for (indexed_transaction_set::const_iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+        {
+            const CTxMemPoolEntry& e = *mi;
+            Object info;
+            info.push_back(Pair("size", (int)e.GetTxSize()));
+            info.push_back(Pair("fee", ValueFromAmount(e.GetFee())));
+            info.push_back(Pair("time", (boost::int64_t)e.GetTime()));
+            info.push_back(Pair("height", (int)e.GetHeight()));
+            info.push_back(Pair("startingpriority", e.GetPriority(e.GetHeight())));
+            info.push_back(Pair("currentpriority", e.GetPriority(nBestHeight + 1)));
+            info.push_back(Pair("ancestorcount", (boost::int64_t)e.GetCountWithAncestors()));
+            info.push_back(Pair("ancestorsize", (boost::int64_t)e.GetSizeWithAncestors()));
+            info.push_back(Pair("ancestorfees", ValueFromAmount(e.GetFeesWithAncestors())));
+            info.push_back(Pair("descendantcount", (boost::int64_t)e.GetCountWithDescendants()));
+            info.push_back(Pair("descendantsize", (boost::int64_t)e.GetSizeWithDescendants()));
+            info.push_back(Pair("descendantfees", ValueFromAmount(e.GetFeesWithDescendants())));
+            Array depends;
+            BOOST_FOREACH(CTxMemPool::txiter itParent, mempool.GetMemPoolParents(mi))
+                depends.push_back(itParent->GetHash().ToString());
+            info.push_back(Pair("depends", depends));
+            o.push_back(Pair(e.GetHash().ToString(), info));
+        }
+        return o;
+    }
 
     vector<uint256> vtxid;
     mempool.queryHashes(vtxid);
@@ -126,6 +212,58 @@ Value getrawmempool(const Array& params, bool fHelp)
     return a;
 }
 
+Value getmempoolinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getmempoolinfo\n"
+            "Returns the number of transactions in memory pool, their size in bytes,\n"
+            "the memory the pool takes and may take, and the fee per 1000 bytes it\n"
+            "currently asks of new transactions.");
+
+    int64 nMaxMempool = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
+    Object obj;
+    obj.push_back(Pair("size", (boost::int64_t)mempool.size()));
+    obj.push_back(Pair("bytes", (boost::int64_t)mempool.GetTotalTxSize()));
+    obj.push_back(Pair("usage", (boost::int64_t)mempool.DynamicMemoryUsage()));
+    obj.push_back(Pair("maxmempool", (boost::int64_t)nMaxMempool));
+    obj.push_back(Pair("mempoolminfee", ValueFromAmount(max(mempool.GetMinFee(nMaxMempool), CTransaction::nMinRelayTxFee))));
+    return obj;
+}
+
+Value estimatefee(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "estimatefee <nblocks>\n"
+            "Returns the fee per 1000 bytes a transaction needs to begin\n"
+            "confirmation within <nblocks> blocks, as memory pool transactions\n"
+            "have lately, or -1 if not enough of them were seen yet.");
+
+    int nBlocks = params[0].get_int();
+    if (nBlocks < 1)
+        nBlocks = 1;
+    int64 nFee = mempool.estimateFee(nBlocks);
+    if (nFee < 0)
+        return -1.0;
+    return ValueFromAmount(nFee);
+}
+
+Value estimatepriority(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "estimatepriority <nblocks>\n"
+            "Returns the priority a transaction without a fee needs to begin\n"
+            "confirmation within <nblocks> blocks, as memory pool transactions\n"
+            "have lately, or -1 if not enough of them were seen yet.");
+
+    int nBlocks = params[0].get_int();
+    if (nBlocks < 1)
+        nBlocks = 1;
+    return mempool.estimatePriority(nBlocks);
+}
+
 Value getblockhash(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -183,6 +321,26 @@ Value gettxoutsetinfo(const Array& params, bool fHelp)
     return ret;
 }
 
+Value getpubkeycacheinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getpubkeycacheinfo\n"
+            "Returns statistics about the parsed public key cache used for signature checks.");
+
+    CPubKeyCacheStats stats;
+    GetPubKeyCacheStats(stats);
+
+    uint64 nLookups = stats.nHits + stats.nMisses;
+    Object ret;
+    ret.push_back(Pair("entries", (boost::uint64_t)stats.nEntries));
+    ret.push_back(Pair("maxentries", (boost::uint64_t)stats.nMaxEntries));
+    ret.push_back(Pair("hits", (boost::uint64_t)stats.nHits));
+    ret.push_back(Pair("misses", (boost::uint64_t)stats.nMisses));
+    ret.push_back(Pair("hitrate", nLookups ? (double)stats.nHits / nLookups : 0.0));
+    return ret;
+}
+
 Value gettxout(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() < 2 || params.size() > 3)
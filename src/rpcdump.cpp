@@ -1271,6 +1271,28 @@ Value getmultisigaddressofaddressoraccount(const Array& params, bool fHelp)
 	return x;
 }
 
+// Size of a transaction spending the given multisig outputs to nOutputs
+// addresses, once all the signatures it needs are in
+static unsigned int EstimateMultisigTxSize(const std::vector<my_rawlistunspent> & vSpent, unsigned int nOutputs)
+{
+	// Version, lock time, counts, and each output paying to an address
+	unsigned int nSize = 10 + 34 * nOutputs;
+	BOOST_FOREACH(const my_rawlistunspent & unspent, vSpent)
+	{
+		std::vector<unsigned char> vRedeemScript = ParseHex(unspent.redeemScript);
+		CScript redeemScript(vRedeemScript.begin(), vRedeemScript.end());
+		CScript::const_iterator pc = redeemScript.begin();
+		opcodetype opcode;
+		int nRequired = 1;
+		if (redeemScript.GetOp(pc, opcode) && opcode >= OP_1 && opcode <= OP_16)
+			nRequired = CScript::DecodeOP_N(opcode);
+		// Outpoint, sequence and script length, OP_0, a signature per key
+		// required, and the redeem script pushed
+		nSize += 41 + 3 + 1 + 73 * nRequired + 3 + vRedeemScript.size();
+	}
+	return nSize;
+}
+
 bool buildtransaction_multisig(std::string & account_or_address, std::string & receive_address, double amount, double fee, int minconfirmations, Array & params)
 {
 	if(minconfirmations<0)
@@ -1303,34 +1325,56 @@ bool buildtransaction_multisig(std::string & account_or_address, std::string & r
 	{
 		return false;
 	}
+	// Without a fee given, pay what lately got transactions of its size
+	// confirmed within -txconfirmtarget blocks
+	int64 nFeeEstimate = -1;
+	if(fee==0 && nTxConfirmTarget > 0)
+		nFeeEstimate = mempool.estimateFee(nTxConfirmTarget);
 	Array arr;
-	double tAmount=amount+fee;
-	double currentAmount = 0;
-	int size=my_unspenttransactions.size();
 	Array arr2;
-	Array paramsR;
-	for(int i = 0; i < size; i++)
+	double currentAmount;
+	int size=my_unspenttransactions.size();
+	loop
 	{
-			if(currentAmount >= tAmount)
-			{
-				break;
-			}
-			Object obj;
-			obj.push_back(Pair("txid", my_unspenttransactions.at(i).txid));
-			obj.push_back(Pair("vout", my_unspenttransactions.at(i).vout));
-			obj.push_back(Pair("scriptPubKey", my_unspenttransactions.at(i).scriptPubKey));
-			obj.push_back(Pair("redeemScript", my_unspenttransactions.at(i).redeemScript));
-			if(my_unspenttransactions.at(i).confirmations>=minconfirmations)
-			{
-				arr2.push_back(my_unspenttransactions.at(i).txid);
-				arr.push_back(obj);
-				currentAmount+=my_unspenttransactions.at(i).amount;
-			}
-			if(i+1==size&&currentAmount < tAmount)
-			{
-				return false;
-			}
+		arr.clear();
+		arr2.clear();
+		currentAmount = 0;
+		std::vector<my_rawlistunspent> vSpent;
+		double tAmount=amount+fee;
+		for(int i = 0; i < size; i++)
+		{
+				if(currentAmount >= tAmount)
+				{
+					break;
+				}
+				Object obj;
+				obj.push_back(Pair("txid", my_unspenttransactions.at(i).txid));
+				obj.push_back(Pair("vout", my_unspenttransactions.at(i).vout));
+				obj.push_back(Pair("scriptPubKey", my_unspenttransactions.at(i).scriptPubKey));
+				obj.push_back(Pair("redeemScript", my_unspenttransactions.at(i).redeemScript));
+				if(my_unspenttransactions.at(i).confirmations>=minconfirmations)
+				{
+					arr2.push_back(my_unspenttransactions.at(i).txid);
+					arr.push_back(obj);
+					vSpent.push_back(my_unspenttransactions.at(i));
+					currentAmount+=my_unspenttransactions.at(i).amount;
+				}
+				if(i+1==size&&currentAmount < tAmount)
+				{
+					return false;
+				}
+		}
+		if(nFeeEstimate <= 0)
+			break;
+		// More inputs make it larger, so pick again until the fee covers it
+		double feeNeeded = (double)(nFeeEstimate * EstimateMultisigTxSize(vSpent, 2) / 1000) / COIN;
+		if(fee >= feeNeeded)
+			break;
+		fee = feeNeeded;
+		if(amount<=fee)
+			return false;
 	}
+	Array paramsR;
 	paramsR.push_back(arr);
 	Object obj2;
 	double diff=currentAmount-amount-fee;
@@ -1340,13 +1384,15 @@ bool buildtransaction_multisig(std::string & account_or_address, std::string & r
 	paramsR.push_back(obj2);
 	params.push_back(paramsR);
 	params.push_back(arr2);
+	return true;
 }
 
 Value createtransaction_multisig(const Array& params, bool fHelp)
 {
 	if (fHelp || params.size() < 4 || params.size() > 5)
         throw runtime_error("createtransaction_multisig <account_or_address> <receive_address> <amount> <fee> [<min_confirmations>]\n"
-							"Returns a json array!\n");
+							"Returns a json array!\n"
+							"With a fee of 0 and -txconfirmtarget set, the fee is the estimate for the transaction's size\n");
 	string account_or_address=params[0].get_str();
 	string receive_address=params[1].get_str();
 	double amount = params[2].get_real();
@@ -1379,6 +1425,7 @@ Value createrawtransaction_multisig(const Array& params, bool fHelp)
         throw runtime_error("createrawtransaction_multisig <account_or_address> <receive_address> <amount> <fee> [<minconfirmations>] [<set>]\n"
 							"minconfirmations is a optional parameter and is the value of confirmations that a unspent txid transaction at least must have\n"
 							"to can build the transaction, default is 0 if you not set this parameter\n"
+							"with a fee of 0 and -txconfirmtarget set, the fee is the estimate for the transaction's size\n"
 							"set is a optional parameter and if set is true then the output is a object\n"
 							"if set is not set the output is a enncrypted + base64 encoded string\n");
 	string account_or_address=params[0].get_str();
@@ -149,7 +149,7 @@ Value getwork(const Array& params, bool fHelp)
 
         // Update nExtraNonce
         static unsigned int nExtraNonce = 0;
-        IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
+        IncrementExtraNonce(pblocktemplate, pindexPrev, nExtraNonce);
 
         // Save
         mapNewBlock[pblock->hashMerkleRoot] = make_pair(pblock, pblock->vtx[0].vin[0].scriptSig);
@@ -216,9 +216,13 @@ Value getblocktemplate(const Array& params, bool fHelp)
             "  \"sizelimit\" : limit of block size\n"
             "  \"bits\" : compressed target of next block\n"
             "  \"height\" : height of the next block\n"
+            "  \"longpollid\" : pass as \"longpollid\" in [params] to wait for the next template\n"
+            "A request with a longpollid only returns once the best block changed, or,\n"
+            "after a minute, once new transactions came in.\n"
             "See https://en.bitcoin.it/wiki/BIP_0022 for full specification.");
 
     std::string strMode = "template";
+    Value lpval = Value::null;
     if (params.size() > 0)
     {
         const Object& oparam = params[0].get_obj();
@@ -231,6 +235,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
         }
         else
             throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid mode");
+        lpval = find_value(oparam, "longpollid");
     }
 
     if (strMode != "template")
@@ -242,13 +247,45 @@ Value getblocktemplate(const Array& params, bool fHelp)
     if (IsInitialBlockDownload())
         throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "Bitcoin is downloading blocks...");
 
-    // Update block
+    if (lpval.type() != null_type)
+    {
+        // Wait, without holding any locks, until the template the client has is outdated
+        uint256 hashWatchedChain;
+        unsigned int nTransactionsUpdatedLastLP;
+        if (lpval.type() == str_type)
+        {
+            // Format: <hashBestChain><nTransactionsUpdated>
+            std::string lpstr = lpval.get_str();
+            hashWatchedChain.SetHex(lpstr.substr(0, 64));
+            nTransactionsUpdatedLastLP = atoi64(lpstr.substr(std::min(lpstr.size(), (size_t)64)));
+        }
+        else
+        {
+            LOCK(cs_main);
+            hashWatchedChain = hashBestChain;
+            nTransactionsUpdatedLastLP = nTransactionsUpdated;
+        }
+
+        // New transactions alone are not worth a new template in the first minute
+        int64 nTxCheckTime = GetTimeMillis() + 60 * 1000;
+        loop
+        {
+            if (WaitForBlockChange(hashWatchedChain, 1000) != hashWatchedChain)
+                break;
+            if (ShutdownRequested())
+                throw JSONRPCError(RPC_CLIENT_NOT_CONNECTED, "Shutting down");
+            if (GetTimeMillis() >= nTxCheckTime && nTransactionsUpdated != nTransactionsUpdatedLastLP)
+                break;
+        }
+    }
+
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+
+    // Update block, which only takes what the block assembler already picked
     static unsigned int nTransactionsUpdatedLast;
     static CBlockIndex* pindexPrev;
-    static int64 nStart;
     static CBlockTemplate* pblocktemplate;
-    if (pindexPrev != pindexBest ||
-        (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 5))
+    if (pindexPrev != pindexBest || nTransactionsUpdated != nTransactionsUpdatedLast)
     {
         // Clear pindexPrev so future calls make a new block, despite any failures from here on
         pindexPrev = NULL;
@@ -256,7 +293,6 @@ Value getblocktemplate(const Array& params, bool fHelp)
         // Store the pindexBest used before CreateNewBlock, to avoid races
         nTransactionsUpdatedLast = nTransactionsUpdated;
         CBlockIndex* pindexPrevNew = pindexBest;
-        nStart = GetTime();
 
         // Create new block
         if(pblocktemplate)
@@ -339,6 +375,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
     result.push_back(Pair("curtime", (int64_t)pblock->nTime));
     result.push_back(Pair("bits", HexBits(pblock->nBits)));
     result.push_back(Pair("height", (int64_t)(pindexPrev->nHeight+1)));
+    result.push_back(Pair("longpollid", pindexPrev->GetBlockHash().GetHex() + i64tostr(nTransactionsUpdatedLast)));
 
     return result;
 }
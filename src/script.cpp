@@ -4,6 +4,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 #include <boost/foreach.hpp>
 #include <boost/tuple/tuple.hpp>
+#include <openssl/sha.h>
 
 using namespace std;
 using namespace boost;
@@ -878,7 +879,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     else if (opcode == OP_SHA1)
                         SHA1(&vch[0], vch.size(), &vchHash[0]);
                     else if (opcode == OP_SHA256)
-                        SHA256(&vch[0], vch.size(), &vchHash[0]);
+                        CSHA256().Write(&vch[0], vch.size()).Finalize(&vchHash[0]);
                     else if (opcode == OP_HASH160)
                     {
                         uint160 hash160 = Hash160(vch);
@@ -1169,6 +1170,148 @@ public:
     }
 };
 
+// Parsed public key cache, to avoid decoding (and decompressing) the same
+// serialized public key into a fresh EC_KEY on every signature check.
+// Multisig outputs tend to reuse a small set of cosigner keys, so the
+// same keys show up over and over again in CHECKMULTISIG evaluations.
+// Shared by all script verification threads.
+
+class CPubKeyCache;
+
+// Lookups counted by one thread, so the script check threads don't take a
+// lock for the statistics on every signature
+struct CPubKeyCacheCounts
+{
+    CPubKeyCache* pcache;
+    uint64 nHits;
+    uint64 nMisses;
+
+    CPubKeyCacheCounts(CPubKeyCache* pcacheIn) : pcache(pcacheIn), nHits(0), nMisses(0) { }
+};
+
+static void ReleasePubKeyCacheCounts(CPubKeyCacheCounts* pcounts);
+
+class CPubKeyCache
+{
+private:
+    std::map<valtype, CKey> mapKeys;
+    // The keys of mapKeys, to pick one at random for eviction
+    std::vector<valtype> vKeys;
+    // -maxpubkeycachesize, read on first use
+    int64 nMaxEntries;
+    boost::shared_mutex cs_pubkeycache;
+
+    // statistics: the counts of each thread, and those of threads that
+    // have exited; cs_stats guards the list and the totals
+    CCriticalSection cs_stats;
+    std::vector<CPubKeyCacheCounts*> vCounts;
+    uint64 nHits;
+    uint64 nMisses;
+    boost::thread_specific_ptr<CPubKeyCacheCounts> ptrCounts;
+
+    CPubKeyCacheCounts& GetCounts()
+    {
+        if (!ptrCounts.get())
+        {
+            ptrCounts.reset(new CPubKeyCacheCounts(this));
+            LOCK(cs_stats);
+            vCounts.push_back(ptrCounts.get());
+        }
+        return *ptrCounts;
+    }
+
+public:
+    CPubKeyCache() : nMaxEntries(-1), nHits(0), nMisses(0), ptrCounts(&ReleasePubKeyCacheCounts) { }
+
+    // Fold the counts of an exiting thread into the totals
+    void ReleaseCounts(CPubKeyCacheCounts* pcounts)
+    {
+        LOCK(cs_stats);
+        nHits += pcounts->nHits;
+        nMisses += pcounts->nMisses;
+        vCounts.erase(std::remove(vCounts.begin(), vCounts.end(), pcounts), vCounts.end());
+    }
+
+    bool Get(const valtype& vchPubKey, CKey& key)
+    {
+        bool fFound = false;
+        {
+            boost::shared_lock<boost::shared_mutex> lock(cs_pubkeycache);
+
+            std::map<valtype, CKey>::const_iterator mi = mapKeys.find(vchPubKey);
+            if (mi != mapKeys.end())
+            {
+                // Copying the EC_KEY is much cheaper than parsing it again,
+                // and leaves the cached key untouched by the verifier.
+                key = mi->second;
+                fFound = true;
+            }
+        }
+        CPubKeyCacheCounts& counts = GetCounts();
+        if (fFound)
+            counts.nHits++;
+        else
+            counts.nMisses++;
+        return fFound;
+    }
+
+    void Set(const valtype& vchPubKey, const CKey& key)
+    {
+        boost::unique_lock<boost::shared_mutex> lock(cs_pubkeycache);
+
+        // Each entry holds an EC_KEY (~500 bytes), so the default
+        // limit keeps the cache at a few MB.
+        if (nMaxEntries < 0)
+            nMaxEntries = std::max((int64)0, GetArg("-maxpubkeycachesize", 5000));
+        if (nMaxEntries == 0) return;
+
+        while (static_cast<int64>(mapKeys.size()) >= nMaxEntries)
+        {
+            // Evict a random entry, for the same reason as the
+            // signature cache above. Serialized keys all start with
+            // 2, 3 or 4, so a random position in the map would not do.
+            unsigned int i = GetRand(vKeys.size());
+            mapKeys.erase(vKeys[i]);
+            vKeys[i].swap(vKeys.back());
+            vKeys.pop_back();
+        }
+
+        if (mapKeys.insert(make_pair(vchPubKey, key)).second)
+            vKeys.push_back(vchPubKey);
+    }
+
+    void GetStats(CPubKeyCacheStats& stats)
+    {
+        {
+            boost::shared_lock<boost::shared_mutex> lock(cs_pubkeycache);
+            stats.nEntries = mapKeys.size();
+            stats.nMaxEntries = nMaxEntries < 0 ? std::max((int64)0, GetArg("-maxpubkeycachesize", 5000)) : nMaxEntries;
+        }
+        // Other threads' counts may be a lookup or so behind
+        LOCK(cs_stats);
+        stats.nHits = nHits;
+        stats.nMisses = nMisses;
+        BOOST_FOREACH(const CPubKeyCacheCounts* pcounts, vCounts)
+        {
+            stats.nHits += pcounts->nHits;
+            stats.nMisses += pcounts->nMisses;
+        }
+    }
+};
+
+static void ReleasePubKeyCacheCounts(CPubKeyCacheCounts* pcounts)
+{
+    pcounts->pcache->ReleaseCounts(pcounts);
+    delete pcounts;
+}
+
+static CPubKeyCache pubKeyCache;
+
+void GetPubKeyCacheStats(CPubKeyCacheStats& stats)
+{
+    pubKeyCache.GetStats(stats);
+}
+
 bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode,
               const CTransaction& txTo, unsigned int nIn, int nHashType, int flags)
 {
@@ -1189,8 +1332,12 @@ bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CSc
         return true;
 
     CKey key;
-    if (!key.SetPubKey(vchPubKey))
-        return false;
+    if (!pubKeyCache.Get(vchPubKey, key))
+    {
+        if (!key.SetPubKey(vchPubKey))
+            return false;
+        pubKeyCache.Set(vchPubKey, key);
+    }
 
     if (!key.Verify(sighash, vchSig))
         return false;
@@ -679,6 +679,19 @@ bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CTransa
 bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
 
+/** Counters of the parsed public key cache used by signature checking */
+struct CPubKeyCacheStats
+{
+    uint64 nEntries;
+    uint64 nMaxEntries;
+    uint64 nHits;
+    uint64 nMisses;
+
+    CPubKeyCacheStats() : nEntries(0), nMaxEntries(0), nHits(0), nMisses(0) {}
+};
+
+void GetPubKeyCacheStats(CPubKeyCacheStats& stats);
+
 // Given two sets of signatures for scriptPubKey, possibly with OP_0 placeholders,
 // combine them intelligently and return the result.
 CScript CombineSignatures(CScript scriptPubKey, const CTransaction& txTo, unsigned int nIn, const CScript& scriptSig1, const CScript& scriptSig2);
@@ -1371,4 +1371,51 @@ public:
     }
 };
 
+/** Stream to deserialize from memory that it doesn't own, such as a
+ *  memory-mapped file, without copying it first. */
+class CBufferReader
+{
+private:
+    const char* pbegin;
+    const char* pend;
+    const char* pcur;
+
+public:
+    int nType;
+    int nVersion;
+
+    CBufferReader(const char* pbeginIn, const char* pendIn, int nTypeIn, int nVersionIn) :
+        pbegin(pbeginIn), pend(pendIn), pcur(pbeginIn), nType(nTypeIn), nVersion(nVersionIn) {
+    }
+
+    // bytes read so far
+    size_t GetPos() const {
+        return pcur - pbegin;
+    }
+
+    // bytes left to read
+    size_t size() const {
+        return pend - pcur;
+    }
+
+    bool empty() const {
+        return pcur == pend;
+    }
+
+    CBufferReader& read(char *pch, size_t nSize) {
+        if (nSize > (size_t)(pend - pcur))
+            throw std::ios_base::failure("CBufferReader::read : end of data");
+        memcpy(pch, pcur, nSize);
+        pcur += nSize;
+        return (*this);
+    }
+
+    template<typename T>
+    CBufferReader& operator>>(T& obj) {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
 #endif
@@ -0,0 +1,58 @@
+// Copyright (c) 2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_SHA256_H
+#define BITCOIN_SHA256_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string>
+
+// The x86 kernels are compiled with per-file target options, which needs
+// intrinsics that are usable without global -m flags (GCC 4.9 and later).
+#if defined(__GNUC__) && !defined(__clang__) && (defined(__x86_64__) || defined(__i386__)) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define USE_SHA256_X86 1
+#endif
+
+/** A hasher class for SHA-256, dispatching to the fastest transform the CPU supports. */
+class CSHA256
+{
+private:
+    uint32_t s[8];
+    unsigned char buf[64];
+    uint64_t bytes;
+
+public:
+    static const size_t OUTPUT_SIZE = 32;
+
+    CSHA256();
+    CSHA256& Write(const unsigned char* data, size_t len);
+    void Finalize(unsigned char hash[OUTPUT_SIZE]);
+    CSHA256& Reset();
+};
+
+/** Select the fastest SHA-256 implementation for this CPU.
+ *  Returns a description of the selected kernels. Until this is called
+ *  the portable implementation is used.
+ */
+std::string SHA256AutoDetect();
+
+/** Compute double-SHA256 of nBlocks independent 64-byte messages.
+ *  The messages are read back to back from input, and the 32-byte
+ *  results written back to back to output. Several messages are
+ *  hashed at once when multi-lane kernels are available.
+ */
+void SHA256D64(unsigned char* output, const unsigned char* input, size_t nBlocks);
+
+/** Scan nonces of a block header for SHA256d hashes with the top 16 bits zero.
+ *  pmidstate is the SHA-256 state after the first 64 header bytes, and pdata
+ *  the 16 words of the padded second block with the nonce in word 3, both as
+ *  native integers (the layout FormatHashBuffers produces). Nonces nNonce+1
+ *  up to nNonce+nCount are tried in order, several per pass when multi-lane
+ *  kernels are available. Returns true at the first hit, with nNonce set to
+ *  it and its hash state words in phash; otherwise nNonce is advanced by nCount.
+ */
+bool SHA256ScanNonces(const uint32_t* pmidstate, const uint32_t* pdata, uint32_t& nNonce, uint32_t nCount, uint32_t* phash);
+
+#endif
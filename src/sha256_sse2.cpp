@@ -0,0 +1,201 @@
+// Copyright (c) 2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+//
+// 4-way double-SHA256 of 64-byte messages and 4-way nonce scanning using SSE2.
+// Only called after SHA256AutoDetect() has checked for CPU support.
+
+#include "sha256.h"
+
+#if defined(USE_SHA256_X86)
+
+#pragma GCC target("sse2")
+
+#include <immintrin.h>
+
+namespace sha256_sse2
+{
+
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+// Round constants plus message schedule of the second block of a
+// 64-byte message, which is always the same padding block.
+static const uint32_t PADDING_KW[64] = {
+    0xc28a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf374,
+    0x649b69c1, 0xf0fe4786, 0x0fe1edc6, 0x240cf254, 0x4fe9346f, 0x6cc984be, 0x61b9411e, 0x16f988fa,
+    0xf2c65152, 0xa88e5a6d, 0xb019fc65, 0xb9d99ec7, 0x9a1231c3, 0xe70eeaa0, 0xfdb1232b, 0xc7353eb0,
+    0x3069bad5, 0xcb976d5f, 0x5a0f118f, 0xdc1eeefd, 0x0a35b689, 0xde0b7a04, 0x58f4ca9d, 0xe15d5b16,
+    0x007f3e86, 0x37088980, 0xa507ea32, 0x6fab9537, 0x17406110, 0x0d8cd6f1, 0xcdaa3b6d, 0xc0bbbe37,
+    0x83613bda, 0xdb48a363, 0x0b02e931, 0x6fd15ca7, 0x521afaca, 0x31338431, 0x6ed41a95, 0x6d437890,
+    0xc39c91f2, 0x9eccabbd, 0xb5c9a0e6, 0x532fb63c, 0xd2c741c6, 0x07237ea3, 0xa4954b68, 0x4c191d76
+};
+
+typedef __m128i vec;
+
+vec inline __attribute__((always_inline)) Const(uint32_t x) { return _mm_set1_epi32(x); }
+vec inline __attribute__((always_inline)) Add(vec x, vec y) { return _mm_add_epi32(x, y); }
+vec inline __attribute__((always_inline)) Xor(vec x, vec y) { return _mm_xor_si128(x, y); }
+vec inline __attribute__((always_inline)) Or(vec x, vec y) { return _mm_or_si128(x, y); }
+vec inline __attribute__((always_inline)) And(vec x, vec y) { return _mm_and_si128(x, y); }
+vec inline __attribute__((always_inline)) ShR(vec x, int n) { return _mm_srli_epi32(x, n); }
+vec inline __attribute__((always_inline)) ShL(vec x, int n) { return _mm_slli_epi32(x, n); }
+
+vec inline __attribute__((always_inline)) Ch(vec x, vec y, vec z) { return Xor(z, And(x, Xor(y, z))); }
+vec inline __attribute__((always_inline)) Maj(vec x, vec y, vec z) { return Or(And(x, y), And(z, Or(x, y))); }
+vec inline __attribute__((always_inline)) Sigma0(vec x) { return Xor(Xor(Or(ShR(x, 2), ShL(x, 30)), Or(ShR(x, 13), ShL(x, 19))), Or(ShR(x, 22), ShL(x, 10))); }
+vec inline __attribute__((always_inline)) Sigma1(vec x) { return Xor(Xor(Or(ShR(x, 6), ShL(x, 26)), Or(ShR(x, 11), ShL(x, 21))), Or(ShR(x, 25), ShL(x, 7))); }
+vec inline __attribute__((always_inline)) sigma0(vec x) { return Xor(Xor(Or(ShR(x, 7), ShL(x, 25)), Or(ShR(x, 18), ShL(x, 14))), ShR(x, 3)); }
+vec inline __attribute__((always_inline)) sigma1(vec x) { return Xor(Xor(Or(ShR(x, 17), ShL(x, 15)), Or(ShR(x, 19), ShL(x, 13))), ShR(x, 10)); }
+
+/** One round of SHA-256 on all lanes; k is the round constant plus the message word. */
+void inline __attribute__((always_inline)) Round(vec a, vec b, vec c, vec& d, vec e, vec f, vec g, vec& h, vec k)
+{
+    vec t1 = Add(Add(h, Sigma1(e)), Add(Ch(e, f, g), k));
+    vec t2 = Add(Sigma0(a), Maj(a, b, c));
+    d = Add(d, t1);
+    h = Add(t1, t2);
+}
+
+/** Extend the 16 message words in w to the full schedule, and add the round constants into kw. */
+void inline Schedule(vec* kw, vec* w)
+{
+    for (int i = 16; i < 64; i++)
+        w[i] = Add(Add(sigma1(w[i - 2]), w[i - 7]), Add(sigma0(w[i - 15]), w[i - 16]));
+    for (int i = 0; i < 64; i++)
+        kw[i] = Add(w[i], Const(K[i]));
+}
+
+/** Run the 64 rounds over state s, feeding the result forward into s. */
+void inline Rounds(vec* s, const vec* kw)
+{
+    vec a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+    for (int i = 0; i < 64; i += 8) {
+        Round(a, b, c, d, e, f, g, h, kw[i]);
+        Round(h, a, b, c, d, e, f, g, kw[i + 1]);
+        Round(g, h, a, b, c, d, e, f, kw[i + 2]);
+        Round(f, g, h, a, b, c, d, e, kw[i + 3]);
+        Round(e, f, g, h, a, b, c, d, kw[i + 4]);
+        Round(d, e, f, g, h, a, b, c, kw[i + 5]);
+        Round(c, d, e, f, g, h, a, b, kw[i + 6]);
+        Round(b, c, d, e, f, g, h, a, kw[i + 7]);
+    }
+    s[0] = Add(s[0], a);
+    s[1] = Add(s[1], b);
+    s[2] = Add(s[2], c);
+    s[3] = Add(s[3], d);
+    s[4] = Add(s[4], e);
+    s[5] = Add(s[5], f);
+    s[6] = Add(s[6], g);
+    s[7] = Add(s[7], h);
+}
+
+uint32_t inline ReadBE32(const unsigned char* p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+void inline WriteBE32(unsigned char* p, uint32_t x)
+{
+    p[0] = x >> 24;
+    p[1] = x >> 16;
+    p[2] = x >> 8;
+    p[3] = x;
+}
+
+/** Load word offset of each of the 4 input messages, one per lane. */
+vec inline Read4(const unsigned char* in, int offset)
+{
+    return _mm_set_epi32(ReadBE32(in + 192 + offset), ReadBE32(in + 128 + offset), ReadBE32(in + 64 + offset), ReadBE32(in + 0 + offset));
+}
+
+/** Store each lane as word offset of the corresponding 4 output hashes. */
+void inline Write4(unsigned char* out, int offset, vec v)
+{
+    uint32_t lanes[4] __attribute__((aligned(16)));
+    _mm_store_si128((vec*)lanes, v);
+    for (int i = 0; i < 4; i++)
+        WriteBE32(out + 32 * i + offset, lanes[i]);
+}
+
+void Transform_4way(unsigned char* out, const unsigned char* in)
+{
+    static const uint32_t IV[8] = {0x6a09e667ul, 0xbb67ae85ul, 0x3c6ef372ul, 0xa54ff53aul, 0x510e527ful, 0x9b05688cul, 0x1f83d9abul, 0x5be0cd19ul};
+    vec s[8], t[8], w[64], kw[64];
+
+    // Transform 1: the 64-byte messages
+    for (int i = 0; i < 8; i++)
+        s[i] = Const(IV[i]);
+    for (int i = 0; i < 16; i++)
+        w[i] = Read4(in, 4 * i);
+    Schedule(kw, w);
+    Rounds(s, kw);
+
+    // Transform 2: the padding block
+    for (int i = 0; i < 64; i++)
+        kw[i] = Const(PADDING_KW[i]);
+    Rounds(s, kw);
+
+    // Transform 3: SHA-256 of the 32-byte first hash
+    for (int i = 0; i < 8; i++) {
+        w[i] = s[i];
+        t[i] = Const(IV[i]);
+    }
+    w[8] = Const(0x80000000ul);
+    for (int i = 9; i < 15; i++)
+        w[i] = Const(0);
+    w[15] = Const(0x100);
+    Schedule(kw, w);
+    Rounds(t, kw);
+
+    for (int i = 0; i < 8; i++)
+        Write4(out, 4 * i, t[i]);
+}
+
+void ScanHash_4way(uint32_t* out, const uint32_t* midstate, const uint32_t* data, uint32_t nonce)
+{
+    static const uint32_t IV[8] = {0x6a09e667ul, 0xbb67ae85ul, 0x3c6ef372ul, 0xa54ff53aul, 0x510e527ful, 0x9b05688cul, 0x1f83d9abul, 0x5be0cd19ul};
+    vec s[8], t[8], w[64], kw[64];
+
+    // Second block of the header, continuing from the shared midstate;
+    // only the nonce word differs between lanes.
+    for (int i = 0; i < 8; i++)
+        s[i] = Const(midstate[i]);
+    for (int i = 0; i < 16; i++)
+        w[i] = Const(data[i]);
+    w[3] = Add(Const(nonce), _mm_set_epi32(3, 2, 1, 0));
+    Schedule(kw, w);
+    Rounds(s, kw);
+
+    // SHA-256 of the 32-byte first hash
+    for (int i = 0; i < 8; i++) {
+        w[i] = s[i];
+        t[i] = Const(IV[i]);
+    }
+    w[8] = Const(0x80000000ul);
+    for (int i = 9; i < 15; i++)
+        w[i] = Const(0);
+    w[15] = Const(0x100);
+    Schedule(kw, w);
+    Rounds(t, kw);
+
+    for (int i = 0; i < 8; i++) {
+        uint32_t lanes[4] __attribute__((aligned(16)));
+        _mm_store_si128((vec*)lanes, t[i]);
+        for (int j = 0; j < 4; j++)
+            out[8 * j + i] = lanes[j];
+    }
+}
+
+} // namespace sha256_sse2
+
+#endif
@@ -0,0 +1,684 @@
+// Copyright (c) 2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "stratum.h"
+#include "init.h"
+#include "wallet.h"
+#include "base58.h"
+#include "netbase.h"
+#include "ui_interface.h"
+
+#include "json/json_spirit_reader_template.h"
+#include "json/json_spirit_writer_template.h"
+#include "json/json_spirit_utils.h"
+
+#include <deque>
+#include <limits>
+
+#include <boost/foreach.hpp>
+
+using namespace json_spirit;
+using namespace std;
+
+//
+// Stratum mining server
+//
+// Miners keep a TCP connection open and exchange newline separated JSON-RPC
+// messages with us.  Instead of polling for work they subscribe once, and we
+// push a new job the moment the best block changes, or every
+// -stratumjobinterval seconds while new transactions keep coming in.  Each
+// connection gets its own extranonce1, so miners never duplicate each
+// other's work, and rolls extranonce2 itself.
+//
+
+static const unsigned short DEFAULT_STRATUM_PORT = 3333;
+static const int64 DEFAULT_STRATUM_JOB_INTERVAL = 10;
+// Jobs a miner may still submit shares for, when no new block made them stale
+static const unsigned int MAX_STRATUM_JOBS = 16;
+static const unsigned int MAX_STRATUM_CLIENTS = 256;
+// Longest request line we buffer before giving up on a connection
+static const unsigned int MAX_STRATUM_LINE = 16 * 1024;
+
+class CStratumClient
+{
+public:
+    SOCKET hSocket;
+    CService addr;
+    std::string strRecv;
+    std::string strSend;
+    std::vector<unsigned char> vchExtraNonce1;
+    bool fSubscribed;
+    bool fAuthorized;
+    bool fDisconnect;
+
+    CStratumClient(SOCKET hSocketIn, const CService& addrIn, unsigned int nExtraNonce1) : hSocket(hSocketIn), addr(addrIn)
+    {
+        for (int i = STRATUM_EXTRANONCE1_SIZE - 1; i >= 0; i--)
+            vchExtraNonce1.push_back((nExtraNonce1 >> (8 * i)) & 0xff);
+        fSubscribed = false;
+        fAuthorized = false;
+        fDisconnect = false;
+    }
+};
+
+static CCriticalSection cs_stratum;
+static SOCKET hStratumListenSocket = INVALID_SOCKET;
+static std::vector<CStratumClient*> vStratumClients;
+// Current jobs, newest last
+static std::deque<CStratumJob*> vStratumJobs;
+// Hashes of the shares accepted since the last new block
+static std::set<uint256> setStratumShares;
+// Blocks found, for the server thread to hand on once it lets go of cs_stratum
+static std::vector<CBlock> vStratumBlocksFound;
+static unsigned int nStratumExtraNonce1 = 0;
+static unsigned int nStratumJobId = 0;
+static double dStratumDifficulty = 1.0;
+static uint256 hashStratumShareTarget = 0;
+// Pays out to -stratumaddress if given, else to a key from the wallet
+static CScript scriptStratumPayout;
+static CReserveKey* pStratumKey = NULL;
+
+
+CStratumJob::CStratumJob(const std::string& strIdIn, const CBlockTemplate& blocktemplate, int nHeightIn, bool fCleanIn) :
+    strId(strIdIn), block(blocktemplate.block), nHeight(nHeightIn), vMerkleBranch(blocktemplate.vCoinbaseBranch), fClean(fCleanIn)
+{
+    // The extranonce gets a push of its own, right after the height
+    CScript scriptPrefix = CScript() << nHeight;
+    CScript scriptSig = scriptPrefix;
+    scriptSig << std::vector<unsigned char>(STRATUM_EXTRANONCE_SIZE, 0);
+    scriptSig += COINBASE_FLAGS;
+    assert(scriptSig.size() <= 100);
+    block.vtx[0].vin[0].scriptSig = scriptSig;
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << block.vtx[0];
+    std::vector<unsigned char> vch(ss.begin(), ss.end());
+
+    // nVersion, vin count, prevout, scriptSig length, height and push opcode
+    unsigned int nOffset = 4 + 1 + 36 + GetSizeOfCompactSize(scriptSig.size()) + scriptPrefix.size() + 1;
+    vchCoinbase1.assign(vch.begin(), vch.begin() + nOffset);
+    vchCoinbase2.assign(vch.begin() + nOffset + STRATUM_EXTRANONCE_SIZE, vch.end());
+}
+
+uint256 CStratumJob::GetMerkleRoot(const std::vector<unsigned char>& vchExtraNonce) const
+{
+    std::vector<unsigned char> vch(vchCoinbase1);
+    vch.insert(vch.end(), vchExtraNonce.begin(), vchExtraNonce.end());
+    vch.insert(vch.end(), vchCoinbase2.begin(), vchCoinbase2.end());
+    return CBlock::CheckMerkleBranch(Hash(vch.begin(), vch.end()), vMerkleBranch, 0);
+}
+
+CBlock CStratumJob::GetBlock(const std::vector<unsigned char>& vchExtraNonce, unsigned int nTime, unsigned int nNonce) const
+{
+    std::vector<unsigned char> vch(vchCoinbase1);
+    vch.insert(vch.end(), vchExtraNonce.begin(), vchExtraNonce.end());
+    vch.insert(vch.end(), vchCoinbase2.begin(), vchCoinbase2.end());
+
+    CBlock blockRet(block);
+    CDataStream ss(vch, SER_NETWORK, PROTOCOL_VERSION);
+    ss >> blockRet.vtx[0];
+    blockRet.nTime = nTime;
+    blockRet.nNonce = nNonce;
+    blockRet.hashMerkleRoot = GetMerkleRoot(vchExtraNonce);
+    return blockRet;
+}
+
+
+static uint256 GetStratumShareTarget(double dDifficulty)
+{
+    // Difficulty 1 is the target of the easiest block there can be; scale
+    // in fixed point so fractional difficulties come out right too
+    CBigNum bnTarget = CBigNum().SetCompact(0x1d00ffff);
+    bnTarget <<= 32;
+    bnTarget /= CBigNum((uint64)(dDifficulty * 4294967296.0));
+    if (bnTarget > CBigNum(~uint256(0)))
+        return ~uint256(0);
+    return bnTarget.getuint256();
+}
+
+// Stratum sends the previous block hash as eight words, each byte swapped
+static std::string StratumPrevHash(const uint256& hash)
+{
+    std::vector<unsigned char> vch(BEGIN(hash), END(hash));
+    for (unsigned int i = 0; i < vch.size(); i += 4)
+        std::reverse(vch.begin() + i, vch.begin() + i + 4);
+    return HexStr(vch);
+}
+
+static Array StratumError(int nCode, const std::string& strMessage)
+{
+    Array error;
+    error.push_back(nCode);
+    error.push_back(strMessage);
+    error.push_back(Value::null);
+    return error;
+}
+
+static void StratumReply(CStratumClient* pclient, const Value& id, const Value& result, const Value& error)
+{
+    Object reply;
+    reply.push_back(Pair("id", id));
+    reply.push_back(Pair("result", result));
+    reply.push_back(Pair("error", error));
+    pclient->strSend += write_string(Value(reply), false) + "\n";
+}
+
+static void StratumNotify(CStratumClient* pclient, const std::string& strMethod, const Array& params)
+{
+    Object notification;
+    notification.push_back(Pair("id", Value::null));
+    notification.push_back(Pair("method", strMethod));
+    notification.push_back(Pair("params", params));
+    pclient->strSend += write_string(Value(notification), false) + "\n";
+}
+
+static void StratumNotifyDifficulty(CStratumClient* pclient)
+{
+    Array params;
+    params.push_back(dStratumDifficulty);
+    StratumNotify(pclient, "mining.set_difficulty", params);
+}
+
+static void StratumNotifyJob(CStratumClient* pclient, const CStratumJob& job, bool fClean)
+{
+    Array params;
+    params.push_back(job.strId);
+    params.push_back(StratumPrevHash(job.block.hashPrevBlock));
+    params.push_back(HexStr(job.vchCoinbase1));
+    params.push_back(HexStr(job.vchCoinbase2));
+    Array branch;
+    BOOST_FOREACH(const uint256& hash, job.vMerkleBranch)
+        branch.push_back(HexStr(BEGIN(hash), END(hash)));
+    params.push_back(branch);
+    params.push_back(strprintf("%08x", job.block.nVersion));
+    params.push_back(strprintf("%08x", job.block.nBits));
+    params.push_back(strprintf("%08x", job.block.nTime));
+    params.push_back(fClean);
+    StratumNotify(pclient, "mining.notify", params);
+}
+
+// Write out as much of the send buffer as the socket takes without blocking
+static void StratumSend(CStratumClient* pclient)
+{
+    if (pclient->strSend.empty() || pclient->fDisconnect)
+        return;
+    int nBytes = send(pclient->hSocket, pclient->strSend.data(), pclient->strSend.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (nBytes > 0)
+        pclient->strSend.erase(0, nBytes);
+    else if (nBytes < 0)
+    {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+        {
+            printf("stratum: send to %s failed: %d\n", pclient->addr.ToString().c_str(), nErr);
+            pclient->fDisconnect = true;
+        }
+    }
+}
+
+// Called without cs_stratum, processing the block takes a while
+static void SubmitStratumBlock(CBlock& block)
+{
+    printf("StratumServer : proof-of-work found, hash: %s target: %s\n", block.GetHash().GetHex().c_str(), CBigNum().SetCompact(block.nBits).getuint256().GetHex().c_str());
+
+    LOCK(cs_main);
+    if (block.hashPrevBlock != hashBestChain)
+    {
+        printf("StratumServer : found block is stale\n");
+        return;
+    }
+
+    if (scriptStratumPayout.empty())
+    {
+        LOCK(cs_stratum);
+        if (pStratumKey)
+            pStratumKey->KeepKey();
+    }
+    {
+        LOCK(pwalletMain->cs_wallet);
+        pwalletMain->mapRequestCount[block.GetHash()] = 0;
+    }
+
+    CValidationState state;
+    if (!ProcessBlock(state, NULL, &block))
+        printf("StratumServer : ProcessBlock, block not accepted\n");
+}
+
+static Value StratumSubscribe(CStratumClient* pclient, const Array& params)
+{
+    pclient->fSubscribed = true;
+
+    Array subscriptions;
+    Array subscription;
+    subscription.push_back("mining.set_difficulty");
+    subscription.push_back(HexStr(pclient->vchExtraNonce1));
+    subscriptions.push_back(subscription);
+    subscription[0] = "mining.notify";
+    subscriptions.push_back(subscription);
+
+    Array result;
+    result.push_back(subscriptions);
+    result.push_back(HexStr(pclient->vchExtraNonce1));
+    result.push_back((int)STRATUM_EXTRANONCE2_SIZE);
+    return result;
+}
+
+static Value StratumAuthorize(CStratumClient* pclient, const Array& params)
+{
+    if (params.size() < 1)
+        throw StratumError(20, "Invalid params");
+    if (mapArgs.count("-stratumpassword") &&
+        (params.size() < 2 || params[1].type() != str_type || params[1].get_str() != mapArgs["-stratumpassword"]))
+        throw StratumError(24, "Unauthorized worker");
+    pclient->fAuthorized = true;
+    return true;
+}
+
+static Value StratumSubmit(CStratumClient* pclient, const Array& params)
+{
+    if (!pclient->fSubscribed)
+        throw StratumError(25, "Not subscribed");
+    if (!pclient->fAuthorized)
+        throw StratumError(24, "Unauthorized worker");
+    if (params.size() < 5)
+        throw StratumError(20, "Invalid params");
+
+    const std::string& strJobId = params[1].get_str();
+    std::vector<unsigned char> vchExtraNonce2 = ParseHex(params[2].get_str());
+    unsigned int nTime = strtoul(params[3].get_str().c_str(), NULL, 16);
+    unsigned int nNonce = strtoul(params[4].get_str().c_str(), NULL, 16);
+    if (vchExtraNonce2.size() != STRATUM_EXTRANONCE2_SIZE)
+        throw StratumError(20, "Invalid extranonce2");
+
+    const CStratumJob* pjob = NULL;
+    BOOST_FOREACH(const CStratumJob* pjobIter, vStratumJobs)
+        if (pjobIter->strId == strJobId)
+            pjob = pjobIter;
+    if (pjob == NULL)
+        throw StratumError(21, "Job not found");
+    if (nTime < pjob->block.nTime || nTime > GetAdjustedTime() + 2 * 60 * 60)
+        throw StratumError(20, "ntime out of range");
+
+    std::vector<unsigned char> vchExtraNonce(pclient->vchExtraNonce1);
+    vchExtraNonce.insert(vchExtraNonce.end(), vchExtraNonce2.begin(), vchExtraNonce2.end());
+
+    CBlockHeader header = pjob->block.GetBlockHeader();
+    header.hashMerkleRoot = pjob->GetMerkleRoot(vchExtraNonce);
+    header.nTime = nTime;
+    header.nNonce = nNonce;
+    uint256 hash = header.GetHash();
+
+    if (hash > hashStratumShareTarget)
+        throw StratumError(23, "Low difficulty share");
+    if (!setStratumShares.insert(hash).second)
+        throw StratumError(22, "Duplicate share");
+
+    if (hash <= CBigNum().SetCompact(header.nBits).getuint256())
+        vStratumBlocksFound.push_back(pjob->GetBlock(vchExtraNonce, nTime, nNonce));
+
+    return true;
+}
+
+static void ProcessStratumMessage(CStratumClient* pclient, const std::string& strLine)
+{
+    Value valRequest;
+    if (!read_string(strLine, valRequest) || valRequest.type() != obj_type)
+    {
+        printf("stratum: malformed request from %s\n", pclient->addr.ToString().c_str());
+        pclient->fDisconnect = true;
+        return;
+    }
+    const Object& request = valRequest.get_obj();
+    Value id = find_value(request, "id");
+    const Value& method = find_value(request, "method");
+    const Value& params = find_value(request, "params");
+    if (method.type() != str_type || params.type() != array_type)
+    {
+        StratumReply(pclient, id, Value::null, StratumError(20, "Invalid request"));
+        return;
+    }
+
+    const std::string& strMethod = method.get_str();
+    Value result;
+    try
+    {
+        if (strMethod == "mining.subscribe")
+            result = StratumSubscribe(pclient, params.get_array());
+        else if (strMethod == "mining.authorize")
+            result = StratumAuthorize(pclient, params.get_array());
+        else if (strMethod == "mining.submit")
+            result = StratumSubmit(pclient, params.get_array());
+        else
+            throw StratumError(20, "Method not found");
+    }
+    catch (Array& error)
+    {
+        StratumReply(pclient, id, Value::null, error);
+        return;
+    }
+    catch (std::exception& e)
+    {
+        StratumReply(pclient, id, Value::null, StratumError(20, e.what()));
+        return;
+    }
+    StratumReply(pclient, id, result, Value::null);
+
+    if (strMethod == "mining.subscribe")
+    {
+        StratumNotifyDifficulty(pclient);
+        if (!vStratumJobs.empty())
+            StratumNotifyJob(pclient, *vStratumJobs.back(), true);
+    }
+}
+
+static void ThreadStratumServer()
+{
+    RenameThread("bitcoin-stratum");
+
+    loop
+    {
+        boost::this_thread::interruption_point();
+
+        fd_set fdsetRecv;
+        fd_set fdsetSend;
+        FD_ZERO(&fdsetRecv);
+        FD_ZERO(&fdsetSend);
+        FD_SET(hStratumListenSocket, &fdsetRecv);
+        SOCKET hSocketMax = hStratumListenSocket;
+        {
+            LOCK(cs_stratum);
+            std::vector<CStratumClient*> vClientsCopy = vStratumClients;
+            BOOST_FOREACH(CStratumClient* pclient, vClientsCopy)
+            {
+                if (pclient->fDisconnect)
+                {
+                    printf("stratum: disconnecting %s\n", pclient->addr.ToString().c_str());
+                    vStratumClients.erase(remove(vStratumClients.begin(), vStratumClients.end(), pclient), vStratumClients.end());
+                    closesocket(pclient->hSocket);
+                    delete pclient;
+                    continue;
+                }
+                FD_SET(pclient->hSocket, &fdsetRecv);
+                if (!pclient->strSend.empty())
+                    FD_SET(pclient->hSocket, &fdsetSend);
+                hSocketMax = max(hSocketMax, pclient->hSocket);
+            }
+        }
+
+        struct timeval timeout;
+        timeout.tv_sec  = 0;
+        timeout.tv_usec = 50000; // frequency to notice disconnects and interrupts
+        int nSelect = select(hSocketMax + 1, &fdsetRecv, &fdsetSend, NULL, &timeout);
+        boost::this_thread::interruption_point();
+        if (nSelect == SOCKET_ERROR)
+        {
+            printf("stratum: select failed: %d\n", WSAGetLastError());
+            MilliSleep(50);
+            continue;
+        }
+
+        if (FD_ISSET(hStratumListenSocket, &fdsetRecv))
+        {
+#ifdef USE_IPV6
+            struct sockaddr_storage sockaddr;
+#else
+            struct sockaddr sockaddr;
+#endif
+            socklen_t len = sizeof(sockaddr);
+            SOCKET hSocket = accept(hStratumListenSocket, (struct sockaddr*)&sockaddr, &len);
+            CService addr;
+            if (hSocket != INVALID_SOCKET)
+                addr.SetSockAddr((const struct sockaddr*)&sockaddr);
+
+            LOCK(cs_stratum);
+            if (hSocket == INVALID_SOCKET)
+            {
+                int nErr = WSAGetLastError();
+                if (nErr != WSAEWOULDBLOCK)
+                    printf("stratum: accept failed: %d\n", nErr);
+            }
+            else if (vStratumClients.size() >= MAX_STRATUM_CLIENTS)
+                closesocket(hSocket);
+            else
+            {
+                printf("stratum: accepted connection %s\n", addr.ToString().c_str());
+                vStratumClients.push_back(new CStratumClient(hSocket, addr, ++nStratumExtraNonce1));
+            }
+        }
+
+        std::vector<CBlock> vBlocksFound;
+        {
+            LOCK(cs_stratum);
+            BOOST_FOREACH(CStratumClient* pclient, vStratumClients)
+            {
+                if (pclient->fDisconnect)
+                    continue;
+                if (FD_ISSET(pclient->hSocket, &fdsetRecv))
+                {
+                    char pchBuf[0x10000];
+                    int nBytes = recv(pclient->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+                    if (nBytes > 0)
+                        pclient->strRecv.append(pchBuf, nBytes);
+                    else if (nBytes == 0)
+                        pclient->fDisconnect = true;
+                    else
+                    {
+                        int nErr = WSAGetLastError();
+                        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+                            pclient->fDisconnect = true;
+                    }
+
+                    size_t nPos;
+                    while (!pclient->fDisconnect && (nPos = pclient->strRecv.find('\n')) != std::string::npos)
+                    {
+                        std::string strLine = pclient->strRecv.substr(0, nPos);
+                        pclient->strRecv.erase(0, nPos + 1);
+                        if (strLine.find_first_not_of(" \t\r") != std::string::npos)
+                            ProcessStratumMessage(pclient, strLine);
+                    }
+                    if (pclient->strRecv.size() > MAX_STRATUM_LINE)
+                        pclient->fDisconnect = true;
+                }
+                StratumSend(pclient);
+            }
+            vBlocksFound.swap(vStratumBlocksFound);
+        }
+
+        BOOST_FOREACH(CBlock& block, vBlocksFound)
+            SubmitStratumBlock(block);
+    }
+}
+
+static void PublishStratumJob(CStratumJob* pjob)
+{
+    LOCK(cs_stratum);
+    if (pjob->fClean)
+    {
+        // Work on the old tip is worthless now
+        BOOST_FOREACH(CStratumJob* pjobOld, vStratumJobs)
+            delete pjobOld;
+        vStratumJobs.clear();
+        setStratumShares.clear();
+    }
+    vStratumJobs.push_back(pjob);
+    while (vStratumJobs.size() > MAX_STRATUM_JOBS)
+    {
+        delete vStratumJobs.front();
+        vStratumJobs.pop_front();
+    }
+
+    // Push it straight away rather than wait for the server thread to wake
+    BOOST_FOREACH(CStratumClient* pclient, vStratumClients)
+    {
+        if (!pclient->fSubscribed || pclient->fDisconnect)
+            continue;
+        StratumNotifyJob(pclient, *pjob, pjob->fClean);
+        StratumSend(pclient);
+    }
+}
+
+static void ThreadStratumWork()
+{
+    RenameThread("bitcoin-stratumwork");
+
+    int64 nJobInterval = GetArg("-stratumjobinterval", DEFAULT_STRATUM_JOB_INTERVAL) * 1000;
+    uint256 hashBestLast = 0;
+    uint256 hashPrevJob = 0;
+    unsigned int nTransactionsUpdatedLast = 0;
+    int64 nLastJob = 0;
+    loop
+    {
+        // Wakes up as soon as a new block arrives
+        uint256 hashBest = WaitForBlockChange(hashBestLast, 100);
+        boost::this_thread::interruption_point();
+        if (hashBest == hashBestLast &&
+            (nTransactionsUpdated == nTransactionsUpdatedLast || GetTimeMillis() - nLastJob < nJobInterval))
+            continue;
+
+        hashBestLast = hashBest;
+        nTransactionsUpdatedLast = nTransactionsUpdated;
+        nLastJob = GetTimeMillis();
+        CScript scriptPubKey = scriptStratumPayout;
+        if (scriptPubKey.empty())
+        {
+            // The server thread keeps the key when a block is found. The
+            // template is made without cs_stratum, so miners aren't kept waiting.
+            LOCK(cs_stratum);
+            CPubKey pubkey;
+            if (pStratumKey && pStratumKey->GetReservedKey(pubkey))
+                scriptPubKey << pubkey << OP_CHECKSIG;
+        }
+        auto_ptr<CBlockTemplate> pblocktemplate;
+        if (!scriptPubKey.empty())
+            pblocktemplate.reset(CreateNewBlock(scriptPubKey));
+        if (!pblocktemplate.get())
+        {
+            printf("StratumServer : could not create a block template, keypool ran out?\n");
+            MilliSleep(1000);
+            continue;
+        }
+        const CBlock& block = pblocktemplate->block;
+
+        int nHeight;
+        {
+            LOCK(cs_main);
+            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.hashPrevBlock);
+            if (mi == mapBlockIndex.end())
+                continue;
+            nHeight = mi->second->nHeight + 1;
+        }
+
+        bool fClean = (block.hashPrevBlock != hashPrevJob);
+        hashPrevJob = block.hashPrevBlock;
+        PublishStratumJob(new CStratumJob(strprintf("%x", ++nStratumJobId), *pblocktemplate, nHeight, fClean));
+    }
+}
+
+bool StartStratumServer(boost::thread_group& threadGroup, std::string& strError)
+{
+    strError = "";
+
+    dStratumDifficulty = atof(GetArg("-stratumdifficulty", "1").c_str());
+    if (!(dStratumDifficulty * 4294967296.0 >= 1.0) || dStratumDifficulty >= 4294967296.0)
+    {
+        strError = strprintf(_("Invalid amount for -stratumdifficulty=<amount>: '%s'"), mapArgs["-stratumdifficulty"].c_str());
+        return false;
+    }
+    hashStratumShareTarget = GetStratumShareTarget(dStratumDifficulty);
+
+    scriptStratumPayout.clear();
+    if (mapArgs.count("-stratumaddress"))
+    {
+        CBitcoinAddress address(mapArgs["-stratumaddress"]);
+        if (!address.IsValid())
+        {
+            strError = strprintf(_("Invalid -stratumaddress: '%s'"), mapArgs["-stratumaddress"].c_str());
+            return false;
+        }
+        scriptStratumPayout.SetDestination(address.Get());
+    }
+
+    CService addrBind;
+    std::string strBind = GetArg("-stratumbind", "127.0.0.1");
+    if (!Lookup(strBind.c_str(), addrBind, GetArg("-stratumport", DEFAULT_STRATUM_PORT), false))
+    {
+        strError = strprintf(_("Cannot resolve -stratumbind address: '%s'"), strBind.c_str());
+        return false;
+    }
+
+#ifdef USE_IPV6
+    struct sockaddr_storage sockaddr;
+#else
+    struct sockaddr sockaddr;
+#endif
+    socklen_t len = sizeof(sockaddr);
+    if (!addrBind.GetSockAddr((struct sockaddr*)&sockaddr, &len))
+    {
+        strError = strprintf("Error: bind address family for %s not supported", addrBind.ToString().c_str());
+        return false;
+    }
+
+    SOCKET hSocket = socket(((struct sockaddr*)&sockaddr)->sa_family, SOCK_STREAM, IPPROTO_TCP);
+    if (hSocket == INVALID_SOCKET)
+    {
+        strError = strprintf("Error: Couldn't open socket for stratum connections (socket returned error %d)", WSAGetLastError());
+        return false;
+    }
+
+    int nOne = 1;
+#ifdef SO_NOSIGPIPE
+    setsockopt(hSocket, SOL_SOCKET, SO_NOSIGPIPE, (void*)&nOne, sizeof(int));
+#endif
+#ifndef WIN32
+    setsockopt(hSocket, SOL_SOCKET, SO_REUSEADDR, (void*)&nOne, sizeof(int));
+#endif
+#ifdef WIN32
+    if (ioctlsocket(hSocket, FIONBIO, (u_long*)&nOne) == SOCKET_ERROR ||
+#else
+    if (fcntl(hSocket, F_SETFL, O_NONBLOCK) == SOCKET_ERROR ||
+#endif
+        ::bind(hSocket, (struct sockaddr*)&sockaddr, len) == SOCKET_ERROR ||
+        listen(hSocket, SOMAXCONN) == SOCKET_ERROR)
+    {
+        int nErr = WSAGetLastError();
+        strError = strprintf(_("Unable to bind to %s on this computer (bind returned error %d, %s)"), addrBind.ToString().c_str(), nErr, strerror(nErr));
+        closesocket(hSocket);
+        return false;
+    }
+    printf("StratumServer : listening on %s\n", addrBind.ToString().c_str());
+
+    {
+        LOCK(cs_stratum);
+        hStratumListenSocket = hSocket;
+        nStratumExtraNonce1 = GetRand(std::numeric_limits<unsigned int>::max());
+        pStratumKey = new CReserveKey(pwalletMain);
+    }
+
+    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "stratum", &ThreadStratumServer));
+    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "stratumwork", &ThreadStratumWork));
+    return true;
+}
+
+void StopStratumServer()
+{
+    LOCK(cs_stratum);
+    BOOST_FOREACH(CStratumClient* pclient, vStratumClients)
+    {
+        closesocket(pclient->hSocket);
+        delete pclient;
+    }
+    vStratumClients.clear();
+    if (hStratumListenSocket != INVALID_SOCKET)
+    {
+        closesocket(hStratumListenSocket);
+        hStratumListenSocket = INVALID_SOCKET;
+    }
+    BOOST_FOREACH(CStratumJob* pjob, vStratumJobs)
+        delete pjob;
+    vStratumJobs.clear();
+    setStratumShares.clear();
+    vStratumBlocksFound.clear();
+    delete pStratumKey;
+    pStratumKey = NULL;
+}
@@ -0,0 +1,53 @@
+// Copyright (c) 2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_STRATUM_H
+#define BITCOIN_STRATUM_H
+
+#include <string>
+#include <vector>
+
+#include <boost/thread.hpp>
+
+#include "main.h"
+
+/** Bytes of extranonce the server assigns to each connection */
+static const unsigned int STRATUM_EXTRANONCE1_SIZE = 4;
+/** Bytes of extranonce each miner rolls itself */
+static const unsigned int STRATUM_EXTRANONCE2_SIZE = 4;
+static const unsigned int STRATUM_EXTRANONCE_SIZE = STRATUM_EXTRANONCE1_SIZE + STRATUM_EXTRANONCE2_SIZE;
+
+/** A block template as handed out to stratum miners.
+ *
+ * The coinbase is split around its extranonce, so a miner rebuilds it as
+ * coinb1 + extranonce1 + extranonce2 + coinb2 and folds its hash up the
+ * merkle branch to get the merkle root, without ever seeing the other
+ * transactions of the block.
+ */
+class CStratumJob
+{
+public:
+    std::string strId;
+    CBlock block;
+    int nHeight;
+    std::vector<unsigned char> vchCoinbase1;
+    std::vector<unsigned char> vchCoinbase2;
+    std::vector<uint256> vMerkleBranch;
+    // Whether miners should drop their work on older jobs
+    bool fClean;
+
+    CStratumJob(const std::string& strIdIn, const CBlockTemplate& blocktemplate, int nHeightIn, bool fCleanIn);
+
+    /** The merkle root for a coinbase carrying vchExtraNonce */
+    uint256 GetMerkleRoot(const std::vector<unsigned char>& vchExtraNonce) const;
+
+    /** The complete block a miner found with vchExtraNonce, nTime and nNonce */
+    CBlock GetBlock(const std::vector<unsigned char>& vchExtraNonce, unsigned int nTime, unsigned int nNonce) const;
+};
+
+/** Start listening for stratum miners on -stratumport */
+bool StartStratumServer(boost::thread_group& threadGroup, std::string& strError);
+/** Disconnect all stratum miners and stop listening */
+void StopStratumServer();
+
+#endif
@@ -16,10 +16,17 @@
 #include <stdint.h>
 
 // Tests this internal-to-main.cpp method:
-extern bool AddOrphanTx(const CTransaction& tx);
-extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
-extern std::map<uint256, CTransaction> mapOrphanTransactions;
+extern bool AddOrphanTx(const boost::shared_ptr<CTransaction>& ptx, NodeId peer);
+extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, uint64 nMaxBytes);
+extern std::map<uint256, COrphanTx> mapOrphanTransactions;
 extern std::map<uint256, std::set<uint256> > mapOrphanTransactionsByPrev;
+extern std::map<NodeId, uint64> mapOrphanBytesByPeer;
+extern uint64 nOrphanBytes;
+
+static bool AddOrphanTx(const CTransaction& tx, NodeId peer)
+{
+    return AddOrphanTx(boost::shared_ptr<CTransaction>(new CTransaction(tx)), peer);
+}
 
 CService ip(uint32_t i)
 {
@@ -133,11 +140,11 @@ BOOST_AUTO_TEST_CASE(DoS_checknbits)
 
 CTransaction RandomOrphan()
 {
-    std::map<uint256, CTransaction>::iterator it;
+    std::map<uint256, COrphanTx>::iterator it;
     it = mapOrphanTransactions.lower_bound(GetRandHash());
     if (it == mapOrphanTransactions.end())
         it = mapOrphanTransactions.begin();
-    return it->second;
+    return *it->second.ptx;
 }
 
 BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
@@ -159,7 +166,7 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         tx.vout[0].nValue = 1*CENT;
         tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
 
-        AddOrphanTx(tx);
+        AddOrphanTx(tx, i);
     }
 
     // ... and 50 that depend on other orphans:
@@ -176,7 +183,7 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
         SignSignature(keystore, txPrev, tx, 0);
 
-        AddOrphanTx(tx);
+        AddOrphanTx(tx, i);
     }
 
     // This really-big orphan should be ignored:
@@ -200,17 +207,64 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         for (unsigned int j = 1; j < tx.vin.size(); j++)
             tx.vin[j].scriptSig = tx.vin[0].scriptSig;
 
-        BOOST_CHECK(!AddOrphanTx(tx));
+        BOOST_CHECK(!AddOrphanTx(tx, i));
+    }
+
+    // Test EraseOrphansFor():
+    for (NodeId i = 0; i < 3; i++)
+    {
+        size_t sizeBefore = mapOrphanTransactions.size();
+        EraseOrphansFor(i);
+        BOOST_CHECK(mapOrphanTransactions.size() < sizeBefore);
+        BOOST_CHECK(!mapOrphanBytesByPeer.count(i));
     }
 
     // Test LimitOrphanTxSize() function:
-    LimitOrphanTxSize(40);
+    LimitOrphanTxSize(40, MAX_ORPHAN_BYTES);
     BOOST_CHECK(mapOrphanTransactions.size() <= 40);
-    LimitOrphanTxSize(10);
+    LimitOrphanTxSize(10, MAX_ORPHAN_BYTES);
     BOOST_CHECK(mapOrphanTransactions.size() <= 10);
-    LimitOrphanTxSize(0);
+    uint64 nBytes = 0;
+    BOOST_FOREACH(const PAIRTYPE(uint256, COrphanTx)& item, mapOrphanTransactions)
+        nBytes += item.second.nTxSize;
+    BOOST_CHECK_EQUAL(nOrphanBytes, nBytes);
+    LimitOrphanTxSize(10, nBytes / 2);
+    BOOST_CHECK(nOrphanBytes <= nBytes / 2);
+    LimitOrphanTxSize(0, MAX_ORPHAN_BYTES);
     BOOST_CHECK(mapOrphanTransactions.empty());
     BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+    BOOST_CHECK(mapOrphanBytesByPeer.empty());
+    BOOST_CHECK_EQUAL(nOrphanBytes, 0U);
+}
+
+BOOST_AUTO_TEST_CASE(DoS_mapOrphans_perpeer)
+{
+    // One peer can only take its share of the orphan space
+    unsigned int nAdded = 0;
+    for (int i = 0; i < 10000; i++)
+    {
+        CTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout.hash = GetRandHash();
+        tx.vin[0].scriptSig = CScript() << std::vector<unsigned char>(4000, 1);
+        tx.vout.resize(1);
+        if (!AddOrphanTx(tx, 1))
+            break;
+        nAdded++;
+    }
+    BOOST_CHECK(nAdded > 0);
+    BOOST_CHECK(mapOrphanBytesByPeer[1] <= MAX_ORPHAN_BYTES_PER_PEER);
+    BOOST_CHECK(mapOrphanBytesByPeer[1] > MAX_ORPHAN_BYTES_PER_PEER - 5000);
+
+    // ... while others still can add theirs
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.hash = GetRandHash();
+    tx.vout.resize(1);
+    BOOST_CHECK(AddOrphanTx(tx, 2));
+
+    LimitOrphanTxSize(0, MAX_ORPHAN_BYTES);
+    BOOST_CHECK(mapOrphanBytesByPeer.empty());
 }
 
 BOOST_AUTO_TEST_CASE(DoS_checkSig)
@@ -237,7 +291,7 @@ BOOST_AUTO_TEST_CASE(DoS_checkSig)
         tx.vout[0].nValue = 1*CENT;
         tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
 
-        AddOrphanTx(tx);
+        AddOrphanTx(tx, 0);
     }
 
     // Create a transaction that depends on orphans:
@@ -297,7 +351,43 @@ BOOST_AUTO_TEST_CASE(DoS_checkSig)
         BOOST_CHECK(VerifySignature(CCoins(orphans[j], MEMPOOL_HEIGHT), tx, j, flags, SIGHASH_ALL));
     mapArgs.erase("-maxsigcachesize");
 
-    LimitOrphanTxSize(0);
+    LimitOrphanTxSize(0, MAX_ORPHAN_BYTES);
+}
+
+BOOST_AUTO_TEST_CASE(DoS_recvbuffer)
+{
+    CAddress addr1(ip(0xa0b0c001));
+    CNode dummyNode1(INVALID_SOCKET, addr1, "", true);
+    uint64 nTotalBefore = GetTotalRecvQueued();
+    LOCK(dummyNode1.cs_vRecvMsg);
+
+    // A header announcing a huge message doesn't get it allocated up front
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CMessageHeader("block", 30000000);
+    ss << std::vector<unsigned char>(997); // 1000 bytes with its size
+    BOOST_CHECK(dummyNode1.ReceiveMsgBytes(&ss[0], ss.size()));
+    BOOST_CHECK_EQUAL(dummyNode1.GetTotalRecvSize(), 24U + 1000U);
+    BOOST_CHECK_EQUAL(GetTotalRecvQueued(), nTotalBefore + 24 + 1000);
+    BOOST_CHECK(dummyNode1.vRecvMsg.back().vRecv.size() < 300000);
+    BOOST_CHECK(dummyNode1.IsReceiveBufferAvailable()); // incomplete, must keep reading
+
+    dummyNode1.EraseRecvMsg(dummyNode1.vRecvMsg.end());
+    BOOST_CHECK_EQUAL(dummyNode1.GetTotalRecvSize(), 0U);
+    BOOST_CHECK_EQUAL(GetTotalRecvQueued(), nTotalBefore);
+
+    // Complete messages are only added to within the budget
+    mapArgs["-maxreceivebuffer"] = "1";
+    CDataStream ss2(SER_NETWORK, PROTOCOL_VERSION);
+    ss2 << CMessageHeader("tx", 600);
+    ss2 << std::vector<unsigned char>(597);
+    BOOST_CHECK(dummyNode1.ReceiveMsgBytes(&ss2[0], ss2.size()));
+    BOOST_CHECK(dummyNode1.IsReceiveBufferAvailable());
+    BOOST_CHECK(dummyNode1.ReceiveMsgBytes(&ss2[0], ss2.size()));
+    BOOST_CHECK_EQUAL(dummyNode1.vRecvMsg.size(), 2U);
+    BOOST_CHECK(!dummyNode1.IsReceiveBufferAvailable());
+    dummyNode1.EraseRecvMsg(dummyNode1.vRecvMsg.begin() + 1);
+    BOOST_CHECK(dummyNode1.IsReceiveBufferAvailable());
+    mapArgs.erase("-maxreceivebuffer");
 }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,228 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+#include "addrman.h"
+#include "db.h"
+#include "serialize.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(addrman_tests)
+
+static CAddress MakeAddress(unsigned int n)
+{
+    struct in_addr addr;
+    addr.s_addr = htonl(0x0B000000 + n * 2654435761U % 0xC0000000);
+    CAddress ret(CService(addr, 8333));
+    ret.nTime = GetAdjustedTime() - 3600;
+    return ret;
+}
+
+static CNetAddr MakeSource(unsigned int n)
+{
+    struct in_addr addr;
+    addr.s_addr = htonl(0x0C000000 + n * 0x70000);
+    return CNetAddr(addr);
+}
+
+BOOST_AUTO_TEST_CASE(addrman_select)
+{
+    CAddrMan addrman;
+    BOOST_CHECK(!addrman.Select(50).IsValid());
+    BOOST_CHECK(!addrman.Select(100).IsValid());
+
+    // Non-routable addresses are not added
+    BOOST_CHECK(!addrman.Add(CAddress(CService("127.0.0.1", 8333)), MakeSource(0)));
+    BOOST_CHECK_EQUAL(addrman.size(), 0);
+
+    // A single entry in a sparse table is found whatever the bias
+    CAddress addr = MakeAddress(1);
+    BOOST_CHECK(addrman.Add(addr, MakeSource(0)));
+    BOOST_CHECK_EQUAL(addrman.size(), 1);
+    BOOST_CHECK(addrman.Select(0) == addr);
+    BOOST_CHECK(addrman.Select(100) == addr);
+
+    // Moved to tried, it can still be selected when asking for new entries only
+    addrman.Good(addr);
+    BOOST_CHECK_EQUAL(addrman.size(), 1);
+    BOOST_CHECK(addrman.Select(100) == addr);
+    BOOST_CHECK(addrman.Select(0) == addr);
+}
+
+BOOST_AUTO_TEST_CASE(addrman_serialize)
+{
+    CAddrMan addrman;
+    for (unsigned int i = 0; i < 20; i++)
+    {
+        vector<CAddress> vAddr;
+        for (unsigned int j = 0; j < 500; j++)
+            vAddr.push_back(MakeAddress(i * 500 + j));
+        addrman.Add(vAddr, MakeSource(i));
+        for (int j = 0; j < 10; j++)
+            addrman.Good(addrman.Select(100));
+    }
+    BOOST_CHECK(addrman.size() > 1000);
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << addrman;
+    CAddrMan addrman2;
+    ss >> addrman2;
+    BOOST_CHECK(ss.empty());
+    BOOST_CHECK_EQUAL(addrman2.size(), addrman.size());
+
+    // Writing it back gives the same file, apart from the order of entries
+    CDataStream ss1(SER_DISK, CLIENT_VERSION), ss2(SER_DISK, CLIENT_VERSION);
+    ss1 << addrman;
+    ss2 << addrman2;
+    BOOST_CHECK_EQUAL(ss1.size(), ss2.size());
+
+    // Every entry can be handed out again
+    vector<CAddress> vAddr = addrman2.GetAddr();
+    BOOST_CHECK_EQUAL(vAddr.size(), (unsigned int)min(addrman.size() * ADDRMAN_GETADDR_MAX_PCT / 100, ADDRMAN_GETADDR_MAX));
+    set<CService> setAddr(vAddr.begin(), vAddr.end());
+    BOOST_CHECK_EQUAL(setAddr.size(), vAddr.size());
+}
+
+// Number of "new" and "tried" entries, as written to peers.dat
+static pair<int, int> GetCounts(CAddrMan &addrman)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << addrman;
+    unsigned char nVersion;
+    vector<unsigned char> vchKey;
+    int nNew, nTried;
+    ss >> nVersion >> vchKey >> nNew >> nTried;
+    return make_pair(nNew, nTried);
+}
+
+BOOST_AUTO_TEST_CASE(addrman_log)
+{
+    CAddrMan addrman;
+    for (unsigned int i = 0; i < 20; i++)
+    {
+        vector<CAddress> vAddr;
+        for (unsigned int j = 0; j < 200; j++)
+            vAddr.push_back(MakeAddress(i * 200 + j));
+        addrman.Add(vAddr, MakeSource(i));
+    }
+    int nSnapshot = addrman.size();
+    CAddrDB adb;
+    BOOST_CHECK(adb.Write(addrman));
+    boost::filesystem::path pathLog = GetDataDir() / "peers.log";
+    int nLogSize = boost::filesystem::file_size(pathLog);
+
+    // Entries promoted, attempted, added and evicted after the snapshot
+    // only go to the log
+    for (int i = 0; i < 100; i++)
+        addrman.Good(addrman.Select(100));
+    for (int i = 0; i < 100; i++)
+        addrman.Attempt(addrman.Select(50));
+    BOOST_CHECK(adb.Append(addrman));
+    for (unsigned int i = 20; i < 24; i++)
+    {
+        vector<CAddress> vAddr;
+        for (unsigned int j = 0; j < 200; j++)
+            vAddr.push_back(MakeAddress(i * 200 + j));
+        addrman.Add(vAddr, MakeSource(i));
+    }
+    BOOST_CHECK(adb.Append(addrman));
+    BOOST_CHECK(adb.Append(addrman));
+    BOOST_CHECK(boost::filesystem::file_size(pathLog) > (unsigned int)nLogSize);
+
+    CAddrMan addrman2;
+    BOOST_CHECK(adb.Read(addrman2));
+    BOOST_CHECK_EQUAL(addrman2.size(), addrman.size());
+    BOOST_CHECK(GetCounts(addrman2) == GetCounts(addrman));
+
+    // An incomplete batch at the end is dropped
+    nLogSize = boost::filesystem::file_size(pathLog);
+    {
+        FILE *file = fopen(pathLog.string().c_str(), "ab");
+        fwrite("\xfd\xff\xff", 1, 3, file);
+        fclose(file);
+    }
+    CAddrMan addrman3;
+    BOOST_CHECK(adb.Read(addrman3));
+    BOOST_CHECK_EQUAL(addrman3.size(), addrman.size());
+    BOOST_CHECK_EQUAL(boost::filesystem::file_size(pathLog), (unsigned int)nLogSize);
+
+    // A log written for another snapshot is ignored, and the next append
+    // writes a new snapshot instead
+    CDataStream ssLog(SER_DISK, CLIENT_VERSION);
+    ssLog << FLATDATA(pchMessageStart) << uint256(1);
+    {
+        FILE *file = fopen(pathLog.string().c_str(), "wb");
+        fwrite(&ssLog[0], 1, ssLog.size(), file);
+        fclose(file);
+    }
+    CAddrMan addrman4;
+    BOOST_CHECK(adb.Read(addrman4));
+    BOOST_CHECK_EQUAL(addrman4.size(), nSnapshot);
+    BOOST_CHECK(adb.Append(addrman));
+    CAddrMan addrman5;
+    BOOST_CHECK(adb.Read(addrman5));
+    BOOST_CHECK_EQUAL(addrman5.size(), addrman.size());
+
+    // A snapshot that fails its checksum is written anew by the next append,
+    // rather than logged onto
+    boost::filesystem::path pathAddr = GetDataDir() / "peers.dat";
+    {
+        FILE *file = fopen(pathAddr.string().c_str(), "r+b");
+        fseek(file, 100, SEEK_SET);
+        int c = fgetc(file);
+        fseek(file, 100, SEEK_SET);
+        fputc(c ^ 0xff, file);
+        fclose(file);
+    }
+    CAddrMan addrman6;
+    BOOST_CHECK(!adb.Read(addrman6));
+    bool fSnapshot = false;
+    BOOST_CHECK(adb.Append(addrman, &fSnapshot));
+    BOOST_CHECK(fSnapshot);
+    CAddrMan addrman7;
+    BOOST_CHECK(adb.Read(addrman7));
+    BOOST_CHECK_EQUAL(addrman7.size(), addrman.size());
+    BOOST_CHECK(adb.Append(addrman, &fSnapshot));
+    BOOST_CHECK(!fSnapshot);
+}
+
+static void SelectLoop(CAddrMan* paddrman, volatile bool* pfStop, int* pnBad)
+{
+    while (!*pfStop)
+    {
+        CAddress addr = paddrman->Select(50);
+        if (!addr.IsValid() && paddrman->size() > 0)
+            (*pnBad)++;
+        paddrman->GetAddr();
+    }
+}
+
+BOOST_AUTO_TEST_CASE(addrman_concurrent)
+{
+    CAddrMan addrman;
+    addrman.Add(MakeAddress(0), MakeSource(0));
+
+    volatile bool fStop = false;
+    int nBad[4] = {0, 0, 0, 0};
+    boost::thread_group threadGroup;
+    for (int i = 0; i < 4; i++)
+        threadGroup.create_thread(boost::bind(&SelectLoop, &addrman, &fStop, &nBad[i]));
+
+    for (unsigned int i = 0; i < 40; i++)
+    {
+        vector<CAddress> vAddr;
+        for (unsigned int j = 0; j < 500; j++)
+            vAddr.push_back(MakeAddress(1 + i * 500 + j));
+        addrman.Add(vAddr, MakeSource(i));
+        addrman.Good(addrman.Select(100));
+        addrman.Attempt(addrman.Select(100));
+    }
+
+    fStop = true;
+    threadGroup.join_all();
+    for (int i = 0; i < 4; i++)
+        BOOST_CHECK_EQUAL(nBad[i], 0);
+    BOOST_CHECK(addrman.size() > 5000);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -55,6 +55,33 @@ BOOST_AUTO_TEST_CASE(base58_DecodeBase58)
     }
 
     BOOST_CHECK(!DecodeBase58("invalid", result));
+
+    // Surrounding whitespace is skipped, embedded whitespace is not
+    BOOST_CHECK(DecodeBase58(" \t\n 111zSW2 \n", result));
+    BOOST_CHECK(HexStr(result) == "000000ab01ff");
+    BOOST_CHECK(!DecodeBase58("111 zSW2", result));
+    BOOST_CHECK(!DecodeBase58("111zS0W2", result));
+}
+
+// Goal: check that encoding and decoding are inverse across limb boundaries
+BOOST_AUTO_TEST_CASE(base58_roundtrip)
+{
+    std::vector<unsigned char> result;
+    for (int nSize = 0; nSize < 70; nSize++)
+    {
+        for (int nZeroes = 0; nZeroes <= std::min(nSize, 3); nZeroes++)
+        {
+            std::vector<unsigned char> data(nSize, 0);
+            for (int i = nZeroes; i < nSize; i++)
+                data[i] = (unsigned char)GetRand(256);
+            if (nZeroes < nSize)
+                data[nZeroes] |= 1;
+            std::string str = EncodeBase58(data);
+            BOOST_CHECK_EQUAL(str.find_first_not_of('1'), nZeroes == nSize ? std::string::npos : (size_t)nZeroes);
+            BOOST_CHECK(DecodeBase58(str, result));
+            BOOST_CHECK(result == data);
+        }
+    }
 }
 
 // Visitor to check address type
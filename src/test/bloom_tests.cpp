@@ -6,6 +6,7 @@
 #include "key.h"
 #include "base58.h"
 #include "main.h"
+#include "hash.h"
 
 using namespace std;
 using namespace boost::tuples;
@@ -444,4 +445,165 @@ BOOST_AUTO_TEST_CASE(merkle_block_4_test_update_none)
     BOOST_CHECK(!filter.contains(COutPoint(uint256("0x02981fa052f0481dbc5868f4fc2166035a10f27a03cfd2de67326471df5bc041"), 0)));
 }
 
+BOOST_AUTO_TEST_CASE(bloom_murmur3_seeds)
+{
+    BOOST_CHECK_EQUAL(MurmurHash3(0x00000000, vector<unsigned char>()), 0x00000000U);
+    BOOST_CHECK_EQUAL(MurmurHash3(0xFBA4C795, ParseHex("00")), 0xea3f0b17U);
+    BOOST_CHECK_EQUAL(MurmurHash3(0x00000000, ParseHex("0011")), 0x16c6b7abU);
+    BOOST_CHECK_EQUAL(MurmurHash3(0x00000000, ParseHex("00112233")), 0xb4471bf8U);
+    BOOST_CHECK_EQUAL(MurmurHash3(0x00000000, ParseHex("00112233445566")), 0xb074502cU);
+
+    // Premixed data hashed for several seeds at once, over every tail length
+    // and both the four lane and the single seed paths
+    for (unsigned int nLen = 0; nLen <= 40; nLen++)
+    {
+        vector<unsigned char> vch(nLen);
+        for (unsigned int i = 0; i < nLen; i++)
+            vch[i] = (unsigned char)(i * 37 + nLen);
+        vector<uint32_t> vWords(nLen / 4 + 1);
+        MurmurHash3Mix(vch.empty() ? NULL : &vch[0], nLen, &vWords[0]);
+        uint32_t vSeeds[7], vHash[7];
+        for (unsigned int i = 0; i < 7; i++)
+            vSeeds[i] = i * 0xFBA4C795 + nLen * 0x9E3779B9;
+        MurmurHash3Seeds(&vWords[0], nLen, vSeeds, 7, vHash);
+        for (unsigned int i = 0; i < 7; i++)
+            BOOST_CHECK_EQUAL(vHash[i], MurmurHash3(vSeeds[i], vch));
+    }
+}
+
+// Whether any element of tx is in the filter, checked one by one
+static bool ContainsAnyElement(const CBloomFilter& filter, const CTransaction& tx)
+{
+    if (filter.contains(tx.GetHash()))
+        return true;
+    vector<CScript> vScripts;
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        vScripts.push_back(txout.scriptPubKey);
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        if (filter.contains(txin.prevout))
+            return true;
+        vScripts.push_back(txin.scriptSig);
+    }
+    BOOST_FOREACH(const CScript& script, vScripts)
+    {
+        CScript::const_iterator pc = script.begin();
+        vector<unsigned char> data;
+        opcodetype opcode;
+        while (script.GetOp(pc, opcode, data))
+            if (data.size() != 0 && filter.contains(data))
+                return true;
+    }
+    return false;
+}
+
+BOOST_AUTO_TEST_CASE(bloom_shared_elements)
+{
+    // Transactions paying to pubkeys and multisig, with several inputs
+    vector<CTransaction> vtx;
+    for (int i = 0; i < 8; i++)
+    {
+        CTransaction tx;
+        for (int j = 0; j <= i % 3; j++)
+        {
+            tx.vin.push_back(CTxIn(COutPoint(uint256(i * 10 + j + 1), j)));
+            tx.vin.back().scriptSig << vector<unsigned char>(71, (unsigned char)(i + j)) << vector<unsigned char>(33, (unsigned char)(i * j));
+        }
+        for (int j = 0; j < 3; j++)
+        {
+            CKey key;
+            key.MakeNewKey(true);
+            CScript script;
+            if (j == 2)
+                script << OP_1 << key.GetPubKey() << key.GetPubKey() << OP_2 << OP_CHECKMULTISIG;
+            else if (j == 1)
+                script << key.GetPubKey() << OP_CHECKSIG;
+            else
+                script.SetDestination(key.GetPubKey().GetID());
+            tx.vout.push_back(CTxOut(j * COIN, script));
+        }
+        vtx.push_back(tx);
+    }
+
+    // Filters of many peers, each watching one element of one transaction,
+    // matched against data extracted once per transaction
+    for (int nFilter = 0; nFilter < 60; nFilter++)
+    {
+        CBloomFilter filter(3 + nFilter % 7, 0.0001, nFilter * 0x01234567, nFilter % 3);
+        const CTransaction& txWatched = vtx[nFilter % vtx.size()];
+        int nOut = (nFilter / 3) % 3;
+        const CScript& script = txWatched.vout[nOut].scriptPubKey;
+        vector<unsigned char> data;
+        CScript::const_iterator pc = script.begin();
+        opcodetype opcode;
+        while (script.GetOp(pc, opcode, data) && data.empty());
+        if (nFilter % 5 == 0)
+            filter.insert(txWatched.vin[0].prevout);
+        else if (nFilter % 5 == 1)
+            filter.insert(txWatched.GetHash());
+        else
+            filter.insert(data);
+        CBloomFilter filter2 = filter;
+
+        BOOST_FOREACH(const CTransaction& tx, vtx)
+        {
+            bool fContains = ContainsAnyElement(filter, tx);
+            bool fMatch = filter.IsRelevantAndUpdate(CBloomTxElements(tx, tx.GetHash()));
+            BOOST_CHECK_EQUAL(fMatch, fContains);
+            BOOST_CHECK_EQUAL(filter2.IsRelevantAndUpdate(tx, tx.GetHash()), fMatch);
+        }
+        BOOST_CHECK(filter.IsRelevantAndUpdate(CBloomTxElements(txWatched, txWatched.GetHash())));
+
+        // Outputs matched by their data are added as the flags say
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION), ss2(SER_NETWORK, PROTOCOL_VERSION);
+        ss << filter;
+        ss2 << filter2;
+        BOOST_CHECK(ss.str() == ss2.str());
+        if (nFilter % 5 >= 2)
+        {
+            bool fAdded = nFilter % 3 == BLOOM_UPDATE_ALL || (nFilter % 3 == BLOOM_UPDATE_P2PUBKEY_ONLY && nOut != 0);
+            BOOST_CHECK_EQUAL(filter.contains(COutPoint(txWatched.GetHash(), nOut)), fAdded);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(rolling_bloom)
+{
+    CRollingBloomFilter rb(100, 0.001);
+
+    // The last 100 entries are always remembered, others rarely show up
+    for (int i = 0; i < 1000; i++)
+    {
+        rb.insert(GetRandHash() ^ i);
+        uint256 hash = GetRandHash();
+        rb.insert(hash);
+        BOOST_CHECK(rb.contains(hash));
+    }
+    vector<uint256> vHashes;
+    for (int i = 0; i < 100; i++)
+    {
+        vHashes.push_back(GetRandHash());
+        rb.insert(vHashes.back());
+    }
+    BOOST_FOREACH(const uint256& hash, vHashes)
+        BOOST_CHECK(rb.contains(hash));
+    int nFalse = 0;
+    for (int i = 0; i < 10000; i++)
+        if (rb.contains(GetRandHash()))
+            nFalse++;
+    BOOST_CHECK(nFalse < 100);
+
+    // Entries more than three generations back are forgotten
+    for (int i = 0; i < 200; i++)
+        rb.insert(GetRandHash());
+    int nOld = 0;
+    BOOST_FOREACH(const uint256& hash, vHashes)
+        if (rb.contains(hash))
+            nOld++;
+    BOOST_CHECK(nOld < 10);
+
+    rb.reset();
+    BOOST_CHECK(!rb.contains(vHashes.back()));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -63,4 +63,23 @@ BOOST_AUTO_TEST_CASE(May15)
     SetMockTime(0);
 }
 
+BOOST_AUTO_TEST_CASE(ReadBlockMessage_test)
+{
+    // The raw message read from disk must match what PushMessage would send
+    CBlock block;
+    BOOST_CHECK(block.ReadFromDisk(pindexGenesisBlock));
+    CDataStream ssExpected(SER_NETWORK, PROTOCOL_VERSION);
+    ssExpected << block;
+    CMessageHeader hdr("block", ssExpected.size());
+    uint256 hash = Hash(ssExpected.begin(), ssExpected.end());
+    memcpy(&hdr.nChecksum, &hash, sizeof(hdr.nChecksum));
+    CDataStream ssMessage(SER_NETWORK, PROTOCOL_VERSION);
+    ssMessage << hdr;
+    ssMessage.write(&ssExpected[0], ssExpected.size());
+
+    CSerializeData vMsg;
+    BOOST_CHECK(ReadBlockMessage(pindexGenesisBlock, vMsg));
+    BOOST_CHECK(vMsg.size() == ssMessage.size() && std::equal(vMsg.begin(), vMsg.end(), ssMessage.begin()));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
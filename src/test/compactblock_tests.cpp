@@ -0,0 +1,178 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "hash.h"
+#include "serialize.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(compactblock_tests)
+
+BOOST_AUTO_TEST_CASE(siphash)
+{
+    uint256 val("0x1f1e1d1c1b1a191817161514131211100f0e0d0c0b0a09080706050403020100");
+    BOOST_CHECK_EQUAL(SipHashUint256(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, val), 0x7127512f72f27cceULL);
+}
+
+static CTransaction MakeTransaction(int n)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.hash = uint256(n + 1);
+    tx.vin[0].prevout.n = 0;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 1000 * n;
+    tx.vout[0].scriptPubKey << OP_TRUE;
+    return tx;
+}
+
+static CBlock MakeBlock(int nTx)
+{
+    CBlock block;
+    block.vtx.resize(1);
+    block.vtx[0].vin.resize(1);
+    block.vtx[0].vin[0].scriptSig << OP_1;
+    block.vtx[0].vout.resize(1);
+    block.vtx[0].vout[0].nValue = 50 * COIN;
+    for (int i = 1; i < nTx; i++)
+        block.vtx.push_back(MakeTransaction(i));
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    block.nVersion = 2;
+    block.nTime = 1380000000;
+    block.nBits = 0x207fffff;
+    return block;
+}
+
+// Pass a message through the wire format
+template<typename T>
+static T Relay(const T& obj)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << obj;
+    T objOut;
+    ss >> objOut;
+    BOOST_CHECK(ss.empty());
+    return objOut;
+}
+
+BOOST_AUTO_TEST_CASE(compactblock_serialize)
+{
+    CBlock block = MakeBlock(5);
+    CCompactBlock cmpctblock(block, 0x123456789abcdefULL);
+    BOOST_CHECK_EQUAL(cmpctblock.vShortTxID.size(), 4U);
+    BOOST_CHECK_EQUAL(cmpctblock.vPrefilledTxn.size(), 1U);
+    BOOST_CHECK_EQUAL(cmpctblock.GetTransactionCount(), 5U);
+
+    CCompactBlock cmpctblock2 = Relay(cmpctblock);
+    BOOST_CHECK(cmpctblock2.header.GetHash() == block.GetHash());
+    BOOST_CHECK(cmpctblock2.nNonce == cmpctblock.nNonce);
+    BOOST_CHECK(cmpctblock2.vShortTxID == cmpctblock.vShortTxID);
+    BOOST_CHECK(cmpctblock2.vPrefilledTxn[0].tx.GetHash() == block.vtx[0].GetHash());
+
+    // Short ids take 6 bytes on the wire
+    BOOST_CHECK_EQUAL(::GetSerializeSize(cmpctblock, SER_NETWORK, PROTOCOL_VERSION),
+                      80 + 8 + 1 + 4 * 6 + 1 + 4 + ::GetSerializeSize(block.vtx[0], SER_NETWORK, PROTOCOL_VERSION));
+}
+
+BOOST_AUTO_TEST_CASE(compactblock_reconstruct)
+{
+    // The sending node mined a block, the receiving node has part of its
+    // transactions in its memory pool, plus some that aren't in the block
+    CBlock block = MakeBlock(20);
+    CTxMemPool pool;
+    {
+        LOCK(pool.cs);
+        for (unsigned int i = 1; i < block.vtx.size(); i++)
+            if (i % 3 != 0)
+                pool.addUnchecked(block.vtx[i].GetHash(), block.vtx[i]);
+        for (int i = 100; i < 110; i++)
+        {
+            CTransaction tx = MakeTransaction(i);
+            pool.addUnchecked(tx.GetHash(), tx);
+        }
+    }
+
+    // Receiver: rebuild from the pool and ask for the rest
+    CPartialBlock partial;
+    BOOST_CHECK(partial.Init(Relay(CCompactBlock(block, GetRand(~(uint64)0))), pool));
+    BOOST_CHECK(!partial.IsValid());
+    CBlockTransactionsRequest req;
+    req.blockhash = partial.block.GetHash();
+    req.vIndexes = partial.GetMissing();
+    BOOST_CHECK(req.blockhash == block.GetHash());
+    BOOST_CHECK_EQUAL(req.vIndexes.size(), 6U);
+    BOOST_FOREACH(unsigned int nIndex, req.vIndexes)
+        BOOST_CHECK(nIndex % 3 == 0 && nIndex > 0);
+
+    // Sender: answer from the block
+    CBlockTransactionsRequest req2 = Relay(req);
+    CBlockTransactions resp;
+    resp.blockhash = req2.blockhash;
+    BOOST_FOREACH(unsigned int nIndex, req2.vIndexes)
+        resp.vtx.push_back(block.vtx[nIndex]);
+
+    // Receiver: complete the block
+    CPartialBlock partial2 = partial;
+    BOOST_CHECK(partial.FillMissing(Relay(resp).vtx));
+    BOOST_CHECK(partial.IsValid());
+    BOOST_CHECK(partial.GetMissing().empty());
+    BOOST_CHECK(partial.block.GetHash() == block.GetHash());
+    BOOST_CHECK(SerializeHash(partial.block) == SerializeHash(block));
+
+    // Wrong transactions are caught by the merkle root
+    swap(resp.vtx[0], resp.vtx[1]);
+    BOOST_CHECK(partial2.FillMissing(resp.vtx));
+    BOOST_CHECK(!partial2.IsValid());
+
+    // So is a wrong number of them
+    CPartialBlock partial3;
+    BOOST_CHECK(partial3.Init(CCompactBlock(block, 1), pool));
+    resp.vtx.pop_back();
+    BOOST_CHECK(!partial3.FillMissing(resp.vtx));
+
+    // A receiver with everything in its pool needs no round trip
+    {
+        LOCK(pool.cs);
+        for (unsigned int i = 1; i < block.vtx.size(); i++)
+            pool.addUnchecked(block.vtx[i].GetHash(), block.vtx[i]);
+    }
+    CPartialBlock partial4;
+    BOOST_CHECK(partial4.Init(CCompactBlock(block, 2), pool));
+    BOOST_CHECK(partial4.GetMissing().empty());
+    BOOST_CHECK(partial4.IsValid());
+}
+
+BOOST_AUTO_TEST_CASE(compactblock_malformed)
+{
+    CBlock block = MakeBlock(4);
+    CTxMemPool pool;
+    CPartialBlock partial;
+
+    // Prefilled transaction beyond the end of the block
+    CCompactBlock cmpctblock(block, 0);
+    cmpctblock.vPrefilledTxn[0].nIndex = 4;
+    BOOST_CHECK(!partial.Init(cmpctblock, pool));
+
+    // Prefilled transactions out of order
+    cmpctblock = CCompactBlock(block, 0);
+    cmpctblock.vShortTxID.resize(1);
+    cmpctblock.vPrefilledTxn.push_back(CPrefilledTransaction(2, block.vtx[2]));
+    cmpctblock.vPrefilledTxn.push_back(CPrefilledTransaction(1, block.vtx[1]));
+    BOOST_CHECK(!partial.Init(cmpctblock, pool));
+
+    // Two transactions with the same short id
+    cmpctblock = CCompactBlock(block, 0);
+    cmpctblock.vShortTxID[1] = cmpctblock.vShortTxID[0];
+    BOOST_CHECK(!partial.Init(cmpctblock, pool));
+
+    // Empty block
+    BOOST_CHECK(!partial.Init(CCompactBlock(), pool));
+
+    // Short ids of bad length don't deserialize
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << block.GetBlockHeader() << (uint64)0 << vector<unsigned char>(7) << vector<CPrefilledTransaction>();
+    CCompactBlock cmpctblock2;
+    BOOST_CHECK_THROW(ss >> cmpctblock2, std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,375 @@
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include "keystore.h"
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(mempool_tests)
+
+// A transaction with nOut outputs spending the given outpoints, or a
+// made-up confirmed one when there are none
+static CTransaction MakeTransaction(const vector<COutPoint>& vPrevout, int nOut)
+{
+    static int nSalt = 0;
+    CTransaction tx;
+    if (vPrevout.empty())
+    {
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(uint256(++nSalt), 0);
+    }
+    BOOST_FOREACH(const COutPoint& prevout, vPrevout)
+        tx.vin.push_back(CTxIn(prevout));
+    for (int i = 0; i < nOut; i++)
+        tx.vout.push_back(CTxOut(COIN, CScript() << OP_TRUE));
+    return tx;
+}
+
+static CTxMemPool::txiter Add(CTxMemPool& pool, const CTransaction& tx, int64 nFee, int64 nTime = 0)
+{
+    uint256 hash = tx.GetHash();
+    BOOST_CHECK(pool.addUnchecked(hash, CTxMemPoolEntry(tx, nFee, nTime, 0, 1, 0, 0)));
+    return pool.mapTx.find(hash);
+}
+
+static void CheckTotals(CTxMemPool::txiter it, const vector<CTxMemPool::txiter>& vAncestors,
+                        const vector<CTxMemPool::txiter>& vDescendants)
+{
+    uint64 nSize = it->GetTxSize();
+    int64 nFees = it->GetFee();
+    BOOST_FOREACH(CTxMemPool::txiter itAncestor, vAncestors)
+        nSize += itAncestor->GetTxSize(), nFees += itAncestor->GetFee();
+    BOOST_CHECK_EQUAL(it->GetCountWithAncestors(), vAncestors.size() + 1);
+    BOOST_CHECK_EQUAL(it->GetSizeWithAncestors(), nSize);
+    BOOST_CHECK_EQUAL(it->GetFeesWithAncestors(), nFees);
+
+    nSize = it->GetTxSize();
+    nFees = it->GetFee();
+    BOOST_FOREACH(CTxMemPool::txiter itDescendant, vDescendants)
+        nSize += itDescendant->GetTxSize(), nFees += itDescendant->GetFee();
+    BOOST_CHECK_EQUAL(it->GetCountWithDescendants(), vDescendants.size() + 1);
+    BOOST_CHECK_EQUAL(it->GetSizeWithDescendants(), nSize);
+    BOOST_CHECK_EQUAL(it->GetFeesWithDescendants(), nFees);
+}
+
+static vector<CTxMemPool::txiter> List(CTxMemPool::txiter a)
+{
+    return vector<CTxMemPool::txiter>(1, a);
+}
+
+static vector<CTxMemPool::txiter> List(CTxMemPool::txiter a, CTxMemPool::txiter b)
+{
+    vector<CTxMemPool::txiter> v = List(a);
+    v.push_back(b);
+    return v;
+}
+
+static vector<CTxMemPool::txiter> List(CTxMemPool::txiter a, CTxMemPool::txiter b, CTxMemPool::txiter c)
+{
+    vector<CTxMemPool::txiter> v = List(a, b);
+    v.push_back(c);
+    return v;
+}
+
+BOOST_AUTO_TEST_CASE(mempool_package_totals)
+{
+    // A diamond: b spends a, c spends a and b, d spends c
+    CTransaction txA = MakeTransaction(vector<COutPoint>(), 2);
+    CTransaction txB = MakeTransaction(vector<COutPoint>(1, COutPoint(txA.GetHash(), 0)), 1);
+    vector<COutPoint> vPrevout;
+    vPrevout.push_back(COutPoint(txA.GetHash(), 1));
+    vPrevout.push_back(COutPoint(txB.GetHash(), 0));
+    CTransaction txC = MakeTransaction(vPrevout, 1);
+    CTransaction txD = MakeTransaction(vector<COutPoint>(1, COutPoint(txC.GetHash(), 0)), 1);
+    vector<CTransaction> vtx;
+    vtx.push_back(txA);
+    vtx.push_back(txB);
+    vtx.push_back(txC);
+    vtx.push_back(txD);
+
+    // Added parents first, or children first as when a block is disconnected
+    for (int nOrder = 0; nOrder < 2; nOrder++)
+    {
+        CTxMemPool pool;
+        LOCK(pool.cs);
+        for (int i = 0; i < 4; i++)
+        {
+            const CTransaction& tx = vtx[nOrder == 0 ? i : 3 - i];
+            Add(pool, tx, 1000 * (1 + (nOrder == 0 ? i : 3 - i)));
+        }
+        CTxMemPool::txiter a = pool.mapTx.find(txA.GetHash()), b = pool.mapTx.find(txB.GetHash());
+        CTxMemPool::txiter c = pool.mapTx.find(txC.GetHash()), d = pool.mapTx.find(txD.GetHash());
+        CheckTotals(a, vector<CTxMemPool::txiter>(), List(b, c, d));
+        CheckTotals(b, List(a), List(c, d));
+        CheckTotals(c, List(a, b), List(d));
+        CheckTotals(d, List(a, b, c), vector<CTxMemPool::txiter>());
+        BOOST_CHECK_EQUAL(pool.GetMemPoolParents(c).size(), 2U);
+        BOOST_CHECK_EQUAL(pool.GetMemPoolChildren(a).size(), 2U);
+
+        if (nOrder == 0)
+        {
+            // Removing b takes what spends it along
+            pool.remove(txB, true);
+            BOOST_CHECK_EQUAL(pool.size(), 1U);
+            CheckTotals(a, vector<CTxMemPool::txiter>(), vector<CTxMemPool::txiter>());
+        }
+        else
+        {
+            // Mining a leaves the rest, now without it
+            pool.remove(txA);
+            BOOST_CHECK_EQUAL(pool.size(), 3U);
+            CheckTotals(b, vector<CTxMemPool::txiter>(), List(c, d));
+            CheckTotals(c, List(b), List(d));
+            CheckTotals(d, List(b, c), vector<CTxMemPool::txiter>());
+            BOOST_CHECK(pool.GetMemPoolParents(b).empty());
+            BOOST_CHECK_EQUAL(pool.mapNextTx.size(), 4U);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(mempool_orderings)
+{
+    CTxMemPool pool;
+    LOCK(pool.cs);
+
+    // A parent paying nothing with a child paying for both, and two others
+    CTransaction txParent = MakeTransaction(vector<COutPoint>(), 1);
+    CTransaction txChild = MakeTransaction(vector<COutPoint>(1, COutPoint(txParent.GetHash(), 0)), 1);
+    CTransaction txLow = MakeTransaction(vector<COutPoint>(), 1);
+    CTransaction txHigh = MakeTransaction(vector<COutPoint>(), 1);
+    CTxMemPool::txiter itParent = Add(pool, txParent, 0, 400);
+    CTxMemPool::txiter itChild = Add(pool, txChild, 30000, 300);
+    CTxMemPool::txiter itLow = Add(pool, txLow, 1000, 200);
+    CTxMemPool::txiter itHigh = Add(pool, txHigh, 20000, 100);
+
+    // Eviction order: the parent counts with its child
+    vector<uint256> vOrder;
+    BOOST_FOREACH(const CTxMemPoolEntry& entry, pool.mapTx.get<descendant_score>())
+        vOrder.push_back(entry.GetHash());
+    BOOST_CHECK(vOrder[0] == itLow->GetHash());
+    BOOST_CHECK(vOrder[1] == itParent->GetHash());
+    BOOST_CHECK(vOrder[2] == itHigh->GetHash());
+    BOOST_CHECK(vOrder[3] == itChild->GetHash());
+
+    // Mining order: the child counts with its parent
+    vOrder.clear();
+    BOOST_FOREACH(const CTxMemPoolEntry& entry, pool.mapTx.get<ancestor_score>())
+        vOrder.push_back(entry.GetHash());
+    BOOST_CHECK(vOrder[0] == itHigh->GetHash());
+    BOOST_CHECK(vOrder[1] == itChild->GetHash());
+    BOOST_CHECK(vOrder[2] == itLow->GetHash());
+    BOOST_CHECK(vOrder[3] == itParent->GetHash());
+
+    vOrder.clear();
+    BOOST_FOREACH(const CTxMemPoolEntry& entry, pool.mapTx.get<entry_time>())
+        vOrder.push_back(entry.GetHash());
+    BOOST_CHECK(vOrder[0] == itHigh->GetHash());
+    BOOST_CHECK(vOrder[3] == itParent->GetHash());
+
+    // Once the child is gone, the parent is the cheapest
+    pool.remove(txChild);
+    BOOST_CHECK(pool.mapTx.get<descendant_score>().begin()->GetHash() == txParent.GetHash());
+    BOOST_CHECK(pool.mapTx.get<ancestor_score>().rbegin()->GetHash() == txParent.GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(mempool_usage_and_trim)
+{
+    CTxMemPool pool;
+    LOCK(pool.cs);
+
+    CTransaction txParent = MakeTransaction(vector<COutPoint>(), 1);
+    CTransaction txChild = MakeTransaction(vector<COutPoint>(1, COutPoint(txParent.GetHash(), 0)), 1);
+    CTransaction txLow = MakeTransaction(vector<COutPoint>(), 1);
+    CTransaction txHigh = MakeTransaction(vector<COutPoint>(), 1);
+    Add(pool, txParent, 0);
+    Add(pool, txChild, 30000);
+    CTxMemPool::txiter itLow = Add(pool, txLow, 1000);
+    CTxMemPool::txiter itHigh = Add(pool, txHigh, 20000);
+    BOOST_CHECK_EQUAL(pool.GetTotalTxSize(), 4 * (uint64)itLow->GetTxSize());
+
+    // Taking an entry and its link out gives back all it took
+    size_t nUsage = pool.DynamicMemoryUsage();
+    pool.remove(txChild);
+    BOOST_CHECK(pool.DynamicMemoryUsage() < nUsage);
+    Add(pool, txChild, 30000);
+    BOOST_CHECK_EQUAL(pool.DynamicMemoryUsage(), nUsage);
+
+    // The cheapest goes first and sets the minimum fee
+    BOOST_CHECK_EQUAL(pool.GetMinFee(nUsage), 0);
+    pool.TrimToSize(nUsage - 1);
+    BOOST_CHECK_EQUAL(pool.size(), 3U);
+    BOOST_CHECK(!pool.exists(txLow.GetHash()));
+    int64 nMinFee = pool.GetMinFee(nUsage);
+    BOOST_CHECK_EQUAL(nMinFee, 1000 * 1000 / itHigh->GetTxSize() + CTransaction::nMinRelayTxFee);
+
+    // Then the parent with the child paying for it, less than the other
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK_EQUAL(pool.size(), 1U);
+    BOOST_CHECK(pool.exists(txHigh.GetHash()));
+    BOOST_CHECK(pool.GetMinFee(nUsage) > nMinFee);
+    nMinFee = pool.GetMinFee(nUsage);
+
+    // It only decays once a block comes in, faster when the pool is emptier
+    SetMockTime(GetTime());
+    pool.BlockConnected();
+    SetMockTime(GetTime() + 60 * 60 * 3);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(10 * nUsage), nMinFee / 2);
+    SetMockTime(GetTime() + 60 * 60 * 24);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(10 * nUsage), 0);
+    SetMockTime(0);
+}
+
+BOOST_AUTO_TEST_CASE(mempool_priority)
+{
+    CTransaction tx = MakeTransaction(vector<COutPoint>(), 1);
+    CTxMemPoolEntry entry(tx, 0, 0, 1000.0, 100, 5 * COIN, 0);
+    BOOST_CHECK_EQUAL(entry.GetPriority(100), 1000.0);
+    BOOST_CHECK_EQUAL(entry.GetPriority(110), 1000.0 + 10.0 * 5 * COIN / entry.GetTxSize());
+}
+
+BOOST_AUTO_TEST_CASE(mempool_fee_estimates)
+{
+    CTxMemPool pool;
+    LOCK(pool.cs);
+
+    // Each block, 20 transactions paying a lot come in and make the next
+    // block, and 20 paying a little make it 5 blocks later
+    vector<vector<CTransaction> > vLowByHeight;
+    int64 nHighRate = 0, nLowRate = 0;
+    for (unsigned int nHeight = 1; nHeight <= 40; nHeight++)
+    {
+        vector<CTransaction> vBlock, vLow;
+        for (int i = 0; i < 20; i++)
+        {
+            CTransaction txHigh = MakeTransaction(vector<COutPoint>(), 1);
+            CTransaction txLow = MakeTransaction(vector<COutPoint>(), 1);
+            CTxMemPoolEntry entryHigh(txHigh, 10000, 0, 0, nHeight, 0, 0);
+            CTxMemPoolEntry entryLow(txLow, 2000, 0, 0, nHeight, 0, 0);
+            nHighRate = 10000 * 1000 / entryHigh.GetTxSize();
+            nLowRate = 2000 * 1000 / entryLow.GetTxSize();
+            BOOST_CHECK(pool.addUnchecked(txHigh.GetHash(), entryHigh));
+            BOOST_CHECK(pool.addUnchecked(txLow.GetHash(), entryLow));
+            vBlock.push_back(txHigh);
+            vLow.push_back(txLow);
+        }
+        vLowByHeight.push_back(vLow);
+        if (nHeight > 4)
+            vBlock.insert(vBlock.end(), vLowByHeight[nHeight - 5].begin(), vLowByHeight[nHeight - 5].end());
+        pool.removeForBlock(vBlock, nHeight, true);
+    }
+    BOOST_CHECK_EQUAL(pool.size(), 80U);
+    BOOST_CHECK_EQUAL(pool.estimateFee(1), nHighRate);
+    BOOST_CHECK_EQUAL(pool.estimateFee(4), nHighRate);
+    BOOST_CHECK_EQUAL(pool.estimateFee(5), nLowRate);
+    BOOST_CHECK_EQUAL(pool.estimateFee(0), -1);
+    BOOST_CHECK_EQUAL(pool.estimatePriority(1), -1);
+
+    // Blocks seen while catching up, or again, don't count
+    pool.removeForBlock(vLowByHeight[35], 41, false);
+    pool.removeForBlock(vLowByHeight[36], 41, true);
+    BOOST_CHECK_EQUAL(pool.size(), 60U);
+    BOOST_CHECK_EQUAL(pool.estimateFee(5), nLowRate);
+
+    // They come back as they were saved
+    CAutoFile file(tmpfile(), SER_DISK, CLIENT_VERSION);
+    BOOST_CHECK(pool.WriteFeeEstimates(file));
+    rewind(file);
+    CTxMemPool poolRead;
+    BOOST_CHECK(poolRead.ReadFeeEstimates(file));
+    BOOST_CHECK_EQUAL(poolRead.estimateFee(1), nHighRate);
+    BOOST_CHECK_EQUAL(poolRead.estimateFee(5), nLowRate);
+}
+
+
+// A transaction spending txFrom's output nOut to our key, leaving a fee
+static CTransaction MakeSignedSpend(const CKeyStore& keystore, const CTransaction& txFrom, int nOut, const CScript& scriptPubKey)
+{
+    CTransaction tx;
+    tx.vin.push_back(CTxIn(COutPoint(txFrom.GetHash(), nOut)));
+    tx.vout.push_back(CTxOut(txFrom.vout[nOut].nValue - 10000, scriptPubKey));
+    BOOST_CHECK(SignSignature(keystore, txFrom, tx, 0));
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(mempool_dump_load)
+{
+    boost::filesystem::path pathMempool = GetDataDir() / "mempool.dat";
+    boost::filesystem::remove(pathMempool);
+
+    // Nothing was dumped yet, nor may be before the pool was loaded
+    BOOST_CHECK(!DumpMempool());
+    BOOST_CHECK(!LoadMempool());
+
+    // Coins to our key on top of the best block
+    CBasicKeyStore keystore;
+    CKey key;
+    key.MakeNewKey(true);
+    keystore.AddKey(key);
+    CScript scriptPubKey = CScript() << key.GetPubKey() << OP_CHECKSIG;
+    CTransaction txFunding;
+    txFunding.vin.resize(1);
+    txFunding.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    txFunding.vout.resize(3, CTxOut(COIN, scriptPubKey));
+
+    CCoinsView dummy;
+    CCoinsViewCache view(dummy);
+    view.SetBestBlock(pindexBest);
+    view.SetCoins(txFunding.GetHash(), CCoins(txFunding, 1));
+    CCoinsViewCache* pcoinsTipSaved = pcoinsTip;
+    pcoinsTip = &view;
+    blockassembler.Invalidate();
+
+    // Three spends of the coins, and one spending from the pool
+    vector<CTransaction> vtx;
+    for (int i = 0; i < 3; i++)
+        vtx.push_back(MakeSignedSpend(keystore, txFunding, i, scriptPubKey));
+    CTransaction txChild = MakeSignedSpend(keystore, vtx[0], 0, scriptPubKey);
+    vtx.push_back(txChild);
+    int64 nTimeAccepted = GetTime() - 1000;
+    SetMockTime(nTimeAccepted);
+    BOOST_FOREACH(CTransaction& tx, vtx)
+    {
+        CValidationState state;
+        BOOST_CHECK(tx.AcceptToMemoryPool(state, true, false));
+    }
+    SetMockTime(0);
+    BOOST_CHECK_EQUAL(mempool.size(), 4U);
+
+    // They come back as they were saved, the child after its parent, with
+    // the time they first entered the pool
+    BOOST_CHECK(DumpMempool());
+    mempool.clear();
+    BOOST_CHECK(LoadMempool());
+    BOOST_CHECK_EQUAL(mempool.size(), 4U);
+    BOOST_FOREACH(CTransaction& tx, vtx)
+    {
+        BOOST_CHECK(mempool.exists(tx.GetHash()));
+        BOOST_CHECK_EQUAL(mempool.mapTx.find(tx.GetHash())->GetTime(), nTimeAccepted);
+    }
+
+    // A file cut short gives what was read in full
+    mempool.clear();
+    boost::filesystem::resize_file(pathMempool, boost::filesystem::file_size(pathMempool) - 10);
+    BOOST_CHECK(LoadMempool());
+    BOOST_CHECK_EQUAL(mempool.size(), 3U);
+    BOOST_CHECK(!mempool.exists(txChild.GetHash()));
+
+    // A file from another version is left alone
+    mempool.clear();
+    {
+        CAutoFile file(fopen(pathMempool.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        file << (uint64)1 << (uint64)vtx.size();
+        BOOST_FOREACH(CTransaction& tx, vtx)
+            file << tx;
+    }
+    BOOST_CHECK(!LoadMempool());
+    BOOST_CHECK_EQUAL(mempool.size(), 0U);
+
+    boost::filesystem::remove(pathMempool);
+    pcoinsTip = pcoinsTipSaved;
+    blockassembler.Invalidate();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
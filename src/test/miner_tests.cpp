@@ -201,6 +201,153 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     pindexBest->nHeight = nHeight;
 }
 
+// A transaction spending nIn outputs of txid worth a coin each, leaving nFee
+static CTransaction MakeSpend(const uint256& txid, int nIn, int64 nFee)
+{
+    CTransaction tx;
+    for (int i = 0; i < nIn; i++)
+        tx.vin.push_back(CTxIn(COutPoint(txid, i)));
+    tx.vout.push_back(CTxOut(nIn * COIN - nFee, CScript() << OP_TRUE));
+    return tx;
+}
+
+static void AddToPool(CTxMemPool& pool, const CTransaction& tx, int64 nFee)
+{
+    uint256 hash = tx.GetHash();
+    pool.addUnchecked(hash, CTxMemPoolEntry(tx, nFee, GetTime(), 0, nBestHeight + 1, 0, tx.GetLegacySigOpCount()));
+}
+
+BOOST_AUTO_TEST_CASE(block_assembler)
+{
+    // Coins to spend, on top of a made-up best block
+    uint256 hashBlock = hashBestChain;
+    CBlockIndex index;
+    index.phashBlock = &hashBlock;
+    index.nHeight = 1000;
+    CCoinsView dummy;
+    CCoinsViewCache view(dummy);
+    view.SetBestBlock(&index);
+    std::vector<uint256> vFunding;
+    for (int i = 0; i < 4; i++)
+    {
+        CCoins coins;
+        coins.nHeight = 1;
+        coins.vout.resize(2, CTxOut(COIN, CScript() << OP_TRUE));
+        vFunding.push_back(uint256(i + 1));
+        view.SetCoins(vFunding.back(), coins);
+    }
+    CCoinsViewCache* pcoinsTipSaved = pcoinsTip;
+    pcoinsTip = &view;
+
+    CTxMemPool pool;
+    CBlockAssembler assembler(pool);
+    LOCK(pool.cs);
+
+    CTransaction txA = MakeSpend(vFunding[0], 2, COIN / 100);
+    CTransaction txB = MakeSpend(vFunding[1], 1, COIN / 1000);
+    AddToPool(pool, txA, COIN / 100);
+    AddToPool(pool, txB, COIN / 1000);
+    BOOST_CHECK(assembler.Update(&index));
+    BOOST_CHECK(!assembler.Update(&index));
+    BOOST_CHECK_EQUAL(assembler.GetBlockTx(), 2U);
+
+    // Spending what was picked goes straight in, parents first
+    CTransaction txC = MakeSpend(txA.GetHash(), 1, 0);
+    txC.vout[0].nValue = txA.vout[0].nValue - COIN / 100;
+    AddToPool(pool, txC, COIN / 100);
+    BOOST_CHECK(!assembler.Update(&index));
+    BOOST_CHECK_EQUAL(assembler.GetBlockTx(), 3U);
+    CBlockTemplate blocktemplate;
+    BOOST_CHECK_EQUAL(assembler.Fill(blocktemplate), COIN / 100 * 2 + COIN / 1000);
+    BOOST_CHECK_EQUAL(blocktemplate.block.vtx.size(), 3U);
+    BOOST_CHECK(blocktemplate.block.vtx[2].GetHash() == txC.GetHash());
+    BOOST_CHECK_EQUAL(blocktemplate.vTxSigOps[2], 0);
+
+    // What does not connect is left out: missing inputs, a double spend, too much value out
+    CTransaction txMissing = MakeSpend(uint256(100), 1, 0);
+    CTransaction txDoubleSpend = MakeSpend(vFunding[1], 1, COIN / 10);
+    CTransaction txOverspend = MakeSpend(vFunding[2], 1, -COIN);
+    AddToPool(pool, txMissing, 0);
+    AddToPool(pool, txDoubleSpend, COIN / 10);
+    AddToPool(pool, txOverspend, COIN);
+    BOOST_CHECK(!assembler.Update(&index));
+    BOOST_CHECK_EQUAL(assembler.GetBlockTx(), 3U);
+
+    // Picking again takes the better paying of the two spends
+    assembler.Invalidate();
+    BOOST_CHECK(assembler.Update(&index));
+    BOOST_CHECK_EQUAL(assembler.GetBlockTx(), 3U);
+
+    // Taking a picked transaction out has it pick again
+    pool.remove(txA, true);
+    BOOST_CHECK(assembler.Update(&index));
+    BOOST_CHECK_EQUAL(assembler.GetBlockTx(), 1U);
+    CBlockTemplate blocktemplate2;
+    assembler.Fill(blocktemplate2);
+    BOOST_CHECK(blocktemplate2.block.vtx[0].GetHash() == txDoubleSpend.GetHash());
+
+    pcoinsTip = pcoinsTipSaved;
+}
+
+BOOST_AUTO_TEST_CASE(CreateNewBlock_payouts)
+{
+    // Coins to spend on top of the best block
+    CCoinsView dummy;
+    CCoinsViewCache view(dummy);
+    view.SetBestBlock(pindexBest);
+    CCoinsViewCache* pcoinsTipSaved = pcoinsTip;
+    pcoinsTip = &view;
+    blockassembler.Invalidate();
+    for (int i = 0; i < 5; i++)
+    {
+        CCoins coins;
+        coins.nHeight = 1;
+        coins.vout.resize(1, CTxOut(COIN, CScript() << OP_TRUE));
+        view.SetCoins(uint256(i + 1), coins);
+        AddToPool(mempool, MakeSpend(uint256(i + 1), 1, COIN / 100), COIN / 100);
+    }
+
+    // Templates for two payouts share their transactions, and differ in the
+    // coinbase and the merkle root taken from the precomputed branch
+    CScript scriptA = CScript() << OP_TRUE;
+    CScript scriptB = CScript() << OP_2;
+    CBlockTemplate* pblocktemplateA = CreateNewBlock(scriptA);
+    CBlockTemplate* pblocktemplateB = CreateNewBlock(scriptB);
+    BOOST_REQUIRE(pblocktemplateA && pblocktemplateB);
+    CBlock& blockA = pblocktemplateA->block;
+    CBlock& blockB = pblocktemplateB->block;
+    BOOST_CHECK_EQUAL(blockA.vtx.size(), 6U);
+    BOOST_CHECK_EQUAL(blockB.vtx.size(), 6U);
+    BOOST_CHECK(blockA.vtx[0].vout[0].scriptPubKey == scriptA);
+    BOOST_CHECK(blockB.vtx[0].vout[0].scriptPubKey == scriptB);
+    for (unsigned int i = 1; i < blockA.vtx.size(); i++)
+        BOOST_CHECK(blockA.vtx[i].GetHash() == blockB.vtx[i].GetHash());
+    BOOST_CHECK_EQUAL(pblocktemplateA->vCoinbaseBranch.size(), 3U);
+    BOOST_CHECK(blockA.hashMerkleRoot != blockB.hashMerkleRoot);
+    BOOST_CHECK(blockA.hashMerkleRoot == blockA.BuildMerkleTree());
+    BOOST_CHECK(blockB.hashMerkleRoot == blockB.BuildMerkleTree());
+
+    // So is a new extranonce
+    unsigned int nExtraNonce = 0;
+    IncrementExtraNonce(pblocktemplateB, pindexBest, nExtraNonce);
+    BOOST_CHECK(blockB.hashMerkleRoot == blockB.BuildMerkleTree());
+    delete pblocktemplateA;
+    delete pblocktemplateB;
+
+    // The next template sees a change to the pool
+    mempool.clear();
+    AddToPool(mempool, MakeSpend(uint256(1), 1, COIN / 100), COIN / 100);
+    pblocktemplateA = CreateNewBlock(scriptA);
+    BOOST_REQUIRE(pblocktemplateA);
+    BOOST_CHECK_EQUAL(pblocktemplateA->block.vtx.size(), 2U);
+    BOOST_CHECK(pblocktemplateA->block.hashMerkleRoot == pblocktemplateA->block.BuildMerkleTree());
+    delete pblocktemplateA;
+
+    mempool.clear();
+    pcoinsTip = pcoinsTipSaved;
+    blockassembler.Invalidate();
+}
+
 BOOST_AUTO_TEST_CASE(sha256transform_equality)
 {
     unsigned int pSHA256InitState[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
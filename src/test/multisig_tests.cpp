@@ -127,6 +127,56 @@ BOOST_AUTO_TEST_CASE(multisig_verify)
         }
 }
 
+BOOST_AUTO_TEST_CASE(multisig_pubkeycache)
+{
+    // NOCACHE keeps the signature cache out of the way, so every
+    // evaluation has to go through the public key cache.
+    unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC | SCRIPT_VERIFY_NOCACHE;
+
+    CKey key[3];
+    for (int i = 0; i < 3; i++)
+        key[i].MakeNewKey(true);
+
+    CScript escrow;
+    escrow << OP_2 << key[0].GetPubKey() << key[1].GetPubKey() << key[2].GetPubKey() << OP_3 << OP_CHECKMULTISIG;
+
+    CTransaction txFrom;
+    txFrom.vout.resize(1);
+    txFrom.vout[0].scriptPubKey = escrow;
+
+    CPubKeyCacheStats statsBefore;
+    GetPubKeyCacheStats(statsBefore);
+
+    for (int n = 0; n < 10; n++)
+    {
+        CTransaction txTo;
+        txTo.vin.resize(1);
+        txTo.vout.resize(1);
+        txTo.vin[0].prevout.n = 0;
+        txTo.vin[0].prevout.hash = txFrom.GetHash();
+        txTo.vout[0].nValue = n + 1;
+
+        vector<CKey> keys;
+        keys += key[0],key[2];
+        CScript s = sign_multisig(escrow, keys, txTo, 0);
+        BOOST_CHECK_MESSAGE(VerifyScript(s, escrow, txTo, 0, flags, 0), strprintf("pubkeycache: %d", n));
+
+        // A bad signature must still fail with a cached key
+        keys.clear();
+        keys += key[2],key[0];
+        s = sign_multisig(escrow, keys, txTo, 0);
+        BOOST_CHECK_MESSAGE(!VerifyScript(s, escrow, txTo, 0, flags, 0), strprintf("pubkeycache bad order: %d", n));
+    }
+
+    CPubKeyCacheStats statsAfter;
+    GetPubKeyCacheStats(statsAfter);
+
+    // At most one miss per distinct key; everything else is a hit
+    BOOST_CHECK(statsAfter.nMisses - statsBefore.nMisses <= 3);
+    BOOST_CHECK(statsAfter.nHits - statsBefore.nHits >= 20);
+    BOOST_CHECK(statsAfter.nEntries <= statsAfter.nMaxEntries);
+}
+
 BOOST_AUTO_TEST_CASE(multisig_IsStandard)
 {
     CKey key[4];
@@ -3,6 +3,7 @@
 #include <boost/test/unit_test.hpp>
 
 #include "base58.h"
+#include "main.h"
 #include "util.h"
 #include "bitcoinrpc.h"
 
@@ -147,4 +148,23 @@ BOOST_AUTO_TEST_CASE(rpc_rawsign)
     BOOST_CHECK(find_value(r.get_obj(), "complete").get_bool() == true);
 }
 
+BOOST_AUTO_TEST_CASE(rpc_waitfornewblock)
+{
+    Value r;
+    // Without a new block, it gives up after the timeout and returns the best block
+    int64 nStart = GetTimeMillis();
+    r = CallRPC("waitfornewblock 100");
+    BOOST_CHECK(GetTimeMillis() - nStart >= 100);
+    BOOST_CHECK_EQUAL(find_value(r.get_obj(), "hash").get_str(), hashBestChain.GetHex());
+    BOOST_CHECK_EQUAL(find_value(r.get_obj(), "height").get_int(), nBestHeight);
+
+    // Told about a block that is not the best one, it returns right away
+    nStart = GetTimeMillis();
+    r = CallRPC(string("waitfornewblock 60000 ")+uint256(1).GetHex());
+    BOOST_CHECK(GetTimeMillis() - nStart < 60000);
+    BOOST_CHECK_EQUAL(find_value(r.get_obj(), "hash").get_str(), hashBestChain.GetHex());
+
+    BOOST_CHECK_THROW(CallRPC("waitfornewblock -1"), runtime_error);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
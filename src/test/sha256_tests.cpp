@@ -0,0 +1,126 @@
+#include <boost/test/unit_test.hpp>
+
+#include <string>
+#include <vector>
+
+#include "hash.h"
+#include "main.h"
+#include "sha256.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(sha256_tests)
+
+static string SHA256Hex(const string& str)
+{
+    unsigned char hash[CSHA256::OUTPUT_SIZE];
+    CSHA256().Write((const unsigned char*)str.data(), str.size()).Finalize(hash);
+    return HexStr(hash, hash + sizeof(hash));
+}
+
+BOOST_AUTO_TEST_CASE(sha256_vectors)
+{
+    BOOST_CHECK_EQUAL(SHA256Hex(""), "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+    BOOST_CHECK_EQUAL(SHA256Hex("abc"), "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+    BOOST_CHECK_EQUAL(SHA256Hex("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq"),
+                      "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+    BOOST_CHECK_EQUAL(SHA256Hex(string(1000000, 'a')), "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+
+    // Feeding the same data in uneven pieces must not change the result
+    string str(300, 'x');
+    for (unsigned int i = 0; i < str.size(); i++)
+        str[i] = (char)(i * 7 + 3);
+    CSHA256 hasher;
+    for (unsigned int i = 0, n = 1; i < str.size(); i += n, n = n * 3 % 70 + 1)
+        hasher.Write((const unsigned char*)&str[i], min((unsigned int)str.size() - i, n));
+    unsigned char hash[CSHA256::OUTPUT_SIZE];
+    hasher.Finalize(hash);
+    BOOST_CHECK_EQUAL(HexStr(hash, hash + sizeof(hash)), SHA256Hex(str));
+}
+
+BOOST_AUTO_TEST_CASE(sha256d64)
+{
+    // Cover the 8-way, 4-way and single message paths and their remainders
+    for (int n = 0; n <= 34; n++)
+    {
+        vector<unsigned char> in(64 * n + 1);
+        for (unsigned int i = 0; i < in.size(); i++)
+            in[i] = (unsigned char)(i * 13 + n);
+        vector<uint256> out(n + 1);
+        SHA256D64(out[0].begin(), &in[0], n);
+        for (int i = 0; i < n; i++)
+            BOOST_CHECK(out[i] == Hash(in.begin() + 64 * i, in.begin() + 64 * (i + 1)));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(sha256_merkle)
+{
+    for (int nTx = 1; nTx <= 17; nTx++)
+    {
+        CBlock block;
+        block.vtx.resize(nTx);
+        for (int i = 0; i < nTx; i++)
+            block.vtx[i].nLockTime = i;
+
+        // Reference merkle root, hashing one pair at a time
+        vector<uint256> vLevel;
+        for (int i = 0; i < nTx; i++)
+            vLevel.push_back(block.vtx[i].GetHash());
+        while (vLevel.size() > 1)
+        {
+            vector<uint256> vNext;
+            for (unsigned int i = 0; i < vLevel.size(); i += 2)
+            {
+                unsigned int i2 = min(i + 1, (unsigned int)vLevel.size() - 1);
+                vNext.push_back(Hash(BEGIN(vLevel[i]), END(vLevel[i]), BEGIN(vLevel[i2]), END(vLevel[i2])));
+            }
+            vLevel.swap(vNext);
+        }
+        BOOST_CHECK_MESSAGE(block.BuildMerkleTree() == vLevel[0], strprintf("merkle root: %d", nTx));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(sha256_scannonces)
+{
+    CBlock block;
+    block.nVersion = 2;
+    block.hashPrevBlock = 1;
+    block.hashMerkleRoot = 2;
+    block.nTime = 1380000000;
+    block.nBits = 0x1d00ffff;
+    block.nNonce = 0;
+
+    char pmidstatebuf[32+16]; char* pmidstate = alignup<16>(pmidstatebuf);
+    char pdatabuf[128+16];    char* pdata     = alignup<16>(pdatabuf);
+    char phash1buf[64+16];    char* phash1    = alignup<16>(phash1buf);
+    FormatHashBuffers(&block, pmidstate, pdata, phash1);
+
+    // Work through the nonces the way BitcoinMiner does, and check every
+    // candidate against the real block hash.
+    uint32_t nNonce = 0;
+    int nFound = 0;
+    while (nNonce < 0x80000)
+    {
+        uint32_t phash[8];
+        uint32_t nPrev = nNonce;
+        if (!SHA256ScanNonces((const uint32_t*)pmidstate, (const uint32_t*)(pdata + 64), nNonce, 0x1000 - (nNonce & 0xfff), phash))
+        {
+            BOOST_CHECK_EQUAL(nNonce & 0xfff, 0U);
+            continue;
+        }
+        BOOST_CHECK(nNonce > nPrev);
+
+        uint256 hash;
+        for (int i = 0; i < 8; i++)
+            ((uint32_t*)&hash)[i] = ByteReverse(phash[i]);
+        block.nNonce = ByteReverse(nNonce);
+        BOOST_CHECK(hash == block.GetHash());
+        BOOST_CHECK((hash >> 240) == 0);
+        nFound++;
+    }
+    // About one candidate per 65536 nonces; this header has 10
+    BOOST_CHECK_EQUAL(nFound, 10);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,267 @@
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include "init.h"
+#include "main.h"
+#include "netbase.h"
+#include "stratum.h"
+#include "util.h"
+#include "wallet.h"
+#include "bitcoinrpc.h"
+
+using namespace std;
+using namespace json_spirit;
+
+BOOST_AUTO_TEST_SUITE(stratum_tests)
+
+static CBlockTemplate CreateJobTemplate(int nTransactions)
+{
+    CReserveKey reservekey(pwalletMain);
+    CBlockTemplate* pblocktemplate = CreateNewBlock(reservekey);
+    BOOST_REQUIRE(pblocktemplate);
+    CBlockTemplate blocktemplate = *pblocktemplate;
+    delete pblocktemplate;
+
+    // Stand-ins for mempool transactions, only their hashes matter here
+    CBlock& block = blocktemplate.block;
+    for (int i = 0; i < nTransactions; i++)
+    {
+        CTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout.hash = GetRandHash();
+        tx.vin[0].prevout.n = i;
+        tx.vout.resize(1);
+        tx.vout[0].nValue = i;
+        block.vtx.push_back(tx);
+    }
+    block.BuildMerkleTree();
+    blocktemplate.vCoinbaseBranch = block.GetMerkleBranch(0);
+    return blocktemplate;
+}
+
+BOOST_AUTO_TEST_CASE(stratum_job)
+{
+    for (int nTransactions = 0; nTransactions < 6; nTransactions++)
+    {
+        CBlockTemplate blocktemplate = CreateJobTemplate(nTransactions);
+        const CBlock& block = blocktemplate.block;
+        CStratumJob job("1", blocktemplate, 1, true);
+
+        std::vector<unsigned char> vchExtraNonce = ParseHex("0102030405060708");
+        BOOST_REQUIRE_EQUAL(vchExtraNonce.size(), STRATUM_EXTRANONCE_SIZE);
+        CBlock blockFound = job.GetBlock(vchExtraNonce, block.nTime + 1, 42);
+        BOOST_CHECK_EQUAL(blockFound.vtx.size(), block.vtx.size());
+        BOOST_CHECK(blockFound.hashPrevBlock == block.hashPrevBlock);
+        BOOST_CHECK_EQUAL(blockFound.nTime, block.nTime + 1);
+        BOOST_CHECK_EQUAL(blockFound.nNonce, 42U);
+
+        // The extranonce landed in its own push after the height, and
+        // folding the coinbase up the branch gives the real merkle root
+        const CTransaction& txCoinbase = blockFound.vtx[0];
+        BOOST_CHECK(txCoinbase.IsCoinBase());
+        BOOST_CHECK(txCoinbase.vin[0].scriptSig == (CScript() << 1 << vchExtraNonce) + COINBASE_FLAGS);
+        BOOST_CHECK(txCoinbase.vout[0].scriptPubKey == block.vtx[0].vout[0].scriptPubKey);
+        BOOST_CHECK(txCoinbase.vout[0].nValue == block.vtx[0].vout[0].nValue);
+        BOOST_CHECK(job.GetMerkleRoot(vchExtraNonce) == blockFound.hashMerkleRoot);
+        BOOST_CHECK(blockFound.BuildMerkleTree() == blockFound.hashMerkleRoot);
+        for (int i = 1; i <= nTransactions; i++)
+            BOOST_CHECK(blockFound.vtx[i].GetHash() == block.vtx[i].GetHash());
+
+        // Another extranonce is another coinbase
+        vchExtraNonce[7]++;
+        BOOST_CHECK(job.GetMerkleRoot(vchExtraNonce) != blockFound.hashMerkleRoot);
+    }
+}
+
+// Next newline terminated message from the server, waiting at most 10 seconds
+static Object ReadMessage(SOCKET hSocket, std::string& strBuffer)
+{
+    int64 nStart = GetTimeMillis();
+    size_t nPos;
+    while ((nPos = strBuffer.find('\n')) == std::string::npos)
+    {
+        BOOST_REQUIRE(GetTimeMillis() - nStart < 10000);
+        fd_set fdsetRecv;
+        FD_ZERO(&fdsetRecv);
+        FD_SET(hSocket, &fdsetRecv);
+        struct timeval timeout;
+        timeout.tv_sec = 0;
+        timeout.tv_usec = 100000;
+        if (select(hSocket + 1, &fdsetRecv, NULL, NULL, &timeout) <= 0)
+            continue;
+        char pchBuf[4096];
+        int nBytes = recv(hSocket, pchBuf, sizeof(pchBuf), 0);
+        BOOST_REQUIRE(nBytes > 0);
+        strBuffer.append(pchBuf, nBytes);
+    }
+    Value value;
+    BOOST_REQUIRE(read_string(strBuffer.substr(0, nPos), value));
+    strBuffer.erase(0, nPos + 1);
+    BOOST_REQUIRE(value.type() == obj_type);
+    return value.get_obj();
+}
+
+// The reply to request nId, remembering the notifications that come first
+static Object ReadReply(SOCKET hSocket, std::string& strBuffer, int nId, Array& notifyLast)
+{
+    loop
+    {
+        Object message = ReadMessage(hSocket, strBuffer);
+        const Value& id = find_value(message, "id");
+        if (id.type() == int_type && id.get_int() == nId)
+            return message;
+        if (find_value(message, "method") == Value("mining.notify"))
+            notifyLast = find_value(message, "params").get_array();
+    }
+}
+
+static void SendRequest(SOCKET hSocket, int nId, const std::string& strMethod, const Array& params)
+{
+    Object request;
+    request.push_back(Pair("id", nId));
+    request.push_back(Pair("method", strMethod));
+    request.push_back(Pair("params", params));
+    std::string strRequest = write_string(Value(request), false) + "\n";
+    BOOST_REQUIRE_EQUAL(send(hSocket, strRequest.data(), strRequest.size(), MSG_NOSIGNAL), (int)strRequest.size());
+}
+
+static Array SubmitParams(const std::string& strJobId, const std::string& strExtraNonce2, const std::string& strTime, unsigned int nNonce)
+{
+    Array params;
+    params.push_back("worker");
+    params.push_back(strJobId);
+    params.push_back(strExtraNonce2);
+    params.push_back(strTime);
+    params.push_back(strprintf("%08x", nNonce));
+    return params;
+}
+
+// Plays a miner: subscribes, takes the job it is pushed and grinds shares
+// for it exactly the way a stratum miner would, from the notify alone
+BOOST_AUTO_TEST_CASE(stratum_stub_miner)
+{
+    int nPort = 20000 + GetRand(20000);
+    mapArgs["-stratumport"] = strprintf("%d", nPort);
+    mapArgs["-stratumdifficulty"] = "0.000000059604644775390625"; // 1 / 2^24
+    boost::thread_group threadGroup;
+    std::string strError;
+    BOOST_REQUIRE_MESSAGE(StartStratumServer(threadGroup, strError), strError);
+
+    SOCKET hSocket;
+    BOOST_REQUIRE(ConnectSocket(CService("127.0.0.1", nPort), hSocket));
+    std::string strBuffer;
+    Array notify;
+
+    SendRequest(hSocket, 1, "mining.subscribe", Array());
+    Object reply = ReadReply(hSocket, strBuffer, 1, notify);
+    BOOST_CHECK(find_value(reply, "error").type() == null_type);
+    const Array& subscribed = find_value(reply, "result").get_array();
+    BOOST_REQUIRE_EQUAL(subscribed.size(), 3U);
+    std::vector<unsigned char> vchExtraNonce = ParseHex(subscribed[1].get_str());
+    BOOST_CHECK_EQUAL(vchExtraNonce.size(), STRATUM_EXTRANONCE1_SIZE);
+    BOOST_CHECK_EQUAL(subscribed[2].get_int(), (int)STRATUM_EXTRANONCE2_SIZE);
+
+    // Shares are refused until the worker is authorized
+    SendRequest(hSocket, 2, "mining.submit", SubmitParams("1", "00000000", "00000000", 0));
+    reply = ReadReply(hSocket, strBuffer, 2, notify);
+    BOOST_CHECK_EQUAL(find_value(reply, "error").get_array()[0].get_int(), 24);
+
+    Array params;
+    params.push_back("worker");
+    params.push_back("x");
+    SendRequest(hSocket, 3, "mining.authorize", params);
+    reply = ReadReply(hSocket, strBuffer, 3, notify);
+    BOOST_CHECK(find_value(reply, "result") == Value(true));
+
+    // Wait for the job to be pushed
+    while (notify.empty())
+    {
+        Object message = ReadMessage(hSocket, strBuffer);
+        if (find_value(message, "method") == Value("mining.notify"))
+            notify = find_value(message, "params").get_array();
+    }
+    BOOST_REQUIRE_EQUAL(notify.size(), 9U);
+    BOOST_CHECK(notify[8] == Value(true));
+    std::string strJobId = notify[0].get_str();
+
+    std::vector<unsigned char> vchPrevHash = ParseHex(notify[1].get_str());
+    BOOST_REQUIRE_EQUAL(vchPrevHash.size(), 32U);
+    for (unsigned int i = 0; i < vchPrevHash.size(); i += 4)
+        std::reverse(vchPrevHash.begin() + i, vchPrevHash.begin() + i + 4);
+
+    std::vector<unsigned char> vchCoinbase = ParseHex(notify[2].get_str());
+    vchExtraNonce.push_back(0);
+    vchExtraNonce.push_back(0);
+    vchExtraNonce.push_back(0);
+    vchExtraNonce.push_back(1);
+    vchCoinbase.insert(vchCoinbase.end(), vchExtraNonce.begin(), vchExtraNonce.end());
+    std::vector<unsigned char> vchCoinbase2 = ParseHex(notify[3].get_str());
+    vchCoinbase.insert(vchCoinbase.end(), vchCoinbase2.begin(), vchCoinbase2.end());
+    uint256 hashMerkleRoot = Hash(vchCoinbase.begin(), vchCoinbase.end());
+    BOOST_FOREACH(const Value& value, notify[4].get_array())
+    {
+        std::vector<unsigned char> vch = ParseHex(value.get_str());
+        BOOST_REQUIRE_EQUAL(vch.size(), 32U);
+        uint256 hash;
+        memcpy(BEGIN(hash), &vch[0], 32);
+        hashMerkleRoot = Hash(BEGIN(hashMerkleRoot), END(hashMerkleRoot), BEGIN(hash), END(hash));
+    }
+
+    CBlockHeader header;
+    header.nVersion = strtoul(notify[5].get_str().c_str(), NULL, 16);
+    memcpy(BEGIN(header.hashPrevBlock), &vchPrevHash[0], 32);
+    header.hashMerkleRoot = hashMerkleRoot;
+    header.nBits = strtoul(notify[6].get_str().c_str(), NULL, 16);
+    header.nTime = strtoul(notify[7].get_str().c_str(), NULL, 16);
+    {
+        LOCK(cs_main);
+        BOOST_CHECK(header.hashPrevBlock == hashBestChain);
+    }
+
+    // First a share that misses the target, then one that meets it
+    uint256 hashTarget = (CBigNum().SetCompact(0x1d00ffff) << 24).getuint256();
+    header.nNonce = 0;
+    while (header.GetHash() <= hashTarget)
+        header.nNonce++;
+    SendRequest(hSocket, 4, "mining.submit", SubmitParams(strJobId, "00000001", notify[7].get_str(), header.nNonce));
+    reply = ReadReply(hSocket, strBuffer, 4, notify);
+    BOOST_CHECK_EQUAL(find_value(reply, "error").get_array()[0].get_int(), 23);
+
+    while (header.GetHash() > hashTarget)
+        header.nNonce++;
+    SendRequest(hSocket, 5, "mining.submit", SubmitParams(strJobId, "00000001", notify[7].get_str(), header.nNonce));
+    reply = ReadReply(hSocket, strBuffer, 5, notify);
+    BOOST_CHECK(find_value(reply, "error").type() == null_type);
+    BOOST_CHECK(find_value(reply, "result") == Value(true));
+
+    SendRequest(hSocket, 6, "mining.submit", SubmitParams(strJobId, "00000001", notify[7].get_str(), header.nNonce));
+    reply = ReadReply(hSocket, strBuffer, 6, notify);
+    BOOST_CHECK_EQUAL(find_value(reply, "error").get_array()[0].get_int(), 22);
+
+    SendRequest(hSocket, 7, "mining.submit", SubmitParams("nosuchjob", "00000001", notify[7].get_str(), header.nNonce));
+    reply = ReadReply(hSocket, strBuffer, 7, notify);
+    BOOST_CHECK_EQUAL(find_value(reply, "error").get_array()[0].get_int(), 21);
+
+    closesocket(hSocket);
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+    StopStratumServer();
+    mapArgs.erase("-stratumport");
+    mapArgs.erase("-stratumdifficulty");
+}
+
+BOOST_AUTO_TEST_CASE(stratum_difficulty_range)
+{
+    // Share targets are worked out in 32.32 fixed point, which has to fit in 64 bits
+    boost::thread_group threadGroup;
+    std::string strError;
+    const char* ppszInvalid[] = { "0", "0.0000000001", "4294967296", "1e20", "x" };
+    BOOST_FOREACH(const char* pszDifficulty, ppszInvalid)
+    {
+        mapArgs["-stratumdifficulty"] = pszDifficulty;
+        BOOST_CHECK_MESSAGE(!StartStratumServer(threadGroup, strError), pszDifficulty);
+    }
+    mapArgs.erase("-stratumdifficulty");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -1,5 +1,6 @@
 #include <boost/test/unit_test.hpp>
 
+#include "init.h"
 #include "main.h"
 #include "wallet.h"
 
@@ -291,4 +292,39 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     }
 }
 
+BOOST_AUTO_TEST_CASE(keypool_topup)
+{
+    // Big enough to be generated on several threads
+    mapArgs["-keypool"] = "300";
+    BOOST_CHECK(pwalletMain->TopUpKeyPool());
+    BOOST_CHECK_EQUAL(pwalletMain->GetKeyPoolSize(), 301);
+
+    // Every pool entry must have made it to disk with its key
+    set<CKeyID> setAddress;
+    pwalletMain->GetAllReserveKeys(setAddress);
+    BOOST_CHECK_EQUAL(setAddress.size(), 301U);
+
+    // Topping up a full pool doesn't add anything
+    BOOST_CHECK(pwalletMain->TopUpKeyPool());
+    BOOST_CHECK_EQUAL(pwalletMain->GetKeyPoolSize(), 301);
+
+    BOOST_CHECK(pwalletMain->NewKeyPool());
+    BOOST_CHECK_EQUAL(pwalletMain->GetKeyPoolSize(), 300);
+    set<CKeyID> setNewAddress;
+    pwalletMain->GetAllReserveKeys(setNewAddress);
+    BOOST_CHECK_EQUAL(setNewAddress.size(), 300U);
+    BOOST_FOREACH(const CKeyID& keyID, setNewAddress)
+        BOOST_CHECK(!setAddress.count(keyID));
+
+    // More keys than fit in one database transaction
+    mapArgs["-keypool"] = "2500";
+    BOOST_CHECK(pwalletMain->TopUpKeyPool());
+    BOOST_CHECK_EQUAL(pwalletMain->GetKeyPoolSize(), 2501);
+    setAddress.clear();
+    pwalletMain->GetAllReserveKeys(setAddress);
+    BOOST_CHECK_EQUAL(setAddress.size(), 2501U);
+
+    mapArgs.erase("-keypool");
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -795,7 +795,7 @@ void CWallet::ReacceptWalletTransactions()
     bool fRepeat = true;
     while (fRepeat)
     {
-        LOCK(cs_wallet);
+        LOCK2(cs_main, cs_wallet);
         fRepeat = false;
         bool fMissing = false;
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
@@ -1284,6 +1284,13 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64> >& vecSend,
 
                 // Check that enough fee is included
                 int64 nPayFee = nTransactionFee * (1 + (int64)nBytes / 1000);
+                if (nTransactionFee == 0 && nTxConfirmTarget > 0)
+                {
+                    // What lately got transactions into a block in time
+                    int64 nFeeEstimate = mempool.estimateFee(nTxConfirmTarget);
+                    if (nFeeEstimate > 0)
+                        nPayFee = nFeeEstimate * (int64)nBytes / 1000;
+                }
                 bool fAllowFree = CTransaction::AllowFree(dPriority);
                 int64 nMinFee = wtxNew.GetMinFee(1, fAllowFree, GMF_SEND);
                 if (nFeeRet < max(nPayFee, nMinFee))
@@ -1503,6 +1510,118 @@ bool GetWalletFile(CWallet* pwallet, string &strWalletFileOut)
     return true;
 }
 
+static void ThreadGenerateKeys(std::vector<CKey>* pvKeys, unsigned int nBegin, unsigned int nEnd, bool fCompressed, bool* pfFailed)
+{
+    try
+    {
+        for (unsigned int i = nBegin; i < nEnd; i++)
+            (*pvKeys)[i].MakeNewKey(fCompressed);
+    }
+    catch (std::exception& e)
+    {
+        PrintExceptionContinue(&e, "ThreadGenerateKeys()");
+        *pfFailed = true;
+    }
+}
+
+// Generate nKeys new keys. EC key generation dominates the cost of filling
+// the key pool and needs no wallet state, so large batches are spread over
+// one thread per core.
+static void GenerateKeys(std::vector<CKey>& vKeys, unsigned int nKeys, bool fCompressed)
+{
+    RandAddSeedPerfmon();
+    vKeys.resize(nKeys);
+
+    unsigned int nThreads = std::min(boost::thread::hardware_concurrency(), nKeys / 64);
+    if (nThreads <= 1)
+    {
+        for (unsigned int i = 0; i < nKeys; i++)
+            vKeys[i].MakeNewKey(fCompressed);
+        return;
+    }
+
+    bool fFailed = false;
+    boost::thread_group threadGroup;
+    for (unsigned int i = 0; i < nThreads; i++)
+        threadGroup.create_thread(boost::bind(&ThreadGenerateKeys, &vKeys, nKeys * i / nThreads, nKeys * (i + 1) / nThreads, fCompressed, &fFailed));
+    threadGroup.join_all();
+    if (fFailed)
+        throw key_error("GenerateKeys() : MakeNewKey failed");
+}
+
+// Keys written to the wallet database per transaction when filling the key
+// pool. Each key takes a key and a pool record, and a transaction holds a lock
+// per page it touches, so a large -keypool is written in several.
+static const unsigned int KEYPOOL_WRITE_BATCH = 1000;
+
+// Add freshly generated keys to the keystore and the key pool until it holds
+// nPoolSize keys. The key and pool records are written in a few database
+// transactions instead of one sync per record. The pool only hands out keys
+// whose records were committed: a failed batch is taken back out of the
+// keystore, and what earlier batches added stays.
+unsigned int CWallet::AddKeysToKeyPool(CWalletDB& walletdb, const std::vector<CKey>& vKeys, unsigned int nPoolSize)
+{
+    unsigned int nAdded = 0;
+    unsigned int nKeys = 0;
+    if (setKeyPool.size() < nPoolSize)
+        nKeys = std::min((unsigned int)vKeys.size(), nPoolSize - (unsigned int)setKeyPool.size());
+
+    for (unsigned int nBatchStart = 0; nBatchStart < nKeys; nBatchStart += KEYPOOL_WRITE_BATCH)
+    {
+        unsigned int nBatchEnd = std::min(nKeys, nBatchStart + KEYPOOL_WRITE_BATCH);
+
+        if (!walletdb.TxnBegin())
+            throw runtime_error("CWallet::AddKeysToKeyPool() : TxnBegin failed");
+
+        // Compressed public keys were introduced in version 0.6.0
+        if (nBatchStart == 0 && vKeys[0].IsCompressed())
+            SetMinVersion(FEATURE_COMPRPUBKEY, &walletdb);
+
+        // Encrypted keys are written by AddCryptedKey, route them through the
+        // transaction as well
+        CWalletDB* pwalletdbPrev = pwalletdbEncryption;
+        pwalletdbEncryption = &walletdb;
+
+        int64 nIndex = setKeyPool.empty() ? 1 : *(--setKeyPool.end()) + 1;
+        std::vector<int64> vIndex;
+        const char* pszError = NULL;
+        unsigned int i;
+        for (i = nBatchStart; i < nBatchEnd; i++)
+        {
+            const CKey& key = vKeys[i];
+            CPubKey pubkey = key.GetPubKey();
+            if (!CCryptoKeyStore::AddKey(key) || (!IsCrypted() && !walletdb.WriteKey(pubkey, key.GetPrivKey())))
+            {
+                pszError = "CWallet::AddKeysToKeyPool() : AddKey failed";
+                break;
+            }
+            if (!walletdb.WritePool(nIndex, CKeyPool(pubkey)))
+            {
+                pszError = "CWallet::AddKeysToKeyPool() : writing generated key failed";
+                break;
+            }
+            vIndex.push_back(nIndex++);
+        }
+        pwalletdbEncryption = pwalletdbPrev;
+
+        if (pszError)
+            walletdb.TxnAbort();
+        else if (!walletdb.TxnCommit())
+            pszError = "CWallet::AddKeysToKeyPool() : TxnCommit failed";
+        if (pszError)
+        {
+            // Including the key that failed, if it got into the keystore
+            for (unsigned int j = nBatchStart; j <= i && j < nBatchEnd; j++)
+                RemoveKey(vKeys[j].GetPubKey().GetID());
+            throw runtime_error(pszError);
+        }
+
+        setKeyPool.insert(vIndex.begin(), vIndex.end());
+        nAdded += vIndex.size();
+    }
+    return nAdded;
+}
+
 //
 // Mark old keypool keys as used,
 // and generate all new keys
@@ -1520,12 +1639,9 @@ bool CWallet::NewKeyPool()
             return false;
 
         int64 nKeys = max(GetArg("-keypool", 100), (int64)0);
-        for (int i = 0; i < nKeys; i++)
-        {
-            int64 nIndex = i+1;
-            walletdb.WritePool(nIndex, CKeyPool(GenerateNewKey()));
-            setKeyPool.insert(nIndex);
-        }
+        vector<CKey> vKeys;
+        GenerateKeys(vKeys, nKeys, CanSupportFeature(FEATURE_COMPRPUBKEY));
+        AddKeysToKeyPool(walletdb, vKeys, nKeys);
         printf("CWallet::NewKeyPool wrote %"PRI64d" new keys\n", nKeys);
     }
     return true;
@@ -1533,6 +1649,27 @@ bool CWallet::NewKeyPool()
 
 bool CWallet::TopUpKeyPool()
 {
+    unsigned int nTargetSize = max(GetArg("-keypool", 100), 0LL);
+    unsigned int nMissing;
+    bool fCompressed;
+    {
+        LOCK(cs_wallet);
+
+        if (IsLocked())
+            return false;
+        if (setKeyPool.size() >= nTargetSize + 1)
+            return true;
+        nMissing = nTargetSize + 1 - setKeyPool.size();
+        fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY); // default to compressed public keys if we want 0.6.0 wallets
+    }
+
+    // Generate the keys without holding cs_wallet (unless the caller does),
+    // so a large -keypool doesn't stall everything else using the wallet
+    int64 nStart = GetTimeMillis();
+    vector<CKey> vKeys;
+    GenerateKeys(vKeys, nMissing, fCompressed);
+    int64 nGenerated = GetTimeMillis();
+
     {
         LOCK(cs_wallet);
 
@@ -1542,17 +1679,12 @@ bool CWallet::TopUpKeyPool()
         CWalletDB walletdb(strWalletFile);
 
         // Top up key pool
-        unsigned int nTargetSize = max(GetArg("-keypool", 100), 0LL);
-        while (setKeyPool.size() < (nTargetSize + 1))
-        {
-            int64 nEnd = 1;
-            if (!setKeyPool.empty())
-                nEnd = *(--setKeyPool.end()) + 1;
-            if (!walletdb.WritePool(nEnd, CKeyPool(GenerateNewKey())))
-                throw runtime_error("TopUpKeyPool() : writing generated key failed");
-            setKeyPool.insert(nEnd);
-            printf("keypool added key %"PRI64d", size=%"PRIszu"\n", nEnd, setKeyPool.size());
-        }
+        unsigned int nAdded = AddKeysToKeyPool(walletdb, vKeys, nTargetSize + 1);
+        int64 nEnd = GetTimeMillis();
+        if (nAdded > 0)
+            printf("keypool added %u keys in %"PRI64d"ms (generate %.0f keys/s, write %.0f keys/s), size=%"PRIszu"\n",
+                   nAdded, nEnd - nStart, 1000.0 * nMissing / max(nGenerated - nStart, (int64)1),
+                   1000.0 * nAdded / max(nEnd - nGenerated, (int64)1), setKeyPool.size());
     }
     return true;
 }
@@ -186,6 +186,7 @@ public:
     std::string SendMoney(CScript scriptPubKey, int64 nValue, CWalletTx& wtxNew, bool fAskFee=false);
     std::string SendMoneyToDestination(const CTxDestination &address, int64 nValue, CWalletTx& wtxNew, bool fAskFee=false);
 
+    unsigned int AddKeysToKeyPool(CWalletDB& walletdb, const std::vector<CKey>& vKeys, unsigned int nPoolSize);
     bool NewKeyPool();
     bool TopUpKeyPool();
     int64 AddReserveKey(const CKeyPool& keypool);